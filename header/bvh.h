@@ -0,0 +1,70 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.h"
+#include <cfloat>
+
+// =======================================
+// Axis-aligned bounding box
+// =======================================
+struct AABB
+{
+    vec3 min, max;
+
+    AABB();
+    AABB(vec3, vec3);
+    void expand(const AABB &);
+    vec3 center() const;
+    AABB transform(const mat4 &) const;
+};
+
+// =======================================
+// Bounding volume hierarchy
+// - Items are bounding boxes, identified by their index
+// - Queries return items whose box may be inside a set of half-spaces
+//   (e.g. a view frustum, optionally with a clipping plane)
+// - Moving an item refits only the boxes above it
+// =======================================
+class BVH
+{
+  public:
+    // -----------------------------------------------------
+    // A node of the tree
+    // - Inner node: left, right are child nodes
+    // - Leaf: items[first, first + count) belong to it
+    // -----------------------------------------------------
+    struct Node
+    {
+        AABB bounds;
+        int parent, left, right;
+        int first, count;
+    };
+
+    vector<Node> nodes;
+    vector<AABB> itemBounds;
+
+    // Items ordered by leaf, and the leaf of each item
+    vector<int> items;
+    vector<int> itemLeaves;
+
+    // Largest number of items in a leaf
+    int leafSize;
+
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    BVH(int = 4);
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void build(const vector<AABB> &);
+    void update(int, const AABB &);
+    void query(const vector<vec4> &, vector<int> &);
+    int buildNode(int, int, int);
+    void collect(int, vector<int> &);
+
+    static vector<vec4> frustum(const mat4 &);
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+
+// =======================================
+// Asynchronous frame capture
+// - Pixels are read into pixel buffer objects,
+//   and mapped a few frames later when the GPU is done with them
+// - Images are encoded and written on a writer thread
+// - Optionally owns an offscreen target to render views into
+// =======================================
+class Capture
+{
+  public:
+    // An image waiting to be written
+    struct Job
+    {
+        vector<unsigned char> pixels;
+        int width, height;
+        string path;
+    };
+
+    // -----------------------------------------------------
+    // Offscreen target
+    // - fboTarget: render target (multisample if samples > 0)
+    // - fboResolve: single sample copy of fboTarget, read from
+    // -----------------------------------------------------
+    int width, height, samples;
+    GLuint fboTarget, rboTargetColor, rboTargetDepth;
+    GLuint fboResolve, rboResolveColor;
+
+    // -----------------------------------------------------
+    // Pixel buffer objects in a ring
+    // - Each one holds a pending readback until its fence is signaled
+    // -----------------------------------------------------
+    static const int NUM_PBOS = 3;
+    GLuint pbos[NUM_PBOS];
+    GLsync fences[NUM_PBOS];
+    int pboWidths[NUM_PBOS], pboHeights[NUM_PBOS];
+    size_t pboSizes[NUM_PBOS];
+    string pboPaths[NUM_PBOS];
+    int pboHead, pboTail, numPending;
+
+    // -----------------------------------------------------
+    // Writer thread and its queue
+    // -----------------------------------------------------
+    thread writer;
+    mutex queueMutex;
+    condition_variable queueCond;
+    deque<Job> queue;
+    bool isStopping;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    Capture();
+    ~Capture();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void initTarget(int, int, int = 0);
+    void releaseTarget();
+    void bindTarget();
+    GLuint resolveTarget();
+    void read(GLuint, int, int, const string);
+    void readNow(GLuint, int, int, unsigned char *);
+    void collect(bool = false);
+    void finish();
+    int queueDepth();
+    void writeLoop();
+
+    static FIBITMAP *toImage(const unsigned char *, int, int);
+    static bool save(const string, const unsigned char *, int, int);
+};
+
+#endif
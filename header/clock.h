@@ -0,0 +1,52 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+// =======================================
+// Simulation clock with a fixed timestep
+// - Each frame, the clock decides how many fixed steps to simulate
+//   and how far the rendered frame lies between the last two steps
+// - In offline mode, frame N always maps to time N / fps
+// =======================================
+class SimClock
+{
+  public:
+    // -----------------------------------------------------
+    // Settings
+    // - step: fixed simulation timestep in seconds
+    // - fps: offline frame rate, 0 means following the wall clock
+    // - timeScale: speed of simulated time relative to the wall clock
+    // - maxDelta: longest wall time accepted per frame (avoids long catch-up)
+    // -----------------------------------------------------
+    double step;
+    double fps;
+    double timeScale;
+    double maxDelta;
+
+    // -----------------------------------------------------
+    // State
+    // - frame: number of frames advanced
+    // - steps: number of simulated steps
+    // - target: simulated time of the current frame
+    // - alpha: position of the frame between the last two steps, in [0, 1)
+    // -----------------------------------------------------
+    long frame;
+    long steps;
+    double target;
+    float alpha;
+    double lastWallTime;
+
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    SimClock(double = 1.0 / 120.0);
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    int advance(double);
+    double time();
+};
+
+#endif
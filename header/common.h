@@ -9,6 +9,8 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <cfloat>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -33,17 +35,43 @@ using namespace glm;
 class Mesh
 {
   public:
-    // Assimp objects to import 3D object
-    Assimp::Importer importer;
-    const aiScene *scene;
+    // ------------------------------------------------
+    // A 3D model of the mesh
+    // - indices: triangle lists of all LODs, back to back
+    // - lodFirsts, lodCounts: index range of each LOD (0 is full detail)
+    // ------------------------------------------------
+    struct SubMesh
+    {
+        vector<vec3> vtxs, nmls;
+        vector<vec2> uvs;
+        vector<GLuint> indices;
+        vector<int> lodFirsts, lodCounts;
+    };
+
+    vector<SubMesh> subMeshes;
 
     // ------------------------------------------------
     // OpenGL object list
     // - vtx: vertex position
-    // - uv: uv coordinate
-    // - nml: surface normal
+    // - uv: uv coordinate (half float)
+    // - nml: surface normal (GL_INT_2_10_10_10_REV)
+    // - ebo: indices of all LODs
     // ------------------------------------------------
-    vector<GLuint> vboVtxs, vboUvs, vboNmls, vaos;
+    vector<GLuint> vboVtxs, vboUvs, vboNmls, ebos, vaos;
+
+    // ------------------------------------------------
+    // Instances
+    // - vboInstance: model matrix of each instance (attributes 3 to 6)
+    // - All 3D models of the mesh share the same instances
+    // ------------------------------------------------
+    GLuint vboInstance;
+    int numInstances;
+
+    // Bounding box of all 3D models in model space
+    vec3 boundsMin, boundsMax;
+
+    // Number of LODs of the most detailed 3D model
+    int numLods;
 
     // ------------------------------------------------
     // OpenGL object for shaders
@@ -61,6 +89,10 @@ class Mesh
     // Can this object be reflected on water surface
     bool isReflect;
 
+    // Draw calls and triangles of the last draw()
+    int numDrawCalls;
+    long long numTriangles;
+
     // ------------------------------------------------
     // Constructor and destructor
     // ------------------------------------------------
@@ -70,11 +102,19 @@ class Mesh
     // ------------------------------------------------
     // Member functions
     // ------------------------------------------------
+    void importMesh(const string);
+    void buildLods();
+    bool loadCache(const string, const string);
+    void saveCache(const string);
     void initBuffers();
     void initShader();
     void initUniform();
-    void draw(mat4, mat4, mat4, vec3, vec3, vec3, int, int);
+    void draw(mat4, mat4, mat4, vec3, vec3, vec3, int, int, int = 0);
+    void bind(mat4, mat4, mat4, vec3, vec3, vec3, int, int);
+    void setInstances(const vector<mat4> &);
+    void setClipPlane(GLint, vec4);
     void setTexture(GLuint &, int, const string, FREE_IMAGE_FORMAT);
+    size_t hostBytes();
 };
 
 // =======================================
@@ -84,7 +124,8 @@ std::string readFile(const std::string);
 void printLog(GLuint &);
 GLint myGetUniformLocation(GLuint &, string, bool = false);
 GLuint buildShader(string, string, string = "", string = "", string = "");
-GLuint compileShader(string, GLenum);
+GLuint buildComputeShader(string);
+GLuint compileShader(string, GLenum, string = "");
 GLuint linkShader(GLuint, GLuint, GLuint, GLuint, GLuint);
 
 #endif
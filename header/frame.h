@@ -0,0 +1,108 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "common.h"
+#include <atomic>
+
+// =======================================
+// Everything needed to render one frame
+// - Produced by the simulation (main) thread,
+//   consumed by the render thread, never modified in between
+// =======================================
+struct FrameState
+{
+    // Simulation frame number and simulated time
+    long frame;
+    double time;
+
+    // Cameras
+    // - The reflection camera of a water plane depends on its height,
+    //   only its direction and up vector are shared
+    mat4 view, projection;
+    vec3 eyePoint, eyeDirection;
+    vec3 eyeDirectionReflect, upReflect;
+
+    // Water animation
+    float dudvMove;
+
+    // Render settings
+    bool isSkyLookup, isProbeReflect, isLineMode;
+
+    // Save this frame to an image
+    bool isSave;
+
+    // Print render statistics with this frame
+    bool isPrintInfo;
+};
+
+// =======================================
+// Camera pose of a view to render in batch mode
+// - One pose per line in a pose file:
+//   eyeX eyeY eyeZ verticalAngle horizontalAngle fov time
+// =======================================
+struct Pose
+{
+    vec3 eyePoint;
+    float verticalAngle, horizontalAngle;
+    float fov;
+    double time;
+};
+
+// =======================================
+// Lock-free triple buffer
+// - One writer and one reader, each owning one slot
+// - The third slot is exchanged atomically between them
+// =======================================
+template <class T> class TripleBuffer
+{
+  public:
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    TripleBuffer() : middle(1)
+    {
+        back = 0;
+        front = 2;
+    }
+
+    // -----------------------------------------------------
+    // Writer: slot to fill before publish
+    // -----------------------------------------------------
+    T &writeSlot() { return slots[back]; }
+
+    // -----------------------------------------------------
+    // Writer: hand the filled slot over to the reader
+    // -----------------------------------------------------
+    void publish() { back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+    // -----------------------------------------------------
+    // Reader: take the latest published slot
+    // Return: false if nothing was published since the last fetch
+    // -----------------------------------------------------
+    bool fetch()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
+        {
+            return false;
+        }
+
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    // -----------------------------------------------------
+    // Reader: slot taken by the last fetch
+    // -----------------------------------------------------
+    const T &readSlot() { return slots[front]; }
+
+  private:
+    // The middle index carries a flag telling whether it holds a new slot
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    T slots[3];
+    std::atomic<int> middle;
+    int back, front;
+};
+
+#endif
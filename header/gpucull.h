@@ -0,0 +1,82 @@
+#ifndef GPUCULL_H
+#define GPUCULL_H
+
+#include "common.h"
+#include "bvh.h"
+
+// =======================================
+// GPU-driven culling and draw submission (OpenGL 4.3)
+// - Geometry of all meshes is packed into one vertex array
+// - A compute shader culls instances per pass, selects their LOD,
+//   packs the visible ones and writes indirect draw commands
+// - Each pass is one dispatch and one multi-draw per mesh, whatever the number of instances
+// =======================================
+class GpuCuller
+{
+  public:
+    // -----------------------------------------------------
+    // Layouts shared with csCull.glsl
+    // - Instance: model matrix and world bounds (boundsMin.w is the asset)
+    // - Command: same layout as DrawElementsIndirectCommand
+    // -----------------------------------------------------
+    struct Instance
+    {
+        mat4 M;
+        vec4 boundsMin, boundsMax;
+    };
+
+    struct Command
+    {
+        GLuint count, instanceCount, firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // -----------------------------------------------------
+    // OpenGL objects
+    // - vao: packed geometry, and visible instances (attributes 3 to 6)
+    // - ssboInstances: all instances
+    // - vboVisible: visible instances, packed per LOD and asset,
+    //   LOD k of an asset from instance k * numItems + its first instance
+    // - ssboCounts: number of visible instances of each LOD of each asset
+    //   (asset * numLods + LOD)
+    // - bufCommands: one indirect command per LOD of each 3D model,
+    //   grouped by asset, then by LOD
+    // - ssboCommandCounts: count of each command in ssboCounts
+    // -----------------------------------------------------
+    GLuint vao, vboVtx, vboUv, vboNml, ebo;
+    GLuint ssboInstances, vboVisible, ssboCounts, bufCommands;
+    GLuint ssboCommandCounts, ssboAssetFirsts;
+    GLuint shader;
+    GLint uniStage, uniNumItems, uniNumCommands, uniPlanes, uniNumPlanes;
+    GLint uniEye, uniProjScale, uniLodSize, uniLodBias, uniNumLods;
+
+    int numItems, numAssets, numCommands, numLods;
+
+    // First vertex and index of each 3D model in the packed buffers
+    vector<GLint> subVtxFirsts;
+    vector<GLuint> subIndexFirsts;
+
+    // First command of each asset, and the end of the commands
+    vector<int> assetCommandFirsts;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    GpuCuller();
+    ~GpuCuller();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void initGeometry(const vector<Mesh *> &);
+    void initInstances(const vector<Instance> &, const vector<int> &);
+    void initCommands(const vector<Mesh *> &, const vector<int> &);
+    void updateInstance(int, const Instance &);
+    void cull(const vector<vec4> &, vec3, float, float, int);
+    void draw(int);
+
+    static bool isSupported();
+};
+
+#endif
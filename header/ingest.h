@@ -0,0 +1,74 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "common.h"
+#include <mutex>
+
+// =======================================
+// Image ingest
+// - Images are decoded into bottom-up BGRA, 4 bytes per texel,
+//   which GL uploads as GL_RGBA8 without converting or realigning rows
+// - Pixels are written into pixel unpack buffers mapped for writing,
+//   taken from a pool and reused by size, so that a level is copied
+//   once from its file and the upload does not wait for it
+// - Time spent in each step is counted for all images
+// =======================================
+class ImageIngest
+{
+  public:
+    // Steps of the ingest
+    enum Step
+    {
+        DECODE,
+        CONVERT,
+        READ,
+        UPLOAD,
+        NUM_STEPS
+    };
+
+    // -----------------------------------------------------
+    // A staging buffer
+    // - data: mapped memory while in use, 0 otherwise
+    // -----------------------------------------------------
+    struct Staging
+    {
+        GLuint pbo;
+        size_t bytes;
+        unsigned char *data;
+        bool isInUse;
+    };
+
+    vector<Staging> buffers;
+
+    // Free buffers beyond this many bytes are deleted
+    size_t maxFreeBytes;
+
+    // -----------------------------------------------------
+    // Time of each step in milliseconds, and number of times
+    // - Shared by all threads and owners
+    // -----------------------------------------------------
+    static double stepMs[NUM_STEPS];
+    static int stepCounts[NUM_STEPS];
+    static mutex statMutex;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    ImageIngest();
+    ~ImageIngest();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    GLuint acquire(size_t, unsigned char *&);
+    bool unmap(GLuint);
+    void release(GLuint);
+    size_t freeBytes();
+
+    static FIBITMAP *decode(const string, FREE_IMAGE_FORMAT = FIF_UNKNOWN);
+    static void addTime(Step, double);
+    static double now();
+    static void report();
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include "common.h"
+#include "frame.h"
+
+// =======================================
+// Input state read at the start of a frame
+// - time: wall clock time in seconds, drives the simulation clock
+// - cursorX, cursorY: cursor offset from the window center
+// - keys: InputLog::KEY_* bits held down
+// - settings: InputLog::SETTING_* bits on
+// =======================================
+struct InputFrame
+{
+    double time;
+    float cursorX, cursorY;
+    unsigned char keys;
+    unsigned char settings;
+};
+
+// =======================================
+// Recorded inputs of an interactive session
+// - The start camera and the input state of every frame
+//   are written to a compact binary file
+// - Replaying feeds the same inputs and wall times to the simulation,
+//   so the camera path and every frame of a session repeat exactly
+// - Replayed frame times are measured for a report at the end
+// =======================================
+class InputLog
+{
+  public:
+    enum
+    {
+        KEY_W = 1,
+        KEY_S = 2,
+        KEY_D = 4,
+        KEY_A = 8
+    };
+
+    enum
+    {
+        SETTING_SKY_LOOKUP = 1,
+        SETTING_PROBE_REFLECT = 2,
+        SETTING_LINE_MODE = 4
+    };
+
+    // -----------------------------------------------------
+    // Session settings
+    // - start: camera at the first frame (time is unused)
+    // - step, timeScale: settings of the simulation clock
+    // -----------------------------------------------------
+    Pose start;
+    double step, timeScale;
+
+    // -----------------------------------------------------
+    // Recording
+    // - Frames are appended as they are read
+    // -----------------------------------------------------
+    ofstream out;
+    long numRecorded;
+
+    // -----------------------------------------------------
+    // Replaying
+    // - frames: the whole log, read up front so that replaying reads no file
+    // - next: index of the next frame to replay
+    // - wallTimes: wall clock time at which each frame was replayed
+    // -----------------------------------------------------
+    vector<InputFrame> frames;
+    size_t next;
+    vector<double> wallTimes;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    InputLog();
+    ~InputLog();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool record(const string, const Pose &, double, double);
+    void write(const InputFrame &);
+    void finish();
+    bool load(const string);
+    bool read(InputFrame &, double);
+    bool isReplaying();
+    void report();
+};
+
+#endif
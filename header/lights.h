@@ -0,0 +1,146 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// =======================================
+// Clustered point lights
+// - The view frustum of a pass is divided into a grid of clusters:
+//   tiles on the screen, and depth slices growing exponentially
+// - Every frame, each light is binned into the clusters its sphere
+//   touches, on worker threads that each own a range of slices
+// - The clusters of the last few cameras are kept on the GPU,
+//   so passes whose camera did not move bind them without a rebuild
+// - Shaders find the cluster of a fragment and shade only its lights,
+//   so the cost follows the number of lights nearby, not in the scene
+// - Lights, light lists and cluster ranges are texture buffers,
+//   the camera of the clusters is a uniform block
+// =======================================
+class ClusteredLights
+{
+  public:
+    // Cluster grid, the same in shader/clusters.glsl
+    static const int TILES_X = 16;
+    static const int TILES_Y = 9;
+    static const int SLICES = 24;
+    static const int NUM_CLUSTERS = TILES_X * TILES_Y * SLICES;
+
+    // Texture units of the buffers, binding point of the uniform block
+    static const int TEX_UNIT_LIGHTS = 28;
+    static const int TEX_UNIT_CLUSTERS = 29;
+    static const int TEX_UNIT_INDICES = 30;
+    static const int BLOCK_BINDING = 1;
+
+    // Cameras whose clusters are kept, e.g. main, refraction, reflection and probe faces
+    static const int MAX_VIEWS = 8;
+
+    // -----------------------------------------------------
+    // A point light
+    // - Its light fades to 0 at radius
+    // -----------------------------------------------------
+    struct Light
+    {
+        vec3 position;
+        float radius;
+        vec3 color;
+    };
+
+    // -----------------------------------------------------
+    // Content of the uniform block (std140)
+    // - depth: near plane, and log(far / near) to find the slice
+    // -----------------------------------------------------
+    struct Block
+    {
+        mat4 V, P;
+        vec2 depth;
+        int numLights;
+        int padding;
+    };
+
+    // -----------------------------------------------------
+    // Clusters of a camera on the GPU
+    // - version: lights version they were built with
+    // - lastBound: bind count when last bound, for reuse
+    // -----------------------------------------------------
+    struct View
+    {
+        mat4 V, P;
+        int version, lastBound;
+        GLuint vboClusters, tboClusters;
+        GLuint vboIndices, tboIndices;
+        GLuint ubo;
+    };
+
+    // -----------------------------------------------------
+    // Lights
+    // - isDirty: lights changed since they were uploaded
+    // - version: increased on each upload, so that older clusters are rebuilt
+    // -----------------------------------------------------
+    vector<Light> lights;
+    bool isDirty;
+    int version;
+
+    // -----------------------------------------------------
+    // Clusters of the last build
+    // - clusterLights: lights of each cluster, filled by the workers
+    // - ranges: first index and number of lights of each cluster
+    // -----------------------------------------------------
+    vector<vector<GLuint>> clusterLights;
+    vector<GLuint> ranges, indices;
+
+    // -----------------------------------------------------
+    // Clusters on the GPU
+    // - emptyView: grid without lights, uploaded once, bound while there are none
+    // - views: clusters of the last cameras
+    // -----------------------------------------------------
+    View emptyView;
+    vector<View> views;
+    int numBinds;
+
+    // Camera of the build, shared with the workers
+    Block block;
+    vector<vec4> viewLights;
+
+    // -----------------------------------------------------
+    // OpenGL objects
+    // -----------------------------------------------------
+    GLuint vboLights, tboLights;
+
+    // -----------------------------------------------------
+    // Workers
+    // - Each build is a job, run by all workers and the caller
+    // -----------------------------------------------------
+    vector<thread> workers;
+    mutex jobMutex;
+    condition_variable jobCond, doneCond;
+    int job, numDone;
+    bool isStopping;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    ClusteredLights(int = 0);
+    ~ClusteredLights();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void add(vec3, vec3, float);
+    void bind(mat4, mat4);
+    void build(View &, mat4, mat4);
+    void binSlices(int, int);
+    void uploadLights();
+    void upload(View &);
+    void bindView(const View &);
+    View createView();
+    void destroyView(View &);
+    void workLoop(int);
+    int maxClusterLights();
+
+    static void initShader(GLuint);
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "common.h"
+
+// =======================================
+// Mesh processing done once per mesh file
+// - Index reordering for the post-transform vertex cache and for overdraw
+// - Simplification by vertex clustering, for LODs
+// - Quantization of vertex attributes
+// =======================================
+void optimizeVertexCache(vector<GLuint> &, size_t);
+void optimizeOverdraw(vector<GLuint> &, const vector<vec3> &);
+vector<GLuint> simplifyMesh(const vector<GLuint> &, const vector<vec3> &, float);
+float vertexCacheMissRatio(const vector<GLuint> &, int = 32);
+
+GLuint packNormal(vec3);
+GLushort packHalf(float);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include <atomic>
+#include <thread>
+
+// =======================================
+// Runtime metrics of a long-running process
+// - Counters, gauges and histograms are atomics,
+//   updated without locks by the thread doing the measured work
+// - An exporter thread writes them in the Prometheus text format,
+//   periodically to a file (e.g. for the textfile collector of a node exporter),
+//   and to HTTP scrapes on a local port
+// =======================================
+class Metrics
+{
+  public:
+    // Counters, only ever increased
+    enum Counter
+    {
+        FRAMES,
+        DROPPED_FRAMES,
+        DRAW_CALLS,
+        PROGRAM_BINDS,
+        TRIANGLES,
+        NUM_COUNTERS
+    };
+
+    // Gauges set by their owners, memory of OpenGL objects is read at export
+    enum Gauge
+    {
+        STREAMED_TEXTURE_BYTES,
+        CAPTURE_QUEUE,
+        NUM_GAUGES
+    };
+
+    // Histograms of times, the GPU time of each pass and the interval of shown frames
+    enum Timing
+    {
+        PASS_FRAME,
+        PASS_STREAM,
+        PASS_PROBE,
+        PASS_REFRACTION,
+        PASS_REFLECTION,
+        PASS_MAIN,
+        FRAME_INTERVAL,
+        NUM_TIMINGS
+    };
+
+    // -----------------------------------------------------
+    // Histogram with fixed buckets
+    // - counts[i]: observations up to BUCKET_MS[i], the last one above all buckets
+    // - sumNs: sum of observations in nanoseconds
+    // -----------------------------------------------------
+    static const int NUM_BUCKETS = 12;
+    static const double BUCKET_MS[NUM_BUCKETS];
+    struct Histogram
+    {
+        atomic<long long> counts[NUM_BUCKETS + 1];
+        atomic<long long> sumNs;
+    };
+
+    static atomic<long long> counters[NUM_COUNTERS];
+    static atomic<long long> gauges[NUM_GAUGES];
+    static Histogram timings[NUM_TIMINGS];
+
+    // -----------------------------------------------------
+    // Exporter
+    // - filePath: file rewritten every interval seconds, empty if none
+    // - listenFd: socket on 127.0.0.1 answering scrapes, -1 if none
+    // -----------------------------------------------------
+    static string filePath;
+    static double interval;
+    static int listenFd;
+    static double startTime;
+    static atomic<bool> isStopping;
+    static thread exporter;
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    static void add(Counter, long long = 1);
+    static void set(Gauge, long long);
+    static void observe(Timing, double);
+    static bool start(const string, int, double);
+    static void stop();
+    static string format();
+    static void exportLoop();
+    static void writeFile();
+    static void serve(int);
+};
+
+// =======================================
+// GPU time of render passes
+// - Timestamps are written between passes, so they never overlap
+//   the frame timer query of dynamic resolution
+// - Results are read a few frames later when they are available,
+//   so reading never stalls
+// =======================================
+class PassTimer
+{
+  public:
+    // -----------------------------------------------------
+    // Timestamp queries of the last frames in a ring
+    // - queries[f][0] starts frame f, queries[f][i + 1] ends its pass passes[f][i]
+    // - A frame whose marks do not fit is not measured
+    // -----------------------------------------------------
+    static const int NUM_FRAMES = 4;
+    static const int MAX_MARKS = 32;
+    GLuint queries[NUM_FRAMES][MAX_MARKS + 1];
+    int passes[NUM_FRAMES][MAX_MARKS];
+    int numMarks[NUM_FRAMES];
+    bool isPending[NUM_FRAMES];
+    int head, tail;
+    bool isMeasuring;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    PassTimer();
+    ~PassTimer();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void beginFrame();
+    void mark(Metrics::Timing);
+    void endFrame();
+    void readQueries();
+};
+
+#endif
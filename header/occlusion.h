@@ -0,0 +1,47 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "common.h"
+#include "bvh.h"
+
+// =======================================
+// Occlusion culling with a CPU-rasterized depth buffer
+// - Large meshes (occluders) are rasterized at low resolution
+// - A max-depth pyramid (Hi-Z) of the buffer
+//   tests a bounding box with a few texel reads
+// - No GPU query or readback, so it also suits software OpenGL
+// =======================================
+class OcclusionBuffer
+{
+  public:
+    // -----------------------------------------------------
+    // Depth pyramid
+    // - levels[0]: nearest occluder depth of each pixel in [0, 1]
+    // - levels[k + 1]: farthest depth of 2x2 texels of levels[k]
+    // -----------------------------------------------------
+    int width, height;
+    vector<vector<float>> levels;
+    vector<int> levelWidths, levelHeights;
+
+    // View of the buffer (projection * view)
+    mat4 VP;
+
+    // Statistics of the last frame
+    int numTriangles, numTested, numOccluded;
+
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    OcclusionBuffer(int = 256, int = 128);
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void clear(const mat4 &);
+    void rasterize(const vector<vec3> &, const GLuint *, int, const mat4 &, vec4 = vec4(0.f));
+    void buildPyramid();
+    bool isOccluded(const AABB &);
+    void drawTriangle(vec3, vec3, vec3);
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "common.h"
+
+class Probe
+{
+  public:
+    // -----------------------------------------------------
+    // Probe settings
+    // - position: center of the cubemap camera
+    // - size: width and height of each cubemap face
+    // - facesPerFrame: number of faces updated per frame
+    // -----------------------------------------------------
+    vec3 position;
+    int size;
+    int facesPerFrame;
+
+    // Next face to update
+    int face;
+
+    // Has every face been rendered since the probe was (re)enabled
+    // - If not, all faces are updated in the next frame
+    bool isComplete;
+
+    // Texture unit of the cubemap
+    static const int TEX_UNIT;
+
+    // -----------------------------------------------------
+    // OpenGL objects
+    // -----------------------------------------------------
+    GLuint tbo, fbo, rboDepth;
+
+    // Projection matrix shared by all faces (90 degree field of view)
+    mat4 P;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    Probe(vec3, int = 256);
+    ~Probe();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    int facesToUpdate();
+    int bindFace();
+    void finishFace();
+    mat4 faceView(int);
+    void initTexture();
+    void initFramebuffer();
+};
+
+#endif
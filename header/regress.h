@@ -0,0 +1,85 @@
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include "common.h"
+#include "frame.h"
+#include <map>
+
+// =======================================
+// Golden-image regression suite
+// - A suite file lists camera poses at fixed animation times,
+//   which are rendered offscreen and compared with stored golden images
+// - Pixels may differ by a tolerance, and edges may move by one pixel,
+//   so that other drivers and optimizations that round differently pass
+// - Frame times are compared with stored baselines
+// =======================================
+class RegressionSuite
+{
+  public:
+    // A camera pose to render and compare
+    struct Case
+    {
+        string name;
+        Pose pose;
+    };
+
+    // -----------------------------------------------------
+    // Result of comparing an image with its golden image
+    // - numBad: pixels differing by more than the tolerance
+    // - maxDiff: largest difference of a pixel, 0 to 255
+    // - psnr: peak signal-to-noise ratio in dB, pixel by pixel
+    // -----------------------------------------------------
+    struct Result
+    {
+        int numBad;
+        float badFraction;
+        float maxDiff;
+        float psnr;
+    };
+
+    vector<Case> cases;
+
+    // Size of the rendered views
+    int width, height;
+
+    // -----------------------------------------------------
+    // Image gate
+    // - tolerance: difference of a pixel (0 to 255) still accepted
+    // - maxBad: fraction of pixels allowed beyond the tolerance
+    // -----------------------------------------------------
+    float tolerance, maxBad;
+
+    // -----------------------------------------------------
+    // Performance gate
+    // - A case fails if it is slower than its baseline by more than
+    //   maxSlowdown (relative) and slackMs (absolute) at once
+    // - warmup: untimed frames before measuring, to stream textures
+    // - repeat: timed frames, the median counts
+    // -----------------------------------------------------
+    float maxSlowdown, slackMs;
+    int warmup, repeat;
+
+    // Golden images and the timing baselines, "<name>.png" and "timings.txt"
+    string goldenDir;
+    map<string, float> baselines;
+
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    RegressionSuite();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool load(const string);
+    void loadBaselines();
+    bool saveBaselines(const map<string, float> &);
+    bool readGolden(const string, vector<unsigned char> &);
+    Result compare(const unsigned char *, const unsigned char *, unsigned char *);
+    bool isSlower(const string, float);
+
+    static float pixelDiff(const unsigned char *, const unsigned char *);
+    static float median(vector<float>);
+};
+
+#endif
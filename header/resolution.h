@@ -0,0 +1,67 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include "common.h"
+
+class DynamicResolution
+{
+  public:
+    // -----------------------------------------------------
+    // Target size
+    // - width, height: size of the window framebuffer
+    // - scale: current fraction of width and height to render
+    // - samples: current MSAA level (0 means no MSAA)
+    // -----------------------------------------------------
+    int width, height;
+    float scale, minScale, maxScale, scaleStep;
+    int samples, maxSamples;
+
+    // -----------------------------------------------------
+    // Controller settings
+    // - budget: GPU frame time budget in milliseconds
+    // - interval: number of measured frames between adjustments
+    // -----------------------------------------------------
+    float budget;
+    int interval;
+
+    // Measured GPU time since the last adjustment
+    float gpuTimeSum;
+    int gpuTimeCount;
+    float gpuTimeAvg;
+
+    // -----------------------------------------------------
+    // OpenGL objects
+    // - fboScene: offscreen target of the main pass
+    // - fboResolve: single sample copy of fboScene (only used with MSAA)
+    // -----------------------------------------------------
+    GLuint fboScene, rboSceneColor, rboSceneDepth;
+    GLuint fboResolve, rboResolveColor;
+
+    // Timer queries in a ring, so that reading results never stalls
+    static const int NUM_QUERIES = 4;
+    GLuint queries[NUM_QUERIES];
+    bool isQueryPending[NUM_QUERIES];
+    int queryHead, queryTail;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    DynamicResolution(int, int, float, int = 4);
+    ~DynamicResolution();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    void beginFrame();
+    void endFrame();
+    void bindScene();
+    void present();
+    int sceneWidth();
+    int sceneHeight();
+    void initTarget();
+    void releaseTarget();
+    void readQueries();
+    void adjust();
+};
+
+#endif
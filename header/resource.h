@@ -0,0 +1,66 @@
+#ifndef RESOURCE_H
+#define RESOURCE_H
+
+#include "common.h"
+#include <map>
+#include <mutex>
+
+// =======================================
+// Registry of OpenGL objects and host memory
+// - Buffers, textures, renderbuffers, framebuffers, vertex arrays,
+//   queries and programs are created and deleted through it,
+//   under the category of their owner (e.g. "water")
+// - Owners report the size of the data they give each object,
+//   and large host allocations by category
+// - report() prints memory per category,
+//   reportLeaks() lists objects that are still alive (at shutdown)
+// =======================================
+class Resources
+{
+  public:
+    enum Kind
+    {
+        BUFFER,
+        TEXTURE,
+        RENDERBUFFER,
+        FRAMEBUFFER,
+        VERTEX_ARRAY,
+        QUERY,
+        PROGRAM,
+        NUM_KINDS
+    };
+
+    // -----------------------------------------------------
+    // A live object
+    // - label: what it is, if the category is not enough (e.g. shader files)
+    // - bytes: estimated GPU memory
+    // -----------------------------------------------------
+    struct Object
+    {
+        string category, label;
+        size_t bytes;
+    };
+
+    static map<GLuint, Object> objects[NUM_KINDS];
+    static map<string, long long> hostBytes;
+    static mutex objectMutex;
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    static GLuint create(Kind, const string, const string = "");
+    static void create(Kind, GLsizei, GLuint *, const string);
+    static void track(Kind, GLuint, const string, const string = "");
+    static void destroy(Kind, GLuint &);
+    static void destroy(Kind, GLsizei, GLuint *);
+    static void setBytes(Kind, GLuint, size_t);
+    static void addHostBytes(const string, long long);
+    static size_t gpuBytes();
+    static void report();
+    static int reportLeaks();
+
+    static size_t formatBytes(GLenum);
+    static const char *kindName(Kind);
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef RTPOOL_H
+#define RTPOOL_H
+
+#include "common.h"
+#include <map>
+
+// =======================================
+// Pool of render targets
+// - Targets are handed out by descriptor (size, format, samples),
+//   as textures, or as renderbuffers when they are never sampled
+// - A target released after its pass is handed to the next pass
+//   asking for the same kind of target, so passes that do not
+//   overlap in time share memory
+// - A released renderbuffer also serves smaller requests,
+//   a texture is sampled by uv and must match in size
+// - Targets unused for maxIdleFrames frames are deleted
+// =======================================
+class RenderTargetPool
+{
+  public:
+    // -----------------------------------------------------
+    // Descriptor of a render target
+    // - samples: MSAA level, only for renderbuffers (0 means no MSAA)
+    // -----------------------------------------------------
+    struct Desc
+    {
+        int width, height;
+        GLenum format;
+        int samples;
+        bool isTexture;
+    };
+
+    // -----------------------------------------------------
+    // A render target
+    // - name: texture or renderbuffer object
+    // - lastUsed: frame in which it was last acquired
+    // -----------------------------------------------------
+    struct Target
+    {
+        Desc desc;
+        GLuint name;
+        size_t bytes;
+        bool isInUse;
+        int lastUsed;
+    };
+
+    vector<Target> targets;
+    int frame, maxIdleFrames;
+
+    // Bytes of all targets, and of targets in use
+    size_t totalBytes, usedBytes;
+
+    // Format of each named target, set by the command line
+    map<string, GLenum> formats;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    RenderTargetPool();
+    ~RenderTargetPool();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    GLuint acquire(int, int, GLenum, bool = true, int = 0);
+    void release(GLuint, bool = true);
+    void beginFrame();
+    void clear();
+    GLenum formatOf(const string);
+    bool setFormat(const string, const string);
+
+    static void pixelFormat(GLenum, GLenum &, GLenum &);
+    static GLenum depthAttachment(GLenum);
+    static bool hasAlpha(GLenum);
+    static GLenum parseFormat(const string);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "common.h"
+#include "bvh.h"
+#include "occlusion.h"
+#include "gpucull.h"
+#include "stream.h"
+#include "lights.h"
+
+// =======================================
+// Objects of the scene, loaded from a scene file
+// - Each mesh file is imported once,
+//   and all its placements are drawn as instances
+// - Instances are culled per pass with a BVH over their world bounds
+// =======================================
+class Scene
+{
+  public:
+    // A mesh and its instances
+    struct Asset
+    {
+        string name;
+        Mesh *mesh;
+        vector<mat4> instances;
+
+        // Index of the first instance in the BVH
+        int firstItem;
+
+        // Is this mesh large enough to hide others
+        bool isOccluder;
+
+        // Instances that passed culling in the current pass, per LOD
+        vector<vector<mat4>> visible;
+    };
+
+    vector<Asset> assets;
+
+    // Out-of-core meshes, streamed in chunks
+    vector<MeshStream *> streams;
+
+    // -----------------------------------------------------
+    // Culling
+    // - bvh: items are all instances of all assets, in asset order
+    // - itemAssets: asset of each item
+    // - numVisible: instances drawn by the last pass, -1 if culled on the GPU
+    // -----------------------------------------------------
+    BVH bvh;
+    vector<int> itemAssets;
+    vector<int> visibleItems;
+    int numVisible;
+
+    // -----------------------------------------------------
+    // LOD selection
+    // - lodSize: projected size (fraction of the screen height)
+    //   below which the next coarser LOD is used; halves for each LOD
+    // -----------------------------------------------------
+    float lodSize;
+
+    // (Option) Culling and draw submission on the GPU, NULL if off
+    GpuCuller *gpuCuller;
+
+    // Point lights, binned per pass
+    ClusteredLights *lights;
+
+    // Water bodies: center of the surface, and extent along x and z
+    // - Drawn by the water, which groups them by height
+    vector<pair<vec3, vec2>> waterBodies;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    Scene(const string);
+    ~Scene();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool load(const string);
+    void draw(mat4, mat4, vec3, vec3, vec3, vec4 = vec4(0.f), OcclusionBuffer * = NULL, int = 0);
+    void updateStreams(mat4, vec3);
+    int selectLod(int, const mat4 &, vec3, int);
+    void cullOccluded(OcclusionBuffer *, mat4, vec4);
+    void moveInstance(int, int, mat4);
+    void buildBVH();
+    void initGpuCulling();
+    GpuCuller::Instance gpuInstance(int, int);
+    AABB instanceBounds(int, int);
+    void setClipPlane0(vec4);
+    void setClipPlane1(vec4);
+    int numInstances();
+    int findAsset(const string);
+};
+
+#endif
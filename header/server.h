@@ -0,0 +1,70 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "common.h"
+#include "frame.h"
+
+// =======================================
+// Render server over a Unix domain socket
+// - Requests and replies are text lines on the socket
+// - Pixels are returned through a POSIX shared memory segment,
+//   so large frames are never copied through the socket
+// - One client is served at a time
+// =======================================
+class RenderServer
+{
+  public:
+    // -----------------------------------------------------
+    // A render request
+    // "render eyeX eyeY eyeZ verticalAngle horizontalAngle fov time width height format"
+    // - format: "raw" for bottom-up BGRA pixels, or an image format (e.g. "png")
+    // -----------------------------------------------------
+    struct Request
+    {
+        Pose pose;
+        int width, height;
+        string format;
+    };
+
+    // -----------------------------------------------------
+    // Socket
+    // - socketPath: file system path of the socket
+    // - listenFd: listening socket, clientFd: connected client (-1 if none)
+    // -----------------------------------------------------
+    string socketPath;
+    int listenFd, clientFd;
+    string lineBuffer;
+
+    // -----------------------------------------------------
+    // Shared memory
+    // - Grows to fit the largest reply, the client maps it after each reply
+    // -----------------------------------------------------
+    string shmName;
+    int shmFd;
+    unsigned char *shmData;
+    size_t shmSize;
+
+    // Largest accepted width and height
+    int maxSize;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    RenderServer(const string);
+    ~RenderServer();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool start();
+    bool receive(Request &);
+    unsigned char *reserve(size_t);
+    size_t encode(const string, int, int);
+    void reply(size_t, int, int);
+    void replyError(const string);
+    bool readLine(string &);
+    bool sendLine(const string);
+    bool parse(const string, Request &);
+};
+
+#endif
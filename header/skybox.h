@@ -2,6 +2,7 @@
 #define SKYBOX_H
 
 #include "common.h"
+#include "texstream.h"
 
 class Skybox
 {
@@ -48,6 +49,10 @@ class Skybox
     GLuint vbo, tbo, vao, shader;
     GLint uniM, uniV, uniP;
 
+    // Streamed cubemap
+    TextureStreamer *streamer;
+    int texSky;
+
     // -----------------------------------------
     // Transformation matrices
     // -----------------------------------------
@@ -56,7 +61,7 @@ class Skybox
     // -----------------------------------------
     // Constructor and destructor
     // -----------------------------------------
-    Skybox();
+    Skybox(TextureStreamer *);
     ~Skybox();
 
     // -----------------------------------------
@@ -64,6 +69,7 @@ class Skybox
     // -----------------------------------------
     void draw(mat4, mat4, mat4, vec3);
     void initTexture();
+    void streamTexture(mat4, int);
     void initBuffer();
     void initShader();
     void initUniform();
@@ -0,0 +1,142 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "common.h"
+#include "bvh.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+
+// =======================================
+// Out-of-core mesh, streamed from a chunk file
+// - The chunk file (built offline by meshchunk) splits a large mesh into
+//   spatial chunks whose vertices are already in the GPU layout
+// - The file is memory-mapped, so only the pages of loaded chunks use RAM
+// - Chunks near the camera or in its view are copied out of the file on a
+//   loader thread, and uploaded into a fixed pool of GPU slots
+// - When the pool is full, the least recently used chunk is evicted
+// =======================================
+class MeshStream
+{
+  public:
+    // -----------------------------------------------------
+    // A chunk in the chunk file
+    // - offset: first byte of its vertices, followed by its indices
+    // - Indices are 16 bits and local to the chunk
+    // -----------------------------------------------------
+    struct Chunk
+    {
+        vec3 boundsMin, boundsMax;
+        GLuint numVtxs, numIndices;
+        unsigned long long offset;
+    };
+
+    // A chunk copied out of the file, waiting for upload
+    struct Load
+    {
+        int chunk;
+        vector<char> data;
+    };
+
+    // Interleaved vertex: position, uv (half float), normal (2_10_10_10)
+    static const int VERTEX_SIZE = 20;
+
+    vector<Chunk> chunks;
+
+    // -----------------------------------------------------
+    // Memory-mapped chunk file
+    // -----------------------------------------------------
+    int fd;
+    char *fileData;
+    size_t fileSize;
+
+    // -----------------------------------------------------
+    // GPU pool
+    // - Slot i holds slotVtxs vertices from vertex i * slotVtxs,
+    //   and slotIndices indices from index i * slotIndices
+    // - slotChunks: chunk in each slot, -1 if free
+    // - chunkSlots: slot of each chunk, -1 if not resident
+    // -----------------------------------------------------
+    GLuint vao, vbo, ebo, vboInstance;
+    int numSlots, slotVtxs, slotIndices;
+    vector<int> slotChunks, chunkSlots;
+
+    // -----------------------------------------------------
+    // LRU order of resident chunks, most recently used first
+    // - lastUsed: frame in which each chunk was last wanted or drawn,
+    //   chunks of the current frame are never evicted
+    // -----------------------------------------------------
+    list<int> lru;
+    vector<list<int>::iterator> lruPositions;
+    vector<int> lastUsed;
+    int frame;
+
+    // -----------------------------------------------------
+    // Streaming settings
+    // - prefetchRadius: chunks this close to the eye are loaded
+    //   even when they are not in view
+    // - maxLoads: chunks requested from the loader at once
+    // - uploadsPerFrame: chunks uploaded per frame
+    // -----------------------------------------------------
+    float prefetchRadius;
+    int maxLoads, uploadsPerFrame;
+
+    // -----------------------------------------------------
+    // Loader thread
+    // - isRequested: chunk is queued or being loaded
+    // -----------------------------------------------------
+    thread loader;
+    mutex loadMutex;
+    condition_variable loadCond;
+    deque<int> requests;
+    deque<Load> loaded;
+    vector<char> isRequested;
+    int numLoads;
+    bool isStopping;
+
+    // Culling of chunks
+    BVH bvh;
+    vector<int> visibleChunks;
+
+    // Number of chunks and triangles drawn by the last pass
+    int numDrawn;
+    long long numTriangles;
+
+    // -----------------------------------------------------
+    // Shader, same as Mesh with isReflect
+    // -----------------------------------------------------
+    GLuint shader;
+    GLint uniModel, uniView, uniProjection;
+    GLint uniEyePoint, uniLightColor, uniLightPosition;
+    GLint uniTexBase, uniTexNormal;
+    GLint uniClipPlane0, uniClipPlane1;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    MeshStream(const string, float = 64.f);
+    ~MeshStream();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool open(const string);
+    void close();
+    void initPool(float);
+    void initShader();
+    void update(mat4, vec3);
+    void request(int);
+    bool upload(const Load &);
+    void touch(int);
+    int findSlot();
+    void draw(mat4, mat4, vec3, vec3, vec3, vec4 = vec4(0.f));
+    void setClipPlane(GLint, vec4);
+    int numResident();
+    void loadLoop();
+
+    static bool buildChunks(const string, const string, int = 16384);
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include "common.h"
+
+// =======================================
+// Decide when a render target must be re-rendered,
+// and remember the camera it was rendered with,
+// so that it can be reprojected in the frames between
+// =======================================
+class TemporalCache
+{
+  public:
+    // -----------------------------------------------------
+    // Settings
+    // - interval: re-render every N frames (1 means every frame)
+    // - maxMove: eye movement that forces a refresh
+    // - maxTurn: change of view direction (radians) that forces a refresh
+    // -----------------------------------------------------
+    int interval;
+    float maxMove, maxTurn;
+
+    // -----------------------------------------------------
+    // State of the cached render target
+    // - age: frames since the last refresh
+    // - VP: view-projection matrix it was rendered with
+    // - eye, dir, scale: camera and resolution scale it was rendered with
+    // -----------------------------------------------------
+    bool isValid;
+    int age;
+    mat4 VP;
+    vec3 eye, dir;
+    float scale;
+
+    // -----------------------------------------------------
+    // Constructor
+    // -----------------------------------------------------
+    TemporalCache(int = 1, float = 0.5f, float = 0.05f);
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    bool needsRefresh(vec3, vec3, float);
+    void refresh(mat4, mat4, vec3, vec3, float);
+    void skip();
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef TEXSTREAM_H
+#define TEXSTREAM_H
+
+#include "common.h"
+#include "ingest.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// =======================================
+// Texture streaming by mip level
+// - Images are converted once into a mip file next to them,
+//   so that each mip level can be read on its own
+// - Only small mip levels are loaded at startup,
+//   finer levels are read on a loader thread when they are seen
+//   large enough on screen, one level at a time
+// - All textures share a memory budget,
+//   the largest textures give up their finest levels first
+// =======================================
+class TextureStreamer
+{
+  public:
+    // -----------------------------------------------------
+    // A streamed texture
+    // - target: GL_TEXTURE_2D, or GL_TEXTURE_CUBE_MAP with 6 faces
+    // - residentLevel: finest mip level on the GPU
+    // - wantedLevel: finest mip level needed by the last frame
+    // - baseLevel: levels from this one are always resident
+    // - footprint: largest size on screen this frame, in pixels
+    //   across the whole image
+    // -----------------------------------------------------
+    struct Texture
+    {
+        string mipName;
+        GLenum target;
+        int texUnit;
+        GLuint tbo;
+        int width, height, numLevels, numFaces;
+        int residentLevel, wantedLevel, baseLevel;
+        float footprint;
+        bool isLoading;
+    };
+
+    // -----------------------------------------------------
+    // A mip level read from its file, waiting for upload
+    // - staging: buffer the level is read into, mapped at pixels
+    // - isRead: whether the read succeeded
+    // -----------------------------------------------------
+    struct Load
+    {
+        int texture, level;
+        GLuint staging;
+        unsigned char *pixels;
+        bool isRead;
+    };
+
+    vector<Texture> textures;
+
+    // -----------------------------------------------------
+    // Memory
+    // - budget: largest number of bytes of all resident levels
+    // - baseSize: levels up to this size are loaded at startup
+    // -----------------------------------------------------
+    size_t budget, residentBytes;
+    int baseSize;
+
+    // Staging buffers of the levels being read
+    ImageIngest ingest;
+
+    // Load wanted levels before returning from update()
+    // (e.g. offline rendering, where every frame must be complete)
+    bool isBlocking;
+
+    // -----------------------------------------------------
+    // Loader thread
+    // -----------------------------------------------------
+    thread loader;
+    mutex loadMutex;
+    condition_variable loadCond;
+    deque<Load> requests;
+    deque<Load> loaded;
+    bool isStopping;
+
+    // -----------------------------------------------------
+    // Constructor and destructor
+    // -----------------------------------------------------
+    TextureStreamer(float = 256.f);
+    ~TextureStreamer();
+
+    // -----------------------------------------------------
+    // Member functions
+    // -----------------------------------------------------
+    int load(GLenum, int, const vector<string> &);
+    void setFootprint(int, float);
+    void update();
+    void fitBudget();
+    void request(int);
+    Load stage(int, int);
+    void upload(const Load &);
+    bool makeRoom(size_t);
+    void evict(int, int);
+    size_t levelBytes(const Texture &, int);
+    size_t residentTextureBytes(const Texture &);
+    bool readLevel(const Texture &, int, unsigned char *);
+    void loadLoop();
+
+    static bool buildMips(const vector<string> &, const string);
+};
+
+#endif
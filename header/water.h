@@ -2,27 +2,100 @@
 #define WATER_H
 
 #include "common.h"
-
+#include "texstream.h"
+#include "rtpool.h"
+#include "temporal.h"
+
+// =======================================
+// Water surfaces
+// - Bodies of water are rectangles of tiles, each at its own height
+// - Bodies at the same height lie on one plane, and share
+//   its reflection and refraction textures
+// - Only visible planes hold render targets, at most maxPlanes at once,
+//   and at most maxUpdates planes are rendered again per frame,
+//   the others reproject their last textures
+// =======================================
 class Water
 {
   public:
     // Water surface mesh constants
+    // - WATER_SIZE: half the size of a tile
+    // - WATER_Y: height of the default body, used when the scene has none
     static const float WATER_SIZE;
     static const float WATER_Y;
 
-    // Water moving speed
-    static float dudvMove;
+    // -----------------------------------------------------
+    // A body of water
+    // - center: center of its surface
+    // - tilesX, tilesZ: number of tiles along x and z
+    // - plane: the plane it lies on
+    // -----------------------------------------------------
+    struct Body
+    {
+        vec3 center;
+        int tilesX, tilesZ;
+        int plane;
+        bool isVisible;
+    };
+
+    // -----------------------------------------------------
+    // A distinct water plane
+    // - distance: from the eye to its nearest visible body
+    // - source: plane whose textures it is drawn with, itself if it
+    //   holds targets, otherwise the plane nearest in height that does
+    // - reflectCache, refractCache: when and with which cameras
+    //   its textures were rendered, for reprojection
+    // -----------------------------------------------------
+    struct Plane
+    {
+        float height;
+        bool isVisible, hasTargets;
+        float distance;
+        int source;
+
+        // Reflection, refraction and refraction depth textures
+        GLuint tboReflect, tboRefract, tboDepthRefr;
+        GLuint fboReflect, fboRefract;
+
+        TemporalCache reflectCache, refractCache;
+    };
+
+    vector<Body> bodies;
+    vector<Plane> planes;
+
+    // Planes holding render targets at once, planes rendered per frame
+    int maxPlanes, maxUpdates;
+
+    // Settings of the temporal caches of new planes
+    TemporalCache reflectCache, refractCache;
+
+    // Visible bodies and planes of the last cull
+    int numVisibleBodies, numVisiblePlanes;
+
+    // Plane holding the copy of the main pass, with screen-space refraction
+    int copyPlane;
+
+    // -----------------------------------------------------
+    // Water animation state
+    // - dudvMove: offset of the dudv map at the last simulation step
+    // - dudvMovePrev: offset at the step before
+    // - dudvSpeed: offset per second
+    // - dudvMoveRender: offset interpolated for rendering
+    // -----------------------------------------------------
+    float dudvMove, dudvMovePrev, dudvSpeed;
+    float dudvMoveRender;
 
     // -----------------------------------------------------
     // Water surface mesh
-    // - One quad, two triangles
+    // - One quad, two triangles, at height 0
     // - 3 vertices per triangle, 3 coordinates per vertex
+    // - Each tile is moved to its body and height by the model matrix
     // -----------------------------------------------------
     GLfloat vtxs[48] = {
         // Triangle 1 vertices
-        -WATER_SIZE, WATER_Y, -WATER_SIZE, -WATER_SIZE, WATER_Y, WATER_SIZE, WATER_SIZE, WATER_Y, WATER_SIZE,
+        -WATER_SIZE, 0.f, -WATER_SIZE, -WATER_SIZE, 0.f, WATER_SIZE, WATER_SIZE, 0.f, WATER_SIZE,
         // Triangle 2 vertices
-        WATER_SIZE, WATER_Y, WATER_SIZE, WATER_SIZE, WATER_Y, -WATER_SIZE, -WATER_SIZE, WATER_Y, -WATER_SIZE,
+        WATER_SIZE, 0.f, WATER_SIZE, WATER_SIZE, 0.f, -WATER_SIZE, -WATER_SIZE, 0.f, -WATER_SIZE,
         // UV coordinates
         1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
         // Vertex normals
@@ -40,6 +113,10 @@ class Water
     // Texture buffer object for dudv map and normal map
     GLuint tboDudv, tboNormal;
 
+    // Dudv map and normal map are streamed by mip level
+    TextureStreamer *streamer;
+    int texDudv, texNormalMap;
+
     // Uniforms for transformation matrices
     GLint uniM, uniV, uniP;
 
@@ -53,38 +130,99 @@ class Water
     // Uniforms for dudv moving speed and eye point
     GLint uniDudvMove, uniEyePoint;
 
-    // Shader object
-    GLuint shader;
+    // Uniform for sky lookup switch
+    GLint uniSkyLookup;
+
+    // Uniforms for probe reflection switch and probe cubemap
+    GLint uniProbeReflect, uniTexProbe;
 
-    // Texture buffer objects
-    // - For refraction, reflection and refraction depth map
-    GLuint tboRefract, tboReflect, tboDepthRefr;
+    // Take the reflection from the environment probe cubemap
+    // instead of the planar reflection texture
+    bool isProbeReflect;
 
-    // Frame buffer objects
-    // - For refraction and reflection map
-    GLuint fboRefract, fboReflect;
+    // Uniforms for the cameras that reflection and refraction textures were rendered with
+    // - Textures rendered in an earlier frame are reprojected with them
+    GLint uniReflectVP, uniRefractVP;
+
+    // Uniform for the used fraction of reflection and refraction textures
+    GLint uniTexScale;
+
+    // Fraction of reflection and refraction textures rendered this frame
+    // - Dynamic resolution renders them into a smaller viewport
+    float texScale;
+
+    // Resolve sky pixels of the reflection with a cubemap lookup
+    // - If true, the reflection texture only contains reflected geometry,
+    //   and its alpha channel marks the covered pixels
+    bool isSkyLookup;
+
+    // Shader object
+    GLuint shader;
 
-    // Render buffer objects
-    // - For refraction depth and reflection depth map
-    GLuint rboDepthRefract, rboDepthReflect;
+    // Render targets come from the pool, in the formats set for
+    // "reflect", "refract", "reflect-depth" and "refract-depth"
+    RenderTargetPool *pool;
+    GLenum refractFormat;
+
+    // Refract a copy of the main pass instead of a refraction pass
+    // - The copy also contains geometry in front of the water,
+    //   which the water shader masks with the copied depth
+    bool isScreenRefract;
+    GLint uniScreenRefract;
+
+    // Single-sample copy of the main pass at its own size
+    // - Multisample or differently sized targets can't be scaled
+    //   into the refraction texture directly
+    // - Its renderbuffers are only held during the copy
+    GLuint fboCopy, rboCopyColor, rboCopyDepth;
+
+    // Reflect by tracing rays through the same copy of the main pass
+    // - Misses fall back to the skybox cubemap
+    bool isScreenReflect;
+    GLint uniScreenReflect, uniTexHiZ, uniHiZLevels;
+
+    // Nearest-depth pyramid (Hi-Z) of the copied depth
+    // - Rays skip whole cells that lie in front of everything in them
+    // - One framebuffer per mip level, created on first use
+    GLuint tboHiZ, shaderHiZ;
+    vector<GLuint> fboHiZ;
+    GLint uniHiZDepth, uniHiZLevel, uniHiZSourceSize, uniHiZSize;
+
+    // Render buffer object for reflection depth
+    // - Only held during the reflection pass
+    GLuint rboDepthReflect;
 
     // -----------------------------------------------------
     // Constructor and destructor
     // -----------------------------------------------------
-    Water();
+    Water(TextureStreamer *, RenderTargetPool *);
     ~Water();
 
     // -----------------------------------------------------
     // Member functions
     // -----------------------------------------------------
-    void draw(mat4, mat4, mat4, vec3, vec3, vec3);
+    int addBody(vec3, vec2);
+    void cull(mat4, vec3);
+    vector<int> updateOrder(vec3, vec3, float);
+    void invalidateReflections();
+    void draw(mat4, mat4, vec3, vec3, vec3);
+    void bindPlane(int);
+    void update(float);
+    float interpolate(float);
+    float dudvMoveAt(double);
     void initBuffer();
     void initShader();
     void initTexture();
+    void streamTextures(mat4, vec3, int);
     void initUniform();
-    void initReflect();
-    void initRefract();
-    void setTexture(GLuint &, int, const string, FREE_IMAGE_FORMAT);
+    void acquireTargets(Plane &);
+    void releaseTargets(Plane &);
+    void bindRefraction(int, int, int);
+    void bindReflection(int, int, int);
+    void finishReflection(int);
+    void copyRefraction(GLuint, int, int);
+    void initHiZ();
+    void buildHiZ(int, int);
 };
 
 #endif
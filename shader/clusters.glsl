@@ -0,0 +1,58 @@
+// Clustered point lights, the same grid and uniform block as ClusteredLights
+// - Prepended to every fragment shader by buildShader, after #version
+
+layout(std140) uniform Clusters
+{
+    mat4 clusterV, clusterP;
+    vec2 clusterDepth;
+    int numLights;
+};
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterRanges, clusterIndices;
+const ivec3 CLUSTER_GRID = ivec3(16, 9, 24);
+
+// Light list of the cluster containing a point
+// Return: first index and number of lights
+uvec2 findCluster(vec3 p)
+{
+    vec4 viewPos = clusterV * vec4(p, 1.0);
+    vec4 clip = clusterP * viewPos;
+    ivec2 tile = ivec2(floor((clip.xy / clip.w * 0.5 + 0.5) * vec2(CLUSTER_GRID.xy)));
+    tile = clamp(tile, ivec2(0), CLUSTER_GRID.xy - 1);
+
+    // Slices grow exponentially from the near plane
+    int slice = int(floor(log(-viewPos.z / clusterDepth.x) / clusterDepth.y * float(CLUSTER_GRID.z)));
+    slice = clamp(slice, 0, CLUSTER_GRID.z - 1);
+
+    return texelFetch(clusterRanges, (slice * CLUSTER_GRID.y + tile.y) * CLUSTER_GRID.x + tile.x).rg;
+}
+
+// Diffuse and specular light of the point lights around a point
+vec3 pointLights(vec3 p, vec3 N, vec3 V, vec3 kd, vec3 ks, float shininess)
+{
+    vec3 radiance = vec3(0.0);
+    if (numLights == 0)
+    {
+        return radiance;
+    }
+
+    uvec2 range = findCluster(p);
+    for (uint i = 0u; i < range.y; i++)
+    {
+        int light = int(texelFetch(clusterIndices, int(range.x + i)).r);
+        vec4 posRadius = texelFetch(lightData, light * 2);
+        vec3 color = texelFetch(lightData, light * 2 + 1).rgb;
+
+        // Inverse square, windowed to reach 0 at the radius
+        vec3 toLight = posRadius.xyz - p;
+        float dist = length(toLight);
+        float window = clamp(1.0 - pow(dist / posRadius.w, 4.0), 0.0, 1.0);
+        float attenuation = window * window / (dist * dist + 1.0);
+
+        vec3 L = toLight / max(dist, 1e-4);
+        vec3 H = normalize(L + V);
+        radiance += color * attenuation * (kd * max(dot(N, L), 0.0) + ks * pow(max(dot(N, H), 0.0), shininess));
+    }
+
+    return radiance;
+}
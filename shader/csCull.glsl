@@ -0,0 +1,114 @@
+#version 430
+
+layout(local_size_x = 64) in;
+
+struct Instance
+{
+    mat4 M;
+    vec4 boundsMin; // w: asset index
+    vec4 boundsMax;
+};
+
+struct Command
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Instances
+{
+    Instance instances[];
+};
+
+layout(std430, binding = 1) writeonly buffer Visible
+{
+    mat4 visible[];
+};
+
+layout(std430, binding = 2) buffer Counts
+{
+    uint counts[];
+};
+
+layout(std430, binding = 3) buffer Commands
+{
+    Command commands[];
+};
+
+// Index in counts of each command
+layout(std430, binding = 4) readonly buffer CommandCounts
+{
+    uint commandCounts[];
+};
+
+layout(std430, binding = 5) readonly buffer AssetFirsts
+{
+    uint assetFirsts[];
+};
+
+// Stage 0: cull instances and select their LOD, stage 1: write instance counts into commands
+uniform int stage;
+uniform int numItems, numCommands;
+
+// Half-spaces (a, b, c, d) keep points with ax + by + cz + d >= 0
+uniform vec4 planes[7];
+uniform int numPlanes;
+
+// LOD selection, as Scene::selectLod()
+// - projScale: P[1][1] of the pass
+uniform vec3 eye;
+uniform float projScale, lodSize;
+uniform int lodBias, numLods;
+
+void main()
+{
+    int i = int(gl_GlobalInvocationID.x);
+
+    if (stage == 1)
+    {
+        if (i < numCommands)
+        {
+            commands[i].instanceCount = counts[commandCounts[i]];
+        }
+        return;
+    }
+
+    if (i >= numItems)
+    {
+        return;
+    }
+
+    vec3 lo = instances[i].boundsMin.xyz;
+    vec3 hi = instances[i].boundsMax.xyz;
+
+    for (int k = 0; k < numPlanes; k++)
+    {
+        // Corner farthest along the plane normal
+        vec3 p = mix(lo, hi, step(0.0, planes[k].xyz));
+        if (dot(planes[k].xyz, p) + planes[k].w < 0.0)
+        {
+            return;
+        }
+    }
+
+    // Coarser LODs each time the projected size halves
+    float radius = 0.5 * distance(lo, hi);
+    float dist = max(distance((lo + hi) * 0.5, eye), 1e-3);
+    float size = radius / dist * projScale;
+
+    int lod = 0;
+    for (float threshold = lodSize; size < threshold && lod < 8; threshold *= 0.5)
+    {
+        lod++;
+    }
+    lod = min(lod + lodBias, numLods - 1);
+
+    // Visible instances of a LOD of an asset are packed after its first instance in that LOD,
+    // which is the base instance of its commands
+    uint asset = uint(instances[i].boundsMin.w);
+    uint slot = atomicAdd(counts[asset * uint(numLods) + uint(lod)], 1u);
+    visible[uint(lod * numItems) + assetFirsts[asset] + slot] = instances[i].M;
+}
@@ -0,0 +1,47 @@
+#version 330
+
+// Depth of the main pass for level 0, the level above otherwise
+uniform sampler2D texDepth;
+uniform int level;
+
+// Used parts of the level above and of this level,
+// the rest of the texture holds depth of earlier frames
+uniform ivec2 sourceSize, size;
+
+out float depth;
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+
+    if (level == 0)
+    {
+        depth = texelFetch(texDepth, p, 0).r;
+        return;
+    }
+
+    // Nearest depth of the 2x2 texels covered by this one
+    // - Only the bound level is sampled, so its lod is 0
+    // - The last texel also covers the rest of the used part above,
+    //   when this level is smaller than half of it rounded up
+    ivec2 last = sourceSize - 1;
+    ivec2 q = p * 2;
+    ivec2 end = min(q + 1, last);
+    if (p.x == size.x - 1)
+    {
+        end.x = last.x;
+    }
+    if (p.y == size.y - 1)
+    {
+        end.y = last.y;
+    }
+
+    depth = 1.0;
+    for (int y = q.y; y <= end.y; y++)
+    {
+        for (int x = q.x; x <= end.x; x++)
+        {
+            depth = min(depth, texelFetch(texDepth, ivec2(x, y), 0).r);
+        }
+    }
+}
@@ -9,6 +9,8 @@ uniform vec3 lightColor;
 uniform vec3 lightPosition;
 uniform vec3 eyePoint;
 
+// Point lights: findCluster() and pointLights() come from clusters.glsl
+
 out vec4 outputColor;
 
 // Compute fragment normal from a normal map
@@ -63,4 +65,7 @@ void main()
     outputColor += ambient;
     outputColor += diffuse * dc * attenuation;
     outputColor += specular * sc * attenuation;
+
+    // Lamps nearby
+    outputColor.rgb += pointLights(worldPos, N, V, diffuse.rgb, vec3(ks), alpha);
 }
@@ -7,16 +7,34 @@ in vec3 worldN;
 
 uniform sampler2D texReflect, texRefract;
 uniform sampler2D texDudv, texNormal, texDepthRefr;
-uniform samplerCube texSkybox;
+uniform samplerCube texSkybox, texProbe;
 uniform float dudvMove;
 uniform vec3 lightColor, lightPos;
 uniform vec3 eyePoint;
+uniform bool skyLookup;
+uniform bool probeReflect;
+uniform bool screenRefract;
+uniform bool screenReflect;
+uniform sampler2D texHiZ;
+uniform int hiZLevels;
+uniform float texScale;
+uniform mat4 reflectVP, refractVP;
+uniform mat4 P;
+
+// Point lights: findCluster() and pointLights() come from clusters.glsl
 
 out vec4 fragColor;
 
 const float alpha = 0.2;
 const float shineDamper = 300.0;
 
+// Screen-space reflection
+// - Steps through the Hi-Z pyramid, length of a ray in world units,
+//   and how far a ray may pass behind a surface and still hit it
+const int SSR_STEPS = 64;
+const float SSR_DISTANCE = 200.0;
+const float SSR_THICKNESS = 1.0;
+
 // Compute Fresnel reflection coefficient
 float fresnelSchlick(float cosTheta, float F0) { return F0 + (1.0 - F0) * pow(1.0 - cosTheta, 5.0); }
 
@@ -37,18 +55,107 @@ float linearizeDepth(float d)
     return d;
 }
 
+// Distance from the eye along the view direction for a depth value
+float viewDepth(float d) { return P[3][2] / (d * 2.0 - 1.0 + P[2][2]); }
+
+// Trace a reflected ray through the Hi-Z pyramid of the main pass
+// - The ray is marched in texels of level 0 and depth, where it is a straight line
+// - Return: uv of the hit in the copy of the main pass, or -1 on a miss
+vec2 traceScreenRay(vec3 origin, vec3 dir)
+{
+    vec4 clipStart = refractVP * vec4(origin, 1.0);
+    vec4 clipEnd = refractVP * vec4(origin + dir * SSR_DISTANCE, 1.0);
+
+    // Cut the ray at the near plane
+    const float nearW = 0.02;
+    if (clipEnd.w < nearW)
+    {
+        clipEnd = mix(clipStart, clipEnd, (clipStart.w - nearW) / (clipStart.w - clipEnd.w));
+    }
+
+    // Only the lower-left part of the pyramid is used with dynamic resolution
+    vec2 fullSize = vec2(textureSize(texHiZ, 0));
+    vec2 size = fullSize * texScale;
+
+    vec3 o = vec3((clipStart.xy / clipStart.w * 0.5 + 0.5) * size, clipStart.z / clipStart.w * 0.5 + 0.5);
+    vec3 e = vec3((clipEnd.xy / clipEnd.w * 0.5 + 0.5) * size, clipEnd.z / clipEnd.w * 0.5 + 0.5);
+    vec3 d = e - o;
+
+    // Axis-aligned rays never cross the other cell boundaries
+    vec2 dxy = vec2(abs(d.x) < 1e-5 ? 1e-5 : d.x, abs(d.y) < 1e-5 ? 1e-5 : d.y);
+    vec2 toBound = step(0.0, d.xy);
+
+    // One texel per unit of t, skip the texel of the water itself
+    float texel = 1.0 / max(length(d.xy), 1.0);
+    float t = texel;
+    int level = 0;
+
+    for (int i = 0; i < SSR_STEPS && t <= 1.0; i++)
+    {
+        vec3 p = o + d * t;
+        if (any(lessThan(p.xy, vec2(0.0))) || any(greaterThanEqual(p.xy, size)))
+        {
+            break;
+        }
+
+        // Nearest depth in the current cell, and where the ray leaves the cell
+        float cellSize = exp2(float(level));
+        vec2 cell = floor(p.xy / cellSize);
+        // A level rounded down covers the rest of the level above in its last texel
+        float zMin = texelFetch(texHiZ, min(ivec2(cell), textureSize(texHiZ, level) - 1), level).r;
+
+        vec2 tBound = ((cell + toBound) * cellSize - o.xy) / dxy;
+        float tExit = min(tBound.x, tBound.y) + texel * 0.01;
+
+        // Where the ray reaches the nearest depth of the cell
+        float tz = p.z >= zMin ? t : (d.z > 0.0 ? (zMin - o.z) / d.z : 2.0);
+
+        if (tz >= tExit)
+        {
+            // In front of everything in the cell, go on with a larger cell
+            t = tExit;
+            level = min(level + 1, hiZLevels - 1);
+        }
+        else if (level > 0)
+        {
+            // Refine in a smaller cell
+            t = tz;
+            level--;
+        }
+        else
+        {
+            // A ray far behind the surface passes behind the object
+            vec3 h = o + d * tz;
+            if (viewDepth(h.z) - viewDepth(zMin) < SSR_THICKNESS)
+            {
+                return h.xy / fullSize;
+            }
+            t = tExit;
+        }
+    }
+
+    return vec2(-1.0);
+}
+
 void main()
 {
     // -----------------------------------------------------------------
     // Distorting uv-coordinate for refraction and reflecttion textures
     // -----------------------------------------------------------------
-    // Compute NDC from vertex clip-space coordinate
-    vec2 ndc = vec2(clipSpace.x / clipSpace.w, clipSpace.y / clipSpace.w);
-    ndc = ndc / 2.0 + 0.5; // to [-1, 1]
+    // Project the surface point with the cameras that
+    // the refraction and reflection textures were rendered with
+    // - They are the current cameras, unless the textures are reused from an earlier frame
+    // - The reflection camera is mirrored, so its projection is flipped vertically
+    vec4 clipRefr = refractVP * vec4(worldPos, 1.0);
+    vec4 clipRefl = reflectVP * vec4(worldPos, 1.0);
+
+    // Compute NDC from clip-space coordinate
+    vec2 ndc = vec2(clipRefr.x / clipRefr.w, clipRefr.y / clipRefr.w);
+    ndc = ndc / 2.0 + 0.5; // to [0, 1]
 
     // Compute uv-coordinate for refraction and reflection textures based on NDC
     vec2 uvRefr = vec2(ndc.x, ndc.y);
-    vec2 uvRefl = vec2(ndc.x, -ndc.y);
+    vec2 uvRefl = vec2(clipRefl.x / clipRefl.w, clipRefl.y / clipRefl.w) / 2.0 + 0.5;
 
     // Without alpha, distort will be too huge
     vec2 distort1 = texture(texDudv, vec2(uv.x, uv.y - dudvMove)).rg * 2.0 - 1.0;
@@ -59,12 +166,23 @@ void main()
 
     // Distorting uv-coordinate
     uvRefl += distort;
-    uvRefl.x = clamp(uvRefl.x, 0.001, 0.999);
-    uvRefl.y = clamp(uvRefl.y, -0.999, -0.001);
+    uvRefl = clamp(uvRefl, 0.001, 0.999);
 
     uvRefr += distort;
     uvRefr = clamp(uvRefr, 0.001, 0.999);
 
+    // Only the lower-left part of the textures is rendered
+    // when dynamic resolution is on
+    uvRefl *= texScale;
+    uvRefr *= texScale;
+
+    // A copy of the main pass also contains geometry in front of the water,
+    // distorted samples that land on it fall back to the undistorted pixel
+    if (screenRefract && texture(texDepthRefr, uvRefr).r < gl_FragCoord.z)
+    {
+        uvRefr = ndc.xy * texScale;
+    }
+
     // -----------------------------------
     // Compute water color
     // -----------------------------------
@@ -81,11 +199,50 @@ void main()
     vec4 deep = vec4(0.003, 0.109, 0.172, 0);
     vec4 sub = vec4(0.054, 0.345, 0.392, 0);
 
+    // Reflected view vector, distorted in the same way as the textures
+    vec3 Nr = normalize(up + vec3(distort.x, 0.0, distort.y));
+    vec3 Rv = reflect(-V, Nr);
+
     // Compute reflection and refraction color
-    vec4 refl = texture(texReflect, uvRefl);
+    vec4 refl;
+
+    if (probeReflect)
+    {
+        // Far-field reflection from the environment probe
+        refl = texture(texProbe, Rv);
+    }
+    else if (screenReflect)
+    {
+        // Fade out near the edges of the screen, where the reflected content is lost
+        vec4 sky = texture(texSkybox, -Rv);
+        vec2 hit = traceScreenRay(worldPos, Rv);
+
+        if (hit.x < 0.0)
+        {
+            refl = sky;
+        }
+        else
+        {
+            vec2 edge = min(hit, vec2(texScale) - hit) / texScale;
+            refl = mix(sky, texture(texRefract, hit), clamp(min(edge.x, edge.y) * 10.0, 0.0, 1.0));
+        }
+    }
+    else
+    {
+        refl = texture(texReflect, uvRefl);
+
+        // The reflection texture contains no sky,
+        // so resolve uncovered pixels with the skybox cubemap
+        // - The skybox shader samples its cubemap with -position
+        if (skyLookup)
+        {
+            vec4 sky = texture(texSkybox, -Rv);
+            refl = mix(sky, refl, refl.a);
+        }
+    }
 
     // Consider depth value as a factor
-    float dFactor = linearizeDepth(texture(texDepthRefr, ndc.xy).r);
+    float dFactor = linearizeDepth(texture(texDepthRefr, ndc.xy * texScale).r);
     vec4 water = mix(sub, deep, dFactor);
     vec4 refr = mix(texture(texRefract, uvRefr), water, 0.5);
 
@@ -99,6 +256,11 @@ void main()
     // Compute fragment color
     fragColor = mix(refr, refl, fresnel);
 
+    // Lamps glint on the waves and faintly light the water
+    // - The normal map is in tangent space, z is up
+    vec3 Nw = normalize(vec3(N.x, N.z, N.y));
+    fragColor.rgb += pointLights(worldPos, Nw, V, water.rgb * 0.5, vec3(fresnel + 0.5), 100.0);
+
     // Consider specular
     // float specFactor = max(dot(H, N), 0.f);
     // specFactor = pow(specFactor, shineDamper);
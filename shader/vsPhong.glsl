@@ -2,6 +2,7 @@
 layout(location = 0) in vec3 vtxCoord;
 layout(location = 1) in vec2 texUv;
 layout(location = 2) in vec3 vtxN;
+layout(location = 3) in mat4 instanceM;
 
 out vec2 uv;
 out vec3 worldPos;
@@ -11,12 +12,15 @@ uniform mat4 M, V, P;
 
 void main()
 {
-    gl_Position = P * V * M * vec4(vtxCoord, 1.0);
+    // Model matrix of this instance
+    mat4 W = instanceM * M;
+
+    gl_Position = P * V * W * vec4(vtxCoord, 1.0);
 
     uv = texUv;
 
-    worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
+    worldPos = (W * vec4(vtxCoord, 1.0)).xyz;
 
-    worldN = (vec4(vtxN, 1.0) * inverse(M)).xyz;
+    worldN = (vec4(vtxN, 1.0) * inverse(W)).xyz;
     worldN = normalize(worldN);
 }
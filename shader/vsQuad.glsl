@@ -0,0 +1,8 @@
+#version 330
+
+// Full-screen triangle from the vertex index, no vertex buffer is read
+void main()
+{
+    vec2 pos = vec2(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0);
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
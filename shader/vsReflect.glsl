@@ -3,6 +3,7 @@
 layout(location = 0) in vec3 vtxCoord;
 layout(location = 1) in vec2 vtxUv;
 layout(location = 2) in vec3 vtxN;
+layout(location = 3) in mat4 instanceM;
 
 out vec2 uv;
 out vec3 worldPos;
@@ -14,16 +15,19 @@ uniform vec4 clipPlane0, clipPlane1;
 
 void main()
 {
-    gl_Position = P * V * M * vec4(vtxCoord, 1.0);
+    // Model matrix of this instance
+    mat4 W = instanceM * M;
+
+    gl_Position = P * V * W * vec4(vtxCoord, 1.0);
 
     // Use clipping to get reflection and refraction texture
-    gl_ClipDistance[0] = dot(M * vec4(vtxCoord, 1.0), clipPlane0);
-    gl_ClipDistance[1] = dot(M * vec4(vtxCoord, 1.0), clipPlane1);
+    gl_ClipDistance[0] = dot(W * vec4(vtxCoord, 1.0), clipPlane0);
+    gl_ClipDistance[1] = dot(W * vec4(vtxCoord, 1.0), clipPlane1);
 
     uv = vtxUv;
 
-    worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
+    worldPos = (W * vec4(vtxCoord, 1.0)).xyz;
 
-    worldN = (vec4(vtxN, 1.0) * inverse(M)).xyz;
+    worldN = (vec4(vtxN, 1.0) * inverse(W)).xyz;
     worldN = normalize(worldN);
 }
@@ -0,0 +1,300 @@
+#include "bvh.h"
+
+// ================================================
+// AABB
+// ================================================
+// -----------------------------------------------------
+// Constructor
+// - An empty box contains nothing, and expands to anything
+// -----------------------------------------------------
+AABB::AABB()
+{
+    min = vec3(FLT_MAX);
+    max = vec3(-FLT_MAX);
+}
+
+AABB::AABB(vec3 lo, vec3 hi)
+{
+    min = lo;
+    max = hi;
+}
+
+// -----------------------------------------------------
+// Grow to contain another box
+// -----------------------------------------------------
+void AABB::expand(const AABB &other)
+{
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+}
+
+vec3 AABB::center() const { return (min + max) * 0.5f; }
+
+// -----------------------------------------------------
+// Box around this box after a transformation
+// -----------------------------------------------------
+AABB AABB::transform(const mat4 &M) const
+{
+    vec3 c = vec3(M * vec4(center(), 1.f));
+    vec3 e = (max - min) * 0.5f;
+
+    // Extent of the transformed box along each axis
+    mat3 A = mat3(M);
+    vec3 r = abs(A[0]) * e.x + abs(A[1]) * e.y + abs(A[2]) * e.z;
+
+    return AABB(c - r, c + r);
+}
+
+// -----------------------------------------------------
+// Corner of a box farthest along a direction
+// -----------------------------------------------------
+static vec3 corner(const AABB &b, vec3 n)
+{
+    return vec3(n.x >= 0.f ? b.max.x : b.min.x, n.y >= 0.f ? b.max.y : b.min.y, n.z >= 0.f ? b.max.z : b.min.z);
+}
+
+// ================================================
+// BVH
+// ================================================
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. n: largest number of items in a leaf
+// -----------------------------------------------------
+BVH::BVH(int n) { leafSize = n; }
+
+// -----------------------------------------------------
+// Build the tree
+// - Top-down, splitting items at the median of the longest axis
+// Parameters:
+//   1. bounds: bounding box of each item
+// -----------------------------------------------------
+void BVH::build(const vector<AABB> &bounds)
+{
+    itemBounds = bounds;
+
+    items.resize(bounds.size());
+    itemLeaves.resize(bounds.size());
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        items[i] = int(i);
+    }
+
+    nodes.clear();
+    nodes.reserve(items.empty() ? 0 : 2 * items.size() / leafSize + 1);
+    if (!items.empty())
+    {
+        buildNode(-1, 0, int(items.size()));
+    }
+}
+
+// -----------------------------------------------------
+// Build a subtree
+// Parameters:
+//   1. parent: parent node (-1 for the root)
+//   2. first, count: items of the subtree
+// Return: index of the subtree root
+// -----------------------------------------------------
+int BVH::buildNode(int parent, int first, int count)
+{
+    int index = int(nodes.size());
+    nodes.push_back(Node());
+    Node node;
+    node.parent = parent;
+    node.left = -1;
+    node.right = -1;
+    node.first = first;
+    node.count = count;
+
+    // Bounds of the items and of their centers
+    AABB centers;
+    for (int i = first; i < first + count; i++)
+    {
+        const AABB &b = itemBounds[items[i]];
+        node.bounds.expand(b);
+        centers.expand(AABB(b.center(), b.center()));
+    }
+
+    if (count <= leafSize)
+    {
+        for (int i = first; i < first + count; i++)
+        {
+            itemLeaves[items[i]] = index;
+        }
+        nodes[index] = node;
+        return index;
+    }
+
+    // Split at the median of the longest axis
+    vec3 size = centers.max - centers.min;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+    int half = count / 2;
+    nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+                [this, axis](int a, int b) { return itemBounds[a].center()[axis] < itemBounds[b].center()[axis]; });
+
+    nodes[index] = node;
+    int left = buildNode(index, first, half);
+    int right = buildNode(index, first + half, count - half);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].count = 0;
+
+    return index;
+}
+
+// -----------------------------------------------------
+// Move an item
+// - Refits the boxes from its leaf up to the root
+// - The tree is not rebalanced, so after large moves
+//   it is better to build it again
+// Parameters:
+//   1. item: item to move
+//   2. bounds: new bounding box
+// -----------------------------------------------------
+void BVH::update(int item, const AABB &bounds)
+{
+    itemBounds[item] = bounds;
+
+    int index = itemLeaves[item];
+
+    // Leaf
+    Node &leaf = nodes[index];
+    leaf.bounds = AABB();
+    for (int i = leaf.first; i < leaf.first + leaf.count; i++)
+    {
+        leaf.bounds.expand(itemBounds[items[i]]);
+    }
+
+    // Inner nodes
+    for (index = leaf.parent; index >= 0; index = nodes[index].parent)
+    {
+        Node &node = nodes[index];
+        node.bounds = nodes[node.left].bounds;
+        node.bounds.expand(nodes[node.right].bounds);
+    }
+}
+
+// -----------------------------------------------------
+// Find items that may be inside all half-spaces
+// - A half-space (a, b, c, d) keeps points with ax + by + cz + d >= 0
+// - Subtrees fully inside skip further plane tests
+// Parameters:
+//   1. planes: half-spaces
+//   2. result: items found, appended
+// -----------------------------------------------------
+void BVH::query(const vector<vec4> &planes, vector<int> &result)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        int index = stack[--top];
+        const Node &node = nodes[index];
+
+        bool isInside = true;
+        bool isOutside = false;
+        for (size_t i = 0; i < planes.size(); i++)
+        {
+            vec3 n = vec3(planes[i]);
+
+            // Corners farthest along and against the plane normal
+            vec3 pos = corner(node.bounds, n);
+            vec3 neg = corner(node.bounds, -n);
+
+            if (dot(n, pos) + planes[i].w < 0.f)
+            {
+                isOutside = true;
+                break;
+            }
+            if (dot(n, neg) + planes[i].w < 0.f)
+            {
+                isInside = false;
+            }
+        }
+
+        if (isOutside)
+        {
+            continue;
+        }
+
+        if (isInside)
+        {
+            collect(index, result);
+        }
+        else if (node.left < 0)
+        {
+            // Leaf: test its items one by one
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                const AABB &b = itemBounds[items[i]];
+                bool isVisible = true;
+                for (size_t j = 0; j < planes.size() && isVisible; j++)
+                {
+                    vec3 n = vec3(planes[j]);
+                    vec3 pos = corner(b, n);
+                    isVisible = dot(n, pos) + planes[j].w >= 0.f;
+                }
+                if (isVisible)
+                {
+                    result.push_back(items[i]);
+                }
+            }
+        }
+        else
+        {
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Append all items of a subtree
+// -----------------------------------------------------
+void BVH::collect(int index, vector<int> &result)
+{
+    // Leaves of a subtree hold a contiguous range of items
+    int first = index, last = index;
+    while (nodes[first].left >= 0)
+    {
+        first = nodes[first].left;
+    }
+    while (nodes[last].left >= 0)
+    {
+        last = nodes[last].right;
+    }
+
+    for (int i = nodes[first].first; i < nodes[last].first + nodes[last].count; i++)
+    {
+        result.push_back(items[i]);
+    }
+}
+
+// -----------------------------------------------------
+// Half-spaces of a view frustum
+// Parameters:
+//   1. VP: projection * view matrix
+// Return: left, right, bottom, top, near, far planes
+// -----------------------------------------------------
+vector<vec4> BVH::frustum(const mat4 &VP)
+{
+    // Rows of the matrix
+    mat4 T = transpose(VP);
+
+    vector<vec4> planes(6);
+    planes[0] = T[3] + T[0];
+    planes[1] = T[3] - T[0];
+    planes[2] = T[3] + T[1];
+    planes[3] = T[3] - T[1];
+    planes[4] = T[3] + T[2];
+    planes[5] = T[3] - T[2];
+
+    return planes;
+}
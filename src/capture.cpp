@@ -0,0 +1,348 @@
+#include "capture.h"
+#include "resource.h"
+
+// -----------------------------------------------------
+// Constructor
+// -----------------------------------------------------
+Capture::Capture()
+{
+    width = 0;
+    height = 0;
+    samples = 0;
+    fboTarget = 0;
+    fboResolve = 0;
+
+    Resources::create(Resources::BUFFER, NUM_PBOS, pbos, "capture");
+    for (int i = 0; i < NUM_PBOS; i++)
+    {
+        fences[i] = 0;
+        pboSizes[i] = 0;
+    }
+    pboHead = 0;
+    pboTail = 0;
+    numPending = 0;
+
+    isStopping = false;
+    writer = thread(&Capture::writeLoop, this);
+}
+
+// -----------------------------------------------------
+// Destructor
+// - Writes all pending images before returning
+// -----------------------------------------------------
+Capture::~Capture()
+{
+    finish();
+
+    {
+        lock_guard<mutex> lock(queueMutex);
+        isStopping = true;
+    }
+    queueCond.notify_all();
+    writer.join();
+
+    releaseTarget();
+    Resources::destroy(Resources::BUFFER, NUM_PBOS, pbos);
+}
+
+// -----------------------------------------------------
+// Initialize offscreen target
+// Parameters:
+//   1. w, h: size of the target
+//   2. msaa: MSAA level (0 means no MSAA)
+// -----------------------------------------------------
+void Capture::initTarget(int w, int h, int msaa)
+{
+    releaseTarget();
+
+    width = w;
+    height = h;
+    samples = msaa;
+
+    // Render target
+    fboTarget = Resources::create(Resources::FRAMEBUFFER, "capture");
+    glBindFramebuffer(GL_FRAMEBUFFER, fboTarget);
+
+    rboTargetColor = Resources::create(Resources::RENDERBUFFER, "capture");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboTargetColor);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboTargetColor, size_t(width) * height * 4 * std::max(samples, 1));
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboTargetColor);
+
+    rboTargetDepth = Resources::create(Resources::RENDERBUFFER, "capture");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboTargetDepth);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboTargetDepth, size_t(width) * height * 4 * std::max(samples, 1));
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboTargetDepth);
+
+    // Resolve target
+    fboResolve = Resources::create(Resources::FRAMEBUFFER, "capture");
+    glBindFramebuffer(GL_FRAMEBUFFER, fboResolve);
+
+    rboResolveColor = Resources::create(Resources::RENDERBUFFER, "capture");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboResolveColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboResolveColor, size_t(width) * height * 4);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboResolveColor);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "Capture: incomplete framebuffer." << '\n';
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Release offscreen target
+// -----------------------------------------------------
+void Capture::releaseTarget()
+{
+    if (fboTarget == 0)
+    {
+        return;
+    }
+
+    Resources::destroy(Resources::FRAMEBUFFER, fboTarget);
+    Resources::destroy(Resources::FRAMEBUFFER, fboResolve);
+    Resources::destroy(Resources::RENDERBUFFER, rboTargetColor);
+    Resources::destroy(Resources::RENDERBUFFER, rboTargetDepth);
+    Resources::destroy(Resources::RENDERBUFFER, rboResolveColor);
+    fboTarget = 0;
+    fboResolve = 0;
+}
+
+// -----------------------------------------------------
+// Bind the offscreen target for rendering
+// -----------------------------------------------------
+void Capture::bindTarget()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fboTarget);
+    glViewport(0, 0, width, height);
+}
+
+// -----------------------------------------------------
+// Resolve MSAA of the offscreen target
+// Return: framebuffer to read the rendered view from
+// -----------------------------------------------------
+GLuint Capture::resolveTarget()
+{
+    if (samples == 0)
+    {
+        return fboTarget;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fboTarget);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fboResolve);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return fboResolve;
+}
+
+// -----------------------------------------------------
+// Start reading a framebuffer into the next pixel buffer object
+// - Does not wait for the GPU, unless every buffer is still pending,
+//   then blocks until the oldest one is handed over, so no frame is lost
+// Parameters:
+//   1. fbo: framebuffer to read (0 means the back buffer of the window)
+//   2. w, h: size of the region to read
+//   3. path: image file to write, its extension selects the format
+// -----------------------------------------------------
+void Capture::read(GLuint fbo, int w, int h, const string path)
+{
+    while (numPending == NUM_PBOS)
+    {
+        collect(true);
+    }
+
+    size_t size = size_t(w) * h * 4;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pboHead]);
+    if (pboSizes[pboHead] < size)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        pboSizes[pboHead] = size;
+        Resources::setBytes(Resources::BUFFER, pbos[pboHead], size);
+    }
+    glReadPixels(0, 0, w, h, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    fences[pboHead] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pboWidths[pboHead] = w;
+    pboHeights[pboHead] = h;
+    pboPaths[pboHead] = path;
+
+    pboHead = (pboHead + 1) % NUM_PBOS;
+    numPending++;
+}
+
+// -----------------------------------------------------
+// Read a framebuffer and wait for the pixels
+// - For callers that need the pixels right away (e.g. the render server)
+// Parameters:
+//   1. fbo: framebuffer to read
+//   2. w, h: size of the region to read
+//   3. pixels: destination of w * h bottom-up BGRA pixels
+// -----------------------------------------------------
+void Capture::readNow(GLuint fbo, int w, int h, unsigned char *pixels)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glReadPixels(0, 0, w, h, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Hand finished readbacks over to the writer thread
+// Parameters:
+//   1. isWait: wait for the oldest readback even if it is not finished
+// -----------------------------------------------------
+void Capture::collect(bool isWait)
+{
+    while (numPending > 0)
+    {
+        // Flushed, so that the fence is signaled even if nothing else is submitted
+        GLenum status = glClientWaitSync(fences[pboTail], GL_SYNC_FLUSH_COMMANDS_BIT, isWait ? GLuint64(1e9) : 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            break;
+        }
+        if (status == GL_WAIT_FAILED)
+        {
+            // Mapping the buffer below still waits for the readback
+            std::cout << "Capture: waiting for a readback failed (" << pboPaths[pboTail] << ")" << '\n';
+        }
+        glDeleteSync(fences[pboTail]);
+        fences[pboTail] = 0;
+
+        Job job;
+        job.width = pboWidths[pboTail];
+        job.height = pboHeights[pboTail];
+        job.path = pboPaths[pboTail];
+        job.pixels.resize(size_t(job.width) * job.height * 4);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pboTail]);
+        void *src = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, job.pixels.size(), GL_MAP_READ_BIT);
+        if (src)
+        {
+            memcpy(job.pixels.data(), src, job.pixels.size());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        {
+            lock_guard<mutex> lock(queueMutex);
+            queue.push_back(std::move(job));
+        }
+        queueCond.notify_one();
+
+        pboTail = (pboTail + 1) % NUM_PBOS;
+        numPending--;
+
+        // Only the oldest readback is waited for
+        isWait = false;
+    }
+}
+
+// -----------------------------------------------------
+// Hand all pending readbacks to the writer thread,
+// and wait until every image is written
+// -----------------------------------------------------
+void Capture::finish()
+{
+    while (numPending > 0)
+    {
+        collect(true);
+    }
+
+    unique_lock<mutex> lock(queueMutex);
+    queueCond.wait(lock, [this] { return queue.empty(); });
+}
+
+// -----------------------------------------------------
+// Number of images waiting to be written
+// -----------------------------------------------------
+int Capture::queueDepth()
+{
+    lock_guard<mutex> lock(queueMutex);
+    return int(queue.size()) + numPending;
+}
+
+// -----------------------------------------------------
+// Writer thread
+// - Encodes and writes queued images in order
+// -----------------------------------------------------
+void Capture::writeLoop()
+{
+    while (true)
+    {
+        Job job;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueCond.wait(lock, [this] { return isStopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            job = std::move(queue.front());
+        }
+
+        save(job.path, job.pixels.data(), job.width, job.height);
+
+        // Remove the job only after writing, so that finish() waits for it
+        {
+            lock_guard<mutex> lock(queueMutex);
+            queue.pop_front();
+        }
+        queueCond.notify_all();
+    }
+}
+
+// -----------------------------------------------------
+// Wrap read pixels in a 24-bit image
+// - The alpha of the framebuffer is undefined,
+//   it must not end up as transparency in the file
+// Parameters:
+//   1. pixels: w * h bottom-up BGRA pixels
+//   2. w, h: size of the image
+// Return: the image (NULL on failure), unloaded by the caller
+// -----------------------------------------------------
+FIBITMAP *Capture::toImage(const unsigned char *pixels, int w, int h)
+{
+    FIBITMAP *bgra = FreeImage_ConvertFromRawBits(const_cast<unsigned char *>(pixels), w, h, w * 4, 32,
+                                                  FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+    if (!bgra)
+    {
+        return NULL;
+    }
+
+    FIBITMAP *image = FreeImage_ConvertTo24Bits(bgra);
+    FreeImage_Unload(bgra);
+    return image;
+}
+
+// -----------------------------------------------------
+// Encode and write an image
+// Parameters:
+//   1. path: image file, its extension selects the format (BMP if unknown)
+//   2. pixels: w * h bottom-up BGRA pixels, as FreeImage expects
+//   3. w, h: size of the image
+// Return: false if the image could not be written
+// -----------------------------------------------------
+bool Capture::save(const string path, const unsigned char *pixels, int w, int h)
+{
+    FIBITMAP *image = toImage(pixels, w, h);
+    FREE_IMAGE_FORMAT format = FreeImage_GetFIFFromFilename(path.c_str());
+    bool isSaved = image && FreeImage_Save(format == FIF_UNKNOWN ? FIF_BMP : format, image, path.c_str(), 0);
+    if (!isSaved)
+    {
+        std::cout << "Capture: failed to save " << path << '\n';
+    }
+    if (image)
+    {
+        FreeImage_Unload(image);
+    }
+    return isSaved;
+}
@@ -0,0 +1,64 @@
+#include "clock.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. dt: fixed simulation timestep in seconds
+// -----------------------------------------------------
+SimClock::SimClock(double dt)
+{
+    step = dt;
+    fps = 0.0;
+    timeScale = 1.0;
+    maxDelta = 0.25;
+
+    frame = 0;
+    steps = 0;
+    target = 0.0;
+    alpha = 0.f;
+    lastWallTime = -1.0;
+}
+
+// -----------------------------------------------------
+// Advance to the next frame
+// Parameters:
+//   1. wallTime: current wall clock time in seconds (ignored in offline mode)
+// Return: number of fixed steps to simulate for this frame
+// -----------------------------------------------------
+int SimClock::advance(double wallTime)
+{
+    if (fps > 0.0)
+    {
+        // Offline: independent of how long frames take
+        target = frame / fps;
+    }
+    else
+    {
+        if (lastWallTime < 0.0)
+        {
+            lastWallTime = wallTime;
+        }
+
+        target += std::min(wallTime - lastWallTime, maxDelta) * timeScale;
+        lastWallTime = wallTime;
+    }
+
+    frame++;
+
+    // Count steps instead of accumulating time, so that no rounding error builds up
+    int n = 0;
+    while ((steps + 1) * step <= target)
+    {
+        steps++;
+        n++;
+    }
+
+    alpha = float((target - time()) / step);
+
+    return n;
+}
+
+// -----------------------------------------------------
+// Simulated time of the last step
+// -----------------------------------------------------
+double SimClock::time() { return steps * step; }
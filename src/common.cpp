@@ -1,4 +1,8 @@
 #include "common.h"
+#include "meshopt.h"
+#include "resource.h"
+#include "ingest.h"
+#include <sys/stat.h>
 
 // ================================================
 // Read file into a string
@@ -32,12 +36,12 @@ GLuint buildShader(string vsDir, string fsDir, string tcsDir, string tesDir, str
 {
     // For a shader object, 0 means NULL
     GLuint vs, fs, tcs = 0, tes = 0, geo = 0;
-    GLint linkOk;
     GLuint exeShader;
 
     // Build vertex and fragment shaders
+    // - Fragment shaders share the clustered point lights
     vs = compileShader(vsDir, GL_VERTEX_SHADER);
-    fs = compileShader(fsDir, GL_FRAGMENT_SHADER);
+    fs = compileShader(fsDir, GL_FRAGMENT_SHADER, readFile("./shader/clusters.glsl"));
 
     // (Option) TCS, TES
     if (tcsDir != "" && tesDir != "")
@@ -55,20 +59,68 @@ GLuint buildShader(string vsDir, string fsDir, string tcsDir, string tesDir, str
     // Link shader objects
     exeShader = linkShader(vs, fs, tcs, tes, geo);
 
+    // Shader objects are only needed for linking
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    glDeleteShader(tcs);
+    glDeleteShader(tes);
+    glDeleteShader(geo);
+
+    Resources::track(Resources::PROGRAM, exeShader, "shaders", vsDir + " " + fsDir);
+
     return exeShader;
 }
 
+// =====================================================
+// Build compute shader
+// Parameters:
+//   1. csDir: compute shader file
+// Return: shader executable
+// =====================================================
+GLuint buildComputeShader(string csDir)
+{
+    GLuint cs = compileShader(csDir, GL_COMPUTE_SHADER);
+
+    GLuint exe = glCreateProgram();
+    glAttachShader(exe, cs);
+    glLinkProgram(exe);
+    glDeleteShader(cs);
+
+    // Check linking result
+    GLint linkOk;
+    glGetProgramiv(exe, GL_LINK_STATUS, &linkOk);
+    if (linkOk == GL_FALSE)
+    {
+        std::cout << "Failed to link compute shader program." << std::endl;
+        printLog(exe);
+        glDeleteProgram(exe);
+
+        return 0;
+    }
+
+    Resources::track(Resources::PROGRAM, exe, "shaders", csDir);
+
+    return exe;
+}
+
 // ================================================
 // Compile shader file
 // Parameters:
 //   1. fileName: shader file
 //   2. type: shader type
+//   3. prelude: (Option) code inserted after the #version line,
+//      line numbers of errors still count in the shader file
 // Return: shader object
 // ================================================
-GLuint compileShader(string filename, GLenum type)
+GLuint compileShader(string filename, GLenum type, string prelude)
 {
     // Read shader file
     string sTemp = readFile(filename);
+    size_t versionEnd = sTemp.find('\n');
+    if (prelude != "" && versionEnd != string::npos)
+    {
+        sTemp.insert(versionEnd + 1, prelude + "\n#line 2\n");
+    }
     const GLchar *source = sTemp.c_str();
 
     // Set shader type
@@ -81,6 +133,9 @@ GLuint compileShader(string filename, GLenum type)
         case GL_FRAGMENT_SHADER:
             info = "Fragment";
             break;
+        case GL_COMPUTE_SHADER:
+            info = "Compute";
+            break;
     }
 
     // If reading shader file fails
@@ -228,9 +283,22 @@ GLint myGetUniformLocation(GLuint &prog, string name, bool isWarningOn)
 Mesh::Mesh(const string fileName, bool reflect)
 {
     isReflect = reflect;
-
-    // Import mesh with assimp
-    scene = importer.ReadFile(fileName, aiProcess_CalcTangentSpace);
+    tboBase = 0;
+    tboNormal = 0;
+    numDrawCalls = 0;
+    numTriangles = 0;
+
+    // Processing a mesh is slow, so its result is cached next to the file
+    string cacheName = fileName + ".lod";
+    if (!loadCache(fileName, cacheName))
+    {
+        importMesh(fileName);
+        buildLods();
+        if (!subMeshes.empty())
+        {
+            saveCache(cacheName);
+        }
+    }
 
     initBuffers();
     initShader();
@@ -245,13 +313,34 @@ Mesh::~Mesh()
     // Release resource
     // - A mesh consists of several 3D models,
     //   so we must release resource for each model
-    for (size_t i = 0; i < scene->mNumMeshes; i++)
+    for (size_t i = 0; i < subMeshes.size(); i++)
     {
-        glDeleteBuffers(1, &vboVtxs[i]);
-        glDeleteBuffers(1, &vboUvs[i]);
-        glDeleteBuffers(1, &vboNmls[i]);
-        glDeleteVertexArrays(1, &vaos[i]);
+        Resources::destroy(Resources::BUFFER, vboVtxs[i]);
+        Resources::destroy(Resources::BUFFER, vboUvs[i]);
+        Resources::destroy(Resources::BUFFER, vboNmls[i]);
+        Resources::destroy(Resources::BUFFER, ebos[i]);
+        Resources::destroy(Resources::VERTEX_ARRAY, vaos[i]);
     }
+    Resources::destroy(Resources::BUFFER, vboInstance);
+    Resources::destroy(Resources::TEXTURE, tboBase);
+    Resources::destroy(Resources::TEXTURE, tboNormal);
+    Resources::destroy(Resources::PROGRAM, shader);
+
+    Resources::addHostBytes("mesh", -(long long)hostBytes());
+}
+
+// -----------------------------------------------------
+// Bytes of geometry kept on the CPU
+// - Positions and indices stay for culling and occluders
+// -----------------------------------------------------
+size_t Mesh::hostBytes()
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        bytes += sizeof(vec3) * subMeshes[i].vtxs.size() + sizeof(GLuint) * subMeshes[i].indices.size();
+    }
+    return bytes;
 }
 
 // -----------------------------------------------------
@@ -301,78 +390,363 @@ void Mesh::initUniform()
 }
 
 // -----------------------------------------------------
-// Initialize buffer obect for mesh
+// Import mesh with assimp
+// - Identical vertices are joined, so that triangles share vertices
+// Parameters:
+//   1. fileName: 3D model file path
 // -----------------------------------------------------
-void Mesh::initBuffers()
+void Mesh::importMesh(const string fileName)
 {
-    // For each 3D model in the mesh,
-    // initialize its vertex attributes.
-    // Then create OpenGL contents for them.
+    Assimp::Importer importer;
+    const aiScene *scene = importer.ReadFile(
+        fileName, aiProcess_CalcTangentSpace | aiProcess_Triangulate | aiProcess_JoinIdenticalVertices);
+    if (!scene)
+    {
+        std::cout << "Mesh: can't import " << fileName << '\n';
+        return;
+    }
+
     for (size_t i = 0; i < scene->mNumMeshes; i++)
     {
         const aiMesh *mesh = scene->mMeshes[i];
-        int numVtxs = mesh->mNumVertices;
+        SubMesh sub;
+
+        for (size_t j = 0; j < mesh->mNumVertices; j++)
+        {
+            aiVector3D &vtx = mesh->mVertices[j];
+            sub.vtxs.push_back(vec3(vtx.x, vtx.y, vtx.z));
+
+            // Not every model has normals or uv coordinates
+            aiVector3D nml = mesh->HasNormals() ? mesh->mNormals[j] : aiVector3D(0.f, 1.f, 0.f);
+            aiVector3D uv = mesh->HasTextureCoords(0) ? mesh->mTextureCoords[0][j] : aiVector3D(0.f, 0.f, 0.f);
+            sub.nmls.push_back(vec3(nml.x, nml.y, nml.z));
+            sub.uvs.push_back(vec2(uv.x, uv.y));
+        }
+
+        for (size_t j = 0; j < mesh->mNumFaces; j++)
+        {
+            const aiFace &face = mesh->mFaces[j];
+            if (face.mNumIndices == 3)
+            {
+                sub.indices.push_back(face.mIndices[0]);
+                sub.indices.push_back(face.mIndices[1]);
+                sub.indices.push_back(face.mIndices[2]);
+            }
+        }
+
+        subMeshes.push_back(sub);
+    }
+}
+
+// -----------------------------------------------------
+// Build LODs of each 3D model
+// - Each LOD is simplified with a grid twice as coarse as the last one,
+//   and kept only if it removes enough triangles
+// - Every LOD is then reordered for the vertex cache and overdraw
+// -----------------------------------------------------
+void Mesh::buildLods()
+{
+    const int MAX_LODS = 4;
+
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        SubMesh &sub = subMeshes[i];
+
+        vec3 lo(FLT_MAX), hi(-FLT_MAX);
+        for (size_t j = 0; j < sub.vtxs.size(); j++)
+        {
+            lo = min(lo, sub.vtxs[j]);
+            hi = max(hi, sub.vtxs[j]);
+        }
+        float diagonal = sub.vtxs.empty() ? 0.f : distance(lo, hi);
+
+        vector<vector<GLuint>> lods(1, sub.indices);
+        for (float cells = 128.f; lods.size() < size_t(MAX_LODS) && cells >= 4.f; cells /= 2.f)
+        {
+            vector<GLuint> lod = simplifyMesh(lods.back(), sub.vtxs, diagonal / cells);
+            if (!lod.empty() && lod.size() <= lods.back().size() * 6 / 10)
+            {
+                lods.push_back(lod);
+            }
+        }
+
+        sub.indices.clear();
+        sub.lodFirsts.clear();
+        sub.lodCounts.clear();
+        for (size_t k = 0; k < lods.size(); k++)
+        {
+            optimizeVertexCache(lods[k], sub.vtxs.size());
+            optimizeOverdraw(lods[k], sub.vtxs);
+
+            sub.lodFirsts.push_back(int(sub.indices.size()));
+            sub.lodCounts.push_back(int(lods[k].size()));
+            sub.indices.insert(sub.indices.end(), lods[k].begin(), lods[k].end());
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Load processed 3D models from a cache file
+// Parameters:
+//   1. fileName: 3D model file path
+//   2. cacheName: cache file path
+// Return: false if the cache is missing, older than the model or invalid
+// -----------------------------------------------------
+bool Mesh::loadCache(const string fileName, const string cacheName)
+{
+    struct stat modelStat, cacheStat;
+    if (stat(cacheName.c_str(), &cacheStat) != 0 ||
+        (stat(fileName.c_str(), &modelStat) == 0 && modelStat.st_mtime > cacheStat.st_mtime))
+    {
+        return false;
+    }
+
+    ifstream in(cacheName.c_str(), ios::binary);
+
+    char magic[8] = {0};
+    GLuint numSubMeshes = 0;
+    in.read(magic, sizeof(magic));
+    in.read((char *)&numSubMeshes, sizeof(numSubMeshes));
+    if (!in || string(magic) != "DWLOD1")
+    {
+        return false;
+    }
+
+    // Counts are checked against the bytes left in the file before anything is allocated,
+    // so a truncated or corrupt cache is rebuilt
+    const unsigned long long COUNTS_SIZE = 3 * sizeof(GLuint);
+    const unsigned long long VERTEX_SIZE = 2 * sizeof(vec3) + sizeof(vec2);
+    unsigned long long remaining = (unsigned long long)cacheStat.st_size - (unsigned long long)in.tellg();
+    if (numSubMeshes > remaining / COUNTS_SIZE)
+    {
+        std::cout << "Mesh: ignoring broken cache " << cacheName << '\n';
+        return false;
+    }
+
+    vector<SubMesh> subs(numSubMeshes);
+    for (size_t i = 0; i < subs.size() && in; i++)
+    {
+        SubMesh &sub = subs[i];
+        GLuint numVtxs = 0, numIndices = 0, numSubLods = 0;
+
+        in.read((char *)&numVtxs, sizeof(numVtxs));
+        in.read((char *)&numIndices, sizeof(numIndices));
+        in.read((char *)&numSubLods, sizeof(numSubLods));
+        if (!in)
+        {
+            break;
+        }
+
+        remaining = (unsigned long long)cacheStat.st_size - (unsigned long long)in.tellg();
+        unsigned long long bytes = numVtxs * VERTEX_SIZE + numIndices * sizeof(GLuint) + numSubLods * 2 * sizeof(int);
+        if (numSubLods == 0 || bytes > remaining)
+        {
+            in.setstate(ios::failbit);
+            break;
+        }
+
+        sub.vtxs.resize(numVtxs);
+        sub.nmls.resize(numVtxs);
+        sub.uvs.resize(numVtxs);
+        sub.indices.resize(numIndices);
+        sub.lodFirsts.resize(numSubLods);
+        sub.lodCounts.resize(numSubLods);
+        in.read((char *)sub.vtxs.data(), sizeof(vec3) * numVtxs);
+        in.read((char *)sub.nmls.data(), sizeof(vec3) * numVtxs);
+        in.read((char *)sub.uvs.data(), sizeof(vec2) * numVtxs);
+        in.read((char *)sub.indices.data(), sizeof(GLuint) * numIndices);
+        in.read((char *)sub.lodFirsts.data(), sizeof(int) * numSubLods);
+        in.read((char *)sub.lodCounts.data(), sizeof(int) * numSubLods);
+
+        // LODs must lie within the indices, and indices within the vertices
+        for (size_t k = 0; k < sub.lodFirsts.size() && in; k++)
+        {
+            if (sub.lodFirsts[k] < 0 || sub.lodCounts[k] < 0 ||
+                (unsigned long long)sub.lodFirsts[k] + sub.lodCounts[k] > numIndices)
+            {
+                in.setstate(ios::failbit);
+            }
+        }
+        for (size_t k = 0; k < sub.indices.size() && in; k++)
+        {
+            if (sub.indices[k] >= numVtxs)
+            {
+                in.setstate(ios::failbit);
+            }
+        }
+    }
+
+    if (!in)
+    {
+        std::cout << "Mesh: ignoring broken cache " << cacheName << '\n';
+        return false;
+    }
+
+    subMeshes.swap(subs);
+    return true;
+}
+
+// -----------------------------------------------------
+// Save processed 3D models to a cache file
+// - Failing to save only means processing again next time
+// -----------------------------------------------------
+void Mesh::saveCache(const string cacheName)
+{
+    ofstream out(cacheName.c_str(), ios::binary);
+
+    char magic[8] = "DWLOD1";
+    GLuint numSubMeshes = GLuint(subMeshes.size());
+    out.write(magic, sizeof(magic));
+    out.write((const char *)&numSubMeshes, sizeof(numSubMeshes));
+
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        const SubMesh &sub = subMeshes[i];
+        GLuint numVtxs = GLuint(sub.vtxs.size());
+        GLuint numIndices = GLuint(sub.indices.size());
+        GLuint numSubLods = GLuint(sub.lodFirsts.size());
+
+        out.write((const char *)&numVtxs, sizeof(numVtxs));
+        out.write((const char *)&numIndices, sizeof(numIndices));
+        out.write((const char *)&numSubLods, sizeof(numSubLods));
+        out.write((const char *)sub.vtxs.data(), sizeof(vec3) * numVtxs);
+        out.write((const char *)sub.nmls.data(), sizeof(vec3) * numVtxs);
+        out.write((const char *)sub.uvs.data(), sizeof(vec2) * numVtxs);
+        out.write((const char *)sub.indices.data(), sizeof(GLuint) * numIndices);
+        out.write((const char *)sub.lodFirsts.data(), sizeof(int) * numSubLods);
+        out.write((const char *)sub.lodCounts.data(), sizeof(int) * numSubLods);
+    }
+
+    if (!out)
+    {
+        std::cout << "Mesh: can't write cache " << cacheName << '\n';
+    }
+}
+
+// -----------------------------------------------------
+// Initialize buffer obect for mesh
+// - Normals and uv coordinates are quantized on upload
+// -----------------------------------------------------
+void Mesh::initBuffers()
+{
+    // vbo for instances, shared by all 3D models
+    vboInstance = Resources::create(Resources::BUFFER, "mesh");
+
+    boundsMin = vec3(1e30f);
+    boundsMax = vec3(-1e30f);
+    numLods = 1;
 
-        // numVertices * numComponents
-        GLfloat *aVtxCoords = new GLfloat[numVtxs * 3];
-        GLfloat *aUvs = new GLfloat[numVtxs * 2];
-        GLfloat *aNormals = new GLfloat[numVtxs * 3];
+    // For each 3D model in the mesh,
+    // create OpenGL contents for its vertex attributes
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        const SubMesh &sub = subMeshes[i];
+        size_t numVtxs = sub.vtxs.size();
 
+        vector<GLushort> aUvs(numVtxs * 2);
+        vector<GLuint> aNormals(numVtxs);
         for (size_t j = 0; j < numVtxs; j++)
         {
-            aiVector3D &vtx = mesh->mVertices[j];
-            aVtxCoords[j * 3 + 0] = vtx.x;
-            aVtxCoords[j * 3 + 1] = vtx.y;
-            aVtxCoords[j * 3 + 2] = vtx.z;
-
-            aiVector3D &nml = mesh->mNormals[j];
-            aNormals[j * 3 + 0] = nml.x;
-            aNormals[j * 3 + 1] = nml.y;
-            aNormals[j * 3 + 2] = nml.z;
-
-            aiVector3D &uv = mesh->mTextureCoords[0][j];
-            aUvs[j * 2 + 0] = uv.x;
-            aUvs[j * 2 + 1] = uv.y;
+            aUvs[j * 2 + 0] = packHalf(sub.uvs[j].x);
+            aUvs[j * 2 + 1] = packHalf(sub.uvs[j].y);
+            aNormals[j] = packNormal(sub.nmls[j]);
+
+            boundsMin = min(boundsMin, sub.vtxs[j]);
+            boundsMax = max(boundsMax, sub.vtxs[j]);
         }
+        numLods = std::max(numLods, int(sub.lodFirsts.size()));
 
         // vao
-        GLuint vao;
-        glGenVertexArrays(1, &vao);
+        GLuint vao = Resources::create(Resources::VERTEX_ARRAY, "mesh");
         glBindVertexArray(vao);
         vaos.push_back(vao);
 
         // vbo for vertex
-        GLuint vboVtx;
-        glGenBuffers(1, &vboVtx);
+        GLuint vboVtx = Resources::create(Resources::BUFFER, "mesh");
         glBindBuffer(GL_ARRAY_BUFFER, vboVtx);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aVtxCoords, GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * numVtxs, sub.vtxs.data(), GL_STATIC_DRAW);
+        Resources::setBytes(Resources::BUFFER, vboVtx, sizeof(vec3) * numVtxs);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
         glEnableVertexAttribArray(0);
         vboVtxs.push_back(vboVtx);
 
         // vbo for uv
-        GLuint vboUv;
-        glGenBuffers(1, &vboUv);
+        GLuint vboUv = Resources::create(Resources::BUFFER, "mesh");
         glBindBuffer(GL_ARRAY_BUFFER, vboUv);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 2, aUvs, GL_STATIC_DRAW);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLushort) * aUvs.size(), aUvs.data(), GL_STATIC_DRAW);
+        Resources::setBytes(Resources::BUFFER, vboUv, sizeof(GLushort) * aUvs.size());
+        glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, 0, 0);
         glEnableVertexAttribArray(1);
         vboUvs.push_back(vboUv);
 
         // vbo for normal
-        GLuint vboNml;
-        glGenBuffers(1, &vboNml);
+        GLuint vboNml = Resources::create(Resources::BUFFER, "mesh");
         glBindBuffer(GL_ARRAY_BUFFER, vboNml);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aNormals, GL_STATIC_DRAW);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * aNormals.size(), aNormals.data(), GL_STATIC_DRAW);
+        Resources::setBytes(Resources::BUFFER, vboNml, sizeof(GLuint) * aNormals.size());
+        glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, 0);
         glEnableVertexAttribArray(2);
         vboNmls.push_back(vboNml);
 
-        // Release resources
-        delete[] aVtxCoords;
-        delete[] aUvs;
-        delete[] aNormals;
+        // vbo for instances
+        // - A mat4 attribute takes four locations, one column each
+        glBindBuffer(GL_ARRAY_BUFFER, vboInstance);
+        for (int k = 0; k < 4; k++)
+        {
+            glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(sizeof(vec4) * k));
+            glEnableVertexAttribArray(3 + k);
+            glVertexAttribDivisor(3 + k, 1);
+        }
+
+        // ebo for all LODs
+        GLuint ebo = Resources::create(Resources::BUFFER, "mesh");
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * sub.indices.size(), sub.indices.data(),
+                     GL_STATIC_DRAW);
+        Resources::setBytes(Resources::BUFFER, ebo, sizeof(GLuint) * sub.indices.size());
+        ebos.push_back(ebo);
+    }
+
+    glBindVertexArray(0);
+
+    // Normals and uv coordinates are only needed on the GPU
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        vector<vec3>().swap(subMeshes[i].nmls);
+        vector<vec2>().swap(subMeshes[i].uvs);
     }
+    Resources::addHostBytes("mesh", hostBytes());
+
+    // By default, the mesh is drawn once with its model matrix only
+    setInstances(vector<mat4>(1, mat4(1.f)));
+}
+
+// -----------------------------------------------------
+// Set instances
+// - Each instance is drawn with instanceM * M
+// Parameters:
+//   1. instanceMs: model matrix of each instance
+// -----------------------------------------------------
+void Mesh::setInstances(const vector<mat4> &instanceMs)
+{
+    numInstances = int(instanceMs.size());
+
+    glBindBuffer(GL_ARRAY_BUFFER, vboInstance);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(mat4) * instanceMs.size(), instanceMs.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    Resources::setBytes(Resources::BUFFER, vboInstance, sizeof(mat4) * instanceMs.size());
+}
+
+// -----------------------------------------------------
+// Set a clipping plane
+// Parameters:
+//   1. uniClipPlane: uniClipPlane0 or uniClipPlane1
+//   2. plane: clipping plane
+// -----------------------------------------------------
+void Mesh::setClipPlane(GLint uniClipPlane, vec4 plane)
+{
+    glUseProgram(shader);
+    glUniform4fv(uniClipPlane, 1, value_ptr(plane));
 }
 
 // -----------------------------------------------------
@@ -381,22 +755,31 @@ void Mesh::initBuffers()
 //   1. tbo: texture buffer object
 //   2. texUnit: texture unit to use
 //   3. texDir: texture image file path
-//   4. imgType: texture image type
+//   4. imgType: texture image type, FIF_UNKNOWN to find it from the file
 // -----------------------------------------------------
 void Mesh::setTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_FORMAT imgType)
 {
+    // Create texture image from file, in the layout GL takes as it is
+    FIBITMAP *texImage = ImageIngest::decode(texDir, imgType);
+    if (!texImage)
+    {
+        return;
+    }
+
     // Always use "GL_TEXTURE0 + N" to specify a texture unit
     glActiveTexture(GL_TEXTURE0 + texUnit);
 
-    // Create texture image from file
-    FIBITMAP *texImage = FreeImage_ConvertTo24Bits(FreeImage_Load(imgType, texDir.c_str()));
-
     // Create texture object for the image
-    glGenTextures(1, &tbo);
+    // - Uploaded once, straight from the decoded bitmap
+    double startTime = ImageIngest::now();
+    tbo = Resources::create(Resources::TEXTURE, "mesh", texDir);
     glBindTexture(GL_TEXTURE_2D, tbo);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FreeImage_GetWidth(texImage), FreeImage_GetHeight(texImage), 0, GL_BGR,
-                 GL_UNSIGNED_BYTE, (void *)FreeImage_GetBits(texImage));
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, FreeImage_GetWidth(texImage), FreeImage_GetHeight(texImage), 0, GL_BGRA,
+                 GL_UNSIGNED_INT_8_8_8_8_REV, (void *)FreeImage_GetBits(texImage));
+    Resources::setBytes(Resources::TEXTURE, tbo,
+                        size_t(FreeImage_GetWidth(texImage)) * FreeImage_GetHeight(texImage) * 4);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    ImageIngest::addTime(ImageIngest::UPLOAD, ImageIngest::now() - startTime);
 
     // Release resource
     FreeImage_Unload(texImage);
@@ -410,8 +793,43 @@ void Mesh::setTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_
 //   3. lightColor, lightPosition: lighting configuration
 //   4. uniBaseColor: base color texture
 //   5. uniNormal: normal map
+//   6. lod: level of detail (0 is full detail),
+//      3D models with fewer LODs use their coarsest one
 // --------------------------------------------------------------
-void Mesh::draw(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, int uniBaseColor, int uniNormal)
+void Mesh::draw(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, int uniBaseColor, int uniNormal,
+                int lod)
+{
+    bind(M, V, P, eye, lightColor, lightPosition, uniBaseColor, uniNormal);
+
+    numDrawCalls = 0;
+    numTriangles = 0;
+
+    // Draw mesh (draw each 3D model in the mesh)
+    // - All instances of a 3D model are drawn at once
+    for (size_t i = 0; i < subMeshes.size(); i++)
+    {
+        const SubMesh &sub = subMeshes[i];
+        if (sub.lodFirsts.empty())
+        {
+            continue;
+        }
+        int k = std::min(lod, int(sub.lodFirsts.size()) - 1);
+
+        glBindVertexArray(vaos[i]);
+        glDrawElementsInstanced(GL_TRIANGLES, sub.lodCounts[k], GL_UNSIGNED_INT,
+                                (void *)(sizeof(GLuint) * sub.lodFirsts[k]), numInstances);
+
+        numDrawCalls++;
+        numTriangles += (long long)(sub.lodCounts[k] / 3) * numInstances;
+    }
+}
+
+// --------------------------------------------------------------
+// Bind shader program and set its uniforms
+// - Lets other geometry be drawn with the shader of this mesh
+// - Parameters are the same as draw()
+// --------------------------------------------------------------
+void Mesh::bind(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, int uniBaseColor, int uniNormal)
 {
     // Bind shader program
     glUseProgram(shader);
@@ -431,13 +849,4 @@ void Mesh::draw(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPos
     // Set textures
     glUniform1i(uniTexBase, uniBaseColor);
     glUniform1i(uniTexNormal, uniNormal);
-
-    // Draw mesh (draw each 3D model in the mesh)
-    for (size_t i = 0; i < scene->mNumMeshes; i++)
-    {
-        int numVtxs = scene->mMeshes[i]->mNumVertices;
-
-        glBindVertexArray(vaos[i]);
-        glDrawArrays(GL_TRIANGLES, 0, numVtxs);
-    }
 }
@@ -0,0 +1,337 @@
+#include "gpucull.h"
+#include "resource.h"
+#include "metrics.h"
+
+// -----------------------------------------------------
+// Constructor
+// -----------------------------------------------------
+GpuCuller::GpuCuller()
+{
+    vao = Resources::create(Resources::VERTEX_ARRAY, "gpu-cull");
+    vboVtx = Resources::create(Resources::BUFFER, "gpu-cull");
+    vboUv = Resources::create(Resources::BUFFER, "gpu-cull");
+    vboNml = Resources::create(Resources::BUFFER, "gpu-cull");
+    ebo = Resources::create(Resources::BUFFER, "gpu-cull");
+    ssboInstances = Resources::create(Resources::BUFFER, "gpu-cull");
+    vboVisible = Resources::create(Resources::BUFFER, "gpu-cull");
+    ssboCounts = Resources::create(Resources::BUFFER, "gpu-cull");
+    bufCommands = Resources::create(Resources::BUFFER, "gpu-cull");
+    ssboCommandCounts = Resources::create(Resources::BUFFER, "gpu-cull");
+    ssboAssetFirsts = Resources::create(Resources::BUFFER, "gpu-cull");
+
+    shader = buildComputeShader("./shader/csCull.glsl");
+    uniStage = myGetUniformLocation(shader, "stage");
+    uniNumItems = myGetUniformLocation(shader, "numItems");
+    uniNumCommands = myGetUniformLocation(shader, "numCommands");
+    uniPlanes = myGetUniformLocation(shader, "planes");
+    uniNumPlanes = myGetUniformLocation(shader, "numPlanes");
+    uniEye = myGetUniformLocation(shader, "eye");
+    uniProjScale = myGetUniformLocation(shader, "projScale");
+    uniLodSize = myGetUniformLocation(shader, "lodSize");
+    uniLodBias = myGetUniformLocation(shader, "lodBias");
+    uniNumLods = myGetUniformLocation(shader, "numLods");
+
+    numItems = 0;
+    numAssets = 0;
+    numCommands = 0;
+    numLods = 1;
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+GpuCuller::~GpuCuller()
+{
+    Resources::destroy(Resources::VERTEX_ARRAY, vao);
+    Resources::destroy(Resources::BUFFER, vboVtx);
+    Resources::destroy(Resources::BUFFER, vboUv);
+    Resources::destroy(Resources::BUFFER, vboNml);
+    Resources::destroy(Resources::BUFFER, ebo);
+    Resources::destroy(Resources::BUFFER, ssboInstances);
+    Resources::destroy(Resources::BUFFER, vboVisible);
+    Resources::destroy(Resources::BUFFER, ssboCounts);
+    Resources::destroy(Resources::BUFFER, bufCommands);
+    Resources::destroy(Resources::BUFFER, ssboCommandCounts);
+    Resources::destroy(Resources::BUFFER, ssboAssetFirsts);
+    Resources::destroy(Resources::PROGRAM, shader);
+}
+
+// -----------------------------------------------------
+// Is OpenGL 4.3 (compute shaders, multi-draw indirect) available
+// -----------------------------------------------------
+bool GpuCuller::isSupported() { return GLEW_VERSION_4_3; }
+
+// -----------------------------------------------------
+// Pack the geometry of all meshes into one vertex array
+// - Vertex and index data is copied between buffers on the GPU
+// Parameters:
+//   1. meshes: mesh of each asset
+// -----------------------------------------------------
+void GpuCuller::initGeometry(const vector<Mesh *> &meshes)
+{
+    numAssets = int(meshes.size());
+    numLods = 1;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        numLods = std::max(numLods, meshes[i]->numLods);
+    }
+
+    // First vertex and index of each 3D model
+    GLsizeiptr numVtxs = 0, numIndices = 0;
+    subVtxFirsts.clear();
+    subIndexFirsts.clear();
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        for (size_t j = 0; j < meshes[i]->subMeshes.size(); j++)
+        {
+            subVtxFirsts.push_back(GLint(numVtxs));
+            subIndexFirsts.push_back(GLuint(numIndices));
+            numVtxs += meshes[i]->subMeshes[j].vtxs.size();
+            numIndices += meshes[i]->subMeshes[j].indices.size();
+        }
+    }
+
+    glBindVertexArray(vao);
+
+    // Same formats as Mesh::initBuffers()
+    GLuint vbos[3] = {vboVtx, vboUv, vboNml};
+    GLsizeiptr strides[3] = {sizeof(vec3), sizeof(GLushort) * 2, sizeof(GLuint)};
+
+    glBindBuffer(GL_ARRAY_BUFFER, vboVtx);
+    glBufferData(GL_ARRAY_BUFFER, strides[0] * numVtxs, NULL, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vboVtx, strides[0] * numVtxs);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vboUv);
+    glBufferData(GL_ARRAY_BUFFER, strides[1] * numVtxs, NULL, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vboUv, strides[1] * numVtxs);
+    glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vboNml);
+    glBufferData(GL_ARRAY_BUFFER, strides[2] * numVtxs, NULL, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vboNml, strides[2] * numVtxs);
+    glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, 0);
+    glEnableVertexAttribArray(2);
+
+    // Visible instances
+    glBindBuffer(GL_ARRAY_BUFFER, vboVisible);
+    for (int k = 0; k < 4; k++)
+    {
+        glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(sizeof(vec4) * k));
+        glEnableVertexAttribArray(3 + k);
+        glVertexAttribDivisor(3 + k, 1);
+    }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * numIndices, NULL, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, ebo, sizeof(GLuint) * numIndices);
+
+    glBindVertexArray(0);
+
+    // Copy data of each 3D model
+    // - Indices stay relative to the 3D model, commands add its base vertex
+    size_t n = 0;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        const Mesh *mesh = meshes[i];
+        for (size_t j = 0; j < mesh->subMeshes.size(); j++, n++)
+        {
+            GLsizeiptr subNumVtxs = mesh->subMeshes[j].vtxs.size();
+            GLuint srcs[3] = {mesh->vboVtxs[j], mesh->vboUvs[j], mesh->vboNmls[j]};
+
+            for (int k = 0; k < 3; k++)
+            {
+                glBindBuffer(GL_COPY_READ_BUFFER, srcs[k]);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, vbos[k]);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, subVtxFirsts[n] * strides[k],
+                                    subNumVtxs * strides[k]);
+            }
+
+            glBindBuffer(GL_COPY_READ_BUFFER, mesh->ebos[j]);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, sizeof(GLuint) * subIndexFirsts[n],
+                                sizeof(GLuint) * mesh->subMeshes[j].indices.size());
+        }
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Upload instances and build command templates
+// - Must be called after initGeometry()
+// Parameters:
+//   1. instances: all instances, grouped by asset
+//   2. assetFirsts: index of the first instance of each asset
+// -----------------------------------------------------
+void GpuCuller::initInstances(const vector<Instance> &instances, const vector<int> &assetFirsts)
+{
+    numItems = int(instances.size());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboInstances);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Instance) * instances.size(), instances.data(), GL_DYNAMIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, ssboInstances, sizeof(Instance) * instances.size());
+
+    // Room for every instance in each LOD
+    size_t numVisible = size_t(std::max(1, numItems)) * numLods;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vboVisible);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(mat4) * numVisible, NULL, GL_DYNAMIC_COPY);
+    Resources::setBytes(Resources::BUFFER, vboVisible, sizeof(mat4) * numVisible);
+
+    size_t numCounts = size_t(std::max(1, numAssets)) * numLods;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboCounts);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * numCounts, NULL, GL_DYNAMIC_COPY);
+    Resources::setBytes(Resources::BUFFER, ssboCounts, sizeof(GLuint) * numCounts);
+
+    vector<GLuint> firsts(assetFirsts.begin(), assetFirsts.end());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboAssetFirsts);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * firsts.size(), firsts.data(), GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, ssboAssetFirsts, sizeof(GLuint) * firsts.size());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Build command templates
+// - One command per LOD of each 3D model,
+//   drawing the visible instances of its asset
+// - Commands are grouped by asset, so that each asset is drawn with its own shader
+// - Must be called after initGeometry()
+// Parameters:
+//   1. meshes: mesh of each asset
+//   2. assetFirsts: index of the first instance of each asset
+// -----------------------------------------------------
+void GpuCuller::initCommands(const vector<Mesh *> &meshes, const vector<int> &assetFirsts)
+{
+    vector<Command> commands;
+    vector<GLuint> commandCounts;
+    assetCommandFirsts.clear();
+
+    size_t firstSub = 0;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        assetCommandFirsts.push_back(int(commands.size()));
+        for (int lod = 0; lod < numLods; lod++)
+        {
+            for (size_t j = 0; j < meshes[i]->subMeshes.size(); j++)
+            {
+                const Mesh::SubMesh &sub = meshes[i]->subMeshes[j];
+                size_t n = firstSub + j;
+
+                // 3D models with fewer LODs use their coarsest one
+                int k = std::min(lod, int(sub.lodFirsts.size()) - 1);
+
+                Command command;
+                command.count = k < 0 ? 0 : sub.lodCounts[k];
+                command.instanceCount = 0;
+                command.firstIndex = subIndexFirsts[n] + (k < 0 ? 0 : sub.lodFirsts[k]);
+                command.baseVertex = subVtxFirsts[n];
+                command.baseInstance = GLuint(lod * numItems + assetFirsts[i]);
+                commands.push_back(command);
+                commandCounts.push_back(GLuint(i * numLods + lod));
+            }
+        }
+        firstSub += meshes[i]->subMeshes.size();
+    }
+    assetCommandFirsts.push_back(int(commands.size()));
+
+    numCommands = int(commands.size());
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, bufCommands);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(Command) * commands.size(), commands.data(), GL_DYNAMIC_COPY);
+    Resources::setBytes(Resources::BUFFER, bufCommands, sizeof(Command) * commands.size());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboCommandCounts);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * commandCounts.size(), commandCounts.data(),
+                 GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, ssboCommandCounts, sizeof(GLuint) * commandCounts.size());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Update an instance after it moved
+// -----------------------------------------------------
+void GpuCuller::updateInstance(int item, const Instance &instance)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboInstances);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Instance) * item, sizeof(Instance), &instance);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Cull instances, select their LOD and write draw commands on the GPU
+// - LODs are selected as Scene::selectLod() does
+// Parameters:
+//   1. planes: half-spaces of the pass (at most 7)
+//   2. eye: eye position
+//   3. projScale: P[1][1] of the pass
+//   4. lodSize: projected size below which the next coarser LOD is used
+//   5. lodBias: number of LODs to add
+// -----------------------------------------------------
+void GpuCuller::cull(const vector<vec4> &planes, vec3 eye, float projScale, float lodSize, int lodBias)
+{
+    // Reset counts
+    GLuint zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboCounts);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssboInstances);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, vboVisible);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssboCounts);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bufCommands);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssboCommandCounts);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ssboAssetFirsts);
+
+    int numPlanes = std::min(7, int(planes.size()));
+
+    glUseProgram(shader);
+    glUniform1i(uniNumItems, numItems);
+    glUniform1i(uniNumCommands, numCommands);
+    glUniform4fv(uniPlanes, numPlanes, value_ptr(planes[0]));
+    glUniform1i(uniNumPlanes, numPlanes);
+    glUniform3fv(uniEye, 1, value_ptr(eye));
+    glUniform1f(uniProjScale, projScale);
+    glUniform1f(uniLodSize, lodSize);
+    glUniform1i(uniLodBias, lodBias);
+    glUniform1i(uniNumLods, numLods);
+
+    // Stage 0: one thread per instance
+    glUniform1i(uniStage, 0);
+    glDispatchCompute((numItems + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Stage 1: one thread per command
+    glUniform1i(uniStage, 1);
+    glDispatchCompute((numCommands + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+// -----------------------------------------------------
+// Draw the visible instances of an asset, at every LOD
+// - The shader program of its mesh must be bound by the caller
+// Parameters:
+//   1. asset: index of the asset
+// -----------------------------------------------------
+void GpuCuller::draw(int asset)
+{
+    int first = assetCommandFirsts[asset];
+    int count = assetCommandFirsts[asset + 1] - first;
+    if (count == 0)
+    {
+        return;
+    }
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, bufCommands);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void *)(sizeof(Command) * first), count, 0);
+
+    // Instances are only known to the GPU, triangles are not counted
+    Metrics::add(Metrics::DRAW_CALLS);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
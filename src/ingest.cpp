@@ -0,0 +1,252 @@
+#include "ingest.h"
+#include "resource.h"
+#include <chrono>
+
+double ImageIngest::stepMs[ImageIngest::NUM_STEPS];
+int ImageIngest::stepCounts[ImageIngest::NUM_STEPS];
+mutex ImageIngest::statMutex;
+
+// -----------------------------------------------------
+// Constructor
+// -----------------------------------------------------
+ImageIngest::ImageIngest() { maxFreeBytes = 64 * 1024 * 1024; }
+
+// -----------------------------------------------------
+// Destructor
+// - Also deletes buffers still in use
+// -----------------------------------------------------
+ImageIngest::~ImageIngest()
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        unmap(buffers[i].pbo);
+        Resources::destroy(Resources::BUFFER, buffers[i].pbo);
+    }
+}
+
+// -----------------------------------------------------
+// Take a staging buffer, mapped for writing
+// - The smallest free buffer that fits is reused,
+//   its old content is discarded
+// - Otherwise a new buffer replaces the free ones, which are all smaller
+// - The memory may be written by any thread until unmap()
+// Parameters:
+//   1. bytes: size of the pixels
+//   2. data: mapped memory of the buffer
+// Return: pixel unpack buffer
+// -----------------------------------------------------
+GLuint ImageIngest::acquire(size_t bytes, unsigned char *&data)
+{
+    int best = -1;
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (!buffers[i].isInUse && buffers[i].bytes >= bytes &&
+            (best < 0 || buffers[i].bytes < buffers[best].bytes))
+        {
+            best = int(i);
+        }
+    }
+
+    if (best < 0)
+    {
+        // Free buffers too small for this one would only serve smaller levels
+        for (size_t i = 0; i < buffers.size();)
+        {
+            if (!buffers[i].isInUse)
+            {
+                Resources::destroy(Resources::BUFFER, buffers[i].pbo);
+                buffers.erase(buffers.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        Staging staging;
+        staging.pbo = Resources::create(Resources::BUFFER, "staging");
+        staging.bytes = bytes;
+        staging.data = 0;
+        staging.isInUse = false;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+        Resources::setBytes(Resources::BUFFER, staging.pbo, bytes);
+
+        buffers.push_back(staging);
+        best = int(buffers.size()) - 1;
+    }
+
+    Staging &staging = buffers[best];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+    staging.data = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    staging.isInUse = true;
+
+    data = staging.data;
+    return staging.pbo;
+}
+
+// -----------------------------------------------------
+// Finish writing a staging buffer
+// - It can then be bound to GL_PIXEL_UNPACK_BUFFER
+//   and its pixels given to glTexImage2D as offsets
+// Return: false if the content was lost (e.g. a mode switch),
+//   or the buffer could not be mapped
+// -----------------------------------------------------
+bool ImageIngest::unmap(GLuint pbo)
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (buffers[i].pbo != pbo)
+        {
+            continue;
+        }
+        if (!buffers[i].data)
+        {
+            return false;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        bool isValid = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        buffers[i].data = 0;
+        return isValid;
+    }
+    return false;
+}
+
+// -----------------------------------------------------
+// Give a staging buffer back to the pool
+// - Called after the upload that reads it
+// - Deleted if the pool already keeps maxFreeBytes
+// -----------------------------------------------------
+void ImageIngest::release(GLuint pbo)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (buffers[i].pbo != pbo || !buffers[i].isInUse)
+        {
+            continue;
+        }
+
+        unmap(pbo);
+        buffers[i].isInUse = false;
+        if (freeBytes() > maxFreeBytes)
+        {
+            Resources::destroy(Resources::BUFFER, buffers[i].pbo);
+            buffers.erase(buffers.begin() + i);
+        }
+        return;
+    }
+}
+
+// -----------------------------------------------------
+// Bytes of free staging buffers
+// -----------------------------------------------------
+size_t ImageIngest::freeBytes()
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (!buffers[i].isInUse)
+        {
+            bytes += buffers[i].bytes;
+        }
+    }
+    return bytes;
+}
+
+// -----------------------------------------------------
+// Decode an image as bottom-up BGRA
+// - 32-bit images are kept as decoded, others are converted
+//   and the decoded bitmap is released right away
+// - Rows of a 32-bit bitmap have no padding,
+//   so FreeImage_GetBits() can be uploaded as it is
+// Parameters:
+//   1. file: image file path
+//   2. format: image format, found from the file if unknown
+// Return: bitmap to be released with FreeImage_Unload(), 0 on error
+// -----------------------------------------------------
+FIBITMAP *ImageIngest::decode(const string file, FREE_IMAGE_FORMAT format)
+{
+    if (format == FIF_UNKNOWN)
+    {
+        format = FreeImage_GetFileType(file.c_str());
+    }
+    if (format == FIF_UNKNOWN)
+    {
+        format = FreeImage_GetFIFFromFilename(file.c_str());
+    }
+    if (format == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(format))
+    {
+        std::cout << "ImageIngest: unknown image format of " << file << '\n';
+        return 0;
+    }
+
+    double startTime = now();
+    FIBITMAP *loaded = FreeImage_Load(format, file.c_str());
+    addTime(DECODE, now() - startTime);
+    if (!loaded)
+    {
+        std::cout << "ImageIngest: can't read " << file << '\n';
+        return 0;
+    }
+
+    if (FreeImage_GetImageType(loaded) == FIT_BITMAP && FreeImage_GetBPP(loaded) == 32)
+    {
+        return loaded;
+    }
+
+    startTime = now();
+    FIBITMAP *image = FreeImage_ConvertTo32Bits(loaded);
+    FreeImage_Unload(loaded);
+    addTime(CONVERT, now() - startTime);
+    if (!image)
+    {
+        std::cout << "ImageIngest: can't convert " << file << '\n';
+    }
+
+    return image;
+}
+
+// -----------------------------------------------------
+// Count time spent in a step
+// Parameters:
+//   1. step: step of the ingest
+//   2. ms: time in milliseconds
+// -----------------------------------------------------
+void ImageIngest::addTime(Step step, double ms)
+{
+    lock_guard<mutex> lock(statMutex);
+    stepMs[step] += ms;
+    stepCounts[step]++;
+}
+
+// -----------------------------------------------------
+// Current time in milliseconds, for any thread
+// -----------------------------------------------------
+double ImageIngest::now()
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------
+// Print time spent in each step
+// -----------------------------------------------------
+void ImageIngest::report()
+{
+    static const char *names[NUM_STEPS] = {"decode", "convert", "read", "upload"};
+
+    lock_guard<mutex> lock(statMutex);
+    std::cout << "image ingest:";
+    for (int i = 0; i < NUM_STEPS; i++)
+    {
+        std::cout << (i ? ", " : " ") << names[i] << " " << stepCounts[i] << " x "
+                  << (stepCounts[i] ? stepMs[i] / stepCounts[i] : 0.0) << " ms";
+    }
+    std::cout << endl;
+}
@@ -0,0 +1,241 @@
+#include "inputlog.h"
+#include <cstring>
+
+// Input log layout (little-endian)
+// - Header: magic, start camera (eye point, vertical and horizontal angle, fov as floats),
+//   simulation step and time scale (doubles)
+// - Frames: wall time (double), cursor offset (2 floats), keys, settings
+static const char INPUT_MAGIC[8] = "DWINP1";
+static const size_t HEADER_SIZE = 8 + 6 * sizeof(float) + 2 * sizeof(double);
+static const size_t FRAME_SIZE = sizeof(double) + 2 * sizeof(float) + 2;
+
+// -----------------------------------------------------
+// Statistics of frame times
+// Parameters:
+//   1. ms: frame times in milliseconds
+//   2. label: what the times are
+// -----------------------------------------------------
+static void printFrameTimes(vector<float> ms, const string label)
+{
+    if (ms.empty())
+    {
+        return;
+    }
+
+    size_t worst = max_element(ms.begin(), ms.end()) - ms.begin();
+    float worstMs = ms[worst];
+
+    double sum = 0.0;
+    for (size_t i = 0; i < ms.size(); i++)
+    {
+        sum += ms[i];
+    }
+
+    sort(ms.begin(), ms.end());
+    std::cout << label << ": average " << sum / ms.size() << " ms, median " << ms[ms.size() / 2]
+              << " ms, 99th percentile " << ms[ms.size() * 99 / 100] << " ms, max " << worstMs << " ms at frame "
+              << worst + 1 << '\n';
+}
+
+// -----------------------------------------------------
+// Constructor
+// -----------------------------------------------------
+InputLog::InputLog()
+{
+    start.eyePoint = vec3(0.f);
+    start.verticalAngle = 0.f;
+    start.horizontalAngle = 0.f;
+    start.fov = 45.f;
+    start.time = 0.0;
+    step = 1.0 / 120.0;
+    timeScale = 1.0;
+
+    numRecorded = 0;
+    next = 0;
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+InputLog::~InputLog() { finish(); }
+
+// -----------------------------------------------------
+// Start recording
+// Parameters:
+//   1. fileName: log file path
+//   2. camera: camera at the first frame
+//   3. dt, scale: step and time scale of the simulation clock
+// Return: false if the file can't be written
+// -----------------------------------------------------
+bool InputLog::record(const string fileName, const Pose &camera, double dt, double scale)
+{
+    start = camera;
+    step = dt;
+    timeScale = scale;
+
+    out.open(fileName.c_str(), ios::binary);
+    if (!out)
+    {
+        std::cout << "InputLog: can't write " << fileName << '\n';
+        return false;
+    }
+
+    float pose[6] = {start.eyePoint.x,    start.eyePoint.y,        start.eyePoint.z,
+                     start.verticalAngle, start.horizontalAngle, start.fov};
+    char header[HEADER_SIZE];
+    memcpy(header, INPUT_MAGIC, sizeof(INPUT_MAGIC));
+    memcpy(header + 8, pose, sizeof(pose));
+    memcpy(header + 32, &step, sizeof(double));
+    memcpy(header + 40, &timeScale, sizeof(double));
+    out.write(header, sizeof(header));
+
+    numRecorded = 0;
+    return true;
+}
+
+// -----------------------------------------------------
+// Append the inputs of a frame
+// - Written through the stream buffer, no flush per frame
+// -----------------------------------------------------
+void InputLog::write(const InputFrame &input)
+{
+    if (!out.is_open())
+    {
+        return;
+    }
+
+    char data[FRAME_SIZE];
+    memcpy(data, &input.time, sizeof(double));
+    memcpy(data + 8, &input.cursorX, sizeof(float));
+    memcpy(data + 12, &input.cursorY, sizeof(float));
+    data[16] = char(input.keys);
+    data[17] = char(input.settings);
+    out.write(data, sizeof(data));
+
+    numRecorded++;
+}
+
+// -----------------------------------------------------
+// Stop recording and close the file
+// -----------------------------------------------------
+void InputLog::finish()
+{
+    if (!out.is_open())
+    {
+        return;
+    }
+
+    out.close();
+    if (!out)
+    {
+        std::cout << "InputLog: writing failed" << '\n';
+        return;
+    }
+    std::cout << "InputLog: " << numRecorded << " frames recorded" << '\n';
+}
+
+// -----------------------------------------------------
+// Read a log for replaying
+// Parameters:
+//   1. fileName: log file path
+// Return: false if it can't be read or is not an input log
+// -----------------------------------------------------
+bool InputLog::load(const string fileName)
+{
+    ifstream in(fileName.c_str(), ios::binary);
+    if (!in)
+    {
+        std::cout << "InputLog: can't read " << fileName << '\n';
+        return false;
+    }
+
+    char header[HEADER_SIZE];
+    if (!in.read(header, sizeof(header)) || memcmp(header, INPUT_MAGIC, sizeof(INPUT_MAGIC)) != 0)
+    {
+        std::cout << "InputLog: " << fileName << " is not an input log" << '\n';
+        return false;
+    }
+
+    float pose[6];
+    memcpy(pose, header + 8, sizeof(pose));
+    memcpy(&step, header + 32, sizeof(double));
+    memcpy(&timeScale, header + 40, sizeof(double));
+    start.eyePoint = vec3(pose[0], pose[1], pose[2]);
+    start.verticalAngle = pose[3];
+    start.horizontalAngle = pose[4];
+    start.fov = pose[5];
+
+    // A frame cut off at the end (e.g. by a crash) is dropped
+    frames.clear();
+    char data[FRAME_SIZE];
+    while (in.read(data, sizeof(data)))
+    {
+        InputFrame input;
+        memcpy(&input.time, data, sizeof(double));
+        memcpy(&input.cursorX, data + 8, sizeof(float));
+        memcpy(&input.cursorY, data + 12, sizeof(float));
+        input.keys = (unsigned char)data[16];
+        input.settings = (unsigned char)data[17];
+        frames.push_back(input);
+    }
+
+    if (frames.empty() || step <= 0.0)
+    {
+        std::cout << "InputLog: no frames in " << fileName << '\n';
+        return false;
+    }
+
+    next = 0;
+    wallTimes.clear();
+    wallTimes.reserve(frames.size());
+    return true;
+}
+
+// -----------------------------------------------------
+// Take the inputs of the next frame
+// Parameters:
+//   1. input: inputs of the frame (output)
+//   2. wallTime: current wall clock time, for the report
+// Return: false if every frame has been replayed
+// -----------------------------------------------------
+bool InputLog::read(InputFrame &input, double wallTime)
+{
+    if (next >= frames.size())
+    {
+        return false;
+    }
+
+    input = frames[next++];
+    wallTimes.push_back(wallTime);
+    return true;
+}
+
+// -----------------------------------------------------
+// Is a log loaded for replaying
+// -----------------------------------------------------
+bool InputLog::isReplaying() { return !frames.empty(); }
+
+// -----------------------------------------------------
+// Print replayed frame times next to the recorded ones
+// - A frame time is the wall time between the inputs of a frame and
+//   the one before, frames count from 0 in the log
+// -----------------------------------------------------
+void InputLog::report()
+{
+    if (wallTimes.size() < 2)
+    {
+        return;
+    }
+
+    vector<float> replayed, recorded;
+    for (size_t i = 1; i < wallTimes.size(); i++)
+    {
+        replayed.push_back(float((wallTimes[i] - wallTimes[i - 1]) * 1000.0));
+        recorded.push_back(float((frames[i].time - frames[i - 1].time) * 1000.0));
+    }
+
+    std::cout << "InputLog: " << wallTimes.size() << " / " << frames.size() << " frames replayed in "
+              << wallTimes.back() - wallTimes.front() << " s" << '\n';
+    printFrameTimes(replayed, "replayed");
+    printFrameTimes(recorded, "recorded");
+}
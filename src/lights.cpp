@@ -0,0 +1,488 @@
+#include "lights.h"
+#include "resource.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. numThreads: threads binning lights, including the caller
+//      (0: one per core, at most 4)
+// -----------------------------------------------------
+ClusteredLights::ClusteredLights(int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = std::max(1, std::min(4, int(thread::hardware_concurrency())));
+    }
+
+    clusterLights.resize(NUM_CLUSTERS);
+    ranges.assign(NUM_CLUSTERS * 2, 0);
+    isDirty = true;
+    version = 0;
+    numBinds = 0;
+
+    block.V = mat4(1.f);
+    block.P = mat4(1.f);
+    block.depth = vec2(1.f, 1.f);
+    block.numLights = 0;
+    block.padding = 0;
+
+    // Light i is texels 2i (position, radius) and 2i + 1 (color)
+    vboLights = Resources::create(Resources::BUFFER, "lights");
+    tboLights = Resources::create(Resources::TEXTURE, "lights");
+    uploadLights();
+
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_LIGHTS);
+    glBindTexture(GL_TEXTURE_BUFFER, tboLights);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, vboLights);
+
+    // Shaders may draw before the first build
+    emptyView = createView();
+    upload(emptyView);
+    bindView(emptyView);
+
+    job = 0;
+    numDone = 0;
+    isStopping = false;
+    for (int i = 1; i < numThreads; i++)
+    {
+        workers.push_back(thread(&ClusteredLights::workLoop, this, i));
+    }
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+ClusteredLights::~ClusteredLights()
+{
+    {
+        lock_guard<mutex> lock(jobMutex);
+        isStopping = true;
+    }
+    jobCond.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    Resources::destroy(Resources::TEXTURE, tboLights);
+    Resources::destroy(Resources::BUFFER, vboLights);
+    destroyView(emptyView);
+    for (size_t i = 0; i < views.size(); i++)
+    {
+        destroyView(views[i]);
+    }
+}
+
+// -----------------------------------------------------
+// Create the OpenGL objects of the clusters of a camera
+// - Not built, version -1
+// -----------------------------------------------------
+ClusteredLights::View ClusteredLights::createView()
+{
+    View view;
+    view.V = mat4(1.f);
+    view.P = mat4(1.f);
+    view.version = -1;
+    view.lastBound = 0;
+
+    view.vboClusters = Resources::create(Resources::BUFFER, "lights");
+    view.tboClusters = Resources::create(Resources::TEXTURE, "lights");
+    view.vboIndices = Resources::create(Resources::BUFFER, "lights");
+    view.tboIndices = Resources::create(Resources::TEXTURE, "lights");
+    view.ubo = Resources::create(Resources::BUFFER, "lights");
+
+    // Buffer names are only objects once bound
+    glBindBuffer(GL_TEXTURE_BUFFER, view.vboClusters);
+    glBindBuffer(GL_TEXTURE_BUFFER, view.vboIndices);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_CLUSTERS);
+    glBindTexture(GL_TEXTURE_BUFFER, view.tboClusters);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, view.vboClusters);
+
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_INDICES);
+    glBindTexture(GL_TEXTURE_BUFFER, view.tboIndices);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, view.vboIndices);
+
+    return view;
+}
+
+// -----------------------------------------------------
+// Destroy the OpenGL objects of the clusters of a camera
+// -----------------------------------------------------
+void ClusteredLights::destroyView(View &view)
+{
+    Resources::destroy(Resources::TEXTURE, view.tboClusters);
+    Resources::destroy(Resources::TEXTURE, view.tboIndices);
+    Resources::destroy(Resources::BUFFER, view.vboClusters);
+    Resources::destroy(Resources::BUFFER, view.vboIndices);
+    Resources::destroy(Resources::BUFFER, view.ubo);
+}
+
+// -----------------------------------------------------
+// Add a point light
+// Parameters:
+//   1. position: position in world space
+//   2. color: color times intensity
+//   3. radius: distance at which its light reaches 0
+// -----------------------------------------------------
+void ClusteredLights::add(vec3 position, vec3 color, float radius)
+{
+    Light light;
+    light.position = position;
+    light.color = color;
+    light.radius = radius;
+    lights.push_back(light);
+
+    isDirty = true;
+}
+
+// -----------------------------------------------------
+// Make the clusters of a camera current
+// - Without lights, the empty grid is bound and nothing is built
+// - Clusters kept for this camera are bound as they are, only a new camera
+//   or new lights rebuild, into the least recently bound clusters
+// - Called before each pass that draws lit geometry
+// Parameters:
+//   1. V, P: camera of the pass
+// -----------------------------------------------------
+void ClusteredLights::bind(mat4 V, mat4 P)
+{
+    numBinds++;
+
+    if (lights.empty())
+    {
+        bindView(emptyView);
+        return;
+    }
+
+    if (isDirty)
+    {
+        uploadLights();
+    }
+
+    View *view = NULL;
+    for (size_t i = 0; i < views.size() && !view; i++)
+    {
+        if (views[i].version == version && views[i].V == V && views[i].P == P)
+        {
+            view = &views[i];
+        }
+    }
+    if (view)
+    {
+        view->lastBound = numBinds;
+        bindView(*view);
+        return;
+    }
+
+    // Rebuild clusters of older lights first, then new ones, then the least recently bound
+    for (size_t i = 0; i < views.size() && !view; i++)
+    {
+        if (views[i].version != version)
+        {
+            view = &views[i];
+        }
+    }
+    if (!view && views.size() < size_t(MAX_VIEWS))
+    {
+        views.push_back(createView());
+        view = &views.back();
+    }
+    if (!view)
+    {
+        view = &views[0];
+        for (size_t i = 1; i < views.size(); i++)
+        {
+            if (views[i].lastBound < view->lastBound)
+            {
+                view = &views[i];
+            }
+        }
+    }
+    build(*view, V, P);
+
+    view->lastBound = numBinds;
+    bindView(*view);
+}
+
+// -----------------------------------------------------
+// Bind the buffers of the clusters of a camera
+// -----------------------------------------------------
+void ClusteredLights::bindView(const View &view)
+{
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_LIGHTS);
+    glBindTexture(GL_TEXTURE_BUFFER, tboLights);
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_CLUSTERS);
+    glBindTexture(GL_TEXTURE_BUFFER, view.tboClusters);
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT_INDICES);
+    glBindTexture(GL_TEXTURE_BUFFER, view.tboIndices);
+    glBindBufferBase(GL_UNIFORM_BUFFER, BLOCK_BINDING, view.ubo);
+}
+
+// -----------------------------------------------------
+// Bin all lights into the clusters of a camera
+// - Slices are split between the workers and the caller
+// Parameters:
+//   1. view: clusters to build and upload
+//   2. V, P: camera, P must be a perspective projection
+// -----------------------------------------------------
+void ClusteredLights::build(View &view, mat4 V, mat4 P)
+{
+    // Near and far planes of a GL perspective matrix
+    float near = P[3][2] / (P[2][2] - 1.f);
+    float far = P[3][2] / (P[2][2] + 1.f);
+
+    block.V = V;
+    block.P = P;
+    block.depth = vec2(near, log(far / near));
+    block.numLights = int(lights.size());
+
+    viewLights.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        viewLights[i] = vec4(vec3(V * vec4(lights[i].position, 1.f)), lights[i].radius);
+    }
+
+    if (workers.empty())
+    {
+        binSlices(0, 1);
+    }
+    else
+    {
+        {
+            lock_guard<mutex> lock(jobMutex);
+            job++;
+            numDone = 0;
+        }
+        jobCond.notify_all();
+
+        binSlices(0, int(workers.size()) + 1);
+
+        unique_lock<mutex> lock(jobMutex);
+        doneCond.wait(lock, [this] { return numDone == int(workers.size()); });
+    }
+
+    // Light lists back to back, in cluster order
+    indices.clear();
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        ranges[c * 2] = GLuint(indices.size());
+        ranges[c * 2 + 1] = GLuint(clusterLights[c].size());
+        indices.insert(indices.end(), clusterLights[c].begin(), clusterLights[c].end());
+    }
+
+    upload(view);
+
+    view.V = V;
+    view.P = P;
+    view.version = version;
+}
+
+// -----------------------------------------------------
+// Bin lights into the clusters of a range of slices
+// - A light is tested against the clusters under the screen bounds
+//   of its sphere, then kept if the sphere touches the cluster box
+// Parameters:
+//   1. worker: index of the worker, 0 for the caller
+//   2. numWorkers: number of workers, including the caller
+// -----------------------------------------------------
+void ClusteredLights::binSlices(int worker, int numWorkers)
+{
+    int firstSlice = worker * SLICES / numWorkers;
+    int endSlice = (worker + 1) * SLICES / numWorkers;
+    for (int c = firstSlice * TILES_X * TILES_Y; c < endSlice * TILES_X * TILES_Y; c++)
+    {
+        clusterLights[c].clear();
+    }
+
+    float near = block.depth.x, logRatio = block.depth.y;
+    const mat4 &P = block.P;
+
+    // Depth of each slice boundary
+    float sliceDepths[SLICES + 1];
+    for (int z = 0; z <= SLICES; z++)
+    {
+        sliceDepths[z] = near * exp(logRatio * z / SLICES);
+    }
+
+    for (size_t i = 0; i < viewLights.size(); i++)
+    {
+        vec3 center = vec3(viewLights[i]);
+        float radius = viewLights[i].w;
+
+        // The camera looks down -z
+        float d0 = std::max(-center.z - radius, near);
+        float d1 = -center.z + radius;
+        if (d1 < near)
+        {
+            continue;
+        }
+
+        int z0 = std::max(int(floor(log(d0 / near) / logRatio * SLICES)), firstSlice);
+        int z1 = std::min(int(floor(log(d1 / near) / logRatio * SLICES)), endSlice - 1);
+        if (z0 > z1)
+        {
+            continue;
+        }
+
+        // Screen bounds of the box around the sphere, in front of the near plane
+        vec2 ndcMin(FLT_MAX), ndcMax(-FLT_MAX);
+        for (int k = 0; k < 8; k++)
+        {
+            float x = center.x + ((k & 1) ? radius : -radius);
+            float y = center.y + ((k & 2) ? radius : -radius);
+            float d = (k & 4) ? d1 : d0;
+            vec2 ndc(P[0][0] * x / d - P[2][0], P[1][1] * y / d - P[2][1]);
+            ndcMin = min(ndcMin, ndc);
+            ndcMax = max(ndcMax, ndc);
+        }
+        if (ndcMax.x < -1.f || ndcMin.x > 1.f || ndcMax.y < -1.f || ndcMin.y > 1.f)
+        {
+            continue;
+        }
+
+        int x0 = std::max(int(floor((ndcMin.x * 0.5f + 0.5f) * TILES_X)), 0);
+        int x1 = std::min(int(floor((ndcMax.x * 0.5f + 0.5f) * TILES_X)), TILES_X - 1);
+        int y0 = std::max(int(floor((ndcMin.y * 0.5f + 0.5f) * TILES_Y)), 0);
+        int y1 = std::min(int(floor((ndcMax.y * 0.5f + 0.5f) * TILES_Y)), TILES_Y - 1);
+
+        for (int z = z0; z <= z1; z++)
+        {
+            float dn = sliceDepths[z], df = sliceDepths[z + 1];
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    // View-space box of the cluster
+                    vec2 tileMin(x * 2.f / TILES_X - 1.f, y * 2.f / TILES_Y - 1.f);
+                    vec2 tileMax((x + 1) * 2.f / TILES_X - 1.f, (y + 1) * 2.f / TILES_Y - 1.f);
+                    vec3 boxMin(FLT_MAX), boxMax(-FLT_MAX);
+                    for (int k = 0; k < 8; k++)
+                    {
+                        vec2 ndc((k & 1) ? tileMax.x : tileMin.x, (k & 2) ? tileMax.y : tileMin.y);
+                        float d = (k & 4) ? df : dn;
+                        vec3 corner((ndc.x + P[2][0]) * d / P[0][0], (ndc.y + P[2][1]) * d / P[1][1], -d);
+                        boxMin = min(boxMin, corner);
+                        boxMax = max(boxMax, corner);
+                    }
+
+                    vec3 closest = glm::clamp(center, boxMin, boxMax);
+                    if (dot(closest - center, closest - center) <= radius * radius)
+                    {
+                        clusterLights[(z * TILES_Y + y) * TILES_X + x].push_back(GLuint(i));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Upload the lights
+// - Never empty, so that the texture buffer is valid
+// - Clusters built with the older lights are rebuilt when bound
+// -----------------------------------------------------
+void ClusteredLights::uploadLights()
+{
+    vector<vec4> texels(std::max(size_t(1), lights.size()) * 2, vec4(0.f));
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        texels[i * 2] = vec4(lights[i].position, lights[i].radius);
+        texels[i * 2 + 1] = vec4(lights[i].color, 0.f);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, vboLights);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4) * texels.size(), texels.data(), GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vboLights, sizeof(vec4) * texels.size());
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    isDirty = false;
+    version++;
+}
+
+// -----------------------------------------------------
+// Upload the clusters of the last build and its uniform block
+// - Buffers are never empty, so that texture buffers are valid
+// Parameters:
+//   1. view: clusters of the camera of the build
+// -----------------------------------------------------
+void ClusteredLights::upload(View &view)
+{
+    glBindBuffer(GL_TEXTURE_BUFFER, view.vboClusters);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * ranges.size(), ranges.data(), GL_STREAM_DRAW);
+    Resources::setBytes(Resources::BUFFER, view.vboClusters, sizeof(GLuint) * ranges.size());
+
+    GLuint noIndex = 0;
+    glBindBuffer(GL_TEXTURE_BUFFER, view.vboIndices);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * std::max(size_t(1), indices.size()),
+                 indices.empty() ? &noIndex : indices.data(), GL_STREAM_DRAW);
+    Resources::setBytes(Resources::BUFFER, view.vboIndices, sizeof(GLuint) * std::max(size_t(1), indices.size()));
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, view.ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), &block, GL_STREAM_DRAW);
+    Resources::setBytes(Resources::BUFFER, view.ubo, sizeof(Block));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Worker thread
+// - Bins its slices for each new build
+// Parameters:
+//   1. worker: index of the worker, from 1
+// -----------------------------------------------------
+void ClusteredLights::workLoop(int worker)
+{
+    int lastJob = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(jobMutex);
+            jobCond.wait(lock, [this, lastJob] { return isStopping || job != lastJob; });
+            if (isStopping)
+            {
+                return;
+            }
+            lastJob = job;
+        }
+
+        binSlices(worker, int(workers.size()) + 1);
+
+        {
+            lock_guard<mutex> lock(jobMutex);
+            numDone++;
+        }
+        doneCond.notify_one();
+    }
+}
+
+// -----------------------------------------------------
+// Largest number of lights in a cluster of the last build
+// -----------------------------------------------------
+int ClusteredLights::maxClusterLights()
+{
+    GLuint most = 0;
+    for (int c = 0; c < NUM_CLUSTERS; c++)
+    {
+        most = std::max(most, ranges[c * 2 + 1]);
+    }
+    return int(most);
+}
+
+// -----------------------------------------------------
+// Connect a shader program to the light buffers
+// - Called once after the program is built
+// -----------------------------------------------------
+void ClusteredLights::initShader(GLuint shader)
+{
+    glUseProgram(shader);
+    glUniform1i(myGetUniformLocation(shader, "lightData"), TEX_UNIT_LIGHTS);
+    glUniform1i(myGetUniformLocation(shader, "clusterRanges"), TEX_UNIT_CLUSTERS);
+    glUniform1i(myGetUniformLocation(shader, "clusterIndices"), TEX_UNIT_INDICES);
+
+    GLuint blockIndex = glGetUniformBlockIndex(shader, "Clusters");
+    if (blockIndex != GL_INVALID_INDEX)
+    {
+        glUniformBlockBinding(shader, blockIndex, BLOCK_BINDING);
+    }
+}
@@ -1,11 +1,104 @@
 #include "common.h"
 #include "skybox.h"
 #include "water.h"
+#include "resolution.h"
+#include "probe.h"
+#include "temporal.h"
+#include "clock.h"
+#include "frame.h"
+#include "capture.h"
+#include "server.h"
+#include "scene.h"
+#include "resource.h"
+#include "regress.h"
+#include "inputlog.h"
+#include "metrics.h"
+#include <thread>
+#include <sys/stat.h>
 
 GLFWwindow *mainWindow;
 
+// Size of the window framebuffer
+// - On macOS, it is twice the window size
+int fbWidth, fbHeight;
+
+// Target of the main pass when dynamic resolution is off
+// - The window by default, the capture target in batch mode
+GLuint mainFbo = 0;
+int mainWidth, mainHeight;
+
+// ================================================
+// Render settings, toggled by keys on the main thread
+// ================================================
 bool saveTrigger = false;
+bool skyLookup = false;
+bool probeReflect = false;
+bool lineMode = false;
+bool printInfo = false;
+
+// Number of the next saved frame (render thread)
 int frameNumber = 0;
+bool wasSaving = false;
+
+// ================================================
+// Render thread
+// - isThreaded: prepare and render frames on separate threads
+// - frames: prepared frames handed to the render thread
+// ================================================
+bool isThreaded = false;
+atomic<bool> isRunning(false);
+atomic<long> framesConsumed(0);
+TripleBuffer<FrameState> frames;
+
+// ================================================
+// Capture
+// - batchFile: pose file to render in batch mode
+// - outDir, outFormat: where and how batch views are saved
+// - batchWidth, batchHeight: size of batch views, 0 means the window size
+// ================================================
+Capture *capture;
+string batchFile;
+string outDir = "./result";
+string outFormat = "png";
+int batchWidth = 0, batchHeight = 0;
+
+// Socket of the render server
+string socketPath;
+
+// ================================================
+// Regression suite
+// - regressFile: suite file to render and compare
+// - isUpdateGolden: write golden images and timings instead of comparing
+// ================================================
+string regressFile;
+bool isUpdateGolden = false;
+
+// ================================================
+// Input recording and replay
+// - recordFile: write the inputs of this session to a log
+// - replayFile: take the inputs from a log instead of the mouse and keyboard
+// - isUnthrottled: replay as fast as possible instead of at the recorded pace
+// - replayStartTime: wall time the replay started at
+// ================================================
+InputLog *inputLog = NULL;
+string recordFile, replayFile;
+bool isUnthrottled = false;
+double replayStartTime = -1.0;
+
+// ================================================
+// Runtime metrics
+// - metricsFile: file rewritten with the metrics every metricsInterval seconds
+// - metricsPort: local port answering Prometheus scrapes
+// - passTimer: GPU time of each pass, NULL if metrics are off
+// - refreshInterval: time between refreshes of the monitor,
+//   a shown frame later than 1.5 of it is dropped
+// ================================================
+string metricsFile;
+int metricsPort = 0;
+double metricsInterval = 10.0;
+PassTimer *passTimer = NULL;
+double refreshInterval = 1.0 / 60.0;
+double lastShownTime = -1.0;
 
 // ================================================
 // Camera settings
@@ -21,22 +114,102 @@ vec3 eyeDirection =
     vec3(sin(verticalAngle) * cos(horizontalAngle), cos(verticalAngle), sin(verticalAngle) * sin(horizontalAngle));
 vec3 up = vec3(0.f, 1.f, 0.f);
 
+// Camera state at the last two simulation steps,
+// and the moving direction from keyboard inputs
+vec3 eyePointPrev = eyePoint, eyePointNext = eyePoint;
+vec3 moveDirection = vec3(0.f);
+
+// ================================================
+// Simulation clock
+// - offlineFps: frame rate of offline rendering, 0 means real time
+// - offlineFrames: number of frames to render offline, 0 means no limit
+// - timeScale: speed of simulated time in real time
+// ================================================
+SimClock *simClock;
+double offlineFps = 0.0;
+int offlineFrames = 0;
+double timeScale = 1.0;
+
 // Common transformation matrix
 mat4 model, view, projection;
 
-// For reflection texture
-float verticalAngleReflect;
-float horizontalAngleReflect;
-vec3 eyePointReflect;
-mat4 reflectV;
+// For reflection textures
+// - The mirrored camera of every water plane looks this way
+vec3 eyeDirectionReflect, upReflect;
 
 // ================================================
 // 3D models
 // ================================================
 Skybox *skybox;
 Water *water;
-Mesh *name;
-Mesh *scene;
+
+// Objects placed by the scene file
+// - Objects do not move, so their instances stay on the GPU
+Scene *scene;
+string sceneFile = "./mesh/default.scene";
+
+// (Option) Point lights scattered over the water, in addition to the scene file
+int numLamps = 0;
+
+// Environment probe for far-field reflection
+Probe *probe;
+
+// Occlusion culling, one depth buffer per view
+// - NULL if occlusion culling is off
+bool isOcclusion = false;
+OcclusionBuffer *mainOcclusion = NULL;
+OcclusionBuffer *reflectOcclusion = NULL;
+
+// Cull and submit instances on the GPU (needs OpenGL 4.3)
+bool isGpuCull = false;
+
+// Extra LODs for the probe, refraction and reflection passes
+// - Distortion hides their detail anyway
+int waterLodBias = 1;
+
+// Textures streamed by mip level, within a memory budget in MB
+TextureStreamer *texStreamer;
+float texBudget = 256.f;
+
+// Render targets of the water passes, and formats set on the command line
+RenderTargetPool *targetPool;
+vector<pair<string, string>> targetFormats;
+
+// ================================================
+// Dynamic resolution
+// - frameBudget: GPU frame time budget in milliseconds,
+//   0 means rendering the main pass to the window directly
+// - maxSamples: highest MSAA level of the main pass
+// ================================================
+DynamicResolution *dynRes = NULL;
+float frameBudget = 0.f;
+int maxSamples = 4;
+
+// Fraction of the water textures rendered this frame
+float texScale = 1.f;
+
+// Refract a copy of the main pass instead of rendering a refraction pass
+bool isScreenRefract = false;
+
+// Reflect by tracing rays through the same copy instead of rendering a reflection pass
+bool isScreenReflect = false;
+
+// ================================================
+// Temporal reuse of water textures
+// - Reflection and refraction are re-rendered every N frames,
+//   or when the camera moves too much
+// - In the frames between, the water shader reprojects them
+// - Settings for the caches of every water plane
+// ================================================
+TemporalCache reflectCache, refractCache;
+
+// ================================================
+// Water planes
+// - maxWaterPlanes: planes holding reflection and refraction targets
+// - maxWaterUpdates: planes rendered again per frame
+// ================================================
+int maxWaterPlanes = 4;
+int maxWaterUpdates = 2;
 
 // ================================================
 // Lighting
@@ -48,255 +221,1398 @@ float lightPower = 12.f;
 // ================================================
 // Function declarations
 // ================================================
-void computeMatricesFromInputs();
+void parseArgs(int, char **);
+void printUsage(const char *);
+void runSerial();
+void runThreaded();
+void renderLoop();
+void prepareFrame(FrameState &);
+void drawFrame(const FrameState &);
+void applyFrame(const FrameState &);
+void saveFrame();
+bool isOfflineDone();
+void runBatch();
+void runServer();
+bool runRegress();
+bool isHeadless();
+vector<Pose> loadPoses(const string);
+void preparePose(const Pose &, long, FrameState &);
+void computeCameras(vec3, float, float, float, float, FrameState &);
+void renderFrame();
+void renderProbe();
+void renderRefraction(int);
+mat4 renderReflection(int);
+mat4 reflectView(float, vec3 &);
+void renderMain();
+void markPass(Metrics::Timing);
+void readInputs(InputFrame &);
+void replayInputs(InputFrame &);
+void applyInputs(const InputFrame &);
+void simulate(float);
+void computeMatrices(float, FrameState &);
 void keyCallback(GLFWwindow *, int, int, int, int);
 void init();
 void initGL();
 void initOther();
 void initMatrix();
 void initMesh();
+void initTarget();
+void initClock();
+void initInputs();
+void initMetrics();
+
+// ================================================
+// Main function
+// ================================================
+int main(int argc, char **argv)
+{
+    // Command line options
+    parseArgs(argc, argv);
+
+    // Initializations
+    init();
+
+    // A rough way to solve cursor position initialization problem
+    // Must call glfwPollEvents once to activate glfwSetCursorPos
+    // This is a glfw mechanism problem
+    glfwPollEvents();
+    glfwSetCursorPos(mainWindow, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
+
+    // Loop until the user closes the mainWindow
+    int status = EXIT_SUCCESS;
+    if (!regressFile.empty())
+    {
+        status = runRegress() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (!batchFile.empty())
+    {
+        runBatch();
+    }
+    else if (!socketPath.empty())
+    {
+        runServer();
+    }
+    else if (isThreaded)
+    {
+        runThreaded();
+    }
+    else
+    {
+        runSerial();
+    }
+
+    // Release resources
+    // - OpenGL objects must be deleted before the context
+    delete capture;
+    delete mainOcclusion;
+    delete reflectOcclusion;
+    delete dynRes;
+    delete probe;
+    delete simClock;
+    delete water;
+    delete skybox;
+    delete scene;
+    delete texStreamer;
+    delete targetPool;
+    delete passTimer;
+
+    // Close the input log, or report the frame times of its replay
+    if (inputLog && inputLog->isReplaying())
+    {
+        inputLog->report();
+    }
+    delete inputLog;
+
+    // Write the metrics file a last time
+    Metrics::stop();
+
+    // Objects still alive are leaks
+    if (Resources::reportLeaks())
+    {
+        Resources::report();
+    }
+    glfwTerminate();
+    FreeImage_DeInitialise();
+
+    return status;
+}
+
+// ================================================
+// Prepare and render frames one after another
+// ================================================
+void runSerial()
+{
+    while (!glfwWindowShouldClose(mainWindow))
+    {
+        FrameState frame;
+        prepareFrame(frame);
+        drawFrame(frame);
+
+        // Stop after the requested number of offline frames
+        if (isOfflineDone())
+        {
+            glfwSetWindowShouldClose(mainWindow, GLFW_TRUE);
+        }
+
+        // Handle events
+        glfwPollEvents();
+    }
+}
+
+// ================================================
+// Prepare frames on this (main) thread,
+// and render them on a render thread
+// - GLFW events can only be handled on the main thread
+// - The render thread owns the OpenGL context
+// - Frame N + 1 is prepared while frame N is rendered
+// ================================================
+void runThreaded()
+{
+    // Hand the OpenGL context over to the render thread
+    glfwMakeContextCurrent(NULL);
+    isRunning = true;
+    thread renderThread(renderLoop);
+
+    long framesPublished = 0;
+
+    while (!glfwWindowShouldClose(mainWindow))
+    {
+        prepareFrame(frames.writeSlot());
+
+        // Wait until the render thread has taken the last frame,
+        // so that no frame is dropped
+        while (framesConsumed.load() < framesPublished)
+        {
+            glfwWaitEventsTimeout(0.001);
+        }
+
+        frames.publish();
+        framesPublished++;
+
+        // Stop after the requested number of offline frames
+        if (isOfflineDone())
+        {
+            glfwSetWindowShouldClose(mainWindow, GLFW_TRUE);
+        }
+
+        // Handle events
+        glfwPollEvents();
+    }
+
+    // Let the render thread take the last frame, then stop it
+    while (framesConsumed.load() < framesPublished)
+    {
+        this_thread::yield();
+    }
+    isRunning = false;
+    renderThread.join();
+
+    // Take the context back for releasing resources
+    glfwMakeContextCurrent(mainWindow);
+}
+
+// ================================================
+// Render thread
+// ================================================
+void renderLoop()
+{
+    glfwMakeContextCurrent(mainWindow);
+
+    while (isRunning.load())
+    {
+        if (!frames.fetch())
+        {
+            this_thread::sleep_for(chrono::microseconds(100));
+            continue;
+        }
+        framesConsumed++;
+
+        drawFrame(frames.readSlot());
+    }
+
+    glfwMakeContextCurrent(NULL);
+}
+
+// ================================================
+// Prepare a frame
+// - Read inputs, simulate and compute matrices
+// - Runs on the main thread, touches no OpenGL state
+// ================================================
+void prepareFrame(FrameState &frame)
+{
+    // Inputs of this frame, live or replayed
+    InputFrame input;
+    if (inputLog && inputLog->isReplaying())
+    {
+        replayInputs(input);
+    }
+    else
+    {
+        readInputs(input);
+    }
+    if (inputLog)
+    {
+        inputLog->write(input);
+    }
+
+    // View control
+    // - Offline renders do not depend on live inputs
+    if (simClock->fps <= 0.0)
+    {
+        applyInputs(input);
+    }
+
+    // Fixed simulation steps, then interpolate between the last two
+    int steps = simClock->advance(input.time);
+    for (int i = 0; i < steps; i++)
+    {
+        simulate(float(simClock->step));
+    }
+    computeMatrices(simClock->alpha, frame);
+
+    frame.frame = simClock->frame;
+    frame.time = simClock->target;
+
+    // Render settings
+    frame.isSkyLookup = skyLookup;
+    frame.isProbeReflect = probeReflect;
+    frame.isLineMode = lineMode;
+    frame.isSave = saveTrigger;
+    frame.isPrintInfo = printInfo;
+    printInfo = false;
+}
+
+// ================================================
+// Render a prepared frame and show it
+// - Runs on the thread owning the OpenGL context
+// ================================================
+void drawFrame(const FrameState &frame)
+{
+    applyFrame(frame);
+
+    // Start measuring GPU time
+    if (dynRes)
+    {
+        dynRes->beginFrame();
+    }
+
+    // Render all passes
+    renderFrame();
+
+    // Upscale to the window and adjust resolution for next frames
+    if (dynRes)
+    {
+        dynRes->present();
+        dynRes->endFrame();
+    }
+
+    // (Option) Save frame
+    // - Read the back buffer before it is swapped
+    if (frame.isSave)
+    {
+        saveFrame();
+    }
+
+    // Update frame
+    glfwSwapBuffers(mainWindow);
+
+    // Frames shown late, unless frames are meant to be rendered as fast as possible
+    double shownTime = glfwGetTime();
+    if (passTimer && lastShownTime >= 0.0 && offlineFps <= 0.0 && !isUnthrottled)
+    {
+        Metrics::observe(Metrics::FRAME_INTERVAL, shownTime - lastShownTime);
+        if (shownTime - lastShownTime > 1.5 * refreshInterval)
+        {
+            Metrics::add(Metrics::DROPPED_FRAMES);
+        }
+    }
+    lastShownTime = shownTime;
+
+    // Write images whose readback has finished
+    capture->collect();
+
+    if (frame.isPrintInfo)
+    {
+        if (scene->gpuCuller)
+        {
+            std::cout << "instances: " << scene->numInstances() << " (culled on the GPU)" << endl;
+        }
+        else
+        {
+            std::cout << "visible instances: " << scene->numVisible << " / " << scene->numInstances() << endl;
+        }
+        if (mainOcclusion)
+        {
+            std::cout << "occluded: " << mainOcclusion->numOccluded << " / " << mainOcclusion->numTested << ", "
+                      << "occluder triangles: " << mainOcclusion->numTriangles << endl;
+        }
+        std::cout << "texture memory: " << texStreamer->residentBytes / (1024 * 1024) << " / "
+                  << texStreamer->budget / (1024 * 1024) << " MB" << endl;
+        ImageIngest::report();
+        std::cout << "lights: " << scene->lights->lights.size() << ", at most " << scene->lights->maxClusterLights()
+                  << " in a cluster of the last build" << endl;
+        std::cout << "water: " << water->numVisibleBodies << " / " << water->bodies.size() << " bodies, "
+                  << water->numVisiblePlanes << " / " << water->planes.size() << " planes visible" << endl;
+        std::cout << "render targets: " << targetPool->totalBytes / (1024 * 1024) << " MB in "
+                  << targetPool->targets.size() << " targets, " << targetPool->usedBytes / (1024 * 1024)
+                  << " MB held between frames" << endl;
+        std::cout << "GPU memory: " << Resources::gpuBytes() / (1024 * 1024) << " MB (press M for details)" << endl;
+        for (size_t i = 0; i < scene->streams.size(); i++)
+        {
+            MeshStream *stream = scene->streams[i];
+            std::cout << "streamed chunks: " << stream->numDrawn << " drawn, " << stream->numResident() << " / "
+                      << stream->numSlots << " slots, " << stream->chunks.size() << " in file" << endl;
+        }
+    }
+
+    if (frame.isPrintInfo && dynRes)
+    {
+        std::cout << "scale: " << dynRes->scale << ", "
+                  << "samples: " << dynRes->samples << ", "
+                  << "GPU time: " << dynRes->gpuTimeAvg << " ms" << endl;
+    }
+}
+
+// ================================================
+// Copy a prepared frame into the render state
+// ================================================
+void applyFrame(const FrameState &frame)
+{
+    // Cameras
+    view = frame.view;
+    projection = frame.projection;
+    eyePoint = frame.eyePoint;
+    eyeDirection = frame.eyeDirection;
+    eyeDirectionReflect = frame.eyeDirectionReflect;
+    upReflect = frame.upReflect;
+
+    // Water animation
+    water->dudvMoveRender = frame.dudvMove;
+
+    // The reflection textures are rendered differently now
+    if (frame.isSkyLookup != water->isSkyLookup)
+    {
+        water->isSkyLookup = frame.isSkyLookup;
+        water->invalidateReflections();
+    }
+
+    // Render all faces again, the probe was not updated while off
+    // The reflection textures were not updated while the probe was on
+    if (frame.isProbeReflect != water->isProbeReflect)
+    {
+        water->isProbeReflect = frame.isProbeReflect;
+        probe->isComplete = false;
+        water->invalidateReflections();
+    }
+
+    glPolygonMode(GL_FRONT_AND_BACK, frame.isLineMode ? GL_LINE : GL_FILL);
+
+    // Number saved frames from 0 whenever saving starts
+    if (frame.isSave && !wasSaving)
+    {
+        frameNumber = 0;
+    }
+    wasSaving = frame.isSave;
+}
+
+// ================================================
+// Render every pose of the pose file to an image
+// - Resources are loaded once for all views
+// - Readback of view N overlaps rendering of view N + 1,
+//   and images are written on the writer thread
+// ================================================
+void runBatch()
+{
+    vector<Pose> poses = loadPoses(batchFile);
+
+    int w = batchWidth > 0 ? batchWidth : fbWidth;
+    int h = batchHeight > 0 ? batchHeight : fbHeight;
+    capture->initTarget(w, h, maxSamples);
+
+    // The main pass renders to the capture target
+    mainFbo = capture->fboTarget;
+    mainWidth = w;
+    mainHeight = h;
+
+    double startTime = glfwGetTime();
+
+    for (size_t i = 0; i < poses.size(); i++)
+    {
+        FrameState frame;
+        preparePose(poses[i], long(i), frame);
+
+        applyFrame(frame);
+        renderFrame();
+
+        // Zero padding
+        // e.g. "view00001.png"
+        string num = to_string(i);
+        num = string(num.length() < 5 ? 5 - num.length() : 0, '0') + num;
+        capture->read(capture->resolveTarget(), w, h, outDir + "/view" + num + "." + outFormat);
+
+        // Write views whose readback has finished
+        capture->collect();
+    }
+
+    capture->finish();
+
+    std::cout << poses.size() << " views rendered in " << glfwGetTime() - startTime << " s." << '\n';
+}
+
+// ================================================
+// Render requests from clients of the render server
+// - The context, shaders, meshes and textures stay resident,
+//   so a request only costs its own rendering and readback
+// - The offscreen target is only reallocated when the size changes
+// ================================================
+void runServer()
+{
+    RenderServer server(socketPath);
+    if (!server.start())
+    {
+        return;
+    }
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+    server.maxSize = maxSize;
+
+    RenderServer::Request request;
+    long index = 0;
+
+    while (server.receive(request))
+    {
+        int w = request.width;
+        int h = request.height;
+
+        if (w != capture->width || h != capture->height)
+        {
+            capture->initTarget(w, h, maxSamples);
+
+            // The main pass renders to the capture target
+            mainFbo = capture->fboTarget;
+            mainWidth = w;
+            mainHeight = h;
+        }
+
+        FrameState frame;
+        preparePose(request.pose, index++, frame);
+
+        applyFrame(frame);
+        renderFrame();
+
+        // Pixels are read straight into shared memory
+        unsigned char *pixels = server.reserve(size_t(w) * h * 4);
+        if (!pixels)
+        {
+            server.replyError("no shared memory");
+            continue;
+        }
+        capture->readNow(capture->resolveTarget(), w, h, pixels);
+
+        size_t bytes = server.encode(request.format, w, h);
+        if (bytes == 0)
+        {
+            server.replyError("encoding failed");
+            continue;
+        }
+
+        server.reply(bytes, w, h);
+    }
+}
+
+// ================================================
+// Render every case of the regression suite and compare it
+// - Images are compared with the golden images, and frame times
+//   (median of the timed frames, until the GPU is done) with the baselines
+// - Rendered images and the diff images of failed cases go to outDir
+// - With --update-golden, the images and times become the new golden ones
+// Return: false if a case failed
+// ================================================
+bool runRegress()
+{
+    RegressionSuite suite;
+    if (!suite.load(regressFile))
+    {
+        return false;
+    }
+
+    // The golden directory is created with the first golden images
+    if (isUpdateGolden)
+    {
+        mkdir(suite.goldenDir.c_str(), 0755);
+    }
+
+    int w = suite.width, h = suite.height;
+
+    // No MSAA, so that images do not depend on the sample pattern of the driver
+    capture->initTarget(w, h, 0);
+    mainFbo = capture->fboTarget;
+    mainWidth = w;
+    mainHeight = h;
+
+    vector<unsigned char> pixels(size_t(w) * h * 4), golden, diff(size_t(w) * h * 4);
+    map<string, float> times;
+    int numFailed = 0;
+
+    for (size_t i = 0; i < suite.cases.size(); i++)
+    {
+        const RegressionSuite::Case &c = suite.cases[i];
+
+        FrameState frame;
+        preparePose(c.pose, long(i), frame);
+        applyFrame(frame);
+
+        // Warm-up frames wait for mip levels and are not timed
+        vector<float> frameMs;
+        for (int k = 0; k < suite.warmup + suite.repeat; k++)
+        {
+            double startTime = glfwGetTime();
+            renderFrame();
+            glFinish();
+            if (k >= suite.warmup)
+            {
+                frameMs.push_back(float((glfwGetTime() - startTime) * 1000.0));
+            }
+        }
+        float ms = RegressionSuite::median(frameMs);
+        times[c.name] = ms;
+
+        capture->readNow(capture->resolveTarget(), w, h, pixels.data());
+        Capture::save(outDir + "/" + c.name + ".png", pixels.data(), w, h);
+
+        if (isUpdateGolden)
+        {
+            if (!Capture::save(suite.goldenDir + "/" + c.name + ".png", pixels.data(), w, h))
+            {
+                std::cout << "FAIL " << c.name << ": can't write the golden image" << '\n';
+                numFailed++;
+                continue;
+            }
+            std::cout << "UPDATED " << c.name << ": " << ms << " ms" << '\n';
+            continue;
+        }
+
+        if (!suite.readGolden(c.name, golden))
+        {
+            std::cout << "FAIL " << c.name << ": no golden image in " << suite.goldenDir << '\n';
+            numFailed++;
+            continue;
+        }
+
+        RegressionSuite::Result result = suite.compare(pixels.data(), golden.data(), diff.data());
+        bool isImageOk = result.badFraction <= suite.maxBad;
+        bool isSlow = suite.isSlower(c.name, ms);
+        if (!isImageOk)
+        {
+            Capture::save(outDir + "/" + c.name + "-diff.png", diff.data(), w, h);
+        }
+
+        std::cout << (isImageOk && !isSlow ? "PASS " : "FAIL ") << c.name << ": " << result.numBad
+                  << " pixels differ (" << result.badFraction * 100.f << "%), max " << result.maxDiff << ", PSNR "
+                  << result.psnr << " dB, " << ms << " ms";
+        if (suite.baselines.count(c.name))
+        {
+            std::cout << " (baseline " << suite.baselines[c.name] << " ms" << (isSlow ? ", too slow" : "") << ")";
+        }
+        std::cout << '\n';
+
+        if (!isImageOk || isSlow)
+        {
+            numFailed++;
+        }
+    }
+
+    if (isUpdateGolden)
+    {
+        return suite.saveBaselines(times) && numFailed == 0;
+    }
+
+    std::cout << suite.cases.size() - numFailed << " / " << suite.cases.size() << " cases passed." << '\n';
+    return numFailed == 0;
+}
+
+// ================================================
+// Read camera poses
+// Parameters:
+//   1. fileName: pose file, one pose per line
+//      "eyeX eyeY eyeZ verticalAngle horizontalAngle fov time",
+//      empty lines and lines starting with '#' are skipped
+// Return: poses in file order
+// ================================================
+vector<Pose> loadPoses(const string fileName)
+{
+    vector<Pose> poses;
+
+    ifstream in(fileName.c_str());
+    if (!in)
+    {
+        std::cout << "Can't read pose file " << fileName << '\n';
+        return poses;
+    }
+
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        Pose pose;
+        stringstream ss(line);
+        ss >> pose.eyePoint.x >> pose.eyePoint.y >> pose.eyePoint.z >> pose.verticalAngle >> pose.horizontalAngle >>
+            pose.fov >> pose.time;
+
+        if (ss.fail())
+        {
+            std::cout << "Skipping bad pose: " << line << '\n';
+            continue;
+        }
+
+        poses.push_back(pose);
+    }
+
+    return poses;
+}
+
+// ================================================
+// Prepare a frame from a camera pose
+// Parameters:
+//   1. pose: camera pose and time
+//   2. index: frame number
+//   3. frame: frame to prepare
+// ================================================
+void preparePose(const Pose &pose, long index, FrameState &frame)
+{
+    computeCameras(pose.eyePoint, pose.verticalAngle, pose.horizontalAngle, pose.fov,
+                   1.f * mainWidth / mainHeight, frame);
+
+    frame.frame = index;
+    frame.time = pose.time;
+    frame.dudvMove = water->dudvMoveAt(pose.time);
+
+    // Render settings
+    frame.isSkyLookup = skyLookup;
+    frame.isProbeReflect = probeReflect;
+    frame.isLineMode = false;
+    frame.isSave = false;
+    frame.isPrintInfo = false;
+}
+
+// ================================================
+// Save the window to an image
+// ================================================
+void saveFrame()
+{
+    string dir = "./result/output";
+
+    // Zero padding
+    // e.g. "output0001.bmp"
+    string num = to_string(frameNumber);
+    num = string(num.length() < 4 ? 4 - num.length() : 0, '0') + num;
+    string output = dir + num + ".bmp";
+
+    // The window framebuffer is twice the window size on macOS
+    // - The image is written later on the writer thread
+    capture->read(0, fbWidth, fbHeight, output);
+    std::cout << output << " saved." << '\n';
+    frameNumber++;
+}
+
+// ================================================
+// Batch, server and regression modes render offscreen only
+// ================================================
+bool isHeadless() { return !batchFile.empty() || !socketPath.empty() || !regressFile.empty(); }
+
+// ================================================
+// Have all offline frames, or all replayed frames, been prepared
+// ================================================
+bool isOfflineDone()
+{
+    if (inputLog && inputLog->isReplaying())
+    {
+        return inputLog->next >= inputLog->frames.size();
+    }
+    return offlineFps > 0.0 && offlineFrames > 0 && simClock->frame >= offlineFrames;
+}
+
+// ================================================
+// Render one frame
+// - Render targets of the water surface first,
+//   then the main pass that samples them
+// ================================================
+void renderFrame()
+{
+    // GPU time of the passes below
+    if (passTimer)
+    {
+        passTimer->beginFrame();
+    }
+
+    // Fraction of the water textures to render this frame
+    texScale = dynRes ? dynRes->scale : 1.f;
+    water->texScale = texScale;
+
+    // Targets no pass asked for recently are deleted
+    targetPool->beginFrame();
+
+    // Streamed chunks are chosen by the main camera
+    scene->updateStreams(projection * view, eyePoint);
+
+    // Water bodies seen by the main camera, and the planes holding targets
+    water->cull(projection * view, eyePoint);
+
+    // Mip levels needed by this frame
+    // - The sky may be seen larger in the water textures than in the main pass
+    skybox->streamTexture(projection, std::max(mainHeight, int(WINDOW_HEIGHT * 2 * texScale)));
+    water->streamTextures(projection, eyePoint, mainHeight);
+    texStreamer->update();
+    markPass(Metrics::PASS_STREAM);
+
+    // Far-field reflection source
+    if (water->isProbeReflect)
+    {
+        renderProbe();
+        markPass(Metrics::PASS_PROBE);
+    }
+
+    // Refraction camera is the main camera
+    // - With screen-space refraction, the main pass fills the refraction textures
+    //   of the nearest plane, which every plane uses
+    if (isScreenRefract && water->copyPlane >= 0)
+    {
+        water->planes[water->copyPlane].refractCache.VP = projection * view;
+    }
+
+    // Distinct visible planes, within the budget of updates per frame
+    // - The probe and screen-space reflection replace the planar reflection
+    vector<int> updates = water->updateOrder(eyePoint, eyeDirection, texScale);
+    for (size_t i = 0; i < updates.size(); i++)
+    {
+        Water::Plane &plane = water->planes[updates[i]];
+
+        if (!isScreenRefract)
+        {
+            if (plane.refractCache.needsRefresh(eyePoint, eyeDirection, texScale))
+            {
+                renderRefraction(updates[i]);
+                markPass(Metrics::PASS_REFRACTION);
+                plane.refractCache.refresh(view, projection, eyePoint, eyeDirection, texScale);
+            }
+            else
+            {
+                plane.refractCache.skip();
+            }
+        }
+
+        if (!water->isProbeReflect && !isScreenReflect)
+        {
+            if (plane.reflectCache.needsRefresh(eyePoint, eyeDirection, texScale))
+            {
+                mat4 reflectV = renderReflection(updates[i]);
+                markPass(Metrics::PASS_REFLECTION);
+                plane.reflectCache.refresh(reflectV, projection, eyePoint, eyeDirection, texScale);
+            }
+            else
+            {
+                plane.reflectCache.skip();
+            }
+        }
+    }
+
+    renderMain();
+    markPass(Metrics::PASS_MAIN);
+
+    Metrics::add(Metrics::FRAMES);
+    if (passTimer)
+    {
+        passTimer->endFrame();
+        Metrics::set(Metrics::STREAMED_TEXTURE_BYTES, (long long)texStreamer->residentBytes);
+        Metrics::set(Metrics::CAPTURE_QUEUE, capture->queueDepth());
+    }
+}
+
+// ================================================
+// End a pass measured for the metrics
+// Parameters:
+//   1. pass: PASS_* timing of the pass
+// ================================================
+void markPass(Metrics::Timing pass)
+{
+    if (passTimer)
+    {
+        passTimer->mark(pass);
+    }
+}
+
+// ================================================
+// Render to environment probe
+// - Only a few cubemap faces are updated per frame,
+//   so the cost of the probe is constant
+// ================================================
+void renderProbe()
+{
+    // Config clipping planes
+    glDisable(GL_CLIP_DISTANCE0);
+    glDisable(GL_CLIP_DISTANCE1);
+
+    for (int k = probe->facesToUpdate(); k > 0; k--)
+    {
+        int face = probe->bindFace();
+        mat4 faceV = probe->faceView(face);
+
+        // Draw scene
+        skybox->draw(model, faceV, probe->P, probe->position);
+        scene->draw(faceV, probe->P, probe->position, lightColor, lightPosition, vec4(0.f), NULL, waterLodBias);
+
+        probe->finishFace();
+    }
+}
+
+// ================================================
+// Render to refraction texture of a water plane
+// Parameters:
+//   1. index: index of the plane
+// ================================================
+void renderRefraction(int index)
+{
+    water->bindRefraction(index, int(WINDOW_WIDTH * 2 * texScale), int(WINDOW_HEIGHT * 2 * texScale));
+
+    // For user-defined framebuffer,
+    // must clear the depth buffer before rendering to enable depth test
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    // Config clipping planes
+    glEnable(GL_CLIP_DISTANCE0);
+    glDisable(GL_CLIP_DISTANCE1);
+
+    vec4 clipPlane0 = vec4(0, -1, 0, water->planes[index].height);
+
+    scene->setClipPlane0(clipPlane0);
+
+    // Draw scene
+    skybox->draw(model, view, projection, eyePoint);
+    scene->draw(view, projection, eyePoint, lightColor, lightPosition, clipPlane0, NULL, waterLodBias);
+}
+
+// ================================================
+// Render to reflection texture of a water plane
+// Parameters:
+//   1. index: index of the plane
+// Return: view matrix of the reflection camera
+// ================================================
+mat4 renderReflection(int index)
+{
+    float height = water->planes[index].height;
+    vec3 eyePointReflect;
+    mat4 reflectV = reflectView(height, eyePointReflect);
+
+    water->bindReflection(index, int(WINDOW_WIDTH * 2 * texScale), int(WINDOW_HEIGHT * 2 * texScale));
+
+    // For user-defined framebuffer,
+    // must clear the depth buffer before rendering to enable depth test
+    // With sky lookup, also clear the coverage (alpha) of the last frame
+    if (water->isSkyLookup)
+    {
+        glClearColor(0.f, 0.f, 0.f, 0.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+    else
+    {
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    // Config clipping planes
+    glDisable(GL_CLIP_DISTANCE0);
+    glEnable(GL_CLIP_DISTANCE1);
+
+    // For reflection texture,
+    // the eye point and direction are symmetric to xz-plane
+    // So we must change the view matrix for the scene
+    // Note: plane (0, 1, 0, D) means plane y = -D, not y = D
+    vec4 clipPlane1 = vec4(0.f, 1.f, 0.f, -height + 0.125f);
+
+    scene->setClipPlane1(clipPlane1);
+
+    // Draw scene
+    // - With sky lookup, the water shader resolves the sky from the cubemap
+    if (!water->isSkyLookup)
+    {
+        skybox->draw(model, reflectV, projection, eyePointReflect);
+    }
+
+    // When looking from underwater to sky,
+    // the back faces of an object may be seen
+    // By default, back faces are culled by OpenGL
+    // This results in artifacts
+    // Therefore, only disable culling face when drawing objects.
+    glDisable(GL_CULL_FACE);
+    scene->draw(reflectV, projection, eyePoint, lightColor, lightPosition, clipPlane1, reflectOcclusion,
+                waterLodBias);
+    glEnable(GL_CULL_FACE);
+
+    water->finishReflection(index);
+
+    return reflectV;
+}
+
+// ================================================
+// Camera mirrored by a water plane
+// - The eye point and direction are symmetric to the plane
+// Parameters:
+//   1. height: height of the plane
+//   2. eyeReflect: mirrored eye point (output)
+// Return: view matrix of the mirrored camera
+// ================================================
+mat4 reflectView(float height, vec3 &eyeReflect)
+{
+    eyeReflect = vec3(eyePoint.x, 2.f * height - eyePoint.y, eyePoint.z);
+    return lookAt(eyeReflect, eyeReflect + eyeDirectionReflect, upReflect);
+}
+
+// ================================================
+// Render to main screen
+// - Must change back to the original view matrix
+// - With dynamic resolution, render to an offscreen target
+//   and upscale it to the window afterwards
+// ================================================
+void renderMain()
+{
+    if (dynRes)
+    {
+        dynRes->bindScene();
+    }
+    else
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, mainFbo);
+        glViewport(0, 0, mainWidth, mainHeight);
+    }
+
+    // Clear frame
+    glClearColor(97 / 256.f, 175 / 256.f, 239 / 256.f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Config clipping planes
+    glDisable(GL_CLIP_DISTANCE0);
+    glDisable(GL_CLIP_DISTANCE1);
+
+    // Draw scene
+    skybox->draw(model, view, projection, eyePoint);
+    scene->draw(view, projection, eyePoint, lightColor, lightPosition, vec4(0.f), mainOcclusion);
+
+    // All opaque geometry is drawn, the water refracts what is seen so far
+    if (isScreenRefract)
+    {
+        if (dynRes)
+        {
+            water->copyRefraction(dynRes->fboScene, dynRes->sceneWidth(), dynRes->sceneHeight());
+        }
+        else
+        {
+            water->copyRefraction(mainFbo, mainWidth, mainHeight);
+        }
+    }
+
+    // Visible water bodies
+    water->draw(view, projection, eyePoint, lightColor, lightPosition);
+}
+
+// ================================================
+// Parse command line options
+// - --dynres <ms>: enable dynamic resolution with a GPU frame budget
+// - --msaa <n>: highest MSAA level with dynamic resolution
+// - --offline <fps>: deterministic offline rendering, saving every frame
+// - --frames <n>: stop offline rendering after n frames
+// - --time-scale <s>: speed of simulated time in real time
+// - --batch <file>: render every camera pose of a pose file and exit
+// - --out <dir>, --format <ext>: output of batch views
+// - --size <w> <h>: size of batch views
+// - --serve <socket>: render requests from a Unix domain socket
+// - --regress <file>: render a regression suite, compare it and exit
+// - --update-golden: store the images and times of the suite as golden
+// - --scene <file>: scene file to load
+// - --occlusion: cull instances hidden by occluder meshes
+// - --gpu-cull: cull and submit instances on the GPU (OpenGL 4.3)
+// - --lod-bias <n>: extra LODs for the water passes
+// - --lamps <n>: scatter n point lights over the water
+// - --tex-budget <MB>: memory budget of streamed textures
+// - --target-format <name> <format>: format of a water render target
+// - --ss-refraction: refract a copy of the main pass
+// - --ssr: reflect by tracing rays through a copy of the main pass
+// - --threaded: prepare and render frames on separate threads
+// - --reproject <n>: render reflection every n frames
+// - --reproject-refraction <n>: render refraction every n frames
+// - --water-planes <n>: water planes holding render targets at once
+// - --water-updates <n>: water planes rendered per frame
+// - --record <file>: write the inputs of this session to a log
+// - --replay <file>: replay the inputs of a log and report frame times
+// - --unthrottled: replay as fast as possible
+// - --metrics <file>: write metrics in the Prometheus text format to a file
+// - --metrics-port <n>: answer Prometheus scrapes on a local port
+// - --metrics-interval <s>: time between writes of the metrics file
+// ================================================
+void parseArgs(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        // Numbers that can't be parsed are reported like unknown options
+        try
+        {
+            if (arg == "--dynres" && i + 1 < argc)
+            {
+                frameBudget = stof(argv[++i]);
+            }
+            else if (arg == "--msaa" && i + 1 < argc)
+            {
+                maxSamples = stoi(argv[++i]);
+            }
+            else if (arg == "--offline" && i + 1 < argc)
+            {
+                offlineFps = stod(argv[++i]);
+            }
+            else if (arg == "--frames" && i + 1 < argc)
+            {
+                offlineFrames = stoi(argv[++i]);
+            }
+            else if (arg == "--time-scale" && i + 1 < argc)
+            {
+                timeScale = stod(argv[++i]);
+            }
+            else if (arg == "--batch" && i + 1 < argc)
+            {
+                batchFile = argv[++i];
+            }
+            else if (arg == "--out" && i + 1 < argc)
+            {
+                outDir = argv[++i];
+            }
+            else if (arg == "--format" && i + 1 < argc)
+            {
+                outFormat = argv[++i];
+            }
+            else if (arg == "--size" && i + 2 < argc)
+            {
+                batchWidth = stoi(argv[++i]);
+                batchHeight = stoi(argv[++i]);
+            }
+            else if (arg == "--serve" && i + 1 < argc)
+            {
+                socketPath = argv[++i];
+            }
+            else if (arg == "--regress" && i + 1 < argc)
+            {
+                regressFile = argv[++i];
+            }
+            else if (arg == "--update-golden")
+            {
+                isUpdateGolden = true;
+            }
+            else if (arg == "--scene" && i + 1 < argc)
+            {
+                sceneFile = argv[++i];
+            }
+            else if (arg == "--occlusion")
+            {
+                isOcclusion = true;
+            }
+            else if (arg == "--gpu-cull")
+            {
+                isGpuCull = true;
+            }
+            else if (arg == "--lod-bias" && i + 1 < argc)
+            {
+                waterLodBias = stoi(argv[++i]);
+            }
+            else if (arg == "--lamps" && i + 1 < argc)
+            {
+                numLamps = stoi(argv[++i]);
+            }
+            else if (arg == "--tex-budget" && i + 1 < argc)
+            {
+                texBudget = stof(argv[++i]);
+            }
+            else if (arg == "--target-format" && i + 2 < argc)
+            {
+                string name = argv[++i];
+                targetFormats.push_back(make_pair(name, string(argv[++i])));
+            }
+            else if (arg == "--ss-refraction")
+            {
+                isScreenRefract = true;
+            }
+            else if (arg == "--ssr")
+            {
+                // Rays are traced through the copy made for screen-space refraction
+                isScreenReflect = true;
+                isScreenRefract = true;
+            }
+            else if (arg == "--threaded")
+            {
+                isThreaded = true;
+            }
+            else if (arg == "--reproject" && i + 1 < argc)
+            {
+                reflectCache.interval = stoi(argv[++i]);
+            }
+            else if (arg == "--reproject-refraction" && i + 1 < argc)
+            {
+                refractCache.interval = stoi(argv[++i]);
+            }
+            else if (arg == "--water-planes" && i + 1 < argc)
+            {
+                maxWaterPlanes = stoi(argv[++i]);
+            }
+            else if (arg == "--water-updates" && i + 1 < argc)
+            {
+                maxWaterUpdates = stoi(argv[++i]);
+            }
+            else if (arg == "--record" && i + 1 < argc)
+            {
+                recordFile = argv[++i];
+            }
+            else if (arg == "--replay" && i + 1 < argc)
+            {
+                replayFile = argv[++i];
+            }
+            else if (arg == "--unthrottled")
+            {
+                isUnthrottled = true;
+            }
+            else if (arg == "--metrics" && i + 1 < argc)
+            {
+                metricsFile = argv[++i];
+            }
+            else if (arg == "--metrics-port" && i + 1 < argc)
+            {
+                metricsPort = stoi(argv[++i]);
+            }
+            else if (arg == "--metrics-interval" && i + 1 < argc)
+            {
+                metricsInterval = stod(argv[++i]);
+            }
+            else
+            {
+                std::cout << "Unknown option: " << arg << '\n';
+                printUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        catch (const std::exception &)
+        {
+            std::cout << "Bad value for option: " << arg << '\n';
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
 // ================================================
-// Main function
+// Print the command line options
+// Parameters:
+//   1. program: name the program was run as
 // ================================================
-int main(int argc, char **argv)
+void printUsage(const char *program)
 {
-    // Initializations
-    init();
-
-    // A rough way to solve cursor position initialization problem
-    // Must call glfwPollEvents once to activate glfwSetCursorPos
-    // This is a glfw mechanism problem
-    glfwPollEvents();
-    glfwSetCursorPos(mainWindow, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
-
-    /* Loop until the user closes the mainWindow */
-    while (!glfwWindowShouldClose(mainWindow))
-    {
-        // Clear frame
-        glClearColor(97 / 256.f, 175 / 256.f, 239 / 256.f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        // View control
-        computeMatricesFromInputs();
-
-        // -------------------------------------------
-        // Render to refraction texture
-        // -------------------------------------------
-        glBindFramebuffer(GL_FRAMEBUFFER, water->fboRefract);
-
-        // For user-defined framebuffer,
-        // must clear the depth buffer before rendering to enable depth test
-        glClear(GL_DEPTH_BUFFER_BIT);
-
-        // Config clipping planes
-        glEnable(GL_CLIP_DISTANCE0);
-        glDisable(GL_CLIP_DISTANCE1);
-
-        vec4 clipPlane0 = vec4(0, -1, 0, Water::WATER_Y);
-
-        glUseProgram(name->shader);
-        glUniform4fv(name->uniClipPlane0, 1, value_ptr(clipPlane0));
-
-        glUseProgram(scene->shader);
-        glUniform4fv(scene->uniClipPlane0, 1, value_ptr(clipPlane0));
-
-        // Draw scene
-        skybox->draw(model, view, projection, eyePoint);
-
-        mat4 nameM = translate(mat4(1.f), vec3(7.f, 2.3f, 14.f));
-        nameM = scale(nameM, vec3(0.5f, 0.5f, 0.5f));
-        nameM = rotate(nameM, 3.14f / 2.f, vec3(1.f, 0.f, 0.f));
-        nameM = rotate(nameM, 3.14f / 2.f, vec3(0.f, 0.f, 1.f));
-        name->draw(nameM, view, projection, eyePoint, lightColor, lightPosition, 15, 16);
-
-        mat4 sceneM = translate(mat4(1.f), vec3(15.f, 1.5f, 12.f));
-        scene->draw(sceneM, view, projection, eyePoint, lightColor, lightPosition, 15, 16);
-
-        // -------------------------------------------
-        // Render to reflection texture
-        // -------------------------------------------
-        glBindFramebuffer(GL_FRAMEBUFFER, water->fboReflect);
-
-        // For user-defined framebuffer,
-        // must clear the depth buffer before rendering to enable depth test
-        glClear(GL_DEPTH_BUFFER_BIT);
-
-        // Config clipping planes
-        glDisable(GL_CLIP_DISTANCE0);
-        glEnable(GL_CLIP_DISTANCE1);
-
-        // For reflection texture,
-        // the eye point and direction are symmetric to xz-plane
-        // So we must change the view matrix for the scene
-        // Note: plane (0, 1, 0, D) means plane y = -D, not y = D
-        vec4 clipPlane1 = vec4(0.f, 1.f, 0.f, -Water::WATER_Y + 0.125f);
+    std::cout << "Usage: " << program << " [--dynres ms] [--msaa n] [--offline fps] [--frames n] [--time-scale s]"
+              << " [--threaded]"
+              << " [--batch file] [--out dir] [--format ext] [--size w h]"
+              << " [--serve socket] [--regress file] [--update-golden]"
+              << " [--scene file] [--occlusion] [--gpu-cull]"
+              << " [--lod-bias n] [--lamps n] [--tex-budget MB]"
+              << " [--target-format name format] [--ss-refraction] [--ssr]"
+              << " [--reproject n] [--reproject-refraction n]"
+              << " [--water-planes n] [--water-updates n]"
+              << " [--record file] [--replay file] [--unthrottled]"
+              << " [--metrics file] [--metrics-port n] [--metrics-interval s]" << '\n';
+}
 
-        glUseProgram(name->shader);
-        glUniform4fv(name->uniClipPlane1, 1, value_ptr(clipPlane1));
+// =======================================================
+// Read user inputs
+// - The cursor is put back at the center of the window every frame
+//   1. input: inputs of this frame (output)
+// =======================================================
+void readInputs(InputFrame &input)
+{
+    input.time = glfwGetTime();
 
-        glUseProgram(scene->shader);
-        glUniform4fv(scene->uniClipPlane1, 1, value_ptr(clipPlane1));
+    // Get mouse position
+    double xpos, ypos;
+    glfwGetCursorPos(mainWindow, &xpos, &ypos);
 
-        // Draw scene
-        skybox->draw(model, reflectV, projection, eyePointReflect);
+    // Reset mouse position for next frame
+    glfwSetCursorPos(mainWindow, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
 
-        // When looking from underwater to sky,
-        // the back faces of an object may be seen
-        // By default, back faces are culled by OpenGL
-        // This results in artifacts
-        // Therefore, only disable culling face when drawing objects.
-        glDisable(GL_CULL_FACE);
-        name->draw(nameM, reflectV, projection, eyePoint, lightColor, lightPosition, 15, 16);
-        scene->draw(sceneM, reflectV, projection, eyePoint, lightColor, lightPosition, 15, 16);
-        glEnable(GL_CULL_FACE);
-
-        // ------------------------------------------------
-        // Render to main screen
-        // - Must change back to the original view matrix
-        // ------------------------------------------------
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-        // Config clipping planes
-        glDisable(GL_CLIP_DISTANCE0);
-        glDisable(GL_CLIP_DISTANCE1);
+    // As the cursor is put at the center of the screen,
+    // (xpos - WINDOW_WIDTH/2.f) and (ypos - WINDOW_HEIGHT/2.f) are offsets
+    input.cursorX = float(xpos - WINDOW_WIDTH / 2.f);
+    input.cursorY = float(ypos - WINDOW_HEIGHT / 2.f);
 
-        // Draw scene
-        skybox->draw(model, view, projection, eyePoint);
-        name->draw(nameM, view, projection, eyePoint, lightColor, lightPosition, 15, 16);
-        scene->draw(sceneM, view, projection, eyePoint, lightColor, lightPosition, 15, 16);
+    input.keys = 0;
+    if (glfwGetKey(mainWindow, GLFW_KEY_W) == GLFW_PRESS)
+    {
+        input.keys |= InputLog::KEY_W;
+    }
+    if (glfwGetKey(mainWindow, GLFW_KEY_S) == GLFW_PRESS)
+    {
+        input.keys |= InputLog::KEY_S;
+    }
+    if (glfwGetKey(mainWindow, GLFW_KEY_D) == GLFW_PRESS)
+    {
+        input.keys |= InputLog::KEY_D;
+    }
+    if (glfwGetKey(mainWindow, GLFW_KEY_A) == GLFW_PRESS)
+    {
+        input.keys |= InputLog::KEY_A;
+    }
 
-        // Water surface tiling
-        Water::dudvMove += 0.0005f;
-        Water::dudvMove = fmod(Water::dudvMove, 1.0f);
+    // Render settings toggled by keys since the last frame
+    input.settings = (skyLookup ? InputLog::SETTING_SKY_LOOKUP : 0) |
+                     (probeReflect ? InputLog::SETTING_PROBE_REFLECT : 0) |
+                     (lineMode ? InputLog::SETTING_LINE_MODE : 0);
+}
 
-        for (size_t i = 0; i < 15; i++)
+// =======================================================
+// Take the inputs of the next recorded frame
+// - Unless unthrottled, wait until as much time has passed
+//   since the first frame as in the recording
+//   1. input: inputs of this frame (output)
+// =======================================================
+void replayInputs(InputFrame &input)
+{
+    if (!isUnthrottled && inputLog->next < inputLog->frames.size())
+    {
+        if (replayStartTime < 0.0)
         {
-            for (size_t j = 0; j < 15; j++)
-            {
-                mat4 tempM = translate(mat4(1.0), vec3(2.0f * i, 0, 2.0f * j));
-                water->draw(tempM, view, projection, eyePoint, lightColor, lightPosition);
-            }
+            replayStartTime = glfwGetTime();
         }
 
-        // Update frame
-        glfwSwapBuffers(mainWindow);
-
-        // -------------------------------------------
-        // (Option) Save frame
-        // -------------------------------------------
-        if (saveTrigger)
+        double due = replayStartTime + inputLog->frames[inputLog->next].time - inputLog->frames[0].time;
+        while (glfwGetTime() < due)
         {
-            string dir = "./result/output";
-
-            // Zero padding
-            // e.g. "output0001.bmp"
-            string num = to_string(frameNumber);
-            num = string(4 - num.length(), '0') + num;
-            string output = dir + num + ".bmp";
-
-            // Must use WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2 on macOS, don't know why
-            FIBITMAP *outputImage = FreeImage_AllocateT(FIT_UINT32, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2);
-            glReadPixels(0, 0, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
-                         (GLvoid *)FreeImage_GetBits(outputImage));
-            FreeImage_Save(FIF_BMP, outputImage, output.c_str(), 0);
-            std::cout << output << " saved." << '\n';
-            frameNumber++;
+            this_thread::sleep_for(chrono::microseconds(200));
         }
-
-        // Handle events
-        glfwPollEvents();
     }
 
-    // Release resources
-    glfwTerminate();
-    delete water;
-    delete skybox;
-    delete name;
-    delete scene;
-    FreeImage_DeInitialise();
-
-    return EXIT_SUCCESS;
+    inputLog->read(input, glfwGetTime());
 }
 
 // =======================================================
-// Recompute transformation matrices from user inputs
+// Apply inputs to the camera and render settings
+// - Mouse movement turns the camera immediately
+// - Keys set the moving direction, applied in simulation steps
+//   1. input: inputs of this frame
 // =======================================================
-void computeMatricesFromInputs()
+void applyInputs(const InputFrame &input)
 {
-    // glfwGetTime is called only once, the first time this function is called
-    static float lastTime = glfwGetTime();
-
-    // Compute time difference between current and last frame
-    float currentTime = glfwGetTime();
-    float deltaTime = float(currentTime - lastTime);
-
-    // Get mouse position
-    double xpos, ypos;
-    glfwGetCursorPos(mainWindow, &xpos, &ypos);
-
-    // Reset mouse position for next frame
-    glfwSetCursorPos(mainWindow, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
-
     // Compute new orientation
-    // As the cursor is put at the center of the screen,
-    // (WINDOW_WIDTH/2.f - xpos) and (WINDOW_HEIGHT/2.f - ypos) are offsets
-    horizontalAngle += mouseSpeed * float(xpos - WINDOW_WIDTH / 2.f);
-    verticalAngle += mouseSpeed * float(-ypos + WINDOW_HEIGHT / 2.f);
-
-    horizontalAngleReflect = horizontalAngle;
-    verticalAngleReflect = 3.1415f - verticalAngle;
+    horizontalAngle += mouseSpeed * input.cursorX;
+    verticalAngle -= mouseSpeed * input.cursorY;
 
     // Direction : Spherical coordinates to Cartesian coordinates conversion
     vec3 direction =
         vec3(sin(verticalAngle) * cos(horizontalAngle), cos(verticalAngle), sin(verticalAngle) * sin(horizontalAngle));
 
-    vec3 directionReflect = vec3(sin(verticalAngleReflect) * cos(horizontalAngleReflect), cos(verticalAngleReflect),
-                                 sin(verticalAngleReflect) * sin(horizontalAngleReflect));
-
     // Right vector
     vec3 right = vec3(cos(horizontalAngle - 3.14 / 2.f), 0.f, sin(horizontalAngle - 3.14 / 2.f));
 
-    vec3 rightReflect = vec3(cos(horizontalAngleReflect - 3.14 / 2.f), 0.f, sin(horizontalAngleReflect - 3.14 / 2.f));
-
-    // New up vector
-    vec3 newUp = cross(right, direction);
-    vec3 newUpReflect = cross(rightReflect, directionReflect);
+    moveDirection = vec3(0.f);
 
     // Move forward
-    if (glfwGetKey(mainWindow, GLFW_KEY_W) == GLFW_PRESS)
+    if (input.keys & InputLog::KEY_W)
     {
-        eyePoint += direction * deltaTime * speed;
+        moveDirection += direction;
     }
     // Move backward
-    if (glfwGetKey(mainWindow, GLFW_KEY_S) == GLFW_PRESS)
+    if (input.keys & InputLog::KEY_S)
     {
-        eyePoint -= direction * deltaTime * speed;
+        moveDirection -= direction;
     }
     // Strafe right
-    if (glfwGetKey(mainWindow, GLFW_KEY_D) == GLFW_PRESS)
+    if (input.keys & InputLog::KEY_D)
     {
-        eyePoint += right * deltaTime * speed;
+        moveDirection += right;
     }
     // Strafe left
-    if (glfwGetKey(mainWindow, GLFW_KEY_A) == GLFW_PRESS)
+    if (input.keys & InputLog::KEY_A)
     {
-        eyePoint -= right * deltaTime * speed;
+        moveDirection -= right;
     }
 
-    // Update eye point for reflection texture
-    float dist = 2.f * (eyePoint.y - Water::WATER_Y);
-    eyePointReflect = vec3(eyePoint.x, eyePoint.y - dist, eyePoint.z);
+    // Replayed settings override the keys
+    skyLookup = (input.settings & InputLog::SETTING_SKY_LOOKUP) != 0;
+    probeReflect = (input.settings & InputLog::SETTING_PROBE_REFLECT) != 0;
+    lineMode = (input.settings & InputLog::SETTING_LINE_MODE) != 0;
+}
+
+// =======================================================
+// Advance simulation by one fixed step
+//   1. dt: simulation timestep in seconds
+// =======================================================
+void simulate(float dt)
+{
+    // Camera
+    eyePointPrev = eyePointNext;
+    eyePointNext += moveDirection * dt * speed;
+
+    // Water animation
+    water->update(dt);
+}
 
-    // Update common transformation matrices
-    view = lookAt(eyePoint, eyePoint + direction, newUp);
-    projection = perspective(initialFoV, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, nearPlane, farPlane);
+// =======================================================
+// Recompute transformation matrices
+//   1. alpha: position of this frame between the last two simulation steps
+//   2. frame: frame to store cameras and animation state into
+// =======================================================
+void computeMatrices(float alpha, FrameState &frame)
+{
+    // Interpolate simulation state for rendering
+    vec3 eye = mix(eyePointPrev, eyePointNext, alpha);
+    frame.dudvMove = water->interpolate(alpha);
+
+    computeCameras(eye, verticalAngle, horizontalAngle, initialFoV, 1.f * WINDOW_WIDTH / WINDOW_HEIGHT, frame);
+}
+
+// =======================================================
+// Compute main and reflection cameras
+//   1. eye: eye point
+//   2. vAngle, hAngle: vertical and horizontal view angle
+//   3. fov: field of view
+//   4. aspect: aspect ratio of the main pass
+//   5. frame: frame to store cameras into
+// =======================================================
+void computeCameras(vec3 eye, float vAngle, float hAngle, float fov, float aspect, FrameState &frame)
+{
+    float hAngleReflect = hAngle;
+    float vAngleReflect = 3.1415f - vAngle;
+
+    // Direction : Spherical coordinates to Cartesian coordinates conversion
+    vec3 direction = vec3(sin(vAngle) * cos(hAngle), cos(vAngle), sin(vAngle) * sin(hAngle));
+
+    vec3 directionReflect =
+        vec3(sin(vAngleReflect) * cos(hAngleReflect), cos(vAngleReflect), sin(vAngleReflect) * sin(hAngleReflect));
+
+    // Right vector
+    vec3 right = vec3(cos(hAngle - 3.14 / 2.f), 0.f, sin(hAngle - 3.14 / 2.f));
+
+    vec3 rightReflect = vec3(cos(hAngleReflect - 3.14 / 2.f), 0.f, sin(hAngleReflect - 3.14 / 2.f));
+
+    // New up vector
+    vec3 newUp = cross(right, direction);
+    vec3 newUpReflect = cross(rightReflect, directionReflect);
+
+    frame.eyePoint = eye;
+    frame.eyeDirection = direction;
 
-    // Update transformation matrices for reflection texture
-    reflectV = lookAt(eyePointReflect, eyePointReflect + directionReflect, newUpReflect);
+    // Update common transformation matrices
+    frame.view = lookAt(eye, eye + direction, newUp);
+    frame.projection = perspective(fov, aspect, nearPlane, farPlane);
 
-    // For the next frame, the "last time" will be "now"
-    lastTime = currentTime;
+    // Reflection cameras look this way, from the eye point mirrored by each water plane
+    frame.eyeDirectionReflect = directionReflect;
+    frame.upReflect = newUpReflect;
 }
 
 // ===================================================================
@@ -304,9 +1620,11 @@ void computeMatricesFromInputs()
 // - GLFW keyboard callback reference:
 //   https://www.glfw.org/docs/3.3/input_guide.html#input_keyboard
 // ===================================================================
-void keyCallback(GLFWwindow *keyWnd, int key, int scancode, int action, int mods)
+void keyCallback(GLFWwindow *keyWnd, int key, int, int action, int)
 {
     // Key press event
+    // - Runs on the main thread, so only render settings are changed here,
+    //   the render thread applies them with the next frame
     if (action == GLFW_PRESS)
     {
         switch (key)
@@ -320,29 +1638,50 @@ void keyCallback(GLFWwindow *keyWnd, int key, int scancode, int action, int mods
             // F: polygon fill mode
             case GLFW_KEY_F:
             {
-                glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+                lineMode = false;
                 break;
             }
             // L: polygon line mode
             case GLFW_KEY_L:
             {
-                glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                lineMode = true;
                 break;
             }
             // I: eye point information
             case GLFW_KEY_I:
             {
-                std::cout << "eyePoint: " << to_string(eyePoint) << '\n';
+                std::cout << "eyePoint: " << to_string(eyePointNext) << '\n';
                 std::cout << "verticleAngle: " << fmod(verticalAngle, 6.28f) << ", "
                           << "horizontalAngle: " << fmod(horizontalAngle, 6.28f) << endl;
 
+                // Render statistics are printed by the render thread
+                printInfo = true;
+                break;
+            }
+            // M: memory report
+            case GLFW_KEY_M:
+            {
+                Resources::report();
+                break;
+            }
+            // K: sky lookup in water shader on/off
+            case GLFW_KEY_K:
+            {
+                skyLookup = !skyLookup;
+                std::cout << "Sky lookup: " << (skyLookup ? "on" : "off") << '\n';
+                break;
+            }
+            // P: environment probe reflection on/off
+            case GLFW_KEY_P:
+            {
+                probeReflect = !probeReflect;
+                std::cout << "Probe reflection: " << (probeReflect ? "on" : "off") << '\n';
                 break;
             }
             // Y: Save trigger on/off
             case GLFW_KEY_Y:
             {
                 saveTrigger = !saveTrigger;
-                frameNumber = 0;
                 break;
             }
             default:
@@ -367,6 +1706,18 @@ void init()
 
     // Transformation matrices
     initMatrix();
+
+    // Render targets
+    initTarget();
+
+    // Simulation clock
+    initClock();
+
+    // Input recording or replay
+    initInputs();
+
+    // Runtime metrics export
+    initMetrics();
 }
 
 // ===================================================================
@@ -384,8 +1735,22 @@ void initGL()
 
     // Without setting GLFW_CONTEXT_VERSION_MAJOR and _MINOR，
     // OpenGL 1.x will be used
-    glfwWindowHint(GLFW_SAMPLES, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    // With dynamic resolution, MSAA is done in the offscreen target,
+    // and the window must be single sampled to accept the upscaling blit
+    glfwWindowHint(GLFW_SAMPLES, frameBudget > 0.f ? 0 : 4);
+
+    // Depth can only be copied between identical formats,
+    // all targets of the main pass use depth and stencil
+    glfwWindowHint(GLFW_DEPTH_BITS, 24);
+    glfwWindowHint(GLFW_STENCIL_BITS, 8);
+
+    // Batch and server modes render offscreen only
+    if (isHeadless())
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
+    // GPU culling needs compute shaders and multi-draw indirect
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, isGpuCull ? 4 : 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 
     // Must apply the following settings if OpenGL version >= 3.0 is used
@@ -394,6 +1759,16 @@ void initGL()
 
     // Create mainWindow and its OpenGL context
     mainWindow = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Dudv water simulation", NULL, NULL);
+
+    // Without OpenGL 4.3 (e.g. on macOS), fall back to CPU culling
+    if (mainWindow == NULL && isGpuCull)
+    {
+        std::cout << "OpenGL 4.3 is not available, culling on the CPU." << std::endl;
+        isGpuCull = false;
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        mainWindow = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Dudv water simulation", NULL, NULL);
+    }
+
     if (mainWindow == NULL)
     {
         std::cout << "Failed to open GLFW window." << std::endl;
@@ -418,6 +1793,17 @@ void initGL()
         exit(EXIT_FAILURE);
     }
 
+    if (isGpuCull && !GpuCuller::isSupported())
+    {
+        std::cout << "OpenGL 4.3 is not available, culling on the CPU." << std::endl;
+        isGpuCull = false;
+    }
+
+    // The window framebuffer may be larger than the window (e.g. on macOS)
+    glfwGetFramebufferSize(mainWindow, &fbWidth, &fbHeight);
+    mainWidth = fbWidth;
+    mainHeight = fbHeight;
+
     // Face culling and depth test
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
@@ -432,6 +1818,97 @@ void initOther()
     FreeImage_Initialise(true);
 }
 
+// ================================================
+// Initialize simulation clock
+// ================================================
+void initClock()
+{
+    simClock = new SimClock();
+    simClock->fps = offlineFps;
+    simClock->timeScale = timeScale;
+
+    // Offline rendering saves every frame as fast as possible
+    if (offlineFps > 0.0)
+    {
+        glfwSwapInterval(0);
+        saveTrigger = true;
+    }
+}
+
+// ================================================
+// Initialize input recording or replay
+// - A replay starts from the recorded camera and clock settings,
+//   and its recorded wall times drive the clock instead of --offline
+// ================================================
+void initInputs()
+{
+    if (recordFile.empty() && replayFile.empty())
+    {
+        return;
+    }
+
+    inputLog = new InputLog();
+
+    if (!replayFile.empty())
+    {
+        if (!inputLog->load(replayFile))
+        {
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+
+        eyePoint = eyePointPrev = eyePointNext = inputLog->start.eyePoint;
+        verticalAngle = inputLog->start.verticalAngle;
+        horizontalAngle = inputLog->start.horizontalAngle;
+        initialFoV = inputLog->start.fov;
+
+        simClock->step = inputLog->step;
+        simClock->timeScale = inputLog->timeScale;
+        simClock->fps = 0.0;
+
+        if (isUnthrottled)
+        {
+            glfwSwapInterval(0);
+        }
+        std::cout << "Replaying " << inputLog->frames.size() << " frames of " << replayFile << '\n';
+    }
+
+    if (!recordFile.empty())
+    {
+        Pose start;
+        start.eyePoint = eyePointNext;
+        start.verticalAngle = verticalAngle;
+        start.horizontalAngle = horizontalAngle;
+        start.fov = initialFoV;
+        start.time = 0.0;
+        inputLog->record(recordFile, start, simClock->step, simClock->timeScale);
+    }
+}
+
+// ================================================
+// Initialize runtime metrics
+// - Passes are only timed on the GPU while metrics are exported
+// ================================================
+void initMetrics()
+{
+    if (metricsFile.empty() && metricsPort <= 0)
+    {
+        return;
+    }
+
+    if (!Metrics::start(metricsFile, metricsPort, metricsInterval))
+    {
+        return;
+    }
+    passTimer = new PassTimer();
+
+    const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    if (mode && mode->refreshRate > 0)
+    {
+        refreshInterval = 1.0 / mode->refreshRate;
+    }
+}
+
 // ================================================
 // Initialize transformation matrices
 // ================================================
@@ -447,8 +1924,108 @@ void initMatrix()
 // ================================================
 void initMesh()
 {
-    skybox = new Skybox();
-    water = new Water();
-    name = new Mesh("./mesh/name.obj", true);
-    scene = new Mesh("./mesh/scene.obj", true);
+    // Offline and headless frames are saved, so they wait for their mip levels
+    texStreamer = new TextureStreamer(texBudget);
+    texStreamer->isBlocking = isHeadless() || offlineFps > 0.0;
+
+    // Water targets are allocated by the constructor of Water, in the formats set here
+    targetPool = new RenderTargetPool();
+    for (size_t i = 0; i < targetFormats.size(); i++)
+    {
+        if (!targetPool->setFormat(targetFormats[i].first, targetFormats[i].second))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Sky lookup reads coverage from the alpha of the reflection,
+    // and the copy of the main pass needs its depth format
+    if (!RenderTargetPool::hasAlpha(targetPool->formatOf("reflect")))
+    {
+        std::cout << "The reflect target needs an alpha channel." << '\n';
+        exit(EXIT_FAILURE);
+    }
+    if (isScreenRefract && targetPool->formatOf("refract-depth") != GL_DEPTH24_STENCIL8)
+    {
+        std::cout << "Screen-space refraction needs depth24s8 for refract-depth." << '\n';
+        exit(EXIT_FAILURE);
+    }
+
+    skybox = new Skybox(texStreamer);
+    water = new Water(texStreamer, targetPool);
+    water->isScreenRefract = isScreenRefract;
+    water->isScreenReflect = isScreenReflect;
+    water->maxPlanes = maxWaterPlanes;
+    water->maxUpdates = maxWaterUpdates;
+    water->reflectCache = reflectCache;
+    water->refractCache = refractCache;
+
+    // Headless views must not depend on the views before them,
+    // so no water texture is reused from an earlier view
+    if (isHeadless())
+    {
+        water->reflectCache.interval = 1;
+        water->refractCache.interval = 1;
+    }
+    scene = new Scene(sceneFile);
+    if (isGpuCull)
+    {
+        scene->initGpuCulling();
+    }
+
+    // Water bodies of the scene, or 15 x 15 tiles by default
+    for (size_t i = 0; i < scene->waterBodies.size(); i++)
+    {
+        water->addBody(scene->waterBodies[i].first, scene->waterBodies[i].second);
+    }
+    if (water->bodies.empty())
+    {
+        water->addBody(vec3(14.f, Water::WATER_Y, 14.f), vec2(30.f, 30.f));
+    }
+
+    // Every water plane is rendered for every headless view
+    if (isHeadless())
+    {
+        water->maxUpdates = int(water->planes.size());
+    }
+
+    // Lamps just above the first water body, warm and cold
+    // - A fixed seed, so that every run lights the scene the same way
+    const Water::Body &body = water->bodies[0];
+    vec2 extent(body.tilesX * 2.f * Water::WATER_SIZE, body.tilesZ * 2.f * Water::WATER_SIZE);
+    srand(1);
+    for (int i = 0; i < numLamps; i++)
+    {
+        vec3 position(body.center.x + (rand() / float(RAND_MAX) - 0.5f) * extent.x,
+                      body.center.y + 0.5f + rand() / float(RAND_MAX) * 2.f,
+                      body.center.z + (rand() / float(RAND_MAX) - 0.5f) * extent.y);
+        vec3 color = mix(vec3(1.f, 0.6f, 0.25f), vec3(0.6f, 0.8f, 1.f), rand() / float(RAND_MAX)) * 4.f;
+        scene->lights->add(position, color, 5.f);
+    }
+}
+
+// ================================================
+// Initialize render targets
+// ================================================
+void initTarget()
+{
+    // Readback of saved frames and batch views
+    capture = new Capture();
+
+    // Offscreen target for the main pass
+    // - Batch views and server requests are rendered at full resolution
+    if (frameBudget > 0.f && !isHeadless())
+    {
+        dynRes = new DynamicResolution(fbWidth, fbHeight, frameBudget, maxSamples);
+    }
+
+    // Occluder depth buffers of the main and reflection views
+    if (isOcclusion)
+    {
+        mainOcclusion = new OcclusionBuffer();
+        reflectOcclusion = new OcclusionBuffer();
+    }
+
+    // Environment probe slightly above the center of the first water body
+    probe = new Probe(water->bodies[0].center + vec3(0.f, 0.5f, 0.f));
 }
@@ -0,0 +1,29 @@
+// Split a large 3D model into a chunk file for MeshStream
+// Usage: ./meshchunk <model> <chunk file> [triangles per chunk]
+// The model is imported as a whole, so this runs once,
+// on a machine that can hold it; render nodes only map the chunk file.
+
+#include "stream.h"
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 3)
+    {
+        cout << "usage: " << argv[0] << " <model> <chunk file> [triangles per chunk]" << endl;
+        return 1;
+    }
+
+    int maxTriangles = 16384;
+    if (argc > 3)
+    {
+        maxTriangles = atoi(argv[3]);
+    }
+
+    if (MeshStream::buildChunks(argv[1], argv[2], maxTriangles))
+    {
+        cout << "Chunk file successfully saved!" << endl;
+        return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,443 @@
+#include "meshopt.h"
+#include <unordered_map>
+#include <set>
+#include <tuple>
+#include <cstring>
+
+// Size of the simulated post-transform vertex cache
+static const int CACHE_SIZE = 32;
+
+// -----------------------------------------------------
+// Score of a vertex for vertex cache optimization
+// - Vertices in the cache and vertices with few triangles left score higher
+// Parameters:
+//   1. cachePos: position in the cache (-1 if not in the cache)
+//   2. numTris: number of triangles not yet emitted
+// -----------------------------------------------------
+static float vertexScore(int cachePos, int numTris)
+{
+    if (numTris == 0)
+    {
+        return -1.f;
+    }
+
+    float score = 0.f;
+    if (cachePos >= 0)
+    {
+        // The last triangle's vertices get a fixed score,
+        // so that strips are not preferred over fans
+        if (cachePos < 3)
+        {
+            score = 0.75f;
+        }
+        else
+        {
+            score = pow(1.f - float(cachePos - 3) / (CACHE_SIZE - 3), 1.5f);
+        }
+    }
+
+    return score + 2.f * pow(float(numTris), -0.5f);
+}
+
+// ================================================
+// Reorder triangles for the post-transform vertex cache
+// - Greedy, linear-speed method by Tom Forsyth
+// Parameters:
+//   1. indices: triangle list, reordered in place
+//   2. numVtxs: number of vertices
+// ================================================
+void optimizeVertexCache(vector<GLuint> &indices, size_t numVtxs)
+{
+    size_t numTris = indices.size() / 3;
+    if (numTris == 0)
+    {
+        return;
+    }
+
+    // Triangles of each vertex
+    vector<int> vtxNumTris(numVtxs, 0);
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        vtxNumTris[indices[i]]++;
+    }
+
+    vector<int> vtxFirstTri(numVtxs + 1, 0);
+    for (size_t v = 0; v < numVtxs; v++)
+    {
+        vtxFirstTri[v + 1] = vtxFirstTri[v] + vtxNumTris[v];
+    }
+
+    vector<int> vtxTris(indices.size());
+    vector<int> fill(vtxFirstTri.begin(), vtxFirstTri.end() - 1);
+    for (size_t t = 0; t < numTris; t++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            GLuint v = indices[t * 3 + k];
+            vtxTris[fill[v]++] = int(t);
+        }
+    }
+
+    // Scores
+    vector<int> cachePos(numVtxs, -1);
+    vector<float> vtxScores(numVtxs);
+    for (size_t v = 0; v < numVtxs; v++)
+    {
+        vtxScores[v] = vertexScore(-1, vtxNumTris[v]);
+    }
+
+    vector<float> triScores(numTris);
+    vector<bool> isEmitted(numTris, false);
+    for (size_t t = 0; t < numTris; t++)
+    {
+        triScores[t] = vtxScores[indices[t * 3]] + vtxScores[indices[t * 3 + 1]] + vtxScores[indices[t * 3 + 2]];
+    }
+
+    vector<GLuint> result;
+    result.reserve(indices.size());
+
+    vector<GLuint> cache, newCache;
+    size_t nextTri = 0;
+    int bestTri = -1;
+
+    while (result.size() < indices.size())
+    {
+        // Without a candidate in the cache, take the next triangle left
+        if (bestTri < 0)
+        {
+            while (isEmitted[nextTri])
+            {
+                nextTri++;
+            }
+            bestTri = int(nextTri);
+        }
+
+        // Emit the triangle
+        isEmitted[bestTri] = true;
+        newCache.clear();
+        for (int k = 0; k < 3; k++)
+        {
+            GLuint v = indices[bestTri * 3 + k];
+            result.push_back(v);
+            newCache.push_back(v);
+
+            // Remove the triangle from the vertex
+            int first = vtxFirstTri[v];
+            int last = first + vtxNumTris[v] - 1;
+            for (int i = first; i <= last; i++)
+            {
+                if (vtxTris[i] == bestTri)
+                {
+                    std::swap(vtxTris[i], vtxTris[last]);
+                    break;
+                }
+            }
+            vtxNumTris[v]--;
+        }
+
+        // New cache: the triangle's vertices first, then the old ones
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            GLuint v = cache[i];
+            if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+            {
+                newCache.push_back(v);
+            }
+        }
+
+        // Vertices pushed out of the cache
+        for (size_t i = CACHE_SIZE; i < newCache.size(); i++)
+        {
+            cachePos[newCache[i]] = -1;
+            vtxScores[newCache[i]] = vertexScore(-1, vtxNumTris[newCache[i]]);
+        }
+        if (newCache.size() > size_t(CACHE_SIZE))
+        {
+            newCache.resize(CACHE_SIZE);
+        }
+        cache.swap(newCache);
+
+        // Update scores of the vertices in the cache
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            cachePos[cache[i]] = int(i);
+            vtxScores[cache[i]] = vertexScore(int(i), vtxNumTris[cache[i]]);
+        }
+
+        // The best next triangle uses a cached vertex
+        bestTri = -1;
+        float bestScore = -1.f;
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            GLuint v = cache[i];
+            for (int j = vtxFirstTri[v]; j < vtxFirstTri[v] + vtxNumTris[v]; j++)
+            {
+                int t = vtxTris[j];
+                triScores[t] =
+                    vtxScores[indices[t * 3]] + vtxScores[indices[t * 3 + 1]] + vtxScores[indices[t * 3 + 2]];
+                if (triScores[t] > bestScore)
+                {
+                    bestScore = triScores[t];
+                    bestTri = t;
+                }
+            }
+        }
+    }
+
+    indices.swap(result);
+}
+
+// ================================================
+// Reorder triangle clusters to reduce overdraw
+// - Triangles are cut into clusters where the vertex cache restarts,
+//   so the vertex cache order inside a cluster is kept
+// - Clusters facing outwards are drawn first,
+//   as they tend to hide the rest of the mesh
+// Parameters:
+//   1. indices: triangle list, reordered in place
+//   2. vtxs: vertex positions
+// ================================================
+void optimizeOverdraw(vector<GLuint> &indices, const vector<vec3> &vtxs)
+{
+    size_t numTris = indices.size() / 3;
+    if (numTris == 0)
+    {
+        return;
+    }
+
+    // Cut into clusters where all three vertices miss the cache
+    vector<size_t> clusterFirsts;
+    vector<GLuint> cache;
+    for (size_t t = 0; t < numTris; t++)
+    {
+        int misses = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            GLuint v = indices[t * 3 + k];
+            if (std::find(cache.begin(), cache.end(), v) == cache.end())
+            {
+                misses++;
+                cache.insert(cache.begin(), v);
+                if (cache.size() > size_t(CACHE_SIZE))
+                {
+                    cache.pop_back();
+                }
+            }
+        }
+
+        if (t == 0 || (misses == 3 && t - clusterFirsts.back() >= 16))
+        {
+            clusterFirsts.push_back(t);
+        }
+    }
+    clusterFirsts.push_back(numTris);
+
+    // Center of the mesh
+    vec3 center(0.f);
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        center += vtxs[indices[i]];
+    }
+    center /= float(indices.size());
+
+    // Sort clusters by how much they face away from the center
+    size_t numClusters = clusterFirsts.size() - 1;
+    vector<float> sortKeys(numClusters);
+    vector<int> order(numClusters);
+    for (size_t c = 0; c < numClusters; c++)
+    {
+        vec3 clusterCenter(0.f), normal(0.f);
+        float area = 0.f;
+        for (size_t t = clusterFirsts[c]; t < clusterFirsts[c + 1]; t++)
+        {
+            vec3 a = vtxs[indices[t * 3]], b = vtxs[indices[t * 3 + 1]], d = vtxs[indices[t * 3 + 2]];
+            vec3 n = cross(b - a, d - a);
+            float triArea = length(n);
+            clusterCenter += (a + b + d) * (triArea / 3.f);
+            normal += n;
+            area += triArea;
+        }
+
+        clusterCenter = area > 0.f ? clusterCenter / area : vtxs[indices[clusterFirsts[c] * 3]];
+        float normalLength = length(normal);
+        sortKeys[c] = normalLength > 0.f ? dot(clusterCenter - center, normal / normalLength) : 0.f;
+        order[c] = int(c);
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&sortKeys](int a, int b) { return sortKeys[a] > sortKeys[b]; });
+
+    vector<GLuint> result;
+    result.reserve(indices.size());
+    for (size_t i = 0; i < numClusters; i++)
+    {
+        int c = order[i];
+        result.insert(result.end(), indices.begin() + clusterFirsts[c] * 3, indices.begin() + clusterFirsts[c + 1] * 3);
+    }
+
+    indices.swap(result);
+}
+
+// ================================================
+// Simplify a mesh by vertex clustering
+// - Vertices in the same grid cell collapse into the vertex
+//   nearest to their average, so no new vertex is created
+//   and all LODs share the vertex buffer
+// Parameters:
+//   1. indices: triangle list
+//   2. vtxs: vertex positions
+//   3. cellSize: size of a grid cell
+// Return: triangle list of the simplified mesh
+// ================================================
+vector<GLuint> simplifyMesh(const vector<GLuint> &indices, const vector<vec3> &vtxs, float cellSize)
+{
+    vec3 lo(FLT_MAX);
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        lo = min(lo, vtxs[indices[i]]);
+    }
+
+    // Cell of each used vertex
+    std::unordered_map<GLuint, unsigned long long> vtxCells;
+    std::unordered_map<unsigned long long, vec3> cellSums;
+    std::unordered_map<unsigned long long, int> cellCounts;
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        GLuint v = indices[i];
+        if (vtxCells.count(v))
+        {
+            continue;
+        }
+
+        vec3 cell = floor((vtxs[v] - lo) / cellSize);
+        unsigned long long key = (unsigned long long)(cell.x) | ((unsigned long long)(cell.y) << 21) |
+                                 ((unsigned long long)(cell.z) << 42);
+        vtxCells[v] = key;
+
+        if (!cellSums.count(key))
+        {
+            cellSums[key] = vec3(0.f);
+            cellCounts[key] = 0;
+        }
+        cellSums[key] += vtxs[v];
+        cellCounts[key]++;
+    }
+
+    // Representative of each cell
+    std::unordered_map<unsigned long long, GLuint> cellVtxs;
+    std::unordered_map<unsigned long long, float> cellDists;
+    for (auto it = vtxCells.begin(); it != vtxCells.end(); ++it)
+    {
+        vec3 mean = cellSums[it->second] / float(cellCounts[it->second]);
+        float dist = distance(vtxs[it->first], mean);
+        if (!cellVtxs.count(it->second) || dist < cellDists[it->second])
+        {
+            cellVtxs[it->second] = it->first;
+            cellDists[it->second] = dist;
+        }
+    }
+
+    // Remap triangles, dropping collapsed and duplicated ones
+    vector<GLuint> result;
+    std::set<std::tuple<GLuint, GLuint, GLuint>> tris;
+    for (size_t t = 0; t + 2 < indices.size(); t += 3)
+    {
+        GLuint a = cellVtxs[vtxCells[indices[t]]];
+        GLuint b = cellVtxs[vtxCells[indices[t + 1]]];
+        GLuint c = cellVtxs[vtxCells[indices[t + 2]]];
+        if (a == b || b == c || c == a)
+        {
+            continue;
+        }
+
+        // Same triangle with the same winding, whatever the first vertex
+        GLuint m = std::min(a, std::min(b, c));
+        std::tuple<GLuint, GLuint, GLuint> key =
+            m == a ? std::make_tuple(a, b, c) : (m == b ? std::make_tuple(b, c, a) : std::make_tuple(c, a, b));
+        if (!tris.insert(key).second)
+        {
+            continue;
+        }
+
+        result.push_back(a);
+        result.push_back(b);
+        result.push_back(c);
+    }
+
+    return result;
+}
+
+// ================================================
+// Average vertex cache misses per triangle (ACMR)
+// - Simulates a FIFO cache
+// ================================================
+float vertexCacheMissRatio(const vector<GLuint> &indices, int cacheSize)
+{
+    if (indices.empty())
+    {
+        return 0.f;
+    }
+
+    vector<GLuint> cache;
+    int misses = 0;
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        if (std::find(cache.begin(), cache.end(), indices[i]) == cache.end())
+        {
+            misses++;
+            cache.insert(cache.begin(), indices[i]);
+            if (cache.size() > size_t(cacheSize))
+            {
+                cache.pop_back();
+            }
+        }
+    }
+
+    return 3.f * misses / indices.size();
+}
+
+// ================================================
+// Pack a normal into GL_INT_2_10_10_10_REV
+// ================================================
+GLuint packNormal(vec3 n)
+{
+    GLuint packed = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        int value = int(round(std::max(-1.f, std::min(1.f, n[k])) * 511.f));
+        packed |= (GLuint(value) & 0x3FF) << (10 * k);
+    }
+
+    return packed;
+}
+
+// ================================================
+// Convert a float to a half float
+// - Rounds to nearest, flushes values too small to zero
+// ================================================
+GLushort packHalf(float value)
+{
+    GLuint bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xFF) - 127 + 15;
+    GLuint mantissa = bits & 0x7FFFFF;
+
+    if (exponent <= 0)
+    {
+        return GLushort(sign);
+    }
+    if (exponent >= 31)
+    {
+        return GLushort(sign | 0x7C00);
+    }
+
+    // Round the mantissa to 10 bits, may carry into the exponent
+    GLuint half = sign | (GLuint(exponent) << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000)
+    {
+        half++;
+    }
+
+    return GLushort(half);
+}
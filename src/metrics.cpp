@@ -0,0 +1,514 @@
+#include "metrics.h"
+#include "resource.h"
+#include <chrono>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+
+// Upper bounds of the histogram buckets in milliseconds
+const double Metrics::BUCKET_MS[Metrics::NUM_BUCKETS] = {0.25, 0.5,  1.0,  2.0,   4.0,   8.0,
+                                                         16.7, 33.3, 50.0, 100.0, 250.0, 1000.0};
+
+atomic<long long> Metrics::counters[Metrics::NUM_COUNTERS];
+atomic<long long> Metrics::gauges[Metrics::NUM_GAUGES];
+Metrics::Histogram Metrics::timings[Metrics::NUM_TIMINGS];
+
+string Metrics::filePath;
+double Metrics::interval = 10.0;
+int Metrics::listenFd = -1;
+double Metrics::startTime = 0.0;
+atomic<bool> Metrics::isStopping(false);
+thread Metrics::exporter;
+
+// Names and descriptions in the exported text
+static const char *COUNTER_NAMES[Metrics::NUM_COUNTERS] = {
+    "dudv_frames_total", "dudv_frames_dropped_total", "dudv_draw_calls_total", "dudv_program_binds_total",
+    "dudv_triangles_total"};
+static const char *COUNTER_HELP[Metrics::NUM_COUNTERS] = {
+    "Frames rendered.", "Shown frames that missed a refresh of the monitor.", "Draw calls submitted.",
+    "Shader programs bound for drawing.", "Triangles submitted, not counting draws culled on the GPU."};
+static const char *GAUGE_NAMES[Metrics::NUM_GAUGES] = {"dudv_streamed_texture_bytes", "dudv_capture_queue_depth"};
+static const char *GAUGE_HELP[Metrics::NUM_GAUGES] = {"Memory of resident streamed texture levels.",
+                                                      "Images waiting to be read back or written."};
+static const char *PASS_NAMES[Metrics::FRAME_INTERVAL] = {"frame",      "stream",     "probe",
+                                                          "refraction", "reflection", "main"};
+
+// -----------------------------------------------------
+// Seconds of a monotonic clock
+// -----------------------------------------------------
+static double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------
+// Write the description and type of a metric
+// -----------------------------------------------------
+static void writeHeader(stringstream &ss, const char *name, const char *type, const char *help)
+{
+    ss << "# HELP " << name << " " << help << '\n';
+    ss << "# TYPE " << name << " " << type << '\n';
+}
+
+// -----------------------------------------------------
+// Write the buckets, sum and count of a histogram
+// Parameters:
+//   1. ss: exported text
+//   2. name: name of the histogram
+//   3. labels: labels of this series, e.g. "pass=\"main\"", or empty
+//   4. histogram: histogram to write
+// -----------------------------------------------------
+static void writeHistogram(stringstream &ss, const string name, const string labels,
+                           const Metrics::Histogram &histogram)
+{
+    string prefix = labels.empty() ? "" : labels + ",";
+
+    long long count = 0;
+    for (int i = 0; i <= Metrics::NUM_BUCKETS; i++)
+    {
+        count += histogram.counts[i].load(memory_order_relaxed);
+        ss << name << "_bucket{" << prefix << "le=\"";
+        if (i < Metrics::NUM_BUCKETS)
+        {
+            ss << Metrics::BUCKET_MS[i] / 1000.0;
+        }
+        else
+        {
+            ss << "+Inf";
+        }
+        ss << "\"} " << count << '\n';
+    }
+
+    string braces = labels.empty() ? "" : "{" + labels + "}";
+    ss << name << "_sum" << braces << " " << histogram.sumNs.load(memory_order_relaxed) * 1e-9 << '\n';
+    ss << name << "_count" << braces << " " << count << '\n';
+}
+
+// -----------------------------------------------------
+// Increase a counter
+// Parameters:
+//   1. counter: counter to increase
+//   2. n: amount
+// -----------------------------------------------------
+void Metrics::add(Counter counter, long long n) { counters[counter].fetch_add(n, memory_order_relaxed); }
+
+// -----------------------------------------------------
+// Set a gauge
+// -----------------------------------------------------
+void Metrics::set(Gauge gauge, long long value) { gauges[gauge].store(value, memory_order_relaxed); }
+
+// -----------------------------------------------------
+// Add a time to a histogram
+// Parameters:
+//   1. timing: histogram
+//   2. seconds: measured time
+// -----------------------------------------------------
+void Metrics::observe(Timing timing, double seconds)
+{
+    double ms = seconds * 1000.0;
+    int i = 0;
+    while (i < NUM_BUCKETS && ms > BUCKET_MS[i])
+    {
+        i++;
+    }
+
+    timings[timing].counts[i].fetch_add(1, memory_order_relaxed);
+    timings[timing].sumNs.fetch_add((long long)(seconds * 1e9), memory_order_relaxed);
+}
+
+// -----------------------------------------------------
+// Start exporting
+// Parameters:
+//   1. fileName: file to rewrite periodically, empty for none
+//   2. port: local port to answer scrapes on, 0 for none
+//   3. seconds: time between writes of the file
+// Return: false if the port can't be opened
+// -----------------------------------------------------
+bool Metrics::start(const string fileName, int port, double seconds)
+{
+    filePath = fileName;
+    interval = std::max(seconds, 0.1);
+    startTime = now();
+
+    if (port > 0)
+    {
+        // A scraper that disconnects early must not kill the process
+        signal(SIGPIPE, SIG_IGN);
+
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0)
+        {
+            std::cout << "Metrics: can't listen on port " << port << ": " << strerror(errno) << '\n';
+            if (listenFd >= 0)
+            {
+                close(listenFd);
+                listenFd = -1;
+            }
+            return false;
+        }
+        std::cout << "Metrics: serving on http://127.0.0.1:" << port << "/metrics" << '\n';
+    }
+
+    if (!filePath.empty())
+    {
+        std::cout << "Metrics: writing " << filePath << " every " << interval << " s" << '\n';
+    }
+
+    isStopping = false;
+    exporter = thread(exportLoop);
+    return true;
+}
+
+// -----------------------------------------------------
+// Stop exporting
+// - The file is written a last time
+// -----------------------------------------------------
+void Metrics::stop()
+{
+    if (!exporter.joinable())
+    {
+        return;
+    }
+
+    isStopping = true;
+    exporter.join();
+
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        listenFd = -1;
+    }
+}
+
+// -----------------------------------------------------
+// All metrics in the Prometheus text format
+// - Memory of OpenGL objects and host memory are read from the resource registry
+// -----------------------------------------------------
+string Metrics::format()
+{
+    stringstream ss;
+
+    // Sums of long runs keep their fraction
+    ss.precision(12);
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        writeHeader(ss, COUNTER_NAMES[i], "counter", COUNTER_HELP[i]);
+        ss << COUNTER_NAMES[i] << " " << counters[i].load(memory_order_relaxed) << '\n';
+    }
+
+    for (int i = 0; i < NUM_GAUGES; i++)
+    {
+        writeHeader(ss, GAUGE_NAMES[i], "gauge", GAUGE_HELP[i]);
+        ss << GAUGE_NAMES[i] << " " << gauges[i].load(memory_order_relaxed) << '\n';
+    }
+
+    writeHeader(ss, "dudv_pass_gpu_seconds", "histogram", "GPU time of render passes, and of whole frames.");
+    for (int i = 0; i < FRAME_INTERVAL; i++)
+    {
+        writeHistogram(ss, "dudv_pass_gpu_seconds", string("pass=\"") + PASS_NAMES[i] + "\"", timings[i]);
+    }
+
+    writeHeader(ss, "dudv_frame_interval_seconds", "histogram", "Wall time between shown frames.");
+    writeHistogram(ss, "dudv_frame_interval_seconds", "", timings[FRAME_INTERVAL]);
+
+    {
+        lock_guard<mutex> lock(Resources::objectMutex);
+
+        writeHeader(ss, "dudv_gpu_memory_bytes", "gauge", "Estimated GPU memory of OpenGL objects by kind.");
+        for (int k = 0; k < Resources::NUM_KINDS; k++)
+        {
+            size_t bytes = 0;
+            for (map<GLuint, Resources::Object>::iterator it = Resources::objects[k].begin();
+                 it != Resources::objects[k].end(); it++)
+            {
+                bytes += it->second.bytes;
+            }
+            ss << "dudv_gpu_memory_bytes{kind=\"" << Resources::kindName(Resources::Kind(k)) << "\"} " << bytes
+               << '\n';
+        }
+
+        writeHeader(ss, "dudv_host_memory_bytes", "gauge", "Host memory reported by owners.");
+        for (map<string, long long>::iterator it = Resources::hostBytes.begin(); it != Resources::hostBytes.end();
+             it++)
+        {
+            ss << "dudv_host_memory_bytes{category=\"" << it->first << "\"} " << it->second << '\n';
+        }
+    }
+
+    // Resident set of the whole process (Linux only)
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages = 0, residentPages = 0;
+    if (statm && fscanf(statm, "%ld %ld", &pages, &residentPages) == 2)
+    {
+        writeHeader(ss, "dudv_process_resident_bytes", "gauge", "Resident memory of the process.");
+        ss << "dudv_process_resident_bytes " << (long long)residentPages * sysconf(_SC_PAGESIZE) << '\n';
+    }
+    if (statm)
+    {
+        fclose(statm);
+    }
+
+    writeHeader(ss, "dudv_uptime_seconds", "gauge", "Time since metrics were started.");
+    ss << "dudv_uptime_seconds " << now() - startTime << '\n';
+
+    return ss.str();
+}
+
+// -----------------------------------------------------
+// Exporter thread
+// - Rewrites the file every interval, and answers scrapes in between
+// -----------------------------------------------------
+void Metrics::exportLoop()
+{
+    double nextWrite = now();
+
+    while (!isStopping.load())
+    {
+        if (!filePath.empty() && now() >= nextWrite)
+        {
+            writeFile();
+            nextWrite += interval;
+        }
+
+        if (listenFd < 0)
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        // Wake up regularly to check for stopping
+        pollfd pfd;
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) > 0)
+        {
+            int clientFd = accept(listenFd, NULL, NULL);
+            if (clientFd >= 0)
+            {
+                serve(clientFd);
+            }
+        }
+    }
+
+    if (!filePath.empty())
+    {
+        writeFile();
+    }
+}
+
+// -----------------------------------------------------
+// Write the metrics file
+// - Written to a temporary file and renamed,
+//   so that readers never see a partial file
+// -----------------------------------------------------
+void Metrics::writeFile()
+{
+    static bool isFailed = false;
+
+    string tempPath = filePath + ".tmp";
+    ofstream out(tempPath.c_str());
+    out << format();
+    out.close();
+
+    if (!out || rename(tempPath.c_str(), filePath.c_str()) != 0)
+    {
+        // Reported once, not every interval
+        if (!isFailed)
+        {
+            std::cout << "Metrics: can't write " << filePath << '\n';
+        }
+        isFailed = true;
+        return;
+    }
+    isFailed = false;
+}
+
+// -----------------------------------------------------
+// Answer a scrape
+// - Any HTTP request gets the metrics, the connection is closed after it
+// Parameters:
+//   1. clientFd: connected socket, closed here
+// -----------------------------------------------------
+void Metrics::serve(int clientFd)
+{
+    // A client that sends nothing must not block the exporter
+    timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Read the request up to its empty line
+    string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
+    {
+        ssize_t n = recv(clientFd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        request.append(buffer, n);
+    }
+
+    string body = format();
+    string reply = "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: " +
+                   to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while (sent < reply.size())
+    {
+        ssize_t n = send(clientFd, reply.data() + sent, reply.size() - sent, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+
+    close(clientFd);
+}
+
+// -----------------------------------------------------
+// Constructor
+// -----------------------------------------------------
+PassTimer::PassTimer()
+{
+    for (int f = 0; f < NUM_FRAMES; f++)
+    {
+        Resources::create(Resources::QUERY, MAX_MARKS + 1, queries[f], "metrics");
+        numMarks[f] = 0;
+        isPending[f] = false;
+    }
+    head = 0;
+    tail = 0;
+    isMeasuring = false;
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+PassTimer::~PassTimer()
+{
+    for (int f = 0; f < NUM_FRAMES; f++)
+    {
+        Resources::destroy(Resources::QUERY, MAX_MARKS + 1, queries[f]);
+    }
+}
+
+// -----------------------------------------------------
+// Start measuring a frame
+// - If all frames are still in flight, this frame is not measured
+// -----------------------------------------------------
+void PassTimer::beginFrame()
+{
+    readQueries();
+
+    isMeasuring = !isPending[head];
+    if (isMeasuring)
+    {
+        numMarks[head] = 0;
+        glQueryCounter(queries[head][0], GL_TIMESTAMP);
+    }
+}
+
+// -----------------------------------------------------
+// End a pass
+// - The GPU time since the last mark counts for the pass
+// Parameters:
+//   1. pass: PASS_* timing of the pass
+// -----------------------------------------------------
+void PassTimer::mark(Metrics::Timing pass)
+{
+    if (!isMeasuring)
+    {
+        return;
+    }
+    if (numMarks[head] >= MAX_MARKS)
+    {
+        isMeasuring = false;
+        return;
+    }
+
+    int n = numMarks[head]++;
+    passes[head][n] = pass;
+    glQueryCounter(queries[head][n + 1], GL_TIMESTAMP);
+}
+
+// -----------------------------------------------------
+// Stop measuring a frame
+// -----------------------------------------------------
+void PassTimer::endFrame()
+{
+    if (!isMeasuring)
+    {
+        return;
+    }
+
+    isPending[head] = true;
+    head = (head + 1) % NUM_FRAMES;
+    isMeasuring = false;
+}
+
+// -----------------------------------------------------
+// Add the times of finished frames to the histograms
+// - A pass marked several times in a frame (e.g. once per water plane)
+//   is observed once with the sum of its times
+// -----------------------------------------------------
+void PassTimer::readQueries()
+{
+    while (isPending[tail])
+    {
+        int n = numMarks[tail];
+
+        GLint isAvailable = 0;
+        glGetQueryObjectiv(queries[tail][n], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (!isAvailable)
+        {
+            break;
+        }
+
+        GLuint64 first = 0, last = 0;
+        glGetQueryObjectui64v(queries[tail][0], GL_QUERY_RESULT, &first);
+        last = first;
+
+        GLuint64 passNs[Metrics::NUM_TIMINGS] = {0};
+        bool isMarked[Metrics::NUM_TIMINGS] = {false};
+        for (int i = 0; i < n; i++)
+        {
+            GLuint64 t = 0;
+            glGetQueryObjectui64v(queries[tail][i + 1], GL_QUERY_RESULT, &t);
+            passNs[passes[tail][i]] += t - last;
+            isMarked[passes[tail][i]] = true;
+            last = t;
+        }
+
+        for (int p = 0; p < Metrics::NUM_TIMINGS; p++)
+        {
+            if (isMarked[p])
+            {
+                Metrics::observe(Metrics::Timing(p), passNs[p] * 1e-9);
+            }
+        }
+        Metrics::observe(Metrics::PASS_FRAME, (last - first) * 1e-9);
+
+        isPending[tail] = false;
+        tail = (tail + 1) % NUM_FRAMES;
+    }
+}
@@ -0,0 +1,230 @@
+#include "occlusion.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. w, h: size of the depth buffer
+// -----------------------------------------------------
+OcclusionBuffer::OcclusionBuffer(int w, int h)
+{
+    width = w;
+    height = h;
+
+    // Allocate all levels once
+    while (true)
+    {
+        levelWidths.push_back(w);
+        levelHeights.push_back(h);
+        levels.push_back(vector<float>(size_t(w) * h, 1.f));
+        if (w == 1 && h == 1)
+        {
+            break;
+        }
+        w = std::max(1, (w + 1) / 2);
+        h = std::max(1, (h + 1) / 2);
+    }
+
+    numTriangles = 0;
+    numTested = 0;
+    numOccluded = 0;
+}
+
+// -----------------------------------------------------
+// Start a new frame
+// Parameters:
+//   1. viewProjection: projection * view of the pass to cull
+// -----------------------------------------------------
+void OcclusionBuffer::clear(const mat4 &viewProjection)
+{
+    VP = viewProjection;
+    std::fill(levels[0].begin(), levels[0].end(), 1.f);
+
+    numTriangles = 0;
+    numTested = 0;
+    numOccluded = 0;
+}
+
+// -----------------------------------------------------
+// Rasterize an occluder
+// - Triangles crossing the near plane or the clipping plane are skipped,
+//   as they can't safely hide anything
+// Parameters:
+//   1. vtxs: vertex positions in model space
+//   2. indices, numIndices: triangle list
+//   3. M: model matrix
+//   4. clipPlane: plane clipping the pass, vec4(0) means no plane
+// -----------------------------------------------------
+void OcclusionBuffer::rasterize(const vector<vec3> &vtxs, const GLuint *indices, int numIndices, const mat4 &M,
+                                vec4 clipPlane)
+{
+    mat4 MVP = VP * M;
+    bool isClipped = clipPlane != vec4(0.f);
+
+    for (int i = 0; i + 2 < numIndices; i += 3)
+    {
+        vec3 screen[3];
+        bool isSkipped = false;
+
+        for (int k = 0; k < 3 && !isSkipped; k++)
+        {
+            vec4 v = vec4(vtxs[indices[i + k]], 1.f);
+
+            if (isClipped && dot(M * v, clipPlane) < 0.f)
+            {
+                isSkipped = true;
+                break;
+            }
+
+            // In front of the near plane
+            vec4 clip = MVP * v;
+            if (clip.z < -clip.w || clip.w <= 0.f)
+            {
+                isSkipped = true;
+                break;
+            }
+
+            // Pixel coordinates and depth in [0, 1]
+            vec3 ndc = vec3(clip) / clip.w;
+            screen[k] = vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f);
+        }
+
+        if (!isSkipped)
+        {
+            drawTriangle(screen[0], screen[1], screen[2]);
+            numTriangles++;
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Rasterize a triangle in pixel coordinates
+// - Pixel centers inside the triangle keep the nearest depth
+// -----------------------------------------------------
+void OcclusionBuffer::drawTriangle(vec3 a, vec3 b, vec3 c)
+{
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (fabs(area) < 1e-8f)
+    {
+        return;
+    }
+
+    int x0 = std::max(0, int(floor(std::min(a.x, std::min(b.x, c.x)))));
+    int x1 = std::min(width - 1, int(ceil(std::max(a.x, std::max(b.x, c.x)))));
+    int y0 = std::max(0, int(floor(std::min(a.y, std::min(b.y, c.y)))));
+    int y1 = std::min(height - 1, int(ceil(std::max(a.y, std::max(b.y, c.y)))));
+
+    vector<float> &depth = levels[0];
+    float invArea = 1.f / area;
+
+    for (int y = y0; y <= y1; y++)
+    {
+        float py = y + 0.5f;
+        for (int x = x0; x <= x1; x++)
+        {
+            float px = x + 0.5f;
+
+            // Barycentric coordinates, of either winding
+            float w0 = ((b.x - px) * (c.y - py) - (b.y - py) * (c.x - px)) * invArea;
+            float w1 = ((c.x - px) * (a.y - py) - (c.y - py) * (a.x - px)) * invArea;
+            float w2 = 1.f - w0 - w1;
+            if (w0 < 0.f || w1 < 0.f || w2 < 0.f)
+            {
+                continue;
+            }
+
+            // Depth after perspective division is linear in screen space
+            float z = w0 * a.z + w1 * b.z + w2 * c.z;
+            float &d = depth[size_t(y) * width + x];
+            d = std::min(d, z);
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Build the max-depth pyramid from the rasterized occluders
+// -----------------------------------------------------
+void OcclusionBuffer::buildPyramid()
+{
+    for (size_t k = 1; k < levels.size(); k++)
+    {
+        const vector<float> &src = levels[k - 1];
+        vector<float> &dst = levels[k];
+        int sw = levelWidths[k - 1], sh = levelHeights[k - 1];
+        int dw = levelWidths[k], dh = levelHeights[k];
+
+        for (int y = 0; y < dh; y++)
+        {
+            int sy0 = std::min(2 * y, sh - 1), sy1 = std::min(2 * y + 1, sh - 1);
+            for (int x = 0; x < dw; x++)
+            {
+                int sx0 = std::min(2 * x, sw - 1), sx1 = std::min(2 * x + 1, sw - 1);
+                dst[size_t(y) * dw + x] =
+                    std::max(std::max(src[size_t(sy0) * sw + sx0], src[size_t(sy0) * sw + sx1]),
+                             std::max(src[size_t(sy1) * sw + sx0], src[size_t(sy1) * sw + sx1]));
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Test a bounding box against the pyramid
+// - The level is chosen so that the box covers at most 2x2 texels
+// - Boxes crossing the near plane are never occluded
+// Parameters:
+//   1. bounds: world space bounding box
+// Return: true if the box is hidden by occluders
+// -----------------------------------------------------
+bool OcclusionBuffer::isOccluded(const AABB &bounds)
+{
+    numTested++;
+
+    vec2 lo(FLT_MAX), hi(-FLT_MAX);
+    float zMin = FLT_MAX;
+
+    for (int k = 0; k < 8; k++)
+    {
+        vec3 p = vec3(k & 1 ? bounds.max.x : bounds.min.x, k & 2 ? bounds.max.y : bounds.min.y,
+                      k & 4 ? bounds.max.z : bounds.min.z);
+        vec4 clip = VP * vec4(p, 1.f);
+        if (clip.z < -clip.w || clip.w <= 0.f)
+        {
+            return false;
+        }
+
+        vec3 ndc = vec3(clip) / clip.w;
+        vec2 pixel = vec2((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height);
+        lo = min(lo, pixel);
+        hi = max(hi, pixel);
+        zMin = std::min(zMin, ndc.z * 0.5f + 0.5f);
+    }
+
+    int x0 = std::max(0, int(floor(lo.x))), x1 = std::min(width - 1, int(floor(hi.x)));
+    int y0 = std::max(0, int(floor(lo.y))), y1 = std::min(height - 1, int(floor(hi.y)));
+    if (x0 > x1 || y0 > y1)
+    {
+        return false;
+    }
+
+    // Coarsest useful level
+    int level = 0;
+    while (level + 1 < int(levels.size()) && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+    {
+        level++;
+    }
+
+    const vector<float> &depth = levels[level];
+    int w = levelWidths[level];
+    for (int y = y0 >> level; y <= y1 >> level; y++)
+    {
+        for (int x = x0 >> level; x <= x1 >> level; x++)
+        {
+            if (zMin <= depth[size_t(y) * w + x])
+            {
+                return false;
+            }
+        }
+    }
+
+    numOccluded++;
+    return true;
+}
@@ -0,0 +1,134 @@
+#include "probe.h"
+#include "resource.h"
+
+const int Probe::TEX_UNIT = 26;
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. pos: center of the cubemap camera
+//   2. faceSize: width and height of each cubemap face
+// -----------------------------------------------------
+Probe::Probe(vec3 pos, int faceSize)
+{
+    position = pos;
+    size = faceSize;
+    facesPerFrame = 1;
+    face = 0;
+    isComplete = false;
+
+    P = perspective(radians(90.f), 1.f, 0.1f, 2000.f);
+
+    initTexture();
+    initFramebuffer();
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+Probe::~Probe()
+{
+    Resources::destroy(Resources::FRAMEBUFFER, fbo);
+    Resources::destroy(Resources::RENDERBUFFER, rboDepth);
+    Resources::destroy(Resources::TEXTURE, tbo);
+}
+
+// -----------------------------------------------------
+// Number of faces to update this frame
+// -----------------------------------------------------
+int Probe::facesToUpdate() { return isComplete ? facesPerFrame : 6; }
+
+// -----------------------------------------------------
+// Bind the next face as render target
+// Return: index of the bound face
+// -----------------------------------------------------
+int Probe::bindFace()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, tbo, 0);
+    glViewport(0, 0, size, size);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    return face;
+}
+
+// -----------------------------------------------------
+// Move on to the next face
+// - Mipmaps are generated once all 6 faces are rendered
+// -----------------------------------------------------
+void Probe::finishFace()
+{
+    face = (face + 1) % 6;
+
+    if (face == 0)
+    {
+        glActiveTexture(GL_TEXTURE0 + TEX_UNIT);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, tbo);
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        isComplete = true;
+    }
+}
+
+// -----------------------------------------------------
+// View matrix of a cubemap face
+// - Directions and up vectors follow the cubemap face layout,
+//   so that the result can be sampled with a world space vector
+// -----------------------------------------------------
+mat4 Probe::faceView(int i)
+{
+    const vec3 dirs[6] = {vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0),
+                          vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1)};
+    const vec3 ups[6] = {vec3(0, -1, 0), vec3(0, -1, 0), vec3(0, 0, 1),
+                         vec3(0, 0, -1), vec3(0, -1, 0), vec3(0, -1, 0)};
+
+    return lookAt(position, position + dirs[i], ups[i]);
+}
+
+// -----------------------------------------------------
+// Initialize cubemap
+// -----------------------------------------------------
+void Probe::initTexture()
+{
+    glActiveTexture(GL_TEXTURE0 + TEX_UNIT);
+    tbo = Resources::create(Resources::TEXTURE, "probe");
+    glBindTexture(GL_TEXTURE_CUBE_MAP, tbo);
+
+    for (GLuint i = 0; i < 6; i++)
+    {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+
+    // Mipmaps let the water shader fetch a blurry far-field reflection
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+    // Six faces, and a third more for the mip chain
+    Resources::setBytes(Resources::TEXTURE, tbo, size_t(size) * size * 4 * 6 * 4 / 3);
+
+    // Filter across face edges
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+}
+
+// -----------------------------------------------------
+// Initialize frame buffer object
+// - Faces are attached one at a time in bindFace
+// -----------------------------------------------------
+void Probe::initFramebuffer()
+{
+    fbo = Resources::create(Resources::FRAMEBUFFER, "probe");
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+    // User-defined framebuffer must have a depth buffer to enable depth test
+    rboDepth = Resources::create(Resources::RENDERBUFFER, "probe");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+    Resources::setBytes(Resources::RENDERBUFFER, rboDepth, size_t(size) * size * 4);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
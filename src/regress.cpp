@@ -0,0 +1,307 @@
+#include "regress.h"
+#include "ingest.h"
+
+// -----------------------------------------------------
+// Constructor
+// - Defaults accept rounding differences of drivers,
+//   and frame times within 20% or 0.5 ms of the baseline
+// -----------------------------------------------------
+RegressionSuite::RegressionSuite()
+{
+    width = 640;
+    height = 360;
+    tolerance = 8.f;
+    maxBad = 0.001f;
+    maxSlowdown = 0.2f;
+    slackMs = 0.5f;
+    warmup = 3;
+    repeat = 5;
+}
+
+// -----------------------------------------------------
+// Load a suite file
+// - One entry per line, '#' starts a comment line
+//   size w h
+//   tolerance <pixel difference> <fraction of pixels>
+//   slowdown <fraction> <ms>
+//   frames <warmup> <repeat>
+//   golden <directory>
+//   case <name> eyeX eyeY eyeZ verticalAngle horizontalAngle fov time
+// - The golden directory is relative to the suite file,
+//   "golden" next to it by default
+// Parameters:
+//   1. fileName: suite file path
+// Return: false if the file can't be read or has no case
+// -----------------------------------------------------
+bool RegressionSuite::load(const string fileName)
+{
+    ifstream in(fileName.c_str());
+    if (!in)
+    {
+        std::cout << "Regression: can't read " << fileName << '\n';
+        return false;
+    }
+
+    size_t slash = fileName.find_last_of('/');
+    string dir = slash == string::npos ? "." : fileName.substr(0, slash);
+    goldenDir = dir + "/golden";
+
+    string line;
+    int lineNumber = 0;
+    while (getline(in, line))
+    {
+        lineNumber++;
+
+        stringstream ss(line);
+        string command;
+        ss >> command;
+        if (command.empty() || command[0] == '#')
+        {
+            continue;
+        }
+
+        if (command == "size")
+        {
+            ss >> width >> height;
+        }
+        else if (command == "tolerance")
+        {
+            ss >> tolerance >> maxBad;
+        }
+        else if (command == "slowdown")
+        {
+            ss >> maxSlowdown >> slackMs;
+        }
+        else if (command == "frames")
+        {
+            ss >> warmup >> repeat;
+        }
+        else if (command == "golden")
+        {
+            string name;
+            if (ss >> name)
+            {
+                goldenDir = name[0] == '/' ? name : dir + "/" + name;
+            }
+        }
+        else if (command == "case")
+        {
+            Case c;
+            Pose &pose = c.pose;
+            ss >> c.name >> pose.eyePoint.x >> pose.eyePoint.y >> pose.eyePoint.z >> pose.verticalAngle >>
+                pose.horizontalAngle >> pose.fov >> pose.time;
+            if (!ss.fail())
+            {
+                cases.push_back(c);
+            }
+        }
+        else
+        {
+            std::cout << "Regression: unknown entry " << command << " at line " << lineNumber << '\n';
+            continue;
+        }
+
+        if (ss.fail())
+        {
+            std::cout << "Regression: bad " << command << " at line " << lineNumber << '\n';
+        }
+    }
+
+    if (cases.empty() || width <= 0 || height <= 0 || repeat <= 0)
+    {
+        std::cout << "Regression: nothing to render in " << fileName << '\n';
+        return false;
+    }
+
+    loadBaselines();
+    return true;
+}
+
+// -----------------------------------------------------
+// Read the timing baselines, one "name ms" per line
+// - Cases without a baseline are not timed against one
+// -----------------------------------------------------
+void RegressionSuite::loadBaselines()
+{
+    baselines.clear();
+
+    ifstream in((goldenDir + "/timings.txt").c_str());
+    string name;
+    float ms;
+    while (in >> name >> ms)
+    {
+        baselines[name] = ms;
+    }
+}
+
+// -----------------------------------------------------
+// Write the timing baselines
+// Parameters:
+//   1. times: frame time of each case in milliseconds
+// Return: false if the file can't be written
+// -----------------------------------------------------
+bool RegressionSuite::saveBaselines(const map<string, float> &times)
+{
+    ofstream out((goldenDir + "/timings.txt").c_str());
+    if (!out)
+    {
+        std::cout << "Regression: can't write " << goldenDir << "/timings.txt" << '\n';
+        return false;
+    }
+
+    for (map<string, float>::const_iterator it = times.begin(); it != times.end(); ++it)
+    {
+        out << it->first << " " << it->second << '\n';
+    }
+    baselines = times;
+    return true;
+}
+
+// -----------------------------------------------------
+// Read the golden image of a case
+// Parameters:
+//   1. name: name of the case
+//   2. pixels: width * height bottom-up BGRA pixels (output)
+// Return: false if it is missing or has another size
+// -----------------------------------------------------
+bool RegressionSuite::readGolden(const string name, vector<unsigned char> &pixels)
+{
+    string path = goldenDir + "/" + name + ".png";
+    FIBITMAP *image = ImageIngest::decode(path);
+    if (!image)
+    {
+        return false;
+    }
+
+    bool isFit = int(FreeImage_GetWidth(image)) == width && int(FreeImage_GetHeight(image)) == height;
+    if (isFit)
+    {
+        pixels.assign(FreeImage_GetBits(image), FreeImage_GetBits(image) + size_t(width) * height * 4);
+    }
+    else
+    {
+        std::cout << "Regression: " << path << " is not " << width << " x " << height << '\n';
+    }
+
+    FreeImage_Unload(image);
+    return isFit;
+}
+
+// -----------------------------------------------------
+// Compare a rendered image with its golden image
+// - A pixel is bad if it differs from every pixel around it in the other
+//   image, either way, so edges may move by one pixel but nothing may appear
+// - The diff image shows bad pixels in red over the dimmed golden image
+// Parameters:
+//   1. actual, golden: width * height BGRA pixels
+//   2. diff: width * height BGRA pixels (output)
+// Return: differences found
+// -----------------------------------------------------
+RegressionSuite::Result RegressionSuite::compare(const unsigned char *actual, const unsigned char *golden,
+                                                 unsigned char *diff)
+{
+    Result result;
+    result.numBad = 0;
+    result.maxDiff = 0.f;
+
+    double squares = 0.0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            size_t i = (size_t(y) * width + x) * 4;
+
+            for (int c = 0; c < 3; c++)
+            {
+                double d = double(actual[i + c]) - double(golden[i + c]);
+                squares += d * d;
+            }
+
+            float d = pixelDiff(actual + i, golden + i);
+            result.maxDiff = std::max(result.maxDiff, d);
+
+            // Nearest match in the neighborhood, of each image in the other
+            float toGolden = d, toActual = d;
+            for (int dy = -1; dy <= 1 && (toGolden > tolerance || toActual > tolerance); dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int nx = x + dx, ny = y + dy;
+                    if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+                    {
+                        continue;
+                    }
+                    size_t n = (size_t(ny) * width + nx) * 4;
+                    toGolden = std::min(toGolden, pixelDiff(actual + i, golden + n));
+                    toActual = std::min(toActual, pixelDiff(golden + i, actual + n));
+                }
+            }
+
+            bool isBad = toGolden > tolerance || toActual > tolerance;
+            if (isBad)
+            {
+                result.numBad++;
+            }
+
+            unsigned char gray = (unsigned char)((golden[i] + golden[i + 1] + golden[i + 2]) / 9);
+            diff[i] = isBad ? 0 : gray;
+            diff[i + 1] = isBad ? 0 : gray;
+            diff[i + 2] = isBad ? 255 : gray;
+            diff[i + 3] = 255;
+        }
+    }
+
+    size_t numPixels = size_t(width) * height;
+    result.badFraction = float(result.numBad) / numPixels;
+
+    double mse = squares / (numPixels * 3);
+    result.psnr = mse > 0.0 ? float(10.0 * log10(255.0 * 255.0 / mse)) : 99.f;
+
+    return result;
+}
+
+// -----------------------------------------------------
+// Is a case slower than its baseline beyond both thresholds
+// Parameters:
+//   1. name: name of the case
+//   2. ms: measured frame time in milliseconds
+// -----------------------------------------------------
+bool RegressionSuite::isSlower(const string name, float ms)
+{
+    map<string, float>::iterator it = baselines.find(name);
+    if (it == baselines.end())
+    {
+        return false;
+    }
+    return ms > it->second * (1.f + maxSlowdown) && ms > it->second + slackMs;
+}
+
+// -----------------------------------------------------
+// Perceived difference of two BGRA pixels
+// - Weighted distance in RGB ("redmean"), which follows
+//   the eye better than the plain distance and costs as little
+// Return: 0 (same) to 255 (black and white)
+// -----------------------------------------------------
+float RegressionSuite::pixelDiff(const unsigned char *a, const unsigned char *b)
+{
+    float redMean = (a[2] + b[2]) * 0.5f;
+    float dr = float(a[2]) - b[2];
+    float dg = float(a[1]) - b[1];
+    float db = float(a[0]) - b[0];
+
+    return sqrt((2.f + redMean / 256.f) * dr * dr + 4.f * dg * dg + (2.f + (255.f - redMean) / 256.f) * db * db) /
+           3.f;
+}
+
+// -----------------------------------------------------
+// Median of measured times
+// -----------------------------------------------------
+float RegressionSuite::median(vector<float> values)
+{
+    if (values.empty())
+    {
+        return 0.f;
+    }
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
@@ -0,0 +1,246 @@
+#include "resolution.h"
+#include "resource.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. w, h: size of the window framebuffer
+//   2. budgetMs: GPU frame time budget in milliseconds
+//   3. msaa: highest MSAA level to use
+// -----------------------------------------------------
+DynamicResolution::DynamicResolution(int w, int h, float budgetMs, int msaa)
+{
+    width = w;
+    height = h;
+
+    scale = 1.f;
+    minScale = 0.5f;
+    maxScale = 1.f;
+    scaleStep = 0.05f;
+
+    samples = msaa;
+    maxSamples = msaa;
+
+    budget = budgetMs;
+    interval = 8;
+
+    gpuTimeSum = 0.f;
+    gpuTimeCount = 0;
+    gpuTimeAvg = 0.f;
+
+    Resources::create(Resources::QUERY, NUM_QUERIES, queries, "resolution");
+    for (int i = 0; i < NUM_QUERIES; i++)
+    {
+        isQueryPending[i] = false;
+    }
+    queryHead = 0;
+    queryTail = 0;
+
+    initTarget();
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+DynamicResolution::~DynamicResolution()
+{
+    releaseTarget();
+    Resources::destroy(Resources::QUERY, NUM_QUERIES, queries);
+}
+
+// -----------------------------------------------------
+// Start measuring GPU time of a frame
+// - If all queries are still in flight, this frame is not measured
+// -----------------------------------------------------
+void DynamicResolution::beginFrame()
+{
+    readQueries();
+
+    if (!isQueryPending[queryHead])
+    {
+        glBeginQuery(GL_TIME_ELAPSED, queries[queryHead]);
+    }
+}
+
+// -----------------------------------------------------
+// Stop measuring GPU time of a frame
+// -----------------------------------------------------
+void DynamicResolution::endFrame()
+{
+    if (!isQueryPending[queryHead])
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        isQueryPending[queryHead] = true;
+        queryHead = (queryHead + 1) % NUM_QUERIES;
+    }
+
+    if (gpuTimeCount >= interval)
+    {
+        adjust();
+    }
+}
+
+// -----------------------------------------------------
+// Bind the offscreen target for the main pass
+// - Only the scaled lower-left part of the target is used,
+//   so changing the scale never reallocates memory
+// -----------------------------------------------------
+void DynamicResolution::bindScene()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fboScene);
+    glViewport(0, 0, sceneWidth(), sceneHeight());
+}
+
+// -----------------------------------------------------
+// Resolve and upscale the main pass to the window
+// -----------------------------------------------------
+void DynamicResolution::present()
+{
+    int w = sceneWidth();
+    int h = sceneHeight();
+
+    // A multisample framebuffer can only be resolved at the same size
+    GLuint fboSrc = fboScene;
+    if (samples > 0)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fboScene);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fboResolve);
+        glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        fboSrc = fboResolve;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fboSrc);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, w, h, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+
+    // Later readbacks (e.g. saving frames) read from the window
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+}
+
+// -----------------------------------------------------
+// Current render size of the main pass
+// -----------------------------------------------------
+int DynamicResolution::sceneWidth() { return std::max(1, int(width * scale)); }
+
+int DynamicResolution::sceneHeight() { return std::max(1, int(height * scale)); }
+
+// -----------------------------------------------------
+// Initialize offscreen target with current MSAA level
+// -----------------------------------------------------
+void DynamicResolution::initTarget()
+{
+    // Main pass target
+    fboScene = Resources::create(Resources::FRAMEBUFFER, "resolution");
+    glBindFramebuffer(GL_FRAMEBUFFER, fboScene);
+
+    rboSceneColor = Resources::create(Resources::RENDERBUFFER, "resolution");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboSceneColor);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboSceneColor, size_t(width) * height * 4 * std::max(samples, 1));
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboSceneColor);
+
+    rboSceneDepth = Resources::create(Resources::RENDERBUFFER, "resolution");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboSceneDepth);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboSceneDepth, size_t(width) * height * 4 * std::max(samples, 1));
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboSceneDepth);
+
+    // Resolve target
+    fboResolve = Resources::create(Resources::FRAMEBUFFER, "resolution");
+    glBindFramebuffer(GL_FRAMEBUFFER, fboResolve);
+
+    rboResolveColor = Resources::create(Resources::RENDERBUFFER, "resolution");
+    glBindRenderbuffer(GL_RENDERBUFFER, rboResolveColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    Resources::setBytes(Resources::RENDERBUFFER, rboResolveColor, size_t(width) * height * 4);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboResolveColor);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "DynamicResolution: incomplete framebuffer." << '\n';
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// -----------------------------------------------------
+// Release offscreen target
+// -----------------------------------------------------
+void DynamicResolution::releaseTarget()
+{
+    Resources::destroy(Resources::FRAMEBUFFER, fboScene);
+    Resources::destroy(Resources::FRAMEBUFFER, fboResolve);
+    Resources::destroy(Resources::RENDERBUFFER, rboSceneColor);
+    Resources::destroy(Resources::RENDERBUFFER, rboSceneDepth);
+    Resources::destroy(Resources::RENDERBUFFER, rboResolveColor);
+}
+
+// -----------------------------------------------------
+// Collect results of finished timer queries
+// -----------------------------------------------------
+void DynamicResolution::readQueries()
+{
+    while (isQueryPending[queryTail])
+    {
+        GLint isAvailable = 0;
+        glGetQueryObjectiv(queries[queryTail], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (!isAvailable)
+        {
+            break;
+        }
+
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(queries[queryTail], GL_QUERY_RESULT, &ns);
+        gpuTimeSum += ns / 1.0e6f;
+        gpuTimeCount++;
+
+        isQueryPending[queryTail] = false;
+        queryTail = (queryTail + 1) % NUM_QUERIES;
+    }
+}
+
+// -----------------------------------------------------
+// Adjust scale and MSAA level from measured GPU time
+// - Over budget: drop MSAA first, then resolution
+// - Well under budget: restore resolution first, then MSAA
+// -----------------------------------------------------
+void DynamicResolution::adjust()
+{
+    gpuTimeAvg = gpuTimeSum / gpuTimeCount;
+    gpuTimeSum = 0.f;
+    gpuTimeCount = 0;
+
+    int newSamples = samples;
+
+    if (gpuTimeAvg > budget * 0.95f)
+    {
+        if (samples > 0)
+        {
+            newSamples = samples / 2 < 2 ? 0 : samples / 2;
+        }
+        else
+        {
+            scale = std::max(minScale, scale - scaleStep);
+        }
+    }
+    else if (gpuTimeAvg < budget * 0.75f)
+    {
+        if (scale < maxScale)
+        {
+            scale = std::min(maxScale, scale + scaleStep);
+        }
+        else if (samples < maxSamples)
+        {
+            newSamples = std::min(maxSamples, samples == 0 ? 2 : samples * 2);
+        }
+    }
+
+    // Changing MSAA level needs new storage
+    if (newSamples != samples)
+    {
+        samples = newSamples;
+        releaseTarget();
+        initTarget();
+    }
+}
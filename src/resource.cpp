@@ -0,0 +1,293 @@
+#include "resource.h"
+#include <cstdio>
+#include <unistd.h>
+
+map<GLuint, Resources::Object> Resources::objects[Resources::NUM_KINDS];
+map<string, long long> Resources::hostBytes;
+mutex Resources::objectMutex;
+
+// -----------------------------------------------------
+// Create an OpenGL object
+// Parameters:
+//   1. kind: kind of object (programs are created by buildShader)
+//   2. category: owner of the object
+//   3. label: what the object is, optional
+// Return: the object
+// -----------------------------------------------------
+GLuint Resources::create(Kind kind, const string category, const string label)
+{
+    GLuint name = 0;
+    switch (kind)
+    {
+        case BUFFER:
+            glGenBuffers(1, &name);
+            break;
+        case TEXTURE:
+            glGenTextures(1, &name);
+            break;
+        case RENDERBUFFER:
+            glGenRenderbuffers(1, &name);
+            break;
+        case FRAMEBUFFER:
+            glGenFramebuffers(1, &name);
+            break;
+        case VERTEX_ARRAY:
+            glGenVertexArrays(1, &name);
+            break;
+        case QUERY:
+            glGenQueries(1, &name);
+            break;
+        default:
+            return 0;
+    }
+
+    track(kind, name, category, label);
+    return name;
+}
+
+// -----------------------------------------------------
+// Create several OpenGL objects of the same kind
+// Parameters:
+//   1. kind: kind of objects
+//   2. n: number of objects
+//   3. names: the objects
+//   4. category: owner of the objects
+// -----------------------------------------------------
+void Resources::create(Kind kind, GLsizei n, GLuint *names, const string category)
+{
+    for (GLsizei i = 0; i < n; i++)
+    {
+        names[i] = create(kind, category);
+    }
+}
+
+// -----------------------------------------------------
+// Register an object created elsewhere
+// -----------------------------------------------------
+void Resources::track(Kind kind, GLuint name, const string category, const string label)
+{
+    if (!name)
+    {
+        return;
+    }
+
+    lock_guard<mutex> lock(objectMutex);
+    Object &object = objects[kind][name];
+    object.category = category;
+    object.label = label;
+    object.bytes = 0;
+}
+
+// -----------------------------------------------------
+// Delete an OpenGL object
+// - The name is set to 0, deleting 0 does nothing
+// -----------------------------------------------------
+void Resources::destroy(Kind kind, GLuint &name)
+{
+    if (!name)
+    {
+        return;
+    }
+
+    switch (kind)
+    {
+        case BUFFER:
+            glDeleteBuffers(1, &name);
+            break;
+        case TEXTURE:
+            glDeleteTextures(1, &name);
+            break;
+        case RENDERBUFFER:
+            glDeleteRenderbuffers(1, &name);
+            break;
+        case FRAMEBUFFER:
+            glDeleteFramebuffers(1, &name);
+            break;
+        case VERTEX_ARRAY:
+            glDeleteVertexArrays(1, &name);
+            break;
+        case QUERY:
+            glDeleteQueries(1, &name);
+            break;
+        case PROGRAM:
+            glDeleteProgram(name);
+            break;
+        default:
+            break;
+    }
+
+    {
+        lock_guard<mutex> lock(objectMutex);
+        objects[kind].erase(name);
+    }
+    name = 0;
+}
+
+// -----------------------------------------------------
+// Delete several OpenGL objects of the same kind
+// -----------------------------------------------------
+void Resources::destroy(Kind kind, GLsizei n, GLuint *names)
+{
+    for (GLsizei i = 0; i < n; i++)
+    {
+        destroy(kind, names[i]);
+    }
+}
+
+// -----------------------------------------------------
+// Set the estimated GPU memory of an object
+// - Called after each allocation of its storage
+// -----------------------------------------------------
+void Resources::setBytes(Kind kind, GLuint name, size_t bytes)
+{
+    lock_guard<mutex> lock(objectMutex);
+    map<GLuint, Object>::iterator it = objects[kind].find(name);
+    if (it != objects[kind].end())
+    {
+        it->second.bytes = bytes;
+    }
+}
+
+// -----------------------------------------------------
+// Count host memory of a category
+// Parameters:
+//   1. category: owner of the memory
+//   2. bytes: allocated (positive) or freed (negative) bytes
+// -----------------------------------------------------
+void Resources::addHostBytes(const string category, long long bytes)
+{
+    lock_guard<mutex> lock(objectMutex);
+    hostBytes[category] += bytes;
+}
+
+// -----------------------------------------------------
+// Estimated GPU memory of all objects
+// -----------------------------------------------------
+size_t Resources::gpuBytes()
+{
+    lock_guard<mutex> lock(objectMutex);
+
+    size_t total = 0;
+    for (int k = 0; k < NUM_KINDS; k++)
+    {
+        for (map<GLuint, Object>::iterator it = objects[k].begin(); it != objects[k].end(); it++)
+        {
+            total += it->second.bytes;
+        }
+    }
+    return total;
+}
+
+// -----------------------------------------------------
+// Print memory per category
+// - GPU memory and number of objects of each kind,
+//   host memory reported by owners, and the resident set of the process
+// -----------------------------------------------------
+void Resources::report()
+{
+    lock_guard<mutex> lock(objectMutex);
+
+    map<string, size_t> categoryBytes;
+    map<string, int> categoryCounts[NUM_KINDS];
+    size_t total = 0;
+    for (int k = 0; k < NUM_KINDS; k++)
+    {
+        for (map<GLuint, Object>::iterator it = objects[k].begin(); it != objects[k].end(); it++)
+        {
+            categoryBytes[it->second.category] += it->second.bytes;
+            categoryCounts[k][it->second.category]++;
+            total += it->second.bytes;
+        }
+    }
+
+    std::cout << "GPU memory: " << total / 1024 << " KB" << '\n';
+    for (map<string, size_t>::iterator it = categoryBytes.begin(); it != categoryBytes.end(); it++)
+    {
+        std::cout << "  " << it->first << ": " << it->second / 1024 << " KB (";
+        bool isFirst = true;
+        for (int k = 0; k < NUM_KINDS; k++)
+        {
+            if (categoryCounts[k].count(it->first))
+            {
+                std::cout << (isFirst ? "" : ", ") << categoryCounts[k][it->first] << " " << kindName(Kind(k));
+                isFirst = false;
+            }
+        }
+        std::cout << ")" << '\n';
+    }
+
+    std::cout << "Host memory:" << '\n';
+    for (map<string, long long>::iterator it = hostBytes.begin(); it != hostBytes.end(); it++)
+    {
+        std::cout << "  " << it->first << ": " << it->second / 1024 << " KB" << '\n';
+    }
+
+    // Resident set of the whole process, for what is not reported
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages = 0, residentPages = 0;
+    if (statm && fscanf(statm, "%ld %ld", &pages, &residentPages) == 2)
+    {
+        std::cout << "  process resident: " << residentPages * (sysconf(_SC_PAGESIZE) / 1024) << " KB" << '\n';
+    }
+    if (statm)
+    {
+        fclose(statm);
+    }
+}
+
+// -----------------------------------------------------
+// Print objects that are still alive
+// - Called at shutdown, after all owners are deleted
+// Return: number of leaked objects
+// -----------------------------------------------------
+int Resources::reportLeaks()
+{
+    lock_guard<mutex> lock(objectMutex);
+
+    int numLeaks = 0;
+    for (int k = 0; k < NUM_KINDS; k++)
+    {
+        for (map<GLuint, Object>::iterator it = objects[k].begin(); it != objects[k].end(); it++)
+        {
+            std::cout << "Leaked " << kindName(Kind(k)) << " " << it->first << " of " << it->second.category;
+            if (!it->second.label.empty())
+            {
+                std::cout << " (" << it->second.label << ")";
+            }
+            std::cout << ", " << it->second.bytes / 1024 << " KB" << '\n';
+            numLeaks++;
+        }
+    }
+    return numLeaks;
+}
+
+// -----------------------------------------------------
+// Estimated bytes per pixel of an internal format
+// - Three-channel formats are usually padded to four bytes
+// -----------------------------------------------------
+size_t Resources::formatBytes(GLenum format)
+{
+    switch (format)
+    {
+        case GL_R8:
+            return 1;
+        case GL_DEPTH_COMPONENT16:
+            return 2;
+        case GL_RGBA16F:
+            return 8;
+        case GL_RGBA32F:
+            return 16;
+        default:
+            return 4;
+    }
+}
+
+// -----------------------------------------------------
+// Name of a kind of object
+// -----------------------------------------------------
+const char *Resources::kindName(Kind kind)
+{
+    static const char *names[NUM_KINDS] = {"buffers",      "textures", "renderbuffers", "framebuffers",
+                                           "vertex arrays", "queries",  "programs"};
+    return names[kind];
+}
@@ -0,0 +1,306 @@
+#include "rtpool.h"
+#include "resource.h"
+
+// Formats that can be chosen on the command line
+static const struct
+{
+    const char *name;
+    GLenum format;
+} FORMAT_NAMES[] = {{"rgba8", GL_RGBA8},
+                    {"rgb10a2", GL_RGB10_A2},
+                    {"r11g11b10f", GL_R11F_G11F_B10F},
+                    {"rgba16f", GL_RGBA16F},
+                    {"depth16", GL_DEPTH_COMPONENT16},
+                    {"depth24", GL_DEPTH_COMPONENT24},
+                    {"depth24s8", GL_DEPTH24_STENCIL8}};
+
+// -----------------------------------------------------
+// Constructor
+// - Default formats of the named targets
+//   1. reflect, refract: color of the water textures,
+//      reflection keeps alpha to mark covered pixels for sky lookup
+//   2. reflect-depth: depth of the reflection pass, the same format as
+//      the copy of the main pass, so that the two share memory
+//   3. refract-depth: depth of the refraction pass, sampled by the water
+// -----------------------------------------------------
+RenderTargetPool::RenderTargetPool()
+{
+    frame = 0;
+    maxIdleFrames = 120;
+    totalBytes = 0;
+    usedBytes = 0;
+
+    formats["reflect"] = GL_RGBA8;
+    formats["refract"] = GL_RGBA8;
+    formats["reflect-depth"] = GL_DEPTH24_STENCIL8;
+    formats["refract-depth"] = GL_DEPTH24_STENCIL8;
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+RenderTargetPool::~RenderTargetPool() { clear(); }
+
+// -----------------------------------------------------
+// Hand out a render target
+// - A free target of the same kind is reused, the smallest one that fits
+// - Textures are left bound to the active texture unit
+// Parameters:
+//   1. w, h: size of the target
+//   2. format: internal format
+//   3. isTexture: texture to be sampled, or renderbuffer
+//   4. samples: MSAA level of a renderbuffer
+// Return: texture or renderbuffer object
+// -----------------------------------------------------
+GLuint RenderTargetPool::acquire(int w, int h, GLenum format, bool isTexture, int samples)
+{
+    int best = -1;
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        const Desc &desc = targets[i].desc;
+        if (targets[i].isInUse || desc.isTexture != isTexture || desc.format != format || desc.samples != samples)
+        {
+            continue;
+        }
+
+        bool isFit = isTexture ? desc.width == w && desc.height == h : desc.width >= w && desc.height >= h;
+        if (isFit && (best < 0 || desc.width * desc.height < targets[best].desc.width * targets[best].desc.height))
+        {
+            best = int(i);
+        }
+    }
+
+    if (best < 0)
+    {
+        Target target;
+        target.desc.width = w;
+        target.desc.height = h;
+        target.desc.format = format;
+        target.desc.samples = samples;
+        target.desc.isTexture = isTexture;
+        target.bytes = size_t(w) * h * Resources::formatBytes(format) * std::max(samples, 1);
+        target.isInUse = false;
+
+        if (isTexture)
+        {
+            GLenum pixFormat, pixType;
+            pixelFormat(format, pixFormat, pixType);
+
+            target.name = Resources::create(Resources::TEXTURE, "render-targets");
+            glBindTexture(GL_TEXTURE_2D, target.name);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, pixFormat, pixType, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            Resources::setBytes(Resources::TEXTURE, target.name, target.bytes);
+        }
+        else
+        {
+            target.name = Resources::create(Resources::RENDERBUFFER, "render-targets");
+            glBindRenderbuffer(GL_RENDERBUFFER, target.name);
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, w, h);
+            Resources::setBytes(Resources::RENDERBUFFER, target.name, target.bytes);
+        }
+
+        totalBytes += target.bytes;
+        targets.push_back(target);
+        best = int(targets.size()) - 1;
+    }
+    else if (isTexture)
+    {
+        glBindTexture(GL_TEXTURE_2D, targets[best].name);
+    }
+
+    Target &target = targets[best];
+    target.isInUse = true;
+    target.lastUsed = frame;
+    usedBytes += target.bytes;
+
+    return target.name;
+}
+
+// -----------------------------------------------------
+// Give a render target back to the pool
+// - Its content is undefined for the next user
+// Parameters:
+//   1. name: texture or renderbuffer object
+//   2. isTexture: whether name is a texture
+// -----------------------------------------------------
+void RenderTargetPool::release(GLuint name, bool isTexture)
+{
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        if (targets[i].name == name && targets[i].desc.isTexture == isTexture && targets[i].isInUse)
+        {
+            targets[i].isInUse = false;
+            usedBytes -= targets[i].bytes;
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Start a frame
+// - Delete free targets that no pass asked for recently
+// -----------------------------------------------------
+void RenderTargetPool::beginFrame()
+{
+    frame++;
+
+    for (size_t i = 0; i < targets.size();)
+    {
+        Target &target = targets[i];
+        if (target.isInUse || frame - target.lastUsed <= maxIdleFrames)
+        {
+            i++;
+            continue;
+        }
+
+        if (target.desc.isTexture)
+        {
+            Resources::destroy(Resources::TEXTURE, target.name);
+        }
+        else
+        {
+            Resources::destroy(Resources::RENDERBUFFER, target.name);
+        }
+        totalBytes -= target.bytes;
+        targets.erase(targets.begin() + i);
+    }
+}
+
+// -----------------------------------------------------
+// Delete all targets, also the ones in use
+// -----------------------------------------------------
+void RenderTargetPool::clear()
+{
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        if (targets[i].desc.isTexture)
+        {
+            Resources::destroy(Resources::TEXTURE, targets[i].name);
+        }
+        else
+        {
+            Resources::destroy(Resources::RENDERBUFFER, targets[i].name);
+        }
+    }
+
+    targets.clear();
+    totalBytes = 0;
+    usedBytes = 0;
+}
+
+// -----------------------------------------------------
+// Format of a named target
+// -----------------------------------------------------
+GLenum RenderTargetPool::formatOf(const string name) { return formats.count(name) ? formats[name] : GL_RGBA8; }
+
+// -----------------------------------------------------
+// Set the format of a named target
+// Parameters:
+//   1. name: name of the target
+//   2. formatName: name of the format (see parseFormat)
+// Return: false if the target or the format is unknown
+// -----------------------------------------------------
+bool RenderTargetPool::setFormat(const string name, const string formatName)
+{
+    if (!formats.count(name))
+    {
+        std::cout << "Unknown render target: " << name << '\n';
+        return false;
+    }
+
+    // Depth targets take depth formats, color targets color formats
+    GLenum format = parseFormat(formatName);
+    if (!format || (depthAttachment(format) != 0) != (depthAttachment(formats[name]) != 0))
+    {
+        std::cout << "Unknown format for " << name << ": " << formatName << '\n';
+        return false;
+    }
+
+    formats[name] = format;
+    return true;
+}
+
+// -----------------------------------------------------
+// Pixel format and type to allocate a texture of an internal format
+// -----------------------------------------------------
+void RenderTargetPool::pixelFormat(GLenum format, GLenum &pixFormat, GLenum &pixType)
+{
+    switch (format)
+    {
+        case GL_RGB10_A2:
+            pixFormat = GL_RGBA;
+            pixType = GL_UNSIGNED_INT_2_10_10_10_REV;
+            break;
+        case GL_R11F_G11F_B10F:
+            pixFormat = GL_RGB;
+            pixType = GL_UNSIGNED_INT_10F_11F_11F_REV;
+            break;
+        case GL_RGBA16F:
+            pixFormat = GL_RGBA;
+            pixType = GL_HALF_FLOAT;
+            break;
+        case GL_R32F:
+            pixFormat = GL_RED;
+            pixType = GL_FLOAT;
+            break;
+        case GL_DEPTH_COMPONENT16:
+            pixFormat = GL_DEPTH_COMPONENT;
+            pixType = GL_UNSIGNED_SHORT;
+            break;
+        case GL_DEPTH_COMPONENT24:
+            pixFormat = GL_DEPTH_COMPONENT;
+            pixType = GL_UNSIGNED_INT;
+            break;
+        case GL_DEPTH24_STENCIL8:
+            pixFormat = GL_DEPTH_STENCIL;
+            pixType = GL_UNSIGNED_INT_24_8;
+            break;
+        default:
+            pixFormat = GL_RGBA;
+            pixType = GL_UNSIGNED_BYTE;
+            break;
+    }
+}
+
+// -----------------------------------------------------
+// Framebuffer attachment of a depth format
+// Return: 0 for color formats
+// -----------------------------------------------------
+GLenum RenderTargetPool::depthAttachment(GLenum format)
+{
+    switch (format)
+    {
+        case GL_DEPTH_COMPONENT16:
+        case GL_DEPTH_COMPONENT24:
+            return GL_DEPTH_ATTACHMENT;
+        case GL_DEPTH24_STENCIL8:
+            return GL_DEPTH_STENCIL_ATTACHMENT;
+        default:
+            return 0;
+    }
+}
+
+// -----------------------------------------------------
+// Whether a color format has an alpha channel
+// -----------------------------------------------------
+bool RenderTargetPool::hasAlpha(GLenum format) { return format != GL_R11F_G11F_B10F && format != GL_R32F; }
+
+// -----------------------------------------------------
+// Internal format from its name on the command line
+// Return: 0 if the name is unknown
+// -----------------------------------------------------
+GLenum RenderTargetPool::parseFormat(const string name)
+{
+    for (size_t i = 0; i < sizeof(FORMAT_NAMES) / sizeof(FORMAT_NAMES[0]); i++)
+    {
+        if (name == FORMAT_NAMES[i].name)
+        {
+            return FORMAT_NAMES[i].format;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,538 @@
+#include "scene.h"
+#include "metrics.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. fileName: scene file path
+// -----------------------------------------------------
+Scene::Scene(const string fileName)
+{
+    numVisible = 0;
+    gpuCuller = NULL;
+    lodSize = 0.25f;
+    lights = new ClusteredLights();
+
+    load(fileName);
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+Scene::~Scene()
+{
+    delete gpuCuller;
+    delete lights;
+
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        delete assets[i].mesh;
+    }
+
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        delete streams[i];
+    }
+}
+
+// -----------------------------------------------------
+// Load a scene file
+// - One entry per line, '#' starts a comment line
+//   mesh <name> <file>
+//   instance <name> x y z [scale [rotX rotY rotZ]]
+//   matrix <name> m00 m01 ... m33
+//   occluder <name>
+//   stream <chunk file> [pool size in MB]
+//   light x y z r g b radius
+//   water x y z width depth
+// - Angles are in degrees, applied in X, Y, Z order after scaling
+// - matrix takes a model matrix in column-major order
+// Parameters:
+//   1. fileName: scene file path
+// Return: false if the file can't be read
+// -----------------------------------------------------
+bool Scene::load(const string fileName)
+{
+    ifstream in(fileName.c_str());
+    if (!in)
+    {
+        std::cout << "Scene: can't read " << fileName << '\n';
+        return false;
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(in, line))
+    {
+        lineNumber++;
+
+        stringstream ss(line);
+        string command, name;
+        ss >> command;
+        if (command.empty() || command[0] == '#')
+        {
+            continue;
+        }
+
+        // Point lights have no mesh
+        if (command == "light")
+        {
+            vec3 position, color;
+            float radius;
+            ss >> position.x >> position.y >> position.z >> color.x >> color.y >> color.z >> radius;
+            if (ss.fail() || radius <= 0.f)
+            {
+                std::cout << "Scene: bad light at line " << lineNumber << '\n';
+                continue;
+            }
+            lights->add(position, color, radius);
+            continue;
+        }
+
+        // Water bodies are drawn by the water, not as meshes
+        if (command == "water")
+        {
+            vec3 center;
+            vec2 size;
+            ss >> center.x >> center.y >> center.z >> size.x >> size.y;
+            if (ss.fail() || size.x <= 0.f || size.y <= 0.f)
+            {
+                std::cout << "Scene: bad water at line " << lineNumber << '\n';
+                continue;
+            }
+            waterBodies.push_back(make_pair(center, size));
+            continue;
+        }
+
+        ss >> name;
+
+        // Chunk files are streamed, not imported
+        if (command == "stream")
+        {
+            float poolMB = 64.f;
+            float tempPoolMB;
+            if (ss >> tempPoolMB)
+            {
+                poolMB = tempPoolMB;
+            }
+            streams.push_back(new MeshStream(name, poolMB));
+            ClusteredLights::initShader(streams.back()->shader);
+            continue;
+        }
+
+        if (command == "mesh")
+        {
+            string meshFile;
+            ss >> meshFile;
+            if (ss.fail() || findAsset(name) >= 0)
+            {
+                std::cout << "Scene: bad mesh at line " << lineNumber << '\n';
+                continue;
+            }
+
+            Asset asset;
+            asset.name = name;
+            asset.isOccluder = false;
+            asset.mesh = new Mesh(meshFile, true);
+            ClusteredLights::initShader(asset.mesh->shader);
+            assets.push_back(asset);
+            continue;
+        }
+
+        int index = findAsset(name);
+        if (index < 0)
+        {
+            std::cout << "Scene: unknown mesh " << name << " at line " << lineNumber << '\n';
+            continue;
+        }
+
+        // Mark a mesh as an occluder for occlusion culling
+        if (command == "occluder")
+        {
+            assets[index].isOccluder = true;
+            continue;
+        }
+
+        mat4 M(1.f);
+        if (command == "instance")
+        {
+            vec3 pos;
+            ss >> pos.x >> pos.y >> pos.z;
+            if (ss.fail())
+            {
+                std::cout << "Scene: bad instance at line " << lineNumber << '\n';
+                continue;
+            }
+
+            // Scale and rotation are optional
+            float s = 1.f;
+            vec3 angles(0.f);
+            float tempS;
+            vec3 tempAngles;
+            if (ss >> tempS)
+            {
+                s = tempS;
+                if (ss >> tempAngles.x >> tempAngles.y >> tempAngles.z)
+                {
+                    angles = tempAngles;
+                }
+            }
+
+            M = translate(M, pos);
+            M = scale(M, vec3(s));
+            M = rotate(M, radians(angles.x), vec3(1.f, 0.f, 0.f));
+            M = rotate(M, radians(angles.y), vec3(0.f, 1.f, 0.f));
+            M = rotate(M, radians(angles.z), vec3(0.f, 0.f, 1.f));
+        }
+        else if (command == "matrix")
+        {
+            float *m = value_ptr(M);
+            for (int k = 0; k < 16; k++)
+            {
+                ss >> m[k];
+            }
+            if (ss.fail())
+            {
+                std::cout << "Scene: bad matrix at line " << lineNumber << '\n';
+                continue;
+            }
+        }
+        else
+        {
+            std::cout << "Scene: unknown entry " << command << " at line " << lineNumber << '\n';
+            continue;
+        }
+
+        assets[index].instances.push_back(M);
+    }
+
+    buildBVH();
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Draw instances inside the view frustum
+// - Visible instances of each mesh are uploaded and drawn at once
+// - Point lights are binned into the clusters of the camera first
+// Parameters:
+//   1. V, P: view, projection transformation matrix
+//   2. eye: eye position
+//   3. lightColor, lightPosition: lighting configuration
+//   4. clipPlane: also cull instances fully clipped by this plane
+//      (e.g. the water plane), vec4(0) means no plane
+//   5. occlusion: (Option) also cull instances hidden by occluders
+//   6. lodBias: LODs coarser than the projected size asks for
+//      (e.g. for passes seen through distortion)
+// -----------------------------------------------------
+void Scene::draw(mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, vec4 clipPlane,
+                 OcclusionBuffer *occlusion, int lodBias)
+{
+    // Clusters of this camera, also used by the water drawn after the scene
+    lights->bind(V, P);
+
+    vector<vec4> planes = BVH::frustum(P * V);
+    if (clipPlane != vec4(0.f))
+    {
+        planes.push_back(clipPlane);
+    }
+
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i]->draw(V, P, eye, lightColor, lightPosition, clipPlane);
+        Metrics::add(Metrics::PROGRAM_BINDS);
+        Metrics::add(Metrics::DRAW_CALLS, streams[i]->numDrawn);
+        Metrics::add(Metrics::TRIANGLES, streams[i]->numTriangles);
+    }
+
+    // One multi-draw per asset, with the shader of its mesh
+    // - Occlusion culling runs on the CPU, so it is skipped here
+    // - The number of visible instances stays on the GPU
+    if (gpuCuller)
+    {
+        gpuCuller->cull(planes, eye, P[1][1], lodSize, lodBias);
+        for (size_t i = 0; i < assets.size(); i++)
+        {
+            assets[i].mesh->bind(mat4(1.f), V, P, eye, lightColor, lightPosition, 15, 16);
+            Metrics::add(Metrics::PROGRAM_BINDS);
+            gpuCuller->draw(int(i));
+        }
+        numVisible = -1;
+        return;
+    }
+
+    visibleItems.clear();
+    bvh.query(planes, visibleItems);
+
+    if (occlusion)
+    {
+        cullOccluded(occlusion, P * V, clipPlane);
+    }
+    numVisible = int(visibleItems.size());
+
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        assets[i].visible.resize(assets[i].mesh->numLods);
+        for (size_t k = 0; k < assets[i].visible.size(); k++)
+        {
+            assets[i].visible[k].clear();
+        }
+    }
+    for (size_t i = 0; i < visibleItems.size(); i++)
+    {
+        Asset &asset = assets[itemAssets[visibleItems[i]]];
+        int lod = selectLod(visibleItems[i], P, eye, lodBias);
+        asset.visible[lod].push_back(asset.instances[visibleItems[i] - asset.firstItem]);
+    }
+
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        for (size_t k = 0; k < assets[i].visible.size(); k++)
+        {
+            if (!assets[i].visible[k].empty())
+            {
+                assets[i].mesh->setInstances(assets[i].visible[k]);
+                assets[i].mesh->draw(mat4(1.f), V, P, eye, lightColor, lightPosition, 15, 16, int(k));
+                Metrics::add(Metrics::PROGRAM_BINDS);
+                Metrics::add(Metrics::DRAW_CALLS, assets[i].mesh->numDrawCalls);
+                Metrics::add(Metrics::TRIANGLES, assets[i].mesh->numTriangles);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Stream chunks of out-of-core meshes, once per frame
+// Parameters:
+//   1. VP: projection * view of the main camera
+//   2. eye: eye position
+// -----------------------------------------------------
+void Scene::updateStreams(mat4 VP, vec3 eye)
+{
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i]->update(VP, eye);
+    }
+}
+
+// -----------------------------------------------------
+// Select the LOD of an instance from its projected size
+// Parameters:
+//   1. item: instance in the BVH
+//   2. P: projection matrix
+//   3. eye: eye position
+//   4. lodBias: number of LODs to add
+// Return: LOD of the instance, clamped to the LODs of its mesh
+// -----------------------------------------------------
+int Scene::selectLod(int item, const mat4 &P, vec3 eye, int lodBias)
+{
+    const AABB &bounds = bvh.itemBounds[item];
+    float radius = 0.5f * distance(bounds.min, bounds.max);
+    float dist = std::max(distance(bounds.center(), eye), 1e-3f);
+
+    // P[1][1] is 1 / tan(fov / 2), so this is the fraction of the screen height
+    float size = radius / dist * P[1][1];
+
+    int lod = 0;
+    for (float threshold = lodSize; size < threshold && lod < 8; threshold *= 0.5f)
+    {
+        lod++;
+    }
+
+    return std::min(lod + lodBias, assets[itemAssets[item]].mesh->numLods - 1);
+}
+
+// -----------------------------------------------------
+// Remove instances hidden by occluders from visibleItems
+// - Visible occluders are rasterized first, then kept
+// Parameters:
+//   1. occlusion: depth buffer of this view
+//   2. VP: projection * view
+//   3. clipPlane: plane clipping the pass, vec4(0) means no plane
+// -----------------------------------------------------
+void Scene::cullOccluded(OcclusionBuffer *occlusion, mat4 VP, vec4 clipPlane)
+{
+    occlusion->clear(VP);
+
+    for (size_t i = 0; i < visibleItems.size(); i++)
+    {
+        const Asset &asset = assets[itemAssets[visibleItems[i]]];
+        if (!asset.isOccluder)
+        {
+            continue;
+        }
+
+        // Full detail only: a coarser LOD may cover more than the mesh
+        const mat4 &M = asset.instances[visibleItems[i] - asset.firstItem];
+        for (size_t j = 0; j < asset.mesh->subMeshes.size(); j++)
+        {
+            const Mesh::SubMesh &sub = asset.mesh->subMeshes[j];
+            if (!sub.lodCounts.empty())
+            {
+                occlusion->rasterize(sub.vtxs, sub.indices.data(), sub.lodCounts[0], M, clipPlane);
+            }
+        }
+    }
+
+    occlusion->buildPyramid();
+
+    size_t n = 0;
+    for (size_t i = 0; i < visibleItems.size(); i++)
+    {
+        int item = visibleItems[i];
+        if (assets[itemAssets[item]].isOccluder || !occlusion->isOccluded(bvh.itemBounds[item]))
+        {
+            visibleItems[n++] = item;
+        }
+    }
+    visibleItems.resize(n);
+}
+
+// -----------------------------------------------------
+// Move an instance
+// - Only the BVH boxes above the instance are refitted
+// Parameters:
+//   1. asset: index of the asset
+//   2. instance: index of the instance in the asset
+//   3. M: new model matrix
+// -----------------------------------------------------
+void Scene::moveInstance(int asset, int instance, mat4 M)
+{
+    assets[asset].instances[instance] = M;
+    bvh.update(assets[asset].firstItem + instance, instanceBounds(asset, instance));
+
+    if (gpuCuller)
+    {
+        gpuCuller->updateInstance(assets[asset].firstItem + instance, gpuInstance(asset, instance));
+    }
+}
+
+// -----------------------------------------------------
+// Move culling and draw submission to the GPU
+// - Needs OpenGL 4.3
+// -----------------------------------------------------
+void Scene::initGpuCulling()
+{
+    vector<Mesh *> meshes;
+    vector<int> assetFirsts;
+    vector<GpuCuller::Instance> instances;
+
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        meshes.push_back(assets[i].mesh);
+        assetFirsts.push_back(assets[i].firstItem);
+        for (size_t j = 0; j < assets[i].instances.size(); j++)
+        {
+            instances.push_back(gpuInstance(int(i), int(j)));
+        }
+    }
+
+    gpuCuller = new GpuCuller();
+    gpuCuller->initGeometry(meshes);
+    gpuCuller->initInstances(instances, assetFirsts);
+    gpuCuller->initCommands(meshes, assetFirsts);
+}
+
+// -----------------------------------------------------
+// Instance data for the GPU culler
+// -----------------------------------------------------
+GpuCuller::Instance Scene::gpuInstance(int asset, int instance)
+{
+    AABB bounds = bvh.itemBounds[assets[asset].firstItem + instance];
+
+    GpuCuller::Instance data;
+    data.M = assets[asset].instances[instance];
+    data.boundsMin = vec4(bounds.min, float(asset));
+    data.boundsMax = vec4(bounds.max, 0.f);
+
+    return data;
+}
+
+// -----------------------------------------------------
+// Build the BVH over all instances
+// -----------------------------------------------------
+void Scene::buildBVH()
+{
+    vector<AABB> bounds;
+    itemAssets.clear();
+
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        assets[i].firstItem = int(bounds.size());
+        for (size_t j = 0; j < assets[i].instances.size(); j++)
+        {
+            bounds.push_back(instanceBounds(int(i), int(j)));
+            itemAssets.push_back(int(i));
+        }
+    }
+
+    bvh.build(bounds);
+}
+
+// -----------------------------------------------------
+// World space bounding box of an instance
+// -----------------------------------------------------
+AABB Scene::instanceBounds(int asset, int instance)
+{
+    const Mesh *mesh = assets[asset].mesh;
+    return AABB(mesh->boundsMin, mesh->boundsMax).transform(assets[asset].instances[instance]);
+}
+
+// -----------------------------------------------------
+// Set clipping planes of all meshes
+// - clipPlane0: refraction, clipPlane1: reflection
+// -----------------------------------------------------
+void Scene::setClipPlane0(vec4 plane)
+{
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        assets[i].mesh->setClipPlane(assets[i].mesh->uniClipPlane0, plane);
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i]->setClipPlane(streams[i]->uniClipPlane0, plane);
+    }
+}
+
+void Scene::setClipPlane1(vec4 plane)
+{
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        assets[i].mesh->setClipPlane(assets[i].mesh->uniClipPlane1, plane);
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i]->setClipPlane(streams[i]->uniClipPlane1, plane);
+    }
+}
+
+// -----------------------------------------------------
+// Total number of instances
+// -----------------------------------------------------
+int Scene::numInstances()
+{
+    int n = 0;
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        n += int(assets[i].instances.size());
+    }
+
+    return n;
+}
+
+// -----------------------------------------------------
+// Find a mesh by name
+// Return: index of the asset, -1 if not found
+// -----------------------------------------------------
+int Scene::findAsset(const string name)
+{
+    for (size_t i = 0; i < assets.size(); i++)
+    {
+        if (assets[i].name == name)
+        {
+            return int(i);
+        }
+    }
+
+    return -1;
+}
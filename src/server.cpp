@@ -0,0 +1,349 @@
+#include "server.h"
+#include "capture.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. path: file system path of the socket
+// -----------------------------------------------------
+RenderServer::RenderServer(const string path)
+{
+    socketPath = path;
+    listenFd = -1;
+    clientFd = -1;
+
+    shmFd = -1;
+    shmData = NULL;
+    shmSize = 0;
+
+    maxSize = 8192;
+}
+
+// -----------------------------------------------------
+// Destructor
+// - Removes the socket file and the shared memory segment
+// -----------------------------------------------------
+RenderServer::~RenderServer()
+{
+    if (clientFd >= 0)
+    {
+        close(clientFd);
+    }
+
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+
+    if (shmData)
+    {
+        munmap(shmData, shmSize);
+        close(shmFd);
+        shm_unlink(shmName.c_str());
+    }
+}
+
+// -----------------------------------------------------
+// Start listening
+// Return: false if the socket can't be created
+// -----------------------------------------------------
+bool RenderServer::start()
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (socketPath.length() >= sizeof(addr.sun_path))
+    {
+        std::cout << "RenderServer: socket path too long: " << socketPath << '\n';
+        return false;
+    }
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    // A client that disconnects early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        std::cout << "RenderServer: can't create socket: " << strerror(errno) << '\n';
+        return false;
+    }
+
+    // Remove the socket file left by a previous server
+    unlink(socketPath.c_str());
+
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0)
+    {
+        std::cout << "RenderServer: can't listen on " << socketPath << ": " << strerror(errno) << '\n';
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    std::cout << "RenderServer: listening on " << socketPath << '\n';
+    return true;
+}
+
+// -----------------------------------------------------
+// Wait for the next valid request
+// - Accepts a new client when the current one disconnects
+// - Answers malformed requests with an error and keeps waiting
+// Parameters:
+//   1. request: request to fill
+// Return: false when a client asks the server to quit
+// -----------------------------------------------------
+bool RenderServer::receive(Request &request)
+{
+    while (true)
+    {
+        if (clientFd < 0)
+        {
+            clientFd = accept(listenFd, NULL, NULL);
+            if (clientFd < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cout << "RenderServer: accept failed: " << strerror(errno) << '\n';
+                return false;
+            }
+            lineBuffer.clear();
+        }
+
+        string line;
+        if (!readLine(line))
+        {
+            close(clientFd);
+            clientFd = -1;
+            continue;
+        }
+
+        if (line == "quit")
+        {
+            sendLine("ok");
+            return false;
+        }
+
+        if (parse(line, request))
+        {
+            return true;
+        }
+
+        replyError("bad request");
+    }
+}
+
+// -----------------------------------------------------
+// Make sure the shared memory segment can hold a reply
+// - A larger reply gets a new segment with a new name,
+//   as shared memory can't always be resized (e.g. on macOS)
+// Parameters:
+//   1. size: size of the reply in bytes
+// Return: start of the segment, NULL if it can't be created
+// -----------------------------------------------------
+unsigned char *RenderServer::reserve(size_t size)
+{
+    if (shmData && size <= shmSize)
+    {
+        return shmData;
+    }
+
+    if (shmData)
+    {
+        munmap(shmData, shmSize);
+        close(shmFd);
+        shm_unlink(shmName.c_str());
+        shmData = NULL;
+        shmSize = 0;
+    }
+
+    static int numSegments = 0;
+    shmName = "/dudvWater." + to_string(getpid()) + "." + to_string(numSegments++);
+
+    shmFd = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shmFd < 0)
+    {
+        std::cout << "RenderServer: can't create shared memory: " << strerror(errno) << '\n';
+        return NULL;
+    }
+
+    void *data = MAP_FAILED;
+    if (ftruncate(shmFd, off_t(size)) == 0)
+    {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    }
+
+    if (data == MAP_FAILED)
+    {
+        std::cout << "RenderServer: can't map shared memory: " << strerror(errno) << '\n';
+        close(shmFd);
+        shm_unlink(shmName.c_str());
+        shmFd = -1;
+        return NULL;
+    }
+
+    shmData = (unsigned char *)data;
+    shmSize = size;
+
+    return shmData;
+}
+
+// -----------------------------------------------------
+// Encode the raw pixels in shared memory
+// Parameters:
+//   1. format: "raw" keeps the pixels, otherwise an image format
+//   2. w, h: size of the pixels
+// Return: size of the reply in bytes, 0 on failure
+// -----------------------------------------------------
+size_t RenderServer::encode(const string format, int w, int h)
+{
+    if (format == "raw")
+    {
+        // The alpha of the framebuffer is undefined, raw pixels are opaque
+        size_t numPixels = size_t(w) * h;
+        for (size_t i = 0; i < numPixels; i++)
+        {
+            shmData[i * 4 + 3] = 255;
+        }
+        return numPixels * 4;
+    }
+
+    FIBITMAP *image = Capture::toImage(shmData, w, h);
+    if (!image)
+    {
+        return 0;
+    }
+    FIMEMORY *stream = FreeImage_OpenMemory();
+
+    size_t size = 0;
+    BYTE *bytes = NULL;
+    unsigned numBytes = 0;
+    if (FreeImage_SaveToMemory(FreeImage_GetFIFFromFormat(format.c_str()), image, stream, 0) &&
+        FreeImage_AcquireMemory(stream, &bytes, &numBytes))
+    {
+        // The image holds its own copy, so the segment may be replaced here
+        unsigned char *dst = reserve(numBytes);
+        if (dst)
+        {
+            memcpy(dst, bytes, numBytes);
+            size = numBytes;
+        }
+    }
+
+    FreeImage_CloseMemory(stream);
+    FreeImage_Unload(image);
+
+    return size;
+}
+
+// -----------------------------------------------------
+// Tell the client where its pixels are
+// "ok shmName bytes width height"
+// - The segment is only valid until the next request
+// -----------------------------------------------------
+void RenderServer::reply(size_t bytes, int w, int h)
+{
+    sendLine("ok " + shmName + " " + to_string(bytes) + " " + to_string(w) + " " + to_string(h));
+}
+
+void RenderServer::replyError(const string message) { sendLine("error " + message); }
+
+// -----------------------------------------------------
+// Read a line from the client
+// Return: false if the client disconnected
+// -----------------------------------------------------
+bool RenderServer::readLine(string &line)
+{
+    size_t end;
+    while ((end = lineBuffer.find('\n')) == string::npos)
+    {
+        char buffer[1024];
+        ssize_t n = recv(clientFd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        lineBuffer.append(buffer, n);
+    }
+
+    line = lineBuffer.substr(0, end);
+    lineBuffer.erase(0, end + 1);
+
+    // Accept "\r\n" line endings
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Send a line to the client
+// Return: false if the client disconnected
+// -----------------------------------------------------
+bool RenderServer::sendLine(const string line)
+{
+    string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.length())
+    {
+        ssize_t n = send(clientFd, data.c_str() + sent, data.length() - sent, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Parse a render request
+// Return: false if the request is malformed
+// -----------------------------------------------------
+bool RenderServer::parse(const string line, Request &request)
+{
+    stringstream ss(line);
+    string command;
+    ss >> command;
+    if (command != "render")
+    {
+        return false;
+    }
+
+    Pose &pose = request.pose;
+    ss >> pose.eyePoint.x >> pose.eyePoint.y >> pose.eyePoint.z >> pose.verticalAngle >> pose.horizontalAngle >>
+        pose.fov >> pose.time >> request.width >> request.height >> request.format;
+    if (ss.fail())
+    {
+        return false;
+    }
+
+    if (request.width < 1 || request.height < 1 || request.width > maxSize || request.height > maxSize)
+    {
+        return false;
+    }
+
+    return request.format == "raw" || FreeImage_GetFIFFromFormat(request.format.c_str()) != FIF_UNKNOWN;
+}
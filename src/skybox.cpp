@@ -1,10 +1,16 @@
 #include "skybox.h"
+#include "resource.h"
+#include "metrics.h"
 
 // -----------------------------------------
 // Constructor
+// Parameters:
+//   1. texStreamer: streams the cubemap by mip level
 // -----------------------------------------
-Skybox::Skybox()
+Skybox::Skybox(TextureStreamer *texStreamer)
 {
+    streamer = texStreamer;
+
     initShader();
     initUniform();
     initTexture();
@@ -13,8 +19,14 @@ Skybox::Skybox()
 
 // -----------------------------------------
 // Destructor
+// - The cubemap belongs to the texture streamer
 // -----------------------------------------
-Skybox::~Skybox() {}
+Skybox::~Skybox()
+{
+    Resources::destroy(Resources::BUFFER, vbo);
+    Resources::destroy(Resources::VERTEX_ARRAY, vao);
+    Resources::destroy(Resources::PROGRAM, shader);
+}
 
 // ----------------------------------------------------
 // Draw skybox
@@ -38,6 +50,10 @@ void Skybox::draw(mat4 model, mat4 view, mat4 projection, vec3 eyePoint)
     glUseProgram(shader);
     glBindVertexArray(vao);
     glDrawArrays(GL_TRIANGLES, 0, 36);
+
+    Metrics::add(Metrics::PROGRAM_BINDS);
+    Metrics::add(Metrics::DRAW_CALLS);
+    Metrics::add(Metrics::TRIANGLES, 12);
 }
 
 // ----------------------------------------------------
@@ -45,19 +61,8 @@ void Skybox::draw(mat4 model, mat4 view, mat4 projection, vec3 eyePoint)
 // ----------------------------------------------------
 void Skybox::initTexture()
 {
-    // Create texture object
-    glActiveTexture(GL_TEXTURE0);
-    glGenTextures(1, &tbo);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, tbo);
-
-    // Parameter settings
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
     // Read images into cubemap
+    // - Only small mip levels are loaded now, finer ones when they are seen
     vector<string> texImages;
     texImages.push_back("./image/right.png");
     texImages.push_back("./image/left.png");
@@ -66,18 +71,28 @@ void Skybox::initTexture()
     texImages.push_back("./image/back.png");
     texImages.push_back("./image/front.png");
 
-    for (GLuint i = 0; i < texImages.size(); i++)
-    {
-        FIBITMAP *image = FreeImage_ConvertTo24Bits(FreeImage_Load(FIF_PNG, texImages[i].c_str()));
-        int width = FreeImage_GetWidth(image);
-        int height = FreeImage_GetHeight(image);
+    texSky = streamer->load(GL_TEXTURE_CUBE_MAP, 0, texImages);
+    tbo = texSky >= 0 ? streamer->textures[texSky].tbo : 0;
 
-        // Set image to each face of a cubemap
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE,
-                     (void *)FreeImage_GetBits(image));
+    // Parameter settings
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, tbo);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+}
 
-        FreeImage_Unload(image);
-    }
+// ----------------------------------------------------
+// Report the size of the cubemap on screen for streaming
+// - A face covers 90 degrees, whatever the distance
+// Parameters:
+//   1. P: projection matrix of a view
+//   2. height: height of the view in pixels
+// ----------------------------------------------------
+void Skybox::streamTexture(mat4 P, int height)
+{
+    // P[1][1] is 1 / tan(fov / 2), and a face spans tan(45) * 2
+    streamer->setFootprint(texSky, height * P[1][1]);
 }
 
 // ----------------------------------------------------
@@ -87,12 +102,13 @@ void Skybox::initBuffer()
 {
     // If put these code before setting texture,
     // no skybox will be rendered
-    glGenVertexArrays(1, &vao);
+    vao = Resources::create(Resources::VERTEX_ARRAY, "skybox");
     glBindVertexArray(vao);
 
-    glGenBuffers(1, &vbo);
+    vbo = Resources::create(Resources::BUFFER, "skybox");
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * 6 * 3, vtxs, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vbo, sizeof(GLfloat) * 6 * 6 * 3);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
     glEnableVertexAttribArray(0);
 }
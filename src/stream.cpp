@@ -0,0 +1,744 @@
+#include "stream.h"
+#include "meshopt.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "resource.h"
+
+// Chunk file layout
+// - Header: magic, number of chunks, largest chunk (vertices, indices)
+// - Table: bounds (6 floats), numVtxs, numIndices, offset (64 bits)
+// - Data: vertices then indices of each chunk, 4-byte aligned
+static const char CHUNK_MAGIC[8] = "DWCHK1";
+static const size_t HEADER_SIZE = 8 + 4 * sizeof(GLuint);
+static const size_t ENTRY_SIZE = 6 * sizeof(float) + 2 * sizeof(GLuint) + sizeof(unsigned long long);
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. fileName: chunk file path
+//   2. poolMB: size of the GPU pool in megabytes
+// -----------------------------------------------------
+MeshStream::MeshStream(const string fileName, float poolMB)
+{
+    fd = -1;
+    fileData = NULL;
+    fileSize = 0;
+
+    frame = 0;
+    numDrawn = 0;
+    numTriangles = 0;
+    maxLoads = 8;
+    uploadsPerFrame = 4;
+    prefetchRadius = 0.f;
+
+    numLoads = 0;
+    isStopping = false;
+
+    open(fileName);
+    initPool(poolMB);
+    initShader();
+
+    loader = thread(&MeshStream::loadLoop, this);
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+MeshStream::~MeshStream()
+{
+    {
+        lock_guard<mutex> lock(loadMutex);
+        isStopping = true;
+    }
+    loadCond.notify_all();
+    loader.join();
+
+    close();
+
+    Resources::destroy(Resources::BUFFER, vbo);
+    Resources::destroy(Resources::BUFFER, ebo);
+    Resources::destroy(Resources::BUFFER, vboInstance);
+    Resources::destroy(Resources::VERTEX_ARRAY, vao);
+    Resources::destroy(Resources::PROGRAM, shader);
+}
+
+// -----------------------------------------------------
+// Map a chunk file and read its chunk table
+// - Only the table is read here, chunks are read when requested
+// Return: false if the file can't be mapped or is invalid
+// -----------------------------------------------------
+bool MeshStream::open(const string fileName)
+{
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0 || size_t(fileStat.st_size) < HEADER_SIZE)
+    {
+        std::cout << "MeshStream: can't read " << fileName << '\n';
+        close();
+        return false;
+    }
+
+    fileSize = size_t(fileStat.st_size);
+    void *data = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        std::cout << "MeshStream: can't map " << fileName << '\n';
+        close();
+        return false;
+    }
+    fileData = (char *)data;
+
+    GLuint header[4];
+    memcpy(header, fileData + 8, sizeof(header));
+    GLuint numChunks = header[0];
+
+    if (memcmp(fileData, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) != 0 ||
+        HEADER_SIZE + size_t(numChunks) * ENTRY_SIZE > fileSize)
+    {
+        std::cout << "MeshStream: " << fileName << " is not a chunk file" << '\n';
+        close();
+        return false;
+    }
+
+    slotVtxs = int(header[1]);
+    slotIndices = int(header[2]);
+
+    const char *entry = fileData + HEADER_SIZE;
+    for (GLuint i = 0; i < numChunks; i++, entry += ENTRY_SIZE)
+    {
+        Chunk chunk;
+        float bounds[6];
+        memcpy(bounds, entry, sizeof(bounds));
+        memcpy(&chunk.numVtxs, entry + 24, sizeof(GLuint));
+        memcpy(&chunk.numIndices, entry + 28, sizeof(GLuint));
+        memcpy(&chunk.offset, entry + 32, sizeof(chunk.offset));
+        chunk.boundsMin = vec3(bounds[0], bounds[1], bounds[2]);
+        chunk.boundsMax = vec3(bounds[3], bounds[4], bounds[5]);
+
+        size_t bytes = size_t(chunk.numVtxs) * VERTEX_SIZE + size_t(chunk.numIndices) * sizeof(GLushort);
+        if (chunk.offset + bytes > fileSize || int(chunk.numVtxs) > slotVtxs || int(chunk.numIndices) > slotIndices)
+        {
+            std::cout << "MeshStream: broken chunk " << i << " in " << fileName << '\n';
+            chunks.clear();
+            close();
+            return false;
+        }
+        chunks.push_back(chunk);
+    }
+
+    // Chunks around the eye are prefetched, whatever the direction
+    vector<AABB> bounds;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        bounds.push_back(AABB(chunks[i].boundsMin, chunks[i].boundsMax));
+        prefetchRadius = std::max(prefetchRadius, distance(chunks[i].boundsMin, chunks[i].boundsMax));
+    }
+    bvh.build(bounds);
+
+    chunkSlots.assign(chunks.size(), -1);
+    lastUsed.assign(chunks.size(), -1);
+    lruPositions.resize(chunks.size());
+    isRequested.assign(chunks.size(), 0);
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Unmap the chunk file
+// -----------------------------------------------------
+void MeshStream::close()
+{
+    if (fileData)
+    {
+        munmap(fileData, fileSize);
+        fileData = NULL;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+
+    if (chunks.empty())
+    {
+        slotVtxs = 0;
+        slotIndices = 0;
+    }
+}
+
+// -----------------------------------------------------
+// Initialize the GPU pool
+// - Slots are as large as the largest chunk,
+//   so any chunk fits in any slot
+// Parameters:
+//   1. poolMB: size of the pool in megabytes
+// -----------------------------------------------------
+void MeshStream::initPool(float poolMB)
+{
+    size_t slotBytes = size_t(slotVtxs) * VERTEX_SIZE + size_t(slotIndices) * sizeof(GLushort);
+    numSlots = 0;
+    if (slotBytes > 0)
+    {
+        numSlots = int(std::min(double(chunks.size()), std::max(1.0, poolMB * 1024.0 * 1024.0 / slotBytes)));
+    }
+    slotChunks.assign(numSlots, -1);
+
+    vao = Resources::create(Resources::VERTEX_ARRAY, "stream");
+    glBindVertexArray(vao);
+
+    // vbo for interleaved vertices of all slots
+    vbo = Resources::create(Resources::BUFFER, "stream");
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(numSlots) * slotVtxs * VERTEX_SIZE, NULL, GL_DYNAMIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vbo, size_t(numSlots) * slotVtxs * VERTEX_SIZE);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, VERTEX_SIZE, 0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, VERTEX_SIZE, (void *)12);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, VERTEX_SIZE, (void *)16);
+    glEnableVertexAttribArray(2);
+
+    // Chunks are in world space, drawn as one instance
+    mat4 identity(1.f);
+    vboInstance = Resources::create(Resources::BUFFER, "stream");
+    glBindBuffer(GL_ARRAY_BUFFER, vboInstance);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(mat4), value_ptr(identity), GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vboInstance, sizeof(mat4));
+    for (int k = 0; k < 4; k++)
+    {
+        glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(sizeof(vec4) * k));
+        glEnableVertexAttribArray(3 + k);
+        glVertexAttribDivisor(3 + k, 1);
+    }
+
+    // ebo for indices of all slots
+    ebo = Resources::create(Resources::BUFFER, "stream");
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, GLsizeiptr(numSlots) * slotIndices * sizeof(GLushort), NULL,
+                 GL_DYNAMIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, ebo, size_t(numSlots) * slotIndices * sizeof(GLushort));
+
+    glBindVertexArray(0);
+}
+
+// -----------------------------------------------------
+// Initialize shader and its uniform variables
+// -----------------------------------------------------
+void MeshStream::initShader()
+{
+    shader = buildShader("./shader/vsReflect.glsl", "./shader/fsReflect.glsl");
+
+    uniModel = myGetUniformLocation(shader, "M");
+    uniView = myGetUniformLocation(shader, "V");
+    uniProjection = myGetUniformLocation(shader, "P");
+    uniEyePoint = myGetUniformLocation(shader, "eyePoint");
+    uniLightColor = myGetUniformLocation(shader, "lightColor");
+    uniLightPosition = myGetUniformLocation(shader, "lightPosition");
+    uniTexBase = myGetUniformLocation(shader, "texBase");
+    uniTexNormal = myGetUniformLocation(shader, "texNormal");
+    uniClipPlane0 = myGetUniformLocation(shader, "clipPlane0");
+    uniClipPlane1 = myGetUniformLocation(shader, "clipPlane1");
+}
+
+// -----------------------------------------------------
+// Stream chunks for the main camera, once per frame
+// - Uploads chunks loaded since the last frame,
+//   then requests the nearest chunks that are in view or around the eye
+// Parameters:
+//   1. VP: projection * view of the main camera
+//   2. eye: eye position
+// -----------------------------------------------------
+void MeshStream::update(mat4 VP, vec3 eye)
+{
+    frame++;
+
+    // Chunks in view, and chunks in a box around the eye
+    vector<int> wanted;
+    bvh.query(BVH::frustum(VP), wanted);
+
+    vector<vec4> box;
+    box.push_back(vec4(1.f, 0.f, 0.f, prefetchRadius - eye.x));
+    box.push_back(vec4(-1.f, 0.f, 0.f, prefetchRadius + eye.x));
+    box.push_back(vec4(0.f, 1.f, 0.f, prefetchRadius - eye.y));
+    box.push_back(vec4(0.f, -1.f, 0.f, prefetchRadius + eye.y));
+    box.push_back(vec4(0.f, 0.f, 1.f, prefetchRadius - eye.z));
+    box.push_back(vec4(0.f, 0.f, -1.f, prefetchRadius + eye.z));
+    bvh.query(box, wanted);
+
+    sort(wanted.begin(), wanted.end());
+    wanted.erase(unique(wanted.begin(), wanted.end()), wanted.end());
+
+    // Nearest first, by distance from the eye to the chunk bounds
+    vector<pair<float, int>> byDistance;
+    for (size_t i = 0; i < wanted.size(); i++)
+    {
+        const Chunk &chunk = chunks[wanted[i]];
+        vec3 closest = min(max(eye, chunk.boundsMin), chunk.boundsMax);
+        byDistance.push_back(make_pair(distance(eye, closest), wanted[i]));
+    }
+    sort(byDistance.begin(), byDistance.end());
+
+    // Only as many chunks as the pool holds, so that loads never evict each other
+    if (byDistance.size() > size_t(numSlots))
+    {
+        byDistance.resize(numSlots);
+    }
+    for (size_t i = 0; i < byDistance.size(); i++)
+    {
+        lastUsed[byDistance[i].second] = frame;
+        touch(byDistance[i].second);
+    }
+
+    // Upload finished loads
+    vector<Load> ready;
+    {
+        lock_guard<mutex> lock(loadMutex);
+        while (!loaded.empty() && int(ready.size()) < uploadsPerFrame)
+        {
+            ready.push_back(Load());
+            ready.back().chunk = loaded.front().chunk;
+            ready.back().data.swap(loaded.front().data);
+            loaded.pop_front();
+        }
+    }
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        if (!upload(ready[i]))
+        {
+            // No slot until a chunk is unused for a frame, keep the rest in order
+            lock_guard<mutex> lock(loadMutex);
+            for (size_t j = ready.size(); j-- > i;)
+            {
+                loaded.push_front(Load());
+                loaded.front().chunk = ready[j].chunk;
+                loaded.front().data.swap(ready[j].data);
+            }
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < byDistance.size(); i++)
+    {
+        request(byDistance[i].second);
+    }
+}
+
+// -----------------------------------------------------
+// Ask the loader thread for a chunk
+// - Does nothing if the chunk is resident or already requested,
+//   or if too many loads are in flight
+// -----------------------------------------------------
+void MeshStream::request(int chunk)
+{
+    if (chunkSlots[chunk] >= 0 || isRequested[chunk] || numLoads >= maxLoads)
+    {
+        return;
+    }
+
+    isRequested[chunk] = 1;
+    numLoads++;
+
+    {
+        lock_guard<mutex> lock(loadMutex);
+        requests.push_back(chunk);
+    }
+    loadCond.notify_one();
+}
+
+// -----------------------------------------------------
+// Upload a loaded chunk into a slot of the pool
+// - Chunks nobody asked for since the last frame are dropped
+// Return: false if all slots are in use, the chunk stays loaded and requested
+// -----------------------------------------------------
+bool MeshStream::upload(const Load &load)
+{
+    int chunk = load.chunk;
+    int slot = -1;
+    if (chunkSlots[chunk] < 0 && lastUsed[chunk] >= frame - 1)
+    {
+        slot = findSlot();
+        if (slot < 0)
+        {
+            return false;
+        }
+    }
+
+    isRequested[chunk] = 0;
+    numLoads--;
+    if (slot < 0)
+    {
+        return true;
+    }
+
+    const Chunk &c = chunks[chunk];
+    size_t vtxBytes = size_t(c.numVtxs) * VERTEX_SIZE;
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, GLintptr(slot) * slotVtxs * VERTEX_SIZE, vtxBytes, load.data.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // The element buffer binding is part of the vao
+    glBindVertexArray(vao);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, GLintptr(slot) * slotIndices * sizeof(GLushort),
+                    c.numIndices * sizeof(GLushort), load.data.data() + vtxBytes);
+    glBindVertexArray(0);
+
+    slotChunks[slot] = chunk;
+    chunkSlots[chunk] = slot;
+    lru.push_front(chunk);
+    lruPositions[chunk] = lru.begin();
+    return true;
+}
+
+// -----------------------------------------------------
+// Move a resident chunk to the front of the LRU order
+// -----------------------------------------------------
+void MeshStream::touch(int chunk)
+{
+    if (chunkSlots[chunk] >= 0)
+    {
+        lru.splice(lru.begin(), lru, lruPositions[chunk]);
+    }
+}
+
+// -----------------------------------------------------
+// Find a slot for a new chunk
+// - A free slot if any, otherwise the slot of the least recently used
+//   chunk, unless that chunk is used in the current frame
+// Return: slot, -1 if all slots are in use
+// -----------------------------------------------------
+int MeshStream::findSlot()
+{
+    if (int(lru.size()) < numSlots)
+    {
+        for (int i = 0; i < numSlots; i++)
+        {
+            if (slotChunks[i] < 0)
+            {
+                return i;
+            }
+        }
+    }
+
+    if (lru.empty() || lastUsed[lru.back()] == frame)
+    {
+        return -1;
+    }
+
+    int evicted = lru.back();
+    lru.pop_back();
+    int slot = chunkSlots[evicted];
+    chunkSlots[evicted] = -1;
+    slotChunks[slot] = -1;
+
+    return slot;
+}
+
+// -----------------------------------------------------
+// Draw resident chunks inside the view frustum
+// - Chunks in view that are not resident are requested,
+//   so that other passes (e.g. reflection) also stream what they see
+// Parameters:
+//   1. V, P: view, projection transformation matrix
+//   2. eye: eye position
+//   3. lightColor, lightPosition: lighting configuration
+//   4. clipPlane: also cull chunks fully clipped by this plane,
+//      vec4(0) means no plane
+// -----------------------------------------------------
+void MeshStream::draw(mat4 V, mat4 P, vec3 eye, vec3 lightColor, vec3 lightPosition, vec4 clipPlane)
+{
+    vector<vec4> planes = BVH::frustum(P * V);
+    if (clipPlane != vec4(0.f))
+    {
+        planes.push_back(clipPlane);
+    }
+
+    visibleChunks.clear();
+    bvh.query(planes, visibleChunks);
+
+    glUseProgram(shader);
+    glUniformMatrix4fv(uniModel, 1, GL_FALSE, value_ptr(mat4(1.f)));
+    glUniformMatrix4fv(uniView, 1, GL_FALSE, value_ptr(V));
+    glUniformMatrix4fv(uniProjection, 1, GL_FALSE, value_ptr(P));
+    glUniform3fv(uniEyePoint, 1, value_ptr(eye));
+    glUniform3fv(uniLightColor, 1, value_ptr(lightColor));
+    glUniform3fv(uniLightPosition, 1, value_ptr(lightPosition));
+    glUniform1i(uniTexBase, 15);
+    glUniform1i(uniTexNormal, 16);
+
+    glBindVertexArray(vao);
+
+    numDrawn = 0;
+    numTriangles = 0;
+    for (size_t i = 0; i < visibleChunks.size(); i++)
+    {
+        int chunk = visibleChunks[i];
+        int slot = chunkSlots[chunk];
+        if (slot < 0)
+        {
+            lastUsed[chunk] = frame;
+            request(chunk);
+            continue;
+        }
+
+        lastUsed[chunk] = frame;
+        touch(chunk);
+
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, chunks[chunk].numIndices, GL_UNSIGNED_SHORT,
+                                          (void *)(sizeof(GLushort) * slot * slotIndices), 1, slot * slotVtxs);
+        numDrawn++;
+        numTriangles += chunks[chunk].numIndices / 3;
+    }
+
+    glBindVertexArray(0);
+}
+
+// -----------------------------------------------------
+// Set a clipping plane
+// Parameters:
+//   1. uniClipPlane: uniClipPlane0 or uniClipPlane1
+//   2. plane: clipping plane
+// -----------------------------------------------------
+void MeshStream::setClipPlane(GLint uniClipPlane, vec4 plane)
+{
+    glUseProgram(shader);
+    glUniform4fv(uniClipPlane, 1, value_ptr(plane));
+}
+
+// -----------------------------------------------------
+// Number of chunks in the GPU pool
+// -----------------------------------------------------
+int MeshStream::numResident() { return int(lru.size()); }
+
+// -----------------------------------------------------
+// Loader thread
+// - Copies requested chunks out of the mapped file,
+//   so that page faults never stall the render thread
+// - The pages are released afterwards,
+//   so the file never stays in memory as a whole
+// -----------------------------------------------------
+void MeshStream::loadLoop()
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    while (true)
+    {
+        int chunk;
+        {
+            unique_lock<mutex> lock(loadMutex);
+            loadCond.wait(lock, [this] { return isStopping || !requests.empty(); });
+            if (isStopping)
+            {
+                return;
+            }
+            chunk = requests.front();
+            requests.pop_front();
+        }
+
+        const Chunk &c = chunks[chunk];
+        size_t bytes = size_t(c.numVtxs) * VERTEX_SIZE + size_t(c.numIndices) * sizeof(GLushort);
+
+        Load load;
+        load.chunk = chunk;
+        load.data.assign(fileData + c.offset, fileData + c.offset + bytes);
+
+        size_t first = size_t(c.offset) / pageSize * pageSize;
+        madvise(fileData + first, size_t(c.offset) + bytes - first, MADV_DONTNEED);
+
+        lock_guard<mutex> lock(loadMutex);
+        loaded.push_back(Load());
+        loaded.back().chunk = load.chunk;
+        loaded.back().data.swap(load.data);
+    }
+}
+
+// -----------------------------------------------------
+// Split a mesh into spatial chunks and write a chunk file
+// - Triangles are split at the median of their centers along the
+//   longest axis, until a chunk has at most maxTriangles triangles
+// - Runs offline (see meshchunk), on a machine that can hold the mesh
+// Parameters:
+//   1. meshName: 3D model file path
+//   2. chunkName: chunk file path
+//   3. maxTriangles: largest number of triangles in a chunk
+// Return: false if the model can't be imported or the file can't be written
+// -----------------------------------------------------
+bool MeshStream::buildChunks(const string meshName, const string chunkName, int maxTriangles)
+{
+    // 16-bit indices
+    maxTriangles = std::max(1, std::min(maxTriangles, 65535 / 3));
+
+    Assimp::Importer importer;
+    const aiScene *scene = importer.ReadFile(meshName, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices |
+                                                           aiProcess_PreTransformVertices);
+    if (!scene)
+    {
+        std::cout << "MeshStream: can't import " << meshName << '\n';
+        return false;
+    }
+
+    // All 3D models as one vertex list
+    vector<vec3> vtxs;
+    vector<GLushort> uvs;
+    vector<GLuint> nmls, indices;
+    for (size_t i = 0; i < scene->mNumMeshes; i++)
+    {
+        const aiMesh *mesh = scene->mMeshes[i];
+        GLuint first = GLuint(vtxs.size());
+
+        for (size_t j = 0; j < mesh->mNumVertices; j++)
+        {
+            aiVector3D &vtx = mesh->mVertices[j];
+            aiVector3D nml = mesh->HasNormals() ? mesh->mNormals[j] : aiVector3D(0.f, 1.f, 0.f);
+            aiVector3D uv = mesh->HasTextureCoords(0) ? mesh->mTextureCoords[0][j] : aiVector3D(0.f, 0.f, 0.f);
+
+            vtxs.push_back(vec3(vtx.x, vtx.y, vtx.z));
+            nmls.push_back(packNormal(vec3(nml.x, nml.y, nml.z)));
+            uvs.push_back(packHalf(uv.x));
+            uvs.push_back(packHalf(uv.y));
+        }
+
+        for (size_t j = 0; j < mesh->mNumFaces; j++)
+        {
+            const aiFace &face = mesh->mFaces[j];
+            if (face.mNumIndices == 3)
+            {
+                indices.push_back(first + face.mIndices[0]);
+                indices.push_back(first + face.mIndices[1]);
+                indices.push_back(first + face.mIndices[2]);
+            }
+        }
+    }
+    importer.FreeScene();
+
+    size_t numTriangles = indices.size() / 3;
+    vector<vec3> centers(numTriangles);
+    vector<int> triangles(numTriangles);
+    for (size_t i = 0; i < numTriangles; i++)
+    {
+        centers[i] = (vtxs[indices[i * 3]] + vtxs[indices[i * 3 + 1]] + vtxs[indices[i * 3 + 2]]) / 3.f;
+        triangles[i] = int(i);
+    }
+
+    // Split into ranges of triangles
+    vector<pair<int, int>> ranges;
+    vector<pair<int, int>> stack(1, make_pair(0, int(numTriangles)));
+    while (!stack.empty())
+    {
+        pair<int, int> range = stack.back();
+        stack.pop_back();
+
+        int count = range.second - range.first;
+        if (count <= maxTriangles)
+        {
+            if (count > 0)
+            {
+                ranges.push_back(range);
+            }
+            continue;
+        }
+
+        AABB bounds;
+        for (int i = range.first; i < range.second; i++)
+        {
+            bounds.expand(AABB(centers[triangles[i]], centers[triangles[i]]));
+        }
+        vec3 size = bounds.max - bounds.min;
+        int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+
+        int mid = range.first + count / 2;
+        nth_element(triangles.begin() + range.first, triangles.begin() + mid, triangles.begin() + range.second,
+                    [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+
+        // Second half first, so that chunks are written in spatial order
+        stack.push_back(make_pair(mid, range.second));
+        stack.push_back(make_pair(range.first, mid));
+    }
+
+    ofstream out(chunkName.c_str(), ios::binary);
+
+    // Header and table are written last, once sizes and offsets are known
+    vector<char> table(HEADER_SIZE + ranges.size() * ENTRY_SIZE, 0);
+    out.write(table.data(), table.size());
+    unsigned long long offset = table.size();
+
+    GLuint maxVtxs = 0, maxIndices = 0;
+    vector<int> localIds(vtxs.size(), -1);
+    for (size_t k = 0; k < ranges.size(); k++)
+    {
+        // Vertices of the chunk, in order of first use
+        vector<GLuint> globalIds, local;
+        for (int i = ranges[k].first; i < ranges[k].second; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                GLuint id = indices[triangles[i] * 3 + j];
+                if (localIds[id] < 0)
+                {
+                    localIds[id] = int(globalIds.size());
+                    globalIds.push_back(id);
+                }
+                local.push_back(GLuint(localIds[id]));
+            }
+        }
+        optimizeVertexCache(local, globalIds.size());
+
+        vector<char> data(globalIds.size() * VERTEX_SIZE + local.size() * sizeof(GLushort));
+        AABB bounds;
+        for (size_t i = 0; i < globalIds.size(); i++)
+        {
+            GLuint id = globalIds[i];
+            char *v = &data[i * VERTEX_SIZE];
+            memcpy(v, &vtxs[id].x, sizeof(float));
+            memcpy(v + 4, &vtxs[id].y, sizeof(float));
+            memcpy(v + 8, &vtxs[id].z, sizeof(float));
+            memcpy(v + 12, &uvs[id * 2], 2 * sizeof(GLushort));
+            memcpy(v + 16, &nmls[id], sizeof(GLuint));
+            bounds.expand(AABB(vtxs[id], vtxs[id]));
+
+            localIds[id] = -1;
+        }
+        for (size_t i = 0; i < local.size(); i++)
+        {
+            GLushort index = GLushort(local[i]);
+            memcpy(&data[globalIds.size() * VERTEX_SIZE + i * sizeof(GLushort)], &index, sizeof(index));
+        }
+
+        // Keep every chunk 4-byte aligned
+        data.resize((data.size() + 3) / 4 * 4, 0);
+        out.write(data.data(), data.size());
+
+        GLuint numVtxs = GLuint(globalIds.size());
+        GLuint numIndices = GLuint(local.size());
+        float b[6] = {bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z};
+        char *entry = &table[HEADER_SIZE + k * ENTRY_SIZE];
+        memcpy(entry, b, sizeof(b));
+        memcpy(entry + 24, &numVtxs, sizeof(numVtxs));
+        memcpy(entry + 28, &numIndices, sizeof(numIndices));
+        memcpy(entry + 32, &offset, sizeof(offset));
+
+        offset += data.size();
+        maxVtxs = std::max(maxVtxs, numVtxs);
+        maxIndices = std::max(maxIndices, numIndices);
+    }
+
+    GLuint header[4] = {GLuint(ranges.size()), maxVtxs, maxIndices, 0};
+    memcpy(&table[0], CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+    memcpy(&table[8], header, sizeof(header));
+    out.seekp(0);
+    out.write(table.data(), table.size());
+
+    if (!out)
+    {
+        std::cout << "MeshStream: can't write " << chunkName << '\n';
+        return false;
+    }
+
+    std::cout << "MeshStream: " << numTriangles << " triangles in " << ranges.size() << " chunks, " << offset / 1024
+              << " KB" << '\n';
+
+    return true;
+}
@@ -0,0 +1,67 @@
+#include "temporal.h"
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. n: re-render every n frames
+//   2. move: eye movement that forces a refresh
+//   3. turn: change of view direction (radians) that forces a refresh
+// -----------------------------------------------------
+TemporalCache::TemporalCache(int n, float move, float turn)
+{
+    interval = n;
+    maxMove = move;
+    maxTurn = turn;
+
+    isValid = false;
+    age = 0;
+    VP = mat4(1.f);
+    eye = vec3(0.f);
+    dir = vec3(0.f, 0.f, -1.f);
+    scale = 1.f;
+}
+
+// -----------------------------------------------------
+// Must the render target be rendered this frame
+// Parameters:
+//   1. eyePoint, eyeDirection: current camera
+//   2. texScale: current resolution scale
+// -----------------------------------------------------
+bool TemporalCache::needsRefresh(vec3 eyePoint, vec3 eyeDirection, float texScale)
+{
+    if (!isValid || age + 1 >= interval || texScale != scale)
+    {
+        return true;
+    }
+
+    // Reprojection is only stable for small camera motion
+    float cosTurn = dot(normalize(eyeDirection), normalize(dir));
+    if (distance(eyePoint, eye) > maxMove || cosTurn < cos(maxTurn))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+// -----------------------------------------------------
+// Record that the render target was rendered this frame
+// Parameters:
+//   1. V, P: view and projection matrices used for rendering
+//   2. eyePoint, eyeDirection: current camera
+//   3. texScale: current resolution scale
+// -----------------------------------------------------
+void TemporalCache::refresh(mat4 V, mat4 P, vec3 eyePoint, vec3 eyeDirection, float texScale)
+{
+    isValid = true;
+    age = 0;
+    VP = P * V;
+    eye = eyePoint;
+    dir = eyeDirection;
+    scale = texScale;
+}
+
+// -----------------------------------------------------
+// Record that the render target is reused this frame
+// -----------------------------------------------------
+void TemporalCache::skip() { age++; }
@@ -0,0 +1,604 @@
+#include "texstream.h"
+#include <cstring>
+#include <sys/stat.h>
+#include "resource.h"
+
+// Mip file layout
+// - Header: magic, width, height, number of levels, number of faces
+// - Levels from the finest to the coarsest, faces back to back,
+//   each face is tightly packed bottom-up BGRA, the layout uploaded as GL_RGBA8
+static const char MIP_MAGIC[8] = "DWMIP2";
+static const size_t MIP_HEADER_SIZE = 8 + 4 * sizeof(GLuint);
+
+// -----------------------------------------------------
+// Constructor
+// Parameters:
+//   1. budgetMB: memory budget of all textures in megabytes
+// -----------------------------------------------------
+TextureStreamer::TextureStreamer(float budgetMB)
+{
+    budget = size_t(budgetMB * 1024.0 * 1024.0);
+    residentBytes = 0;
+    baseSize = 64;
+    isBlocking = false;
+
+    isStopping = false;
+    loader = thread(&TextureStreamer::loadLoop, this);
+}
+
+// -----------------------------------------------------
+// Destructor
+// -----------------------------------------------------
+TextureStreamer::~TextureStreamer()
+{
+    {
+        lock_guard<mutex> lock(loadMutex);
+        isStopping = true;
+    }
+    loadCond.notify_all();
+    loader.join();
+
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        Resources::destroy(Resources::TEXTURE, textures[i].tbo);
+    }
+}
+
+// -----------------------------------------------------
+// Create a streamed texture
+// - The mip file is built on first use,
+//   and rebuilt when an image is newer than it
+// - Only levels up to baseSize are loaded here
+// Parameters:
+//   1. target: GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+//   2. texUnit: texture unit to bind the texture to
+//   3. files: image file, or the 6 cubemap faces in GL order
+// Return: index of the texture, -1 if the images can't be read
+// -----------------------------------------------------
+int TextureStreamer::load(GLenum target, int texUnit, const vector<string> &files)
+{
+    Texture tex;
+    tex.mipName = files[0] + ".mip";
+    tex.target = target;
+    tex.texUnit = texUnit;
+    tex.numFaces = int(files.size());
+    tex.footprint = 0.f;
+    tex.isLoading = false;
+
+    // An image newer than the mip file makes it stale
+    struct stat mipStat, imageStat;
+    bool isStale = stat(tex.mipName.c_str(), &mipStat) != 0;
+    for (size_t i = 0; i < files.size() && !isStale; i++)
+    {
+        isStale = stat(files[i].c_str(), &imageStat) == 0 && imageStat.st_mtime > mipStat.st_mtime;
+    }
+
+    GLuint header[4] = {0, 0, 0, 0};
+    if (!isStale)
+    {
+        char magic[8];
+        ifstream in(tex.mipName.c_str(), ios::binary);
+        in.read(magic, sizeof(magic));
+        in.read((char *)header, sizeof(header));
+        isStale = !in || memcmp(magic, MIP_MAGIC, sizeof(MIP_MAGIC)) != 0 || int(header[3]) != tex.numFaces;
+    }
+
+    if (isStale)
+    {
+        if (!buildMips(files, tex.mipName))
+        {
+            return -1;
+        }
+
+        ifstream in(tex.mipName.c_str(), ios::binary);
+        in.seekg(8);
+        in.read((char *)header, sizeof(header));
+    }
+
+    tex.width = int(header[0]);
+    tex.height = int(header[1]);
+    tex.numLevels = int(header[2]);
+
+    // Coarsest level that is at most baseSize
+    tex.baseLevel = 0;
+    while (tex.baseLevel < tex.numLevels - 1 && std::max(tex.width, tex.height) >> tex.baseLevel > baseSize)
+    {
+        tex.baseLevel++;
+    }
+    tex.residentLevel = tex.numLevels;
+    tex.wantedLevel = tex.baseLevel;
+
+    glActiveTexture(GL_TEXTURE0 + texUnit);
+    tex.tbo = Resources::create(Resources::TEXTURE, "textures");
+    glBindTexture(target, tex.tbo);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, tex.numLevels - 1);
+
+    // The loader thread reads textures under the lock
+    int index;
+    {
+        lock_guard<mutex> lock(loadMutex);
+        index = int(textures.size());
+        textures.push_back(tex);
+    }
+
+    // Small levels, coarsest first
+    for (int level = tex.numLevels - 1; level >= tex.baseLevel; level--)
+    {
+        Load load = stage(index, level);
+        load.isRead = readLevel(textures[index], level, load.pixels);
+        upload(load);
+    }
+
+    return index;
+}
+
+// -----------------------------------------------------
+// Report the size of a texture on screen
+// - Called for every view that shows the texture,
+//   the largest size of the frame is kept
+// Parameters:
+//   1. texture: index of the texture
+//   2. pixels: size of the whole image on screen, in pixels
+// -----------------------------------------------------
+void TextureStreamer::setFootprint(int texture, float pixels)
+{
+    if (texture >= 0)
+    {
+        textures[texture].footprint = std::max(textures[texture].footprint, pixels);
+    }
+}
+
+// -----------------------------------------------------
+// Stream textures, once per frame
+// - Wanted levels come from the footprints of this frame,
+//   then are made coarser until they fit the budget
+// - Levels no longer wanted are kept until the budget needs them
+// - Uploads a level read since the last frame,
+//   and requests the next finer level of textures that need one
+// -----------------------------------------------------
+void TextureStreamer::update()
+{
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        Texture &tex = textures[i];
+
+        // One texel per pixel
+        int level = tex.baseLevel;
+        if (tex.footprint > 0.f)
+        {
+            level = int(floor(log2(std::max(tex.width, tex.height) / tex.footprint)));
+            level = std::max(0, std::min(level, tex.baseLevel));
+        }
+        tex.wantedLevel = level;
+        tex.footprint = 0.f;
+    }
+
+    fitBudget();
+    makeRoom(0);
+
+    // Offline, every frame must be complete
+    if (isBlocking)
+    {
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            while (textures[i].residentLevel > textures[i].wantedLevel)
+            {
+                int residentLevel = textures[i].residentLevel;
+                Load load = stage(int(i), residentLevel - 1);
+                load.isRead = readLevel(textures[i], load.level, load.pixels);
+                upload(load);
+
+                // A level that failed or was dropped (e.g. no room in the budget)
+                // is not read again this frame
+                if (textures[i].residentLevel == residentLevel)
+                {
+                    break;
+                }
+            }
+        }
+        return;
+    }
+
+    // One level per frame, to bound the upload time
+    Load load;
+    load.texture = -1;
+    {
+        lock_guard<mutex> lock(loadMutex);
+        if (!loaded.empty())
+        {
+            load = loaded.front();
+            loaded.pop_front();
+        }
+    }
+    if (load.texture >= 0)
+    {
+        upload(load);
+    }
+
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        request(int(i));
+    }
+}
+
+// -----------------------------------------------------
+// Make wanted levels fit the budget
+// - Levels from baseLevel are always kept
+// - Otherwise, the texture whose finest wanted level is the largest
+//   gives it up first
+// -----------------------------------------------------
+void TextureStreamer::fitBudget()
+{
+    size_t total = 0;
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        for (int level = textures[i].wantedLevel; level < textures[i].numLevels; level++)
+        {
+            total += levelBytes(textures[i], level);
+        }
+    }
+
+    while (total > budget)
+    {
+        int largest = -1;
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            const Texture &tex = textures[i];
+            if (tex.wantedLevel < tex.baseLevel &&
+                (largest < 0 ||
+                 levelBytes(tex, tex.wantedLevel) > levelBytes(textures[largest], textures[largest].wantedLevel)))
+            {
+                largest = int(i);
+            }
+        }
+        if (largest < 0)
+        {
+            break;
+        }
+
+        total -= levelBytes(textures[largest], textures[largest].wantedLevel);
+        textures[largest].wantedLevel++;
+    }
+}
+
+// -----------------------------------------------------
+// Ask the loader thread for the next finer level of a texture
+// - Does nothing if the texture is fine enough or already loading
+// -----------------------------------------------------
+void TextureStreamer::request(int texture)
+{
+    Texture &tex = textures[texture];
+    if (tex.residentLevel <= tex.wantedLevel || tex.isLoading)
+    {
+        return;
+    }
+
+    tex.isLoading = true;
+    Load load = stage(texture, tex.residentLevel - 1);
+    {
+        lock_guard<mutex> lock(loadMutex);
+        requests.push_back(load);
+    }
+    loadCond.notify_one();
+}
+
+// -----------------------------------------------------
+// Prepare the read of a mip level
+// - Takes a staging buffer of the size of the level
+// Parameters:
+//   1. texture: index of the texture
+//   2. level: mip level
+// -----------------------------------------------------
+TextureStreamer::Load TextureStreamer::stage(int texture, int level)
+{
+    Load load;
+    load.texture = texture;
+    load.level = level;
+    load.staging = ingest.acquire(levelBytes(textures[texture], level), load.pixels);
+    load.isRead = false;
+
+    return load;
+}
+
+// -----------------------------------------------------
+// Upload a mip level
+// - Levels no longer wanted are dropped
+// - Levels finer than wanted are evicted to make room
+// - The staging buffer goes back to the pool in all cases
+// -----------------------------------------------------
+void TextureStreamer::upload(const Load &load)
+{
+    Texture &tex = textures[load.texture];
+    tex.isLoading = false;
+
+    double startTime = ImageIngest::now();
+    bool isValid = ingest.unmap(load.staging) && load.isRead;
+
+    size_t bytes = levelBytes(tex, load.level);
+    if (!isValid || load.level != tex.residentLevel - 1 || load.level < tex.wantedLevel)
+    {
+        ingest.release(load.staging);
+        return;
+    }
+
+    // Levels from baseLevel are always kept
+    if (load.level < tex.baseLevel && !makeRoom(bytes))
+    {
+        ingest.release(load.staging);
+        return;
+    }
+
+    int w = std::max(1, tex.width >> load.level);
+    int h = std::max(1, tex.height >> load.level);
+    size_t faceBytes = bytes / tex.numFaces;
+
+    glActiveTexture(GL_TEXTURE0 + tex.texUnit);
+    glBindTexture(tex.target, tex.tbo);
+
+    // Pixels are offsets into the staging buffer
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, load.staging);
+    for (int face = 0; face < tex.numFaces; face++)
+    {
+        GLenum faceTarget = tex.target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : tex.target;
+        glTexImage2D(faceTarget, load.level, GL_RGBA8, w, h, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                     (void *)(faceBytes * face));
+    }
+    glTexParameteri(tex.target, GL_TEXTURE_BASE_LEVEL, load.level);
+    ingest.release(load.staging);
+
+    tex.residentLevel = load.level;
+    residentBytes += bytes;
+    Resources::setBytes(Resources::TEXTURE, tex.tbo, residentTextureBytes(tex));
+    ImageIngest::addTime(ImageIngest::UPLOAD, ImageIngest::now() - startTime);
+}
+
+// -----------------------------------------------------
+// Evict levels finer than wanted until more bytes fit the budget
+// - Largest levels first
+// Parameters:
+//   1. bytes: bytes to add
+// Return: false if the bytes still don't fit
+// -----------------------------------------------------
+bool TextureStreamer::makeRoom(size_t bytes)
+{
+    while (residentBytes + bytes > budget)
+    {
+        int largest = -1;
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            const Texture &tex = textures[i];
+            if (tex.residentLevel < tex.wantedLevel &&
+                (largest < 0 ||
+                 levelBytes(tex, tex.residentLevel) > levelBytes(textures[largest], textures[largest].residentLevel)))
+            {
+                largest = int(i);
+            }
+        }
+        if (largest < 0)
+        {
+            return false;
+        }
+        evict(largest, textures[largest].residentLevel + 1);
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Release the mip levels of a texture finer than a level
+// Parameters:
+//   1. texture: index of the texture
+//   2. level: new finest resident level
+// -----------------------------------------------------
+void TextureStreamer::evict(int texture, int level)
+{
+    Texture &tex = textures[texture];
+
+    glActiveTexture(GL_TEXTURE0 + tex.texUnit);
+    glBindTexture(tex.target, tex.tbo);
+    glTexParameteri(tex.target, GL_TEXTURE_BASE_LEVEL, level);
+
+    // A level of size 0 has no storage
+    for (; tex.residentLevel < level; tex.residentLevel++)
+    {
+        for (int face = 0; face < tex.numFaces; face++)
+        {
+            GLenum faceTarget =
+                tex.target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : tex.target;
+            glTexImage2D(faceTarget, tex.residentLevel, GL_RGBA8, 0, 0, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        }
+        residentBytes -= levelBytes(tex, tex.residentLevel);
+    }
+    Resources::setBytes(Resources::TEXTURE, tex.tbo, residentTextureBytes(tex));
+}
+
+// -----------------------------------------------------
+// Size of a mip level, all faces
+// -----------------------------------------------------
+size_t TextureStreamer::levelBytes(const Texture &tex, int level)
+{
+    size_t w = std::max(1, tex.width >> level);
+    size_t h = std::max(1, tex.height >> level);
+
+    return w * h * 4 * tex.numFaces;
+}
+
+// -----------------------------------------------------
+// Size of the resident mip levels of a texture, all faces
+// -----------------------------------------------------
+size_t TextureStreamer::residentTextureBytes(const Texture &tex)
+{
+    size_t bytes = 0;
+    for (int level = tex.residentLevel; level < tex.numLevels; level++)
+    {
+        bytes += levelBytes(tex, level);
+    }
+    return bytes;
+}
+
+// -----------------------------------------------------
+// Read a mip level from the mip file
+// Parameters:
+//   1. tex: the texture
+//   2. level: mip level
+//   3. pixels: mapped staging buffer, 0 if it could not be mapped
+// Return: false if the file can't be read
+// -----------------------------------------------------
+bool TextureStreamer::readLevel(const Texture &tex, int level, unsigned char *pixels)
+{
+    if (!pixels)
+    {
+        return false;
+    }
+
+    size_t offset = MIP_HEADER_SIZE;
+    for (int l = 0; l < level; l++)
+    {
+        offset += levelBytes(tex, l);
+    }
+
+    double startTime = ImageIngest::now();
+    ifstream in(tex.mipName.c_str(), ios::binary);
+    in.seekg(offset);
+    in.read((char *)pixels, levelBytes(tex, level));
+    if (!in)
+    {
+        std::cout << "TextureStreamer: can't read level " << level << " of " << tex.mipName << '\n';
+        return false;
+    }
+    ImageIngest::addTime(ImageIngest::READ, ImageIngest::now() - startTime);
+
+    return true;
+}
+
+// -----------------------------------------------------
+// Loader thread
+// - Reads requested levels, so that file reads never stall rendering
+// -----------------------------------------------------
+void TextureStreamer::loadLoop()
+{
+    while (true)
+    {
+        Load load;
+        Texture tex;
+        {
+            unique_lock<mutex> lock(loadMutex);
+            loadCond.wait(lock, [this] { return isStopping || !requests.empty(); });
+            if (isStopping)
+            {
+                return;
+            }
+            load = requests.front();
+            requests.pop_front();
+
+            // Only fields that never change after load()
+            const Texture &source = textures[load.texture];
+            tex.mipName = source.mipName;
+            tex.width = source.width;
+            tex.height = source.height;
+            tex.numFaces = source.numFaces;
+        }
+
+        // Straight into the staging buffer
+        load.isRead = readLevel(tex, load.level, load.pixels);
+
+        lock_guard<mutex> lock(loadMutex);
+        loaded.push_back(load);
+    }
+}
+
+// -----------------------------------------------------
+// Convert images into a mip file
+// - Each level is a 2x2 box filter of the previous one
+// Parameters:
+//   1. files: image file, or the 6 cubemap faces
+//   2. mipName: mip file path
+// Return: false if an image can't be read or sizes differ
+// -----------------------------------------------------
+bool TextureStreamer::buildMips(const vector<string> &files, const string mipName)
+{
+    int width = 0, height = 0;
+    vector<vector<unsigned char>> faces(files.size());
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        FIBITMAP *image = ImageIngest::decode(files[i]);
+        if (!image)
+        {
+            return false;
+        }
+
+        int w = FreeImage_GetWidth(image);
+        int h = FreeImage_GetHeight(image);
+        if (i > 0 && (w != width || h != height))
+        {
+            std::cout << "TextureStreamer: " << files[i] << " has a different size" << '\n';
+            FreeImage_Unload(image);
+            return false;
+        }
+        width = w;
+        height = h;
+
+        // Rows of a 32-bit bitmap have no padding
+        const unsigned char *bits = FreeImage_GetBits(image);
+        faces[i].assign(bits, bits + size_t(w) * h * 4);
+
+        FreeImage_Unload(image);
+    }
+
+    GLuint numLevels = 1;
+    while ((std::max(width, height) >> numLevels) > 0)
+    {
+        numLevels++;
+    }
+
+    ofstream out(mipName.c_str(), ios::binary);
+    GLuint header[4] = {GLuint(width), GLuint(height), numLevels, GLuint(faces.size())};
+    out.write(MIP_MAGIC, sizeof(MIP_MAGIC));
+    out.write((const char *)header, sizeof(header));
+
+    int w = width, h = height;
+    for (GLuint level = 0; level < numLevels; level++)
+    {
+        for (size_t i = 0; i < faces.size(); i++)
+        {
+            out.write((const char *)faces[i].data(), faces[i].size());
+        }
+
+        // Next level, clamping odd sizes
+        int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+        for (size_t i = 0; i < faces.size(); i++)
+        {
+            vector<unsigned char> next(size_t(nw) * nh * 4);
+            for (int y = 0; y < nh; y++)
+            {
+                int y0 = std::min(y * 2, h - 1), y1 = std::min(y * 2 + 1, h - 1);
+                for (int x = 0; x < nw; x++)
+                {
+                    int x0 = std::min(x * 2, w - 1), x1 = std::min(x * 2 + 1, w - 1);
+                    for (int c = 0; c < 4; c++)
+                    {
+                        int sum = faces[i][(size_t(y0) * w + x0) * 4 + c] + faces[i][(size_t(y0) * w + x1) * 4 + c] +
+                                  faces[i][(size_t(y1) * w + x0) * 4 + c] + faces[i][(size_t(y1) * w + x1) * 4 + c];
+                        next[(size_t(y) * nw + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                    }
+                }
+            }
+            faces[i].swap(next);
+        }
+        w = nw;
+        h = nh;
+    }
+
+    if (!out)
+    {
+        std::cout << "TextureStreamer: can't write " << mipName << '\n';
+        return false;
+    }
+
+    std::cout << "TextureStreamer: built " << mipName << ", " << numLevels << " levels" << '\n';
+
+    return true;
+}
@@ -1,72 +1,468 @@
 #include "common.h"
 #include "water.h"
+#include "resource.h"
+#include "lights.h"
+#include "bvh.h"
+#include "metrics.h"
 
 const float Water::WATER_SIZE = 1.f;
 const float Water::WATER_Y = 2.2f;
-float Water::dudvMove = 0.f;
 
 // -----------------------------------------------------
 // Constructor
+// - Bodies are added afterwards
+// Parameters:
+//   1. texStreamer: streams the dudv map and normal map by mip level
+//   2. targetPool: hands out reflection and refraction targets
 // -----------------------------------------------------
-Water::Water()
+Water::Water(TextureStreamer *texStreamer, RenderTargetPool *targetPool)
 {
+    streamer = texStreamer;
+    pool = targetPool;
+
+    // About 0.0005 per frame at 60 fps
+    dudvMove = 0.f;
+    dudvMovePrev = 0.f;
+    dudvSpeed = 0.03f;
+    dudvMoveRender = 0.f;
+
+    isSkyLookup = false;
+    isProbeReflect = false;
+    isScreenRefract = false;
+    isScreenReflect = false;
+    texScale = 1.f;
+
+    maxPlanes = 4;
+    maxUpdates = 2;
+    numVisibleBodies = 0;
+    numVisiblePlanes = 0;
+    copyPlane = -1;
+
+    tboHiZ = 0;
+
+    // On macOS, targets must be WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2, don't know why
+    refractFormat = pool->formatOf("refract");
+
     initShader();
     initBuffer();
     initTexture();
     initUniform();
-    initReflect();
-    initRefract();
+
+    fboCopy = Resources::create(Resources::FRAMEBUFFER, "water");
 }
 
 // -----------------------------------------------------
 // Destructor
+// - Render targets go back to the pool, which deletes them
+// -----------------------------------------------------
+Water::~Water()
+{
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        releaseTargets(planes[i]);
+        Resources::destroy(Resources::FRAMEBUFFER, planes[i].fboReflect);
+        Resources::destroy(Resources::FRAMEBUFFER, planes[i].fboRefract);
+    }
+
+    Resources::destroy(Resources::FRAMEBUFFER, fboCopy);
+
+    if (tboHiZ)
+    {
+        Resources::destroy(Resources::FRAMEBUFFER, GLsizei(fboHiZ.size()), fboHiZ.data());
+        Resources::destroy(Resources::TEXTURE, tboHiZ);
+        Resources::destroy(Resources::PROGRAM, shaderHiZ);
+    }
+
+    Resources::destroy(Resources::PROGRAM, shader);
+    Resources::destroy(Resources::BUFFER, vbo);
+    Resources::destroy(Resources::VERTEX_ARRAY, vao);
+}
+
+// -----------------------------------------------------
+// Add a body of water
+// - It joins the plane of the bodies at its height, if any
+// Parameters:
+//   1. center: center of its surface
+//   2. size: extent along x and z, rounded up to whole tiles
+// Return: index of the body
+// -----------------------------------------------------
+int Water::addBody(vec3 center, vec2 size)
+{
+    Body body;
+    body.center = center;
+    body.tilesX = std::max(1, int(ceil(size.x / (2.f * WATER_SIZE) - 0.001f)));
+    body.tilesZ = std::max(1, int(ceil(size.y / (2.f * WATER_SIZE) - 0.001f)));
+    body.isVisible = false;
+    body.plane = -1;
+
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        if (fabs(planes[i].height - center.y) < 0.001f)
+        {
+            body.plane = int(i);
+        }
+    }
+
+    if (body.plane < 0)
+    {
+        Plane plane;
+        plane.height = center.y;
+        plane.isVisible = false;
+        plane.hasTargets = false;
+        plane.distance = 0.f;
+        plane.source = -1;
+        plane.tboReflect = plane.tboRefract = plane.tboDepthRefr = 0;
+        plane.fboReflect = Resources::create(Resources::FRAMEBUFFER, "water");
+        plane.fboRefract = Resources::create(Resources::FRAMEBUFFER, "water");
+        plane.reflectCache = reflectCache;
+        plane.refractCache = refractCache;
+
+        planes.push_back(plane);
+        body.plane = int(planes.size()) - 1;
+    }
+
+    bodies.push_back(body);
+    return int(bodies.size()) - 1;
+}
+
+// -----------------------------------------------------
+// Find the bodies and planes seen by the main camera
+// - Planes that are no longer seen give their targets back
+// - The maxPlanes nearest visible planes hold targets,
+//   farther ones borrow the textures of the plane nearest in height
+// Parameters:
+//   1. VP: projection * view matrix of the main camera
+//   2. eye: eye position
+// -----------------------------------------------------
+void Water::cull(mat4 VP, vec3 eye)
+{
+    vector<vec4> frustum = BVH::frustum(VP);
+
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        planes[i].isVisible = false;
+        planes[i].distance = FLT_MAX;
+    }
+
+    numVisibleBodies = 0;
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        Body &body = bodies[i];
+        vec3 half(body.tilesX * WATER_SIZE, 0.f, body.tilesZ * WATER_SIZE);
+        vec3 boxMin = body.center - half, boxMax = body.center + half;
+
+        // Outside if the corner farthest along a plane normal is behind it
+        body.isVisible = true;
+        for (size_t j = 0; j < frustum.size() && body.isVisible; j++)
+        {
+            vec3 n = vec3(frustum[j]);
+            vec3 pos(n.x >= 0.f ? boxMax.x : boxMin.x, n.y >= 0.f ? boxMax.y : boxMin.y,
+                     n.z >= 0.f ? boxMax.z : boxMin.z);
+            body.isVisible = dot(n, pos) + frustum[j].w >= 0.f;
+        }
+        if (!body.isVisible)
+        {
+            continue;
+        }
+
+        Plane &plane = planes[body.plane];
+        plane.isVisible = true;
+        plane.distance = std::min(plane.distance, length(eye - glm::clamp(eye, boxMin, boxMax)));
+        numVisibleBodies++;
+    }
+
+    // Visible planes, nearest first
+    vector<int> visible;
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        if (planes[i].isVisible)
+        {
+            visible.push_back(int(i));
+        }
+    }
+    sort(visible.begin(), visible.end(), [this](int a, int b) { return planes[a].distance < planes[b].distance; });
+    numVisiblePlanes = int(visible.size());
+
+    // Targets given back first, so that the pool hands them to the nearer planes
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        if (planes[i].hasTargets && !planes[i].isVisible)
+        {
+            releaseTargets(planes[i]);
+        }
+    }
+    for (size_t k = std::max(maxPlanes, 1); k < visible.size(); k++)
+    {
+        if (planes[visible[k]].hasTargets)
+        {
+            releaseTargets(planes[visible[k]]);
+        }
+    }
+    for (size_t k = 0; k < visible.size() && int(k) < std::max(maxPlanes, 1); k++)
+    {
+        if (!planes[visible[k]].hasTargets)
+        {
+            acquireTargets(planes[visible[k]]);
+        }
+    }
+
+    for (size_t k = 0; k < visible.size(); k++)
+    {
+        Plane &plane = planes[visible[k]];
+        plane.source = visible[k];
+        for (size_t i = 0; i < planes.size() && !plane.hasTargets; i++)
+        {
+            if (planes[i].hasTargets && (plane.source == visible[k] ||
+                                         fabs(planes[i].height - plane.height) <
+                                             fabs(planes[plane.source].height - plane.height)))
+            {
+                plane.source = int(i);
+            }
+        }
+    }
+
+    // The copy of the main pass is the same for every plane
+    copyPlane = visible.empty() ? -1 : visible[0];
+}
+
+// -----------------------------------------------------
+// Choose the planes whose textures are rendered this frame
+// - Planes without usable textures are always rendered,
+//   then the ones reused the longest, up to maxUpdates planes
+// - Textures of the other visible planes are reprojected
+// Parameters:
+//   1. eyePoint, eyeDirection: main camera
+//   2. scale: fraction of the textures rendered this frame
+// Return: planes to render, each only for the passes its caches ask for
+// -----------------------------------------------------
+vector<int> Water::updateOrder(vec3 eyePoint, vec3 eyeDirection, float scale)
+{
+    bool isReflectPass = !isProbeReflect && !isScreenReflect;
+    bool isRefractPass = !isScreenRefract;
+
+    vector<int> due;
+    vector<bool> isStale(planes.size(), false);
+    vector<int> ages(planes.size(), 0);
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        Plane &plane = planes[i];
+        if (!plane.isVisible || !plane.hasTargets)
+        {
+            continue;
+        }
+
+        TemporalCache *caches[2] = {isReflectPass ? &plane.reflectCache : NULL,
+                                    isRefractPass ? &plane.refractCache : NULL};
+        bool isDue = false;
+        for (int c = 0; c < 2; c++)
+        {
+            if (!caches[c])
+            {
+                continue;
+            }
+            isDue = isDue || caches[c]->needsRefresh(eyePoint, eyeDirection, scale);
+            isStale[i] = isStale[i] || !caches[c]->isValid || caches[c]->scale != scale;
+            ages[i] = std::max(ages[i], caches[c]->age);
+        }
+        if (isDue)
+        {
+            due.push_back(int(i));
+        }
+        else
+        {
+            plane.reflectCache.skip();
+            plane.refractCache.skip();
+        }
+    }
+
+    sort(due.begin(), due.end(), [&](int a, int b) {
+        if (isStale[a] != isStale[b])
+        {
+            return bool(isStale[a]);
+        }
+        if (ages[a] != ages[b])
+        {
+            return ages[a] > ages[b];
+        }
+        return planes[a].distance < planes[b].distance;
+    });
+
+    vector<int> order;
+    for (size_t k = 0; k < due.size(); k++)
+    {
+        if (isStale[due[k]] || int(order.size()) < maxUpdates)
+        {
+            order.push_back(due[k]);
+        }
+        else
+        {
+            // Over the budget, reused one more frame
+            planes[due[k]].reflectCache.skip();
+            planes[due[k]].refractCache.skip();
+        }
+    }
+
+    return order;
+}
+
+// -----------------------------------------------------
+// Render the reflection of every plane again
+// - e.g. when the reflection is rendered differently
 // -----------------------------------------------------
-Water::~Water() {}
+void Water::invalidateReflections()
+{
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        planes[i].reflectCache.isValid = false;
+    }
+}
 
 // ---------------------------------------------------------------
-// Draw water surface
-//   1. M, V, P: model, view, projection transformation matrix
+// Draw the visible water bodies
+// - Each body is drawn tile by tile with the textures of its plane
+//   1. V, P: view, projection transformation matrix
 //   2. eye: eye position
 //   3. lightColor, lightPosition: lighting configuration
 // ---------------------------------------------------------------
-void Water::draw(mat4 M, mat4 V, mat4 P, vec3 eyePoint, vec3 lightColor, vec3 lightPosition)
+void Water::draw(mat4 V, mat4 P, vec3 eyePoint, vec3 lightColor, vec3 lightPosition)
 {
+    if (numVisibleBodies == 0)
+    {
+        return;
+    }
+
     // Bind shader program
     glUseProgram(shader);
+    Metrics::add(Metrics::PROGRAM_BINDS);
 
     // Set dudv moving speed
-    glUniform1f(uniDudvMove, dudvMove);
+    glUniform1f(uniDudvMove, dudvMoveRender);
 
     // Set eye point
     glUniform3fv(uniEyePoint, 1, value_ptr(eyePoint));
 
+    // Set sky lookup switch
+    glUniform1i(uniSkyLookup, isSkyLookup);
+
+    // Set probe reflection switch
+    glUniform1i(uniProbeReflect, isProbeReflect);
+
+    // Set screen-space refraction switch
+    glUniform1i(uniScreenRefract, isScreenRefract);
+
+    // Set screen-space reflection switch
+    glUniform1i(uniScreenReflect, isScreenReflect);
+    glUniform1i(uniHiZLevels, int(fboHiZ.size()));
+
+    // Set used fraction of reflection and refraction textures
+    glUniform1f(uniTexScale, texScale);
+
     // Set lighting
     glUniform3fv(uniLightColor, 1, value_ptr(lightColor));
     glUniform3fv(uniLightPos, 1, value_ptr(lightPosition));
 
     // Set transformation matrices
-    glUniformMatrix4fv(uniM, 1, GL_FALSE, value_ptr(M));
     glUniformMatrix4fv(uniV, 1, GL_FALSE, value_ptr(V));
     glUniformMatrix4fv(uniP, 1, GL_FALSE, value_ptr(P));
 
-    // Draw mesh
     glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+
+    for (size_t b = 0; b < bodies.size(); b++)
+    {
+        const Body &body = bodies[b];
+        if (!body.isVisible)
+        {
+            continue;
+        }
+
+        // Textures and cameras of its plane
+        bindPlane(body.plane);
+
+        // Water surface tiling, from the corner of the body
+        vec3 first = body.center - vec3((body.tilesX - 1) * WATER_SIZE, 0.f, (body.tilesZ - 1) * WATER_SIZE);
+        for (int i = 0; i < body.tilesX; i++)
+        {
+            for (int j = 0; j < body.tilesZ; j++)
+            {
+                mat4 M = translate(mat4(1.0), first + vec3(2.f * WATER_SIZE * i, 0.f, 2.f * WATER_SIZE * j));
+                glUniformMatrix4fv(uniM, 1, GL_FALSE, value_ptr(M));
+
+                // Draw mesh
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+                Metrics::add(Metrics::DRAW_CALLS);
+                Metrics::add(Metrics::TRIANGLES, 2);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------
+// Bind the textures a plane is drawn with
+// - Its own, or those of the plane it borrows from,
+//   and the copy of the main pass with screen-space refraction
+// - The cameras of the textures are set for reprojection
+// Parameters:
+//   1. index: index of a visible plane
+// -----------------------------------------------------
+void Water::bindPlane(int index)
+{
+    const Plane &plane = planes[planes[index].source];
+    const Plane &refract = isScreenRefract ? planes[copyPlane] : plane;
+
+    glActiveTexture(GL_TEXTURE0 + 3);
+    glBindTexture(GL_TEXTURE_2D, plane.tboReflect);
+    glActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D, refract.tboRefract);
+    glActiveTexture(GL_TEXTURE0 + 25);
+    glBindTexture(GL_TEXTURE_2D, refract.tboDepthRefr);
+
+    glUniformMatrix4fv(uniReflectVP, 1, GL_FALSE, value_ptr(plane.reflectCache.VP));
+    glUniformMatrix4fv(uniRefractVP, 1, GL_FALSE, value_ptr(refract.refractCache.VP));
+}
+
+// -----------------------------------------------------
+// Advance water animation by one simulation step
+//   1. dt: simulation timestep in seconds
+// -----------------------------------------------------
+void Water::update(float dt)
+{
+    dudvMovePrev = dudvMove;
+    dudvMove = fmod(dudvMove + dudvSpeed * dt, 1.0f);
+}
+
+// -----------------------------------------------------
+// Interpolate water animation for rendering
+//   1. alpha: position between the last two simulation steps
+// Return: dudv offset to render with (set it to dudvMoveRender)
+// -----------------------------------------------------
+float Water::interpolate(float alpha)
+{
+    // The offset wraps around at 1
+    float next = dudvMove < dudvMovePrev ? dudvMove + 1.f : dudvMove;
+    return fmod(mix(dudvMovePrev, next, alpha), 1.0f);
 }
 
+// -----------------------------------------------------
+// Water animation at an absolute time
+//   1. time: simulated time in seconds
+// Return: dudv offset to render with
+// -----------------------------------------------------
+float Water::dudvMoveAt(double time) { return float(fmod(time * dudvSpeed, 1.0)); }
+
 // -----------------------------------------------------
 // Initialize buffer obect
 // -----------------------------------------------------
 void Water::initBuffer()
 {
     // Create vertex attribute object
-    glGenVertexArrays(1, &vao);
+    vao = Resources::create(Resources::VERTEX_ARRAY, "water");
     glBindVertexArray(vao);
 
     // Create buffer object
-    glGenBuffers(1, &vbo);
+    vbo = Resources::create(Resources::BUFFER, "water");
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vtxs), vtxs, GL_STATIC_DRAW);
+    Resources::setBytes(Resources::BUFFER, vbo, sizeof(vtxs));
 
     // Set position info
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
@@ -92,10 +488,47 @@ void Water::initShader() { shader = buildShader("./shader/vsWater.glsl", "./shad
 void Water::initTexture()
 {
     // Dudv map
-    setTexture(tboDudv, 10, "./image/fftDudv.png", FIF_PNG);
+    texDudv = streamer->load(GL_TEXTURE_2D, 10, vector<string>(1, "./image/fftDudv.png"));
+    tboDudv = texDudv >= 0 ? streamer->textures[texDudv].tbo : 0;
 
     // Normal map
-    setTexture(tboNormal, 11, "./image/fftNormal.png", FIF_PNG);
+    texNormalMap = streamer->load(GL_TEXTURE_2D, 11, vector<string>(1, "./image/fftNormal.png"));
+    tboNormal = texNormalMap >= 0 ? streamer->textures[texNormalMap].tbo : 0;
+}
+
+// -----------------------------------------------------
+// Report the size of the dudv map and normal map on screen for streaming
+// - Both repeat once per tile, and are largest where the water
+//   is nearest to the eye, right below it
+// - The nearest height of the visible bodies counts, or of all bodies
+//   if none is visible
+// Parameters:
+//   1. P: projection matrix of a view
+//   2. eye: eye position
+//   3. height: height of the view in pixels
+// -----------------------------------------------------
+void Water::streamTextures(mat4 P, vec3 eye, int height)
+{
+    if (bodies.empty())
+    {
+        return;
+    }
+
+    float dist = FLT_MAX, distAll = FLT_MAX;
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        float d = fabs(eye.y - bodies[i].center.y);
+        distAll = std::min(distAll, d);
+        if (bodies[i].isVisible)
+        {
+            dist = std::min(dist, d);
+        }
+    }
+    dist = std::max(numVisibleBodies > 0 ? dist : distAll, 0.01f);
+    float pixels = 2.f * WATER_SIZE * height * 0.5f * P[1][1] / dist;
+
+    streamer->setFootprint(texDudv, pixels);
+    streamer->setFootprint(texNormalMap, pixels);
 }
 
 // -----------------------------------------------------
@@ -117,6 +550,7 @@ void Water::initUniform()
     uniTexReflect = myGetUniformLocation(shader, "texReflect");
     uniTexRefract = myGetUniformLocation(shader, "texRefract");
     uniTexSkybox = myGetUniformLocation(shader, "texSkybox");
+    uniTexProbe = myGetUniformLocation(shader, "texProbe");
     uniTexDudv = myGetUniformLocation(shader, "texDudv");
     uniTexNormal = myGetUniformLocation(shader, "texNormal");
     uniTexDepthRefr = myGetUniformLocation(shader, "texDepthRefr");
@@ -127,6 +561,16 @@ void Water::initUniform()
     glUniform1i(uniTexRefract, 2);
     glUniform1i(uniTexDepthRefr, 25);
 
+    // The skybox cubemap is bound to texture unit 0 by Skybox::initTexture
+    glUniform1i(uniTexSkybox, 0);
+
+    // The environment probe cubemap is bound to texture unit 26 by Probe::initTexture
+    glUniform1i(uniTexProbe, 26);
+
+    // The Hi-Z pyramid is bound to texture unit 27 by Water::initHiZ
+    uniTexHiZ = myGetUniformLocation(shader, "texHiZ");
+    glUniform1i(uniTexHiZ, 27);
+
     // Lighting
     uniLightColor = myGetUniformLocation(shader, "lightColor");
     uniLightPos = myGetUniformLocation(shader, "lightPos");
@@ -136,113 +580,297 @@ void Water::initUniform()
 
     // Eye point
     uniEyePoint = myGetUniformLocation(shader, "eyePoint");
+
+    // Sky lookup switch
+    uniSkyLookup = myGetUniformLocation(shader, "skyLookup");
+
+    // Probe reflection switch
+    uniProbeReflect = myGetUniformLocation(shader, "probeReflect");
+
+    // Screen-space refraction switch
+    uniScreenRefract = myGetUniformLocation(shader, "screenRefract");
+
+    // Screen-space reflection switch and levels of the Hi-Z pyramid
+    uniScreenReflect = myGetUniformLocation(shader, "screenReflect");
+    uniHiZLevels = myGetUniformLocation(shader, "hiZLevels");
+
+    // Cameras of reflection and refraction textures
+    uniReflectVP = myGetUniformLocation(shader, "reflectVP");
+    uniRefractVP = myGetUniformLocation(shader, "refractVP");
+
+    // Used fraction of reflection and refraction textures
+    uniTexScale = myGetUniformLocation(shader, "texScale");
+
+    // Point lights, of the clusters bound by the last scene pass
+    ClusteredLights::initShader(shader);
 }
 
 // -----------------------------------------------------
-// Initialize reflection texture
+// Take the reflection and refraction targets of a plane from the pool
+// - Their content is left by another pass, so it is rendered again
 // -----------------------------------------------------
-void Water::initReflect()
+void Water::acquireTargets(Plane &plane)
 {
-    // Create framebuffer object
-    glGenFramebuffers(1, &fboReflect);
-    glBindFramebuffer(GL_FRAMEBUFFER, fboReflect);
-
-    // Create texture object
+    // On macOS, must use WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2, don't know why
+    // The alpha channel of the reflection records which pixels are covered by reflected geometry
     glActiveTexture(GL_TEXTURE0 + 3);
-    glGenTextures(1, &tboReflect);
-    glBindTexture(GL_TEXTURE_2D, tboReflect);
+    plane.tboReflect = pool->acquire(WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, pool->formatOf("reflect"));
 
-    // On macOS, must use WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2, don't know why
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    // The depth buffer is attached by bindReflection
+    glBindFramebuffer(GL_FRAMEBUFFER, plane.fboReflect);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, plane.tboReflect, 0);
+    glDrawBuffer(GL_COLOR_ATTACHMENT2);
 
-    // Set texture object
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, tboReflect, 0);
+    glActiveTexture(GL_TEXTURE0 + 2);
+    plane.tboRefract = pool->acquire(WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, refractFormat);
 
     // The depth buffer
     // User-defined framebuffer must have a depth buffer to enable depth test
-    glGenRenderbuffers(1, &rboDepthReflect);
-    glBindRenderbuffer(GL_RENDERBUFFER, rboDepthReflect);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rboDepthReflect);
+    // Depth is written into a texture, which the water samples
+    // - Depth and stencil like every target of the main pass by default,
+    //   because depth can only be copied between identical formats
+    GLenum depthFormat = pool->formatOf("refract-depth");
+    glActiveTexture(GL_TEXTURE0 + 25);
+    plane.tboDepthRefr = pool->acquire(WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, depthFormat);
 
-    // Attach framebuffer
-    glDrawBuffer(GL_COLOR_ATTACHMENT2);
+    glBindFramebuffer(GL_FRAMEBUFFER, plane.fboRefract);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, plane.tboRefract, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, RenderTargetPool::depthAttachment(depthFormat), plane.tboDepthRefr, 0);
+    glDrawBuffer(GL_COLOR_ATTACHMENT1);
+
+    plane.reflectCache.isValid = false;
+    plane.refractCache.isValid = false;
+    plane.hasTargets = true;
 }
 
 // -----------------------------------------------------
-// Initialize refraction texture
+// Give the targets of a plane back to the pool
+// - They are detached, so that the pool can delete them
 // -----------------------------------------------------
-void Water::initRefract()
+void Water::releaseTargets(Plane &plane)
 {
-    // Create framebuffer object
-    glGenFramebuffers(1, &fboRefract);
-    glBindFramebuffer(GL_FRAMEBUFFER, fboRefract);
+    if (!plane.hasTargets)
+    {
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, plane.fboReflect);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, 0, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, plane.fboRefract);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, 0, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, RenderTargetPool::depthAttachment(pool->formatOf("refract-depth")), 0, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    pool->release(plane.tboReflect);
+    pool->release(plane.tboRefract);
+    pool->release(plane.tboDepthRefr);
+    plane.tboReflect = plane.tboRefract = plane.tboDepthRefr = 0;
+
+    plane.reflectCache.isValid = false;
+    plane.refractCache.isValid = false;
+    plane.hasTargets = false;
+}
 
-    // Create texture object
-    glActiveTexture(GL_TEXTURE0 + 2);
-    glGenTextures(1, &tboRefract);
-    glBindTexture(GL_TEXTURE_2D, tboRefract);
+// -----------------------------------------------------
+// Bind the refraction texture of a plane as render target
+// Parameters:
+//   1. index: index of the plane
+//   2. w, h: size of the viewport
+// -----------------------------------------------------
+void Water::bindRefraction(int index, int w, int h)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, planes[index].fboRefract);
+    glViewport(0, 0, w, h);
+}
 
-    // On macOS, must use WINDOW_WIDTH * 2 and WINDOW_HEIGHT * 2, don't know why
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, tboRefract, 0);
+// -----------------------------------------------------
+// Bind the reflection texture of a plane as render target
+// - The depth buffer is only needed during the pass,
+//   so other passes of the frame can use its memory afterwards
+// Parameters:
+//   1. index: index of the plane
+//   2. w, h: size of the viewport
+// -----------------------------------------------------
+void Water::bindReflection(int index, int w, int h)
+{
+    GLenum format = pool->formatOf("reflect-depth");
+    rboDepthReflect = pool->acquire(WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, format, false);
 
-    // The depth buffer
     // User-defined framebuffer must have a depth buffer to enable depth test
-    // The following setting write depth into framebuffer
-    // glGenRenderbuffers(1, &rboDepthRefract);
-    // glBindRenderbuffer(GL_RENDERBUFFER, rboDepthRefract);
-    // glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, WINDOW_WIDTH *
-    // 2,
-    //                       WINDOW_HEIGHT * 2);
-    // glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-    //                           GL_RENDERBUFFER, rboDepthRefract);
+    glBindFramebuffer(GL_FRAMEBUFFER, planes[index].fboReflect);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, RenderTargetPool::depthAttachment(format), GL_RENDERBUFFER,
+                              rboDepthReflect);
+    glViewport(0, 0, w, h);
+}
 
-    // The depth buffer
-    // User-defined framebuffer must have a depth buffer to enable depth test
-    // The following setting write depth into texture, and can be exported to an image
-    glActiveTexture(GL_TEXTURE0 + 25);
-    glGenTextures(1, &tboDepthRefr);
-    glBindTexture(GL_TEXTURE_2D, tboDepthRefr);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, WINDOW_WIDTH * 2, WINDOW_HEIGHT * 2, 0, GL_DEPTH_COMPONENT,
-                 GL_FLOAT, 0);
+// -----------------------------------------------------
+// Give the depth buffer of a reflection pass back
+// Parameters:
+//   1. index: index of the plane
+// -----------------------------------------------------
+void Water::finishReflection(int index)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, planes[index].fboReflect);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, RenderTargetPool::depthAttachment(pool->formatOf("reflect-depth")),
+                              GL_RENDERBUFFER, 0);
+    pool->release(rboDepthReflect, false);
+}
+
+// -----------------------------------------------------
+// Copy color and depth of the main pass into the refraction textures
+// - Called after all opaque geometry of the main pass is drawn,
+//   the main pass target is bound again afterwards
+// - One copy serves every plane, it is kept by the nearest one
+// Parameters:
+//   1. fbo: target of the main pass
+//   2. w, h: size of the main pass
+// -----------------------------------------------------
+void Water::copyRefraction(GLuint fbo, int w, int h)
+{
+    if (copyPlane < 0)
+    {
+        return;
+    }
+
+    int refrWidth = int(WINDOW_WIDTH * 2 * texScale);
+    int refrHeight = int(WINDOW_HEIGHT * 2 * texScale);
+
+    // A resolve or a scaled copy needs a single-sample source of the same size first,
+    // and a resolve also needs the format of the main pass
+    // - The copy is in the formats of the main pass, its depth buffer
+    //   is usually the one the reflection pass just gave back
+    bool isDirect = w == refrWidth && h == refrHeight && refractFormat == GL_RGBA8;
+    if (!isDirect)
+    {
+        rboCopyColor = pool->acquire(w, h, GL_RGBA8, false);
+        rboCopyDepth = pool->acquire(w, h, GL_DEPTH24_STENCIL8, false);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fboCopy);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rboCopyColor);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboCopyDepth);
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, isDirect ? fbo : fboCopy);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, planes[copyPlane].fboRefract);
+    glBlitFramebuffer(0, 0, w, h, 0, 0, refrWidth, refrHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBlitFramebuffer(0, 0, w, h, 0, 0, refrWidth, refrHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+    if (!isDirect)
+    {
+        pool->release(rboCopyColor, false);
+        pool->release(rboCopyDepth, false);
+    }
+
+    if (isScreenReflect)
+    {
+        glActiveTexture(GL_TEXTURE0 + 25);
+        glBindTexture(GL_TEXTURE_2D, planes[copyPlane].tboDepthRefr);
+        buildHiZ(refrWidth, refrHeight);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+// -----------------------------------------------------
+// Initialize Hi-Z pyramid
+// - Same size as the refraction depth map, down to 1x1
+// - Levels are sized as a mip chain, half the level above rounded down
+// -----------------------------------------------------
+void Water::initHiZ()
+{
+    shaderHiZ = buildShader("./shader/vsQuad.glsl", "./shader/fsHiZ.glsl");
+    uniHiZDepth = myGetUniformLocation(shaderHiZ, "texDepth");
+    uniHiZLevel = myGetUniformLocation(shaderHiZ, "level");
+    uniHiZSourceSize = myGetUniformLocation(shaderHiZ, "sourceSize");
+    uniHiZSize = myGetUniformLocation(shaderHiZ, "size");
+
+    int numLevels = 1;
+    while ((WINDOW_WIDTH * 2 >> numLevels) > 0 || (WINDOW_HEIGHT * 2 >> numLevels) > 0)
+    {
+        numLevels++;
+    }
+
+    glActiveTexture(GL_TEXTURE0 + 27);
+    tboHiZ = Resources::create(Resources::TEXTURE, "water");
+    glBindTexture(GL_TEXTURE_2D, tboHiZ);
+    for (int i = 0; i < numLevels; i++)
+    {
+        glTexImage2D(GL_TEXTURE_2D, i, GL_R32F, std::max(WINDOW_WIDTH * 2 >> i, 1), std::max(WINDOW_HEIGHT * 2 >> i, 1),
+                     0, GL_RED, GL_FLOAT, 0);
+    }
+    // The mip chain adds a third to level 0
+    Resources::setBytes(Resources::TEXTURE, tboHiZ, size_t(WINDOW_WIDTH * 2) * WINDOW_HEIGHT * 2 * 4 * 4 / 3);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tboDepthRefr, 0);
 
-    // Attach framebuffer
-    glDrawBuffer(GL_COLOR_ATTACHMENT1);
+    fboHiZ.resize(numLevels);
+    Resources::create(Resources::FRAMEBUFFER, numLevels, fboHiZ.data(), "water");
+    for (int i = 0; i < numLevels; i++)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, fboHiZ[i]);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tboHiZ, i);
+    }
 }
 
 // -----------------------------------------------------
-// Set texture object
+// Build Hi-Z pyramid from the refraction depth map
+// - Level i is built from level i - 1, which is the only level
+//   the texture exposes meanwhile, so reading and writing never overlap
+// - Only the used part of each level is built, half the part above rounded up,
+//   unless the level is smaller, then its last texel also covers the rest
 // Parameters:
-//   1. tbo: texture buffer object
-//   2. texUnit: texture unit to use
-//   3. texDir: texture image file path
-//   4. imgType: texture image type
+//   1. w, h: used part of the refraction depth map
 // -----------------------------------------------------
-void Water::setTexture(GLuint &tbo, int texUnit, const string texDir, FREE_IMAGE_FORMAT imgType)
+void Water::buildHiZ(int w, int h)
 {
-    // Always use "GL_TEXTURE0 + N" to specify a texture unit
-    glActiveTexture(GL_TEXTURE0 + texUnit);
+    if (!tboHiZ)
+    {
+        initHiZ();
+    }
 
-    // Create texture image from file
-    FIBITMAP *texImage = FreeImage_ConvertTo24Bits(FreeImage_Load(imgType, texDir.c_str()));
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
 
-    // Create texture object for the image
-    glGenTextures(1, &tbo);
-    glBindTexture(GL_TEXTURE_2D, tbo);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FreeImage_GetWidth(texImage), FreeImage_GetHeight(texImage), 0, GL_BGR,
-                 GL_UNSIGNED_BYTE, (void *)FreeImage_GetBits(texImage));
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-    // Release resource
-    FreeImage_Unload(texImage);
+    glUseProgram(shaderHiZ);
+    Metrics::add(Metrics::PROGRAM_BINDS);
+    glBindVertexArray(vao);
+    glDisable(GL_DEPTH_TEST);
+
+    glActiveTexture(GL_TEXTURE0 + 27);
+    glBindTexture(GL_TEXTURE_2D, tboHiZ);
+
+    int numLevels = int(fboHiZ.size());
+    int usedW = w, usedH = h;
+    for (int i = 0; i < numLevels; i++)
+    {
+        int sourceW = usedW, sourceH = usedH;
+        if (i > 0)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, i - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, i - 1);
+            usedW = std::min((usedW + 1) / 2, std::max(WINDOW_WIDTH * 2 >> i, 1));
+            usedH = std::min((usedH + 1) / 2, std::max(WINDOW_HEIGHT * 2 >> i, 1));
+        }
+        glUniform1i(uniHiZDepth, i == 0 ? 25 : 27);
+        glUniform1i(uniHiZLevel, i);
+        glUniform2i(uniHiZSourceSize, sourceW, sourceH);
+        glUniform2i(uniHiZSize, usedW, usedH);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fboHiZ[i]);
+        glViewport(0, 0, usedW, usedH);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        Metrics::add(Metrics::DRAW_CALLS);
+        Metrics::add(Metrics::TRIANGLES);
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+
+    glEnable(GL_DEPTH_TEST);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 }